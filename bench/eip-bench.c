@@ -0,0 +1,179 @@
+/* eip-bench.c
+ *
+ * Throughput benchmark for plcstub-server.  Opens a number of sessions, spread
+ * over a few client threads, and keeps `depth` Read Tag requests in flight
+ * on each for a while, then reports requests per second.  Without -h it
+ * starts a server in-process, on a port of its own.
+ *
+ *     eip-bench [-h host] [-p port] [-c connections] [-d depth] [-s seconds]
+ *               [-T client_threads] [-t server_threads] [-n tag] [-C]
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "eip.h"
+
+struct bench_thread {
+    pthread_t thread;
+    int nconns;
+    uint64_t requests;
+};
+
+static const char* host = NULL;
+static uint16_t port = EIP_PORT;
+static const char* tag_name = "DUMMY_AQUA_ARRAY_0";
+static int depth = 8;
+static bool connected = false;
+static volatile bool stop = false;
+
+static void*
+bench_main(void* arg)
+{
+    struct bench_thread* bt = arg;
+    struct eip_client* conns;
+    struct buf req = { 0 }, reply = { 0 };
+    int i, j;
+
+    conns = calloc(bt->nconns, sizeof(*conns));
+    if (conns == NULL) {
+        err(1, "calloc");
+    }
+
+    cip_build_read(&req, tag_name, 1);
+    for (i = 0; i < bt->nconns; i++) {
+        if (eip_client_connect(&conns[i], host, port)) {
+            err(1, "eip_client_connect");
+        }
+        if (connected && eip_client_forward_open(&conns[i], 4000) != 0) {
+            errx(1, "forward open failed");
+        }
+        for (j = 0; j < depth; j++) {
+            eip_client_send(&conns[i], req.data, req.len);
+        }
+    }
+
+    /* Every reply is answered by another request, so each connection keeps
+     * `depth` of them in flight. */
+    while (!stop) {
+        for (i = 0; i < bt->nconns; i++) {
+            if (eip_client_recv(&conns[i], &reply) || reply.data[2] != 0) {
+                errx(1, "read of %s failed", tag_name);
+            }
+            bt->requests++;
+            eip_client_send(&conns[i], req.data, req.len);
+        }
+    }
+
+    for (i = 0; i < bt->nconns; i++) {
+        eip_client_close(&conns[i]);
+    }
+    free(conns);
+    free(req.data);
+    free(reply.data);
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct eip_server_config cfg = { "127.0.0.1", 0, 4 };
+    struct bench_thread* bts;
+    int ch, i, nconns = 64, nthreads = 4, seconds = 5;
+    uint64_t total = 0;
+    double start, elapsed;
+    bool local;
+
+    while ((ch = getopt(argc, argv, "Cc:d:h:n:p:s:T:t:")) != -1) {
+        switch (ch) {
+        case 'C':
+            connected = true;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'n':
+            tag_name = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'T':
+            nthreads = atoi(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        default:
+            errx(1, "usage: eip-bench [-h host] [-p port] [-c connections] [-d depth] [-s seconds] [-T client_threads] [-t server_threads] [-n tag] [-C]");
+        }
+    }
+    if (nthreads < 1 || nconns < nthreads || depth < 1) {
+        errx(1, "need at least one connection per thread, and a depth of at least 1");
+    }
+
+    local = host == NULL;
+    if (local) {
+        if (eip_server_start(&cfg)) {
+            return 1;
+        }
+        host = "127.0.0.1";
+        port = eip_server_port();
+    }
+
+    bts = calloc(nthreads, sizeof(*bts));
+    if (bts == NULL) {
+        err(1, "calloc");
+    }
+    for (i = 0; i < nthreads; i++) {
+        bts[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+    }
+
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&bts[i].thread, NULL, bench_main, &bts[i])) {
+            errx(1, "pthread_create");
+        }
+    }
+    sleep(seconds);
+    stop = true;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(bts[i].thread, NULL);
+        total += bts[i].requests;
+    }
+    elapsed = now() - start;
+
+    printf("%d connections, depth %d, %s: %llu requests in %.2fs, %.0f req/s\n",
+        nconns, depth, connected ? "connected" : "unconnected",
+        (unsigned long long)(total), elapsed, total / elapsed);
+
+    if (local) {
+        eip_server_stop();
+    }
+    free(bts);
+    return 0;
+}
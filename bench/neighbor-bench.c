@@ -0,0 +1,125 @@
+/* neighbor-bench.c
+ *
+ * False-sharing benchmark.  For 1, 2, 4 ... up to `threads` threads, each
+ * sets and gets its own DINT tag as fast as it can for a while, and the
+ * operations per second are reported.  The tags are created back to back,
+ * so they have adjacent IDs and, in the allocator, adjacent nodes and data:
+ * no thread shares a tag, so any slowdown as threads are added is from
+ * them sharing cache lines.
+ *
+ *     neighbor-bench [-t threads] [-s seconds]
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplctag.h"
+
+#define CACHE_LINE 64
+
+struct bench_thread {
+    pthread_t thread;
+    int32_t tag;
+    uint64_t ops;
+} __attribute__((aligned(CACHE_LINE)));
+
+static volatile bool stop = false;
+
+static void*
+bench_main(void* arg)
+{
+    struct bench_thread* bt = arg;
+    uint64_t ops = 0;
+    int32_t v = 0;
+
+    while (!stop) {
+        plc_tag_set_int32(bt->tag, 0, v + 1);
+        v = plc_tag_get_int32(bt->tag, 0);
+        ops += 2;
+    }
+    bt->ops = ops;
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct bench_thread* bts;
+    char attrs[128];
+    int ch, i, n, max_threads = 64, seconds = 1;
+    uint64_t total;
+    double start, elapsed;
+
+    while ((ch = getopt(argc, argv, "s:t:")) != -1) {
+        switch (ch) {
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            errx(1, "usage: neighbor-bench [-t threads] [-s seconds]");
+        }
+    }
+    if (max_threads < 1) {
+        errx(1, "need at least one thread");
+    }
+
+    bts = calloc(max_threads, sizeof(*bts));
+    if (bts == NULL) {
+        err(1, "calloc");
+    }
+    for (i = 0; i < max_threads; i++) {
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_size=4&name=Neighbor%d", i);
+        bts[i].tag = plc_tag_create(attrs, 1000);
+        if (bts[i].tag < 0) {
+            errx(1, "plc_tag_create: %s", plc_tag_decode_error(bts[i].tag));
+        }
+    }
+
+    for (n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        stop = false;
+        start = now();
+        for (i = 0; i < n; i++) {
+            bts[i].ops = 0;
+            if (pthread_create(&bts[i].thread, NULL, bench_main, &bts[i])) {
+                errx(1, "pthread_create");
+            }
+        }
+        sleep(seconds);
+        stop = true;
+        total = 0;
+        for (i = 0; i < n; i++) {
+            pthread_join(bts[i].thread, NULL);
+            total += bts[i].ops;
+        }
+        elapsed = now() - start;
+
+        printf("%2d threads: %12.0f ops/s (%10.0f per thread)\n", n, total / elapsed, total / elapsed / n);
+
+        if (n == max_threads) {
+            break;
+        }
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        plc_tag_destroy(bts[i].tag);
+    }
+    free(bts);
+    return 0;
+}
@@ -0,0 +1,173 @@
+/* read-bench.c
+ *
+ * Contention benchmark for readers of a single tag.  For 1, 2, 4 ... up to
+ * `readers` threads, each reads random elements of one DINT array with
+ * plc_tag_get_int32() for a while, and the reads per second are reported.
+ * Writers, each setting random elements as fast as they can, may run
+ * alongside.  With -c every reader registers a callback on the tag, which
+ * keeps its reads under the tag's lock, for comparison.
+ *
+ *     read-bench [-r readers] [-w writers] [-e elements] [-s seconds] [-c]
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplctag.h"
+
+#define CACHE_LINE 64
+
+struct bench_thread {
+    pthread_t thread;
+    int32_t tag;
+    unsigned seed;
+    uint64_t ops;
+} __attribute__((aligned(CACHE_LINE)));
+
+static int elements = 1024;
+static bool callbacks = false;
+static volatile bool stop = false;
+
+static void
+noop(int32_t tag_id, int event, int status, void* userdata)
+{
+    (void)(tag_id);
+    (void)(event);
+    (void)(status);
+    (void)(userdata);
+}
+
+static void*
+reader_main(void* arg)
+{
+    struct bench_thread* bt = arg;
+    uint64_t ops = 0;
+    int32_t sum = 0;
+
+    while (!stop) {
+        sum += plc_tag_get_int32(bt->tag, rand_r(&bt->seed) % elements);
+        ops++;
+    }
+    bt->ops = ops + (sum == 0x7fffffff);
+    return NULL;
+}
+
+static void*
+writer_main(void* arg)
+{
+    struct bench_thread* bt = arg;
+    uint64_t ops = 0;
+
+    while (!stop) {
+        plc_tag_set_int32(bt->tag, rand_r(&bt->seed) % elements, (int32_t)ops);
+        ops++;
+    }
+    bt->ops = ops;
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+    struct bench_thread* bts;
+    char attrs[128];
+    int ch, i, n, max_readers = 64, writers = 0, seconds = 1;
+    uint64_t reads, writes;
+    double start, elapsed;
+    int32_t tag;
+
+    while ((ch = getopt(argc, argv, "ce:r:s:w:")) != -1) {
+        switch (ch) {
+        case 'c':
+            callbacks = true;
+            break;
+        case 'e':
+            elements = atoi(optarg);
+            break;
+        case 'r':
+            max_readers = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        default:
+            errx(1, "usage: read-bench [-r readers] [-w writers] [-e elements] [-s seconds] [-c]");
+        }
+    }
+    if (max_readers < 1 || writers < 0 || elements < 1) {
+        errx(1, "need at least one reader and one element");
+    }
+
+    snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_size=4&elem_count=%d&name=ReadBench", elements);
+    tag = plc_tag_create(attrs, 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create: %s", plc_tag_decode_error(tag));
+    }
+
+    bts = calloc(max_readers + writers, sizeof(*bts));
+    if (bts == NULL) {
+        err(1, "calloc");
+    }
+
+    printf("%d elements, %d writers%s\n", elements, writers, callbacks ? ", with callbacks" : "");
+    for (n = 1;; n = n * 2 < max_readers ? n * 2 : max_readers) {
+        stop = false;
+        for (i = 0; i < n + writers; i++) {
+            bts[i].tag = tag;
+            bts[i].seed = i + 1;
+            bts[i].ops = 0;
+        }
+        if (callbacks) {
+            plc_tag_register_callback_ex(tag, noop, NULL);
+        }
+
+        start = now();
+        for (i = 0; i < n + writers; i++) {
+            if (pthread_create(&bts[i].thread, NULL, i < n ? reader_main : writer_main, &bts[i])) {
+                errx(1, "pthread_create");
+            }
+        }
+        sleep(seconds);
+        stop = true;
+        reads = writes = 0;
+        for (i = 0; i < n + writers; i++) {
+            pthread_join(bts[i].thread, NULL);
+            *(i < n ? &reads : &writes) += bts[i].ops;
+        }
+        elapsed = now() - start;
+
+        if (callbacks) {
+            plc_tag_unregister_callback_ex(tag, noop, NULL);
+        }
+        printf("%2d readers: %12.0f reads/s (%10.0f per reader)", n, reads / elapsed, reads / elapsed / n);
+        if (writers > 0) {
+            printf(", %10.0f writes/s", writes / elapsed);
+        }
+        printf("\n");
+
+        if (n == max_readers) {
+            break;
+        }
+    }
+
+    plc_tag_destroy(tag);
+    free(bts);
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* attrib.h
+ *
+ * Parsing of plc_tag_create() attribute strings, such as
+ * "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&name=Motor".
+ */
+
+#ifndef _ATTRIB_H_
+#define _ATTRIB_H_
+
+#include <stddef.h>
+
+#define ATTRIB_NAME_MAX 256
+
+/* What an attribute string asks for.  Numeric attributes that weren't given
+ * are 0, except for debug, which is -1. */
+struct tag_attribs {
+    char name[ATTRIB_NAME_MAX];
+    int elem_size;
+    int elem_count;
+    int debug;
+    int read_cache_ms;
+    int auto_sync_read_ms;
+    int auto_sync_write_ms;
+    int use_connected_msg;
+    int allow_packing;
+    int share_session;
+    int connection_group_id;
+    int str_max_capacity;
+};
+
+/* Parses an attribute string in one pass, without allocating.  Returns
+ * PLCTAG_STATUS_OK or a PLCTAG_ERR_* code. */
+int
+attrib_parse(const char* str, struct tag_attribs* out);
+
+/* As attrib_parse(), but remembers recent strings, so that creating the same
+ * tag again doesn't parse it again. */
+int
+attrib_parse_cached(const char* str, struct tag_attribs* out);
+
+#endif
@@ -0,0 +1,38 @@
+/* events.h
+ *
+ * Batched delivery of tag events, for callers such as language bindings
+ * that pay for every call into them: every event, on every tag, is recorded
+ * with a timestamp, and the records are handed over an array at a time (see
+ * plc_tag_register_batch_callback()).
+ */
+
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libplctag.h"
+
+typedef void (*events_batch_func)(const struct plc_tag_event* events, int count, void* userdata);
+
+/* Whether a batch callback is registered, and so whether events need
+ * recording at all. */
+bool
+events_enabled(void);
+
+/* Records an event for the next batch.  Each thread records into a buffer
+ * of its own, so this takes no lock that other emitting threads do. */
+void
+events_record(int32_t tag_id, int event, int status);
+
+int
+events_register(events_batch_func cb, void* userdata, int max_events, int max_delay_ms);
+
+int
+events_unregister(void);
+
+int
+events_flush(void);
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <err.h>
 #include <pthread.h>
+#include <string.h>
+
+#include "debug.h"
 
 #define MTX_OP(op, mtx_p)                                                     \
     do {                                                                      \
@@ -13,11 +16,36 @@
         }                                                                     \
     } while (0)
 
-#define MTX_UNLOCK(mtx_p) MTX_OP(pthread_mutex_unlock, mtx_p)
-#define MTX_LOCK(mtx_p) MTX_OP(pthread_mutex_lock, mtx_p)
+#ifdef LOCK_PROFILING
+#include "lockprof.h"
+
+/* obj_p is a struct lockprof_obj* to additionally charge the wait and hold
+ * times to, or NULL. */
+#define MTX_ACQUIRE(op, mtx_p, obj_p)                                          \
+    do {                                                                       \
+        static struct lockprof_site lockprof_site_ = LOCKPROF_SITE_INIT(#mtx_p); \
+        uint64_t lockprof_start_ = lockprof_now();                             \
+        MTX_OP(op, mtx_p);                                                     \
+        lockprof_acquired((mtx_p), &lockprof_site_, (obj_p),                   \
+            lockprof_now() - lockprof_start_);                                 \
+    } while (0)
+
+#define MTX_RELEASE(op, mtx_p)      \
+    do {                            \
+        lockprof_releasing(mtx_p);  \
+        MTX_OP(op, mtx_p);          \
+    } while (0)
+#else
+#define MTX_ACQUIRE(op, mtx_p, obj_p) MTX_OP(op, mtx_p)
+#define MTX_RELEASE(op, mtx_p) MTX_OP(op, mtx_p)
+#endif
+
+#define MTX_UNLOCK(mtx_p) MTX_RELEASE(pthread_mutex_unlock, mtx_p)
+#define MTX_LOCK(mtx_p) MTX_ACQUIRE(pthread_mutex_lock, mtx_p, NULL)
+#define MTX_LOCK_OBJ(mtx_p, obj_p) MTX_ACQUIRE(pthread_mutex_lock, mtx_p, obj_p)
 
-#define RW_UNLOCK(mtx_p) MTX_OP(pthread_rwlock_unlock, mtx_p)
-#define RW_RDLOCK(mtx_p) MTX_OP(pthread_rwlock_rdlock, mtx_p)
-#define RW_WRLOCK(mtx_p) MTX_OP(pthread_rwlock_wrlock, mtx_p)
+#define RW_UNLOCK(mtx_p) MTX_RELEASE(pthread_rwlock_unlock, mtx_p)
+#define RW_RDLOCK(mtx_p) MTX_ACQUIRE(pthread_rwlock_rdlock, mtx_p, NULL)
+#define RW_WRLOCK(mtx_p) MTX_ACQUIRE(pthread_rwlock_wrlock, mtx_p, NULL)
 
-#endif
\ No newline at end of file
+#endif
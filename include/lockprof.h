@@ -0,0 +1,90 @@
+/* lockprof.h
+ *
+ * Opt-in lock profiling (configure with -DBUILD_WITH_LOCK_PROFILING=ON).
+ * When enabled, the locking macros in lock_utils.h record how long each
+ * acquisition waited and how long the lock was then held, both per call site
+ * and, for tag locks, per tag.
+ */
+
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Bucket b counts samples in [2^(b-1), 2^b) nanoseconds; bucket 0 counts
+ * zeros.  The last bucket also soaks up everything larger. */
+#define LOCKPROF_BUCKETS 40
+
+/* Acquisitions that waited at least this long are counted as contended. */
+#define LOCKPROF_CONTENDED_NS 1000
+
+struct lockprof_hist {
+    uint64_t buckets[LOCKPROF_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* Statistics for one lock: a tag's mutex, say. */
+struct lockprof_obj {
+    struct lockprof_hist wait;
+    struct lockprof_hist hold;
+    uint64_t contended;
+    uint64_t long_holds; /* plc_tag_lock() holds over the warning threshold */
+};
+
+/* Statistics for one lock call site.  Every expansion of the locking macros
+ * gets its own static instance, so no lookup is needed to find it. */
+struct lockprof_site {
+    const char* file;
+    int line;
+    const char* what;
+    struct lockprof_obj prof;
+    int registered;
+    struct lockprof_site* next;
+};
+
+#define LOCKPROF_SITE_INIT(what_str) \
+    {                                \
+        .file = __FILE__,            \
+        .line = __LINE__,            \
+        .what = (what_str),          \
+        .prof = { .contended = 0 },  \
+        .registered = 0,             \
+        .next = NULL,                \
+    }
+
+uint64_t
+lockprof_now(void);
+
+void
+lockprof_hist_record(struct lockprof_hist* h, uint64_t ns);
+
+/* Called once a lock has been taken, having waited wait_ns for it. obj may be
+ * NULL for locks that are only tracked per call site. */
+void
+lockprof_acquired(const void* lock, struct lockprof_site* site, struct lockprof_obj* obj, uint64_t wait_ns);
+
+/* Called just before a lock is released. */
+void
+lockprof_releasing(const void* lock);
+
+/* How long the calling thread has held the lock so far, or 0 if it isn't
+ * tracking it. */
+uint64_t
+lockprof_held_ns(const void* lock);
+
+/* The plc_tag_lock() hold time above which we complain. 0 disables. */
+uint64_t
+lockprof_get_hold_warn_ns(void);
+void
+lockprof_set_hold_warn_ns(uint64_t ns);
+
+void
+lockprof_obj_print(FILE* f, const struct lockprof_obj* prof);
+
+void
+lockprof_report_sites(FILE* f);
+
+#endif
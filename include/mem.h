@@ -0,0 +1,77 @@
+/* mem.h
+ *
+ * Accounting for the memory the library allocates, by category, and an
+ * optional budget on the total.  The budget may be set with
+ * PLCSTUB_MEM_BUDGET (in bytes) or the "mem_budget" library attribute; once
+ * it would be exceeded, creating tags fails with PLCTAG_ERR_NO_MEM.
+ */
+
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The cache line size we lay hot data out for. */
+#define CACHE_LINE 64
+
+enum mem_e {
+    MEM_TAGS, /* tag nodes and their data */
+    MEM_NAMES, /* tag names and the tables of them */
+    MEM_TYPES, /* interned types and their table */
+    MEM_METATAG, /* the "@tags" and "@udt/<id>" pseudo-tags */
+    MEM_CATALOG, /* handles and the handle table */
+    MEM_EVENTS, /* batched events awaiting delivery */
+    MEM_COUNT,
+};
+
+void
+mem_init(void);
+
+/* Accounts for n more bytes, failing, and accounting for nothing, if that
+ * would take the library over its budget. */
+bool
+mem_charge(enum mem_e m, size_t n);
+
+/* Accounts for n more (or, if negative, fewer) bytes regardless of the
+ * budget, for bookkeeping that can't sensibly fail. */
+void
+mem_account(enum mem_e m, int64_t n);
+
+/* malloc() and free(), accounting for the memory; mem_alloc() returns NULL
+ * if the budget or the system is out of memory. */
+void*
+mem_alloc(enum mem_e m, size_t n);
+
+/* As mem_alloc(), but cache-line aligned, and padded out to whole lines, so
+ * that nothing else allocated shares them.  The padding, like malloc()'s own
+ * overhead, isn't counted.  Freed with mem_free(). */
+void*
+mem_alloc_aligned(enum mem_e m, size_t n);
+
+char*
+mem_strdup(enum mem_e m, const char* s);
+
+void
+mem_free(enum mem_e m, void* p, size_t n);
+
+uint64_t
+mem_get(enum mem_e m);
+
+uint64_t
+mem_total(void);
+
+/* 0 if there is none. */
+uint64_t
+mem_budget_get(void);
+
+void
+mem_budget_set(uint64_t budget);
+
+/* Returns the category with the given attribute name ("mem_tags", etc.), or
+ * -1 if there is none. */
+int
+mem_lookup(const char* name);
+
+#endif
@@ -0,0 +1,56 @@
+/* nameindex.h
+ *
+ * An ordered index of names, ignoring case as Logix does, for finding tags
+ * by prefix or glob without a walk over the whole catalog.  It is an AVL
+ * tree threaded through the nodes of the things it indexes, so that it
+ * allocates nothing; callers do their own locking.
+ */
+
+#ifndef _NAMEINDEX_H_
+#define _NAMEINDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct name_index_node {
+    const char* name; /* must outlive the node's time in the index */
+    struct name_index_node* child[2];
+    int height;
+};
+
+struct name_index {
+    struct name_index_node* root;
+    size_t count;
+};
+
+/* Names needn't be unique: equal ones are kept in an arbitrary, but stable,
+ * order. */
+void
+name_index_insert(struct name_index* idx, struct name_index_node* n);
+
+void
+name_index_remove(struct name_index* idx, struct name_index_node* n);
+
+/* The first node whose name is at least `name`, or NULL. */
+struct name_index_node*
+name_index_first(const struct name_index* idx, const char* name);
+
+/* The first node whose name is greater than `name`, or NULL. */
+struct name_index_node*
+name_index_after(const struct name_index* idx, const char* name);
+
+/* The node after n, or NULL. */
+struct name_index_node*
+name_index_next(const struct name_index* idx, const struct name_index_node* n);
+
+/* Whether a name matches a glob pattern, ignoring case: '*' matches any run
+ * of characters, and '?' any one. */
+bool
+name_glob_match(const char* pattern, const char* name);
+
+/* The length of the pattern's literal prefix, which every name it matches
+ * starts with. */
+size_t
+name_glob_prefix(const char* pattern);
+
+#endif
@@ -0,0 +1,38 @@
+/* path.h
+ *
+ * Compiled member paths ("Motor.Status.Speed[3]") into complex tags.
+ */
+
+#ifndef _PATH_H_
+#define _PATH_H_
+
+#include <stdint.h>
+
+#include "types.h"
+
+/* Where a member lives within the data of a tag of type `root`. */
+struct tag_path {
+    type_t root;
+    type_t type;
+    uint32_t offset;
+    uint8_t bit; /* for BOOL members */
+    int32_t next_free; /* the next free slot, while root is NULL */
+};
+
+/* Compiles a member path against a type, returning a handle (> 0) that
+ * path_get() resolves in constant time, or a PLCTAG_ERR_* code.  Compiled
+ * paths are cached on the type, so resolving the same path again is cheap. */
+int32_t
+path_resolve(type_t root, const char* path);
+
+/* Returns NULL if the handle is unknown, or its type has since been freed.
+ * Once the type is freed, the handle may be reused for another path. */
+const struct tag_path*
+path_get(int32_t handle);
+
+/* Drops a type's cache and invalidates every handle compiled against it.
+ * Called by type_free(). */
+void
+path_cache_free(type_t root);
+
+#endif
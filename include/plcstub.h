@@ -4,13 +4,14 @@
 #include <stdint.h>
 #include <sys/tree.h>
 
-#define NTAGS 10
+#define NTAGS 12
 
 #ifdef __APPLE__
 typedef uintptr_t __uintptr_t;
 #endif
 
 typedef void (*tag_callback_func)(int32_t tag_id, int event, int status);
+typedef void (*tag_callback_ex_func)(int32_t tag_id, int event, int status, void* userdata);
 
 struct __attribute__((packed)) metatag_t {
     uint32_t id;
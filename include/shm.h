@@ -0,0 +1,108 @@
+/* shm.h
+ *
+ * An optional tag store in POSIX shared memory, so that every process on the
+ * host that links plcstub sees the same tags.  It is enabled by setting
+ * PLCSTUB_SHM_NAME to a shm_open() name such as "/plcstub"; the segment's
+ * size may be set with PLCSTUB_SHM_SIZE (in bytes).
+ *
+ * The store holds a catalog of tags, each with its name, its encoded type,
+ * a process-shared lock and an offset to its data.  The catalog is only
+ * ever appended to: a destroyed tag is marked dead, which lets lookups read
+ * it without taking a lock, and its entry and data are only reused by a tag
+ * of the same name, type and size.
+ *
+ * A tag is destroyed once no process has a handle from plc_tag_create() on
+ * it any more.  The store counts the processes that do, so a process that
+ * exits without destroying its handles keeps its tags alive for good.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+#include "types.h"
+
+#define SHM_MAX_TAGS 4096
+#define SHM_NAME_MAX 128
+#define SHM_TYPE_MAX 256
+
+struct shm_tag {
+    char name[SHM_NAME_MAX];
+    uint8_t type[SHM_TYPE_MAX]; /* see type_encode() */
+    uint16_t type_len;
+    uint32_t dead;
+    uint32_t users; /* processes using it; guarded by the store's lock */
+    uint64_t data_off; /* from the start of the segment */
+    uint64_t data_len;
+    /* Process-shared and robust.  In a line of its own, and so are tags'
+     * data, so that using one tag doesn't invalidate its neighbours'. */
+    pthread_mutex_t mtx __attribute__((aligned(CACHE_LINE)));
+};
+
+/* Maps the store named by PLCSTUB_SHM_NAME, creating it if this is the first
+ * process to do so.  Returns 1 if it was created, in which case the caller
+ * populates it and then calls shm_ready(); 0 if an existing store was
+ * attached to; or -1 if the store isn't enabled. */
+int
+shm_attach(void);
+
+/* Lets processes waiting in shm_attach() go ahead. */
+void
+shm_ready(void);
+
+bool
+shm_enabled(void);
+
+/* Returns the index of a live tag with the given name (ignoring case) and
+ * type, creating it (with len bytes of data) if there is none, or a
+ * PLCTAG_ERR_* code.  The calling process is counted as one of its users. */
+int
+shm_tag_create(const char* name, type_t type, size_t len);
+
+/* Counts the calling process as one of a tag's users, unless the tag is
+ * dead, in which case it returns false. */
+bool
+shm_tag_open(int idx);
+
+/* Stops counting the calling process as one of a tag's users, killing the
+ * tag if it was the last. */
+void
+shm_tag_close(int idx);
+
+/* The number of catalog entries, dead or alive.  Entries below this are
+ * fully initialised. */
+int
+shm_tag_count(void);
+
+struct shm_tag*
+shm_tag_get(int idx);
+
+char*
+shm_tag_data(struct shm_tag* tag);
+
+/* How many tags have been killed, so that a process can tell when it needs
+ * to drop its nodes for them. */
+int
+shm_tag_kill_count(void);
+
+/* How many dead tags have been reused, so that a process can tell when it
+ * needs to look for them again. */
+int
+shm_tag_revive_count(void);
+
+/* pthread_mutex_lock(), recovering locks whose holder died; suitable for
+ * process-local mutexes too. */
+int
+shm_mutex_lock(pthread_mutex_t* mtx);
+
+/* As shm_mutex_lock(), but giving up with ETIMEDOUT after timeout_ms, or
+ * with EBUSY straight away if timeout_ms is 0. */
+int
+shm_mutex_timedlock(pthread_mutex_t* mtx, int timeout_ms);
+
+#endif
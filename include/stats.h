@@ -0,0 +1,52 @@
+/* stats.h
+ *
+ * Runtime counters for the library.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/* The counters we keep.  Everything before TAG_STAT_COUNT is kept both
+ * globally and per-tag; the rest only make sense library-wide. */
+enum stat_e {
+    STAT_READS,
+    STAT_WRITES,
+    STAT_GETS,
+    STAT_SETS,
+    STAT_CALLBACKS,
+    TAG_STAT_COUNT,
+
+    STAT_CREATES = TAG_STAT_COUNT,
+    STAT_DESTROYS,
+    STAT_METATAG_REBUILDS,
+    STAT_ATTRIB_CACHE_HITS,
+    STAT_ATTRIB_CACHE_MISSES,
+    STAT_HANDLE_CACHE_HITS,
+    STAT_HANDLE_CACHE_MISSES,
+    STAT_EVENT_BATCHES,
+    STAT_LOCK_TIMEOUTS,
+    STAT_EVENTS_DROPPED,
+    STAT_COUNT,
+};
+
+void
+stats_inc(enum stat_e s);
+
+/* The calling thread's stripe of the counters, for striping other counters,
+ * such as tags' own, the same way. */
+unsigned
+stats_stripe(void);
+
+uint64_t
+stats_get(enum stat_e s);
+
+const char*
+stats_name(enum stat_e s);
+
+/* Returns the counter with the given attribute name, or -1 if there is none. */
+int
+stats_lookup(const char* name);
+
+#endif
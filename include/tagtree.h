@@ -1,38 +1,315 @@
 #ifndef _TAGTREE_H_
 #define _TAGTREE_H_
 
+#include "lock_utils.h"
+#include "mem.h"
+#include "nameindex.h"
 #include "plcstub.h"
+#include "shm.h"
+#include "stats.h"
 #include "types.h"
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
+/* A tag ID is the index of a handle's slot in the handle table, with the
+ * slot's generation above it.  The generation is bumped whenever the slot is
+ * freed, so that the IDs of destroyed handles aren't mistaken for those of
+ * the handles that reuse their slots (until it wraps, after 2048 reuses). */
+#define TAG_ID_INDEX_BITS 20
+#define TAG_ID_GEN_MASK 0x7ff
+#define TAG_ID_INDEX(id) ((uint32_t)(id) & ((1u << TAG_ID_INDEX_BITS) - 1))
+#define TAG_ID_GEN(id) ((uint32_t)(id) >> TAG_ID_INDEX_BITS)
+#define TAG_ID(gen, idx) ((int32_t)((((gen) & TAG_ID_GEN_MASK) << TAG_ID_INDEX_BITS) | (idx)))
+
 /* The tag ID for the "@tag" metatag. */
 #define METATAG_ID 1
 
+/* The tag ID for the "@stats" pseudo-tag: the last slot, which is never
+ * handed out. */
+#define STATSTAG_ID 0x000fffff
+
+/* The tag IDs for the "@udt/<id>" pseudo-tags, which serve the templates of
+ * struct types by UDT ID: the slots just below "@stats", which are never
+ * handed out either. */
+#define UDTTAG_ID_BASE 0x000ff000
+#define UDTTAG_ID(udt_id) (UDTTAG_ID_BASE + (udt_id))
+
+/* With a shared store (see shm.h), tags' IDs follow their place in its
+ * catalog, so that every process agrees on them. */
+#define SHM_TAG_ID(idx) ((idx) + METATAG_ID + 1)
+#define SHM_TAG_IDX(id) ((id) - (METATAG_ID + 1))
+
+struct tag_tree_node;
+struct tag_handle;
+
+/* Invoked by plc_tag_read(), with the tag locked, for tags whose data is
+ * synthesised by the library rather than written by a client. */
+typedef void (*tag_refresh_func)(struct tag_tree_node* tag);
+
+/* A tag's counters are striped over a few lines rather than stats.c's many,
+ * since every tag has its own. */
+#define TAG_STATS_STRIPES 8
+
+struct tag_stats_stripe {
+    uint64_t counters[TAG_STAT_COUNT];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* A tag's backing: its data, type and lock, shared by every handle on it.
+ * Tags are keyed by name (ignoring case, as Logix does), so clients that
+ * create the same tag share its data.
+ *
+ * Nodes are cache-line aligned, and laid out by how their fields are used,
+ * so that accessing one tag doesn't invalidate the lines its neighbours'
+ * accessors are using: what the accessors write (the lock, seq, counters)
+ * and what they only read (where the data is, and its type) each start a
+ * line of their own, and the naming and bookkeeping they never touch come
+ * last.  Tags' data is cache-line aligned too (see mem_alloc_aligned()). */
 struct tag_tree_node {
-    RB_ENTRY(tag_tree_node)
-    rb_entry;
-    int tag_id;
-    char* name; /* TODO: TAG_BASE_STRUCT doesn't contain a name: where does the name live? */
-    tag_callback_func cb;
+    /* Written by every holder of the lock. */
     pthread_mutex_t mtx;
+    /* Odd while the tag's lock is held, and bumped again as it is released,
+     * so that readers can copy data out without the lock, and then tell from
+     * an unchanged, even seq that nobody could have changed it meanwhile. */
+    uint32_t seq;
+    /* The thread holding the tag through plc_tag_lock(), and how many times
+     * it has done so.  The accessors it calls meanwhile don't lock again. */
+    int lock_depth;
+    pthread_t lock_owner;
 
-    type_t type;
+    /* Written by every access, locked or not, and so striped by thread as the
+     * global counters are; see tag_stats_get(). */
+    struct tag_stats_stripe stats[TAG_STATS_STRIPES];
+#ifdef LOCK_PROFILING
+    struct lockprof_obj lockprof;
+#endif
 
+    /* Read by every access, and fixed once the tag is created. */
+    pthread_mutex_t* mtxp __attribute__((aligned(CACHE_LINE))); /* &mtx, or the shared store's lock for the tag */
     /* of length (elem_size * elem_count) 
      * TODO: can this buffer ever be resized?  If not, let's make it a char[0] and save
      * an allocation. */
     char* data;
+    size_t data_len; /* at least the size of the type, possibly more */
+    type_t type;
+    tag_refresh_func refresh;
+    struct shm_tag* shm; /* the tag's entry in the shared store, if any */
+
+    /* Naming and bookkeeping. */
+    int tag_id; /* the ID of one of its handles, by which @tags lists it */
+    char* name; /* TODO: TAG_BASE_STRUCT doesn't contain a name: where does the name live? */
+    int refs; /* handles on it; guarded, like handles, by its shard's lock */
+    struct tag_handle* handles;
+    int shm_opens; /* handles with shm_open set, also guarded by that lock */
+    uint32_t name_hash;
+    struct tag_tree_node* name_next; /* in its name table bucket */
+    struct name_index_node name_idx; /* in its shard's name index, for tag_tree_find() */
+
+#ifdef DEBUG
+    /* While plc_tag_get_data_ptr() has a pointer out, data points at this
+     * guarded copy of the real buffer; see plcstub_shadow_begin(). */
+    char* shadow;
+    size_t shadow_len;
+    char* shadowed_data;
+#endif
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Marks the start and end of a hold on the tag's lock in its seq. */
+static inline void
+tag_seq_begin(struct tag_tree_node* t)
+{
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+tag_seq_end(struct tag_tree_node* t)
+{
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Takes and releases a tag's own lock.  Prefer these to locking t->mtxp
+ * directly, so that lock profiling can attribute the time to the tag, so
+ * that locks abandoned by a dead process are recovered, and so that lockless
+ * readers see the tag's seq change. */
+#define TAG_LOCK(t)                                                 \
+    do {                                                            \
+        MTX_ACQUIRE(shm_mutex_lock, (t)->mtxp, &(t)->lockprof);     \
+        tag_seq_begin(t);                                           \
+    } while (0)
+#define TAG_UNLOCK(t)                \
+    do {                             \
+        tag_seq_end(t);              \
+        MTX_UNLOCK((t)->mtxp);       \
+    } while (0)
+
+/* Whether the calling thread holds the tag through plc_tag_lock().  Only the
+ * owner sets lock_owner to itself, and it clears it again before releasing
+ * the tag, so no other thread can mistake itself for the owner. */
+static inline bool
+tag_lock_held(struct tag_tree_node* t)
+{
+    return __atomic_load_n(&t->lock_depth, __ATOMIC_RELAXED) > 0
+        && pthread_equal(__atomic_load_n(&t->lock_owner, __ATOMIC_RELAXED), pthread_self());
+}
+
+/* Used by the accessors in place of TAG_LOCK() and TAG_UNLOCK(), so that a
+ * client holding plc_tag_lock() can call them without deadlocking.  `locked`
+ * is a bool recording whether the tag had to be locked. */
+#define TAG_ENTER(t, locked)          \
+    do {                              \
+        (locked) = !tag_lock_held(t); \
+        if (locked) {                 \
+            TAG_LOCK(t);              \
+        }                             \
+    } while (0)
+#define TAG_LEAVE(t, locked) \
+    do {                     \
+        if (locked) {        \
+            TAG_UNLOCK(t);   \
+        }                    \
+    } while (0)
+
+/* Takes a tag's lock as TAG_LOCK() does, but waits no more than timeout_ms
+ * for it, or not at all if that is 0.  Returns PLCTAG_ERR_TIMEOUT, or for a
+ * timeout of 0 PLCTAG_ERR_BUSY, if it isn't had in time; a negative timeout
+ * waits as long as it takes. */
+int
+tag_tree_lock_timeout(struct tag_tree_node* t, int timeout_ms);
+
+/* TAG_ENTER() with a timeout, setting `ret` to PLCTAG_STATUS_OK or to
+ * tag_tree_lock_timeout()'s error, in which case TAG_LEAVE() isn't called. */
+#define TAG_ENTER_TIMEOUT(t, locked, timeout_ms, ret)                                    \
+    do {                                                                                 \
+        (locked) = !tag_lock_held(t);                                                    \
+        (ret) = (locked) ? tag_tree_lock_timeout((t), (timeout_ms)) : PLCTAG_STATUS_OK; \
+    } while (0)
+
+/* Bumps a per-tag counter along with its global counterpart. */
+static inline void
+tag_stats_inc(struct tag_tree_node* tag, enum stat_e s)
+{
+    __atomic_add_fetch(&tag->stats[stats_stripe() % TAG_STATS_STRIPES].counters[s], 1, __ATOMIC_RELAXED);
+    stats_inc(s);
+}
+
+/* Sums a per-tag counter over its stripes. */
+static inline uint64_t
+tag_stats_get(struct tag_tree_node* tag, enum stat_e s)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < TAG_STATS_STRIPES; i++) {
+        sum += __atomic_load_n(&tag->stats[i].counters[s], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/* A callback registered on a handle, with either signature. */
+struct tag_subscriber {
+    tag_callback_func cb;
+    tag_callback_ex_func cb_ex;
+    void* userdata;
 };
 
+/* A handle's callbacks.  A list is never changed once it is published:
+ * registering or unregistering a callback publishes a changed copy, and
+ * retires the old list, for the next holder of the tag's lock to free.  Only
+ * holders of the tag's lock walk the lists, so by the time one of them can
+ * take it, nobody else can still be walking a list retired before then. */
+struct tag_subscribers {
+    struct tag_subscribers* next_retired;
+    int n;
+    struct tag_subscriber subs[];
+};
+
+/* What a tag ID refers to.  Every plc_tag_create() makes a handle, even for a
+ * tag that exists already, so that clients sharing a tag keep their own
+ * callbacks and status. */
+struct tag_handle {
+    int32_t id;
+    struct tag_tree_node* tag;
+    struct tag_subscribers* subs; /* NULL if there are none */
+    struct tag_subscribers* retired;
+    int status; /* of the last operation through the handle */
+    struct tag_handle* next; /* on the same tag */
+    /* Made by plc_tag_create() on a tag in the shared store, and so keeping
+     * it alive there, rather than found there by this process. */
+    bool shm_open;
+};
+
+/* Frees a list of subscribers, and those retired after it. */
+void
+tag_subscribers_free(struct tag_subscribers* subs);
+
+/* Creates a handle on the tag with the given name, creating the tag if there
+ * isn't one.  Returns its ID, or a PLCTAG_ERR_* code if the tag exists with a
+ * different type. */
 int
 tag_tree_insert(const char* name, type_t type);
 
+/* As tag_tree_insert(), for a type built from plc_tag_create()'s elem_size
+ * and elem_count attributes (0 if not given): an existing tag of any type is
+ * attached to, so long as it agrees with those that were given. */
+int
+tag_tree_insert_sized(const char* name, type_t type, int elem_size, int elem_count);
+
+/* Looks up a handle by ID; returns NULL if there is none.  The tag it refers
+ * to is stored in *tag, unless tag is NULL, and must then be handed back to
+ * tag_tree_release() once the caller is done with it. */
+struct tag_handle*
+tag_tree_handle(int32_t tag_id, struct tag_tree_node** tag);
+
+/* Looks up the tag a handle refers to, to be handed back to
+ * tag_tree_release(). */
 struct tag_tree_node*
 tag_tree_lookup(int32_t tag_id);
 
+void
+tag_tree_metatag_release(void);
+
+/* Lets go of a tag found by tag_tree_handle() or tag_tree_lookup().  Only
+ * the "@tags" metanode, which is rebuilt as the catalog changes, needs it:
+ * it isn't swapped out while somebody may still be reading it. */
+static inline void
+tag_tree_release(struct tag_tree_node* tag)
+{
+    if (tag != NULL && __atomic_load_n(&tag->tag_id, __ATOMIC_RELAXED) == METATAG_ID) {
+        tag_tree_metatag_release();
+    }
+}
+
+/* Destroys a handle, and the tag with it if it was the last. */
 int
 tag_tree_remove(int32_t tag_id);
 
+/* Returns the ID of the tag with the given name (ignoring case), or
+ * PLCTAG_ERR_NOT_FOUND. */
+int32_t
+tag_tree_lookup_name(const char* name);
+
+/* Stores in ids the IDs of up to max tags whose names match a glob pattern
+ * (see name_glob_match()), in order of name, ignoring case.  The search
+ * starts after the name in cursor, or at the beginning if it is empty, and
+ * the name of the last tag found is left in cursor for the next call.
+ * Returns how many were found, fewer than max only once there are no more,
+ * or PLCTAG_ERR_TOO_SMALL, leaving cursor be, if it can't hold a name found
+ * (PLCTAG_ERR_NO_MEM if there is no memory to search with). */
+int
+tag_tree_find(const char* pattern, char* cursor, size_t cursor_len, int32_t* ids, int max);
+
+/* Calls fn on each client-visible tag, in order of TAG_ID_INDEX(tag->tag_id)
+ * from `first`, with the handle table read-locked, until fn returns non-zero;
+ * returns what it last returned. */
+int
+tag_tree_foreach(int32_t first, int (*fn)(struct tag_tree_node* tag, void* arg), void* arg);
+
+/* Prints lock profiling statistics for every call site and for the top_n
+ * most contended tags. */
+void
+tag_tree_lock_report(FILE* f, int top_n);
+
 #endif
\ No newline at end of file
@@ -5,10 +5,11 @@
 #define __TYPES_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* A type_t is either: 
- * a uintptr_t containing values from TAG_BOOL to TAG_LINT;
+ * a uintptr_t containing values from TAG_BOOL to TAG_STRING;
  * A pointer to a `struct tag array`, where the first value is TAG_ARRAY;
  * A poitner to a `struct tag_struct`, where the first value is TAG_STRUCT
  */
@@ -24,29 +25,70 @@ enum tag_type_e {
     TAG_DINT,
     TAG_REAL,
     TAG_LINT,
+    /* Logix's built-in STRING: a DINT length followed by the characters. */
+    TAG_STRING,
     /* complex types */
     TAG_ARRAY,
     TAG_STRUCT,
 };
 
-#define BASE_TAG_MEMBERS \
-    enum tag_type_e t;
+/* Complex types are hash-consed: constructing a type identical to one that
+ * already exists returns the existing descriptor with another reference
+ * taken, so two types are equal exactly when their pointers are.  They are
+ * immutable once returned, and their layout is computed once, when they are
+ * created, so that sizes and offsets never need a walk over the type. */
+#define TAG_STRING_CAPACITY 82
+#define TAG_STRING_DATA 4 /* the characters' offset */
+#define TAG_STRING_SIZE 88
+#define TAG_STRING_HANDLE 0x0fce /* its structure handle, as Logix reports it */
+
+/* The largest type there can be: tag data is addressed with int offsets. */
+#define TYPE_SIZE_MAX INT32_MAX
+
+#define BASE_TAG_MEMBERS                                            \
+    enum tag_type_e t;                                              \
+    uint32_t refs;                                                  \
+    uint32_t hash;                                                  \
+    void* intern_next; /* hash chain in the intern table */         \
+    uint32_t size; /* in bytes, including any trailing padding */ \
+    uint16_t align;                                                 \
+    struct path_cache* paths; /* member paths compiled against this type */
 
 struct tag_array {
     BASE_TAG_MEMBERS
 
     type_t member_type;
-    uint16_t len;
+    uint32_t len;
+    uint32_t stride; /* bytes between consecutive members; 0 for BOOLs */
+
+    /* An array of arrays is a multi-dimensional array; these describe it
+     * flattened down to its innermost, non-array elements.  The elements of
+     * a BOOL array are the DWORDs its bits are packed into.  An opaque array
+     * of SINTs is a single element, of its size, rather than a dimension. */
+    uint8_t dims;
+    uint32_t elem_count;
+    uint32_t elem_size;
+    bool opaque;
 };
 
 struct tag_struct_pair {
-    char* name;
+    const char* name; /* stored after fields[], in the same allocation */
     type_t type;
+    uint32_t offset;
+    uint8_t bit; /* for BOOL members, which Logix packs into a shared byte */
 };
 
+/* Struct types are numbered, as Logix numbers UDTs, so that clients can ask
+ * for their templates: IDs are 12 bits, skipping 0 and STRING's
+ * TAG_STRING_HANDLE.  A struct whose udt_id is 0 found none free. */
+#define TYPE_UDT_ID_MAX 0x0ffe
+
 struct tag_struct {
     BASE_TAG_MEMBERS
 
+    uint16_t udt_id;
+    struct udt_template* udt_template; /* built on first use */
+
     uint16_t field_cnt;
     struct tag_struct_pair fields[0];
 };
@@ -57,25 +99,105 @@ type_to_enum(type_t t);
 type_t
 type_new_simple(enum tag_type_e e);
 
+/* The constructors take their own references to member types; the caller
+ * keeps (and must eventually type_free()) its own.  An array larger than
+ * TYPE_SIZE_MAX is a TAG_ERROR, as is a new type that there is no memory
+ * for: new types are charged to the memory budget (see mem.h). */
+type_t
+type_new_array(uint32_t cnt, type_t member_type);
+
+/* As type_new_array(), but for the library's own pseudo-tags, which have to
+ * be built whatever the budget. */
 type_t
-type_new_array(uint16_t cnt, type_t member_type);
+type_new_array_unbudgeted(uint32_t cnt, type_t member_type);
+
+/* An opaque element of size bytes, for tags created with an elem_size that no
+ * type has: an array of SINTs, but one element of that size, not size. */
+type_t
+type_new_opaque(uint32_t size);
 
 type_t
 type_new_struct(int cnt, ...);
 
+/* Takes another reference to a type. */
 type_t
 type_dup(type_t t);
 
+/* Drops a reference to a type, freeing it with the last one. */
 void
 type_free(type_t t);
 
+/* Serialises a type into buf, for storing outside this process, returning
+ * the encoded length or -1 if it doesn't fit. */
+int
+type_encode(type_t t, uint8_t* buf, size_t cap);
+
+/* The inverse of type_encode(), returning a new reference to the (interned)
+ * type, or TAG_ERROR for a malformed encoding or one there is no memory
+ * for. */
+type_t
+type_decode(const uint8_t* buf, size_t len);
+
 size_t
 type_size_bytes(type_t t);
 
+size_t
+type_align_bytes(type_t t);
+
+/* Gives a new tag's data the values that its type can't do without, such as
+ * empty STRINGs' lengths, leaving the rest as it was. */
+void
+type_init_data(type_t t, char* data);
+
+/* The number and size of the innermost elements of a (possibly
+ * multi-dimensional) array; any other type is a single element. */
+uint32_t
+type_elem_count(type_t t);
+
+uint32_t
+type_elem_size(type_t t);
+
+/* The CIP data type code for an atomic type, or for the innermost element
+ * type of an array.  Structures, STRING among them, are reported with the
+ * struct bit set over their UDT ID, and BOOL arrays as the DWORDs they are
+ * packed into. */
+uint16_t
+type_cip_code(type_t t);
+
+/* The structure handle by which CIP replies identify a struct or STRING; 0
+ * for anything else. */
+uint16_t
+type_struct_handle(type_t t);
+
+/* Returns a new reference to the struct type with the given UDT ID (STRING
+ * for TAG_STRING_HANDLE), or TAG_ERROR if there is none. */
+type_t
+type_udt_lookup(uint16_t udt_id);
+
+/* The UDT template of a struct or STRING, as Logix serves it and libplctag's
+ * "@udt/<id>" tags present it: a header giving the UDT ID (u16), the size of
+ * the member descriptions in 32-bit words (u32), the size of an instance in
+ * bytes (u32), the member count (u16) and the structure handle (u16); then,
+ * per member, its array length or BOOL bit number (u16), type code (u16) and
+ * offset (u32); then the NUL-terminated name of the UDT, and of each member.
+ * The template is built once per type and lives as long as it does.  Returns
+ * NULL, with *len unset, for other types or if there is no memory for it. */
+const uint8_t*
+type_udt_template(type_t t, size_t* len);
+
+/* Fills in up to three array dimensions, outermost first, and returns how
+ * many there are (0 for anything but an array). */
+int
+type_array_dims(type_t t, uint32_t dims[3]);
+
 const char*
     type_str(type_t);
 
 bool
 type_is_scalar(type_t t);
 
+/* Whether t is a (bit-packed) array of BOOLs. */
+bool
+type_is_bit_array(type_t t);
+
 #endif
\ No newline at end of file
@@ -185,8 +185,8 @@ plc_tag_shutdown(void);
 /*
  * plc_tag_register_callback
  *
- * This function registers the passed callback function with the tag.  Only one callback function
- * may be registered on a tag at a time!
+ * This function registers the passed callback function with the tag.  Any number of callback
+ * functions may be registered on a tag; they are called in the order they were registered.
  *
  * Once registered, any of the following operations on or in the tag will result in the callback
  * being called:
@@ -212,8 +212,7 @@ plc_tag_shutdown(void);
  *
  * Return values:
  *
- * If there is already a callback registered, the function will return PLCTAG_ERR_DUPLICATE.   Only one callback
- * function may be registered at a time on each tag.
+ * If the same callback is already registered, the function will return PLCTAG_ERR_DUPLICATE.
  *
  * If all is successful, the function will return PLCTAG_STATUS_OK.
  */
@@ -231,10 +230,21 @@ plc_tag_shutdown(void);
 extern int
 plc_tag_register_callback(int32_t tag_id, void (*tag_callback_func)(int32_t tag_id, int event, int status));
 
+/*
+ * plc_tag_register_callback_ex
+ *
+ * As plc_tag_register_callback(), but the callback is also passed the userdata pointer given here.  The
+ * same function may be registered more than once with different userdata.
+ */
+
+extern int
+plc_tag_register_callback_ex(int32_t tag_id,
+    void (*tag_callback_func)(int32_t tag_id, int event, int status, void* userdata), void* userdata);
+
 /*
  * plc_tag_unregister_callback
  *
- * This function removes the callback already registered on the tag.
+ * This function removes the callbacks already registered on the tag.
  *
  * Return values:
  *
@@ -440,6 +450,234 @@ plc_tag_get_float32(int32_t tag, int offset);
 extern int
 plc_tag_set_float32(int32_t tag, int offset, float val);
 
+/*
+ * Whole-string access to STRING tags (created with elem_size=88), copying the
+ * string under one lock.  As with the other accessors, string_start_offset
+ * is the index of the STRING in a STRING array, or 0.
+ *
+ * plc_tag_get_string() needs room for the string and its terminating NUL,
+ * and returns PLCTAG_ERR_TOO_SMALL otherwise; plc_tag_set_string() returns
+ * PLCTAG_ERR_TOO_LARGE for more than 82 characters.  Other tags give
+ * PLCTAG_ERR_UNSUPPORTED.
+ */
+extern int
+plc_tag_get_string(int32_t tag, int string_start_offset, char* buffer, int buffer_length);
+extern int
+plc_tag_set_string(int32_t tag, int string_start_offset, const char* string_val);
+extern int
+plc_tag_get_string_length(int32_t tag, int string_start_offset);
+
+/*
+ * plcstub extensions.  These are not part of libplctag.
+ */
+
+/*
+ * Compiles a member path such as "Motor.Status.Speed[3]" against a TAG_STRUCT
+ * or array tag, returning a handle (> 0) for the plc_tag_get/set_*_path()
+ * accessors below, or an error code.  Paths are compiled once per type and
+ * cached, so accessors using the handle do no parsing at all.  The accessor
+ * must match the member's width, and bit accessors need a BOOL member.
+ */
+extern int32_t
+plc_tag_resolve_path(int32_t tag, const char* path);
+
+extern int
+plc_tag_get_bit_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_bit_path(int32_t tag, int32_t path, int val);
+
+/*
+ * Bulk operations on bits [offset_bit, offset_bit + count) of a tag, for
+ * scanning BOOL arrays.  Bits are numbered as for plc_tag_get_bit(): a BOOL
+ * array's bits are its elements, and any other tag's are numbered from bit
+ * 0 of its first byte.
+ *
+ * plc_tag_get_bits() copies the bits into buf, 32 to a word, with bit
+ * offset_bit in bit 0 of buf[0].  plc_tag_count_bits() returns how many
+ * are set, and plc_tag_find_first_bit() the index of the first set bit, or
+ * offset_bit + count if there is none.
+ */
+extern int
+plc_tag_get_bits(int32_t tag, int offset_bit, int count, uint32_t* buf);
+extern int
+plc_tag_count_bits(int32_t tag, int offset_bit, int count);
+extern int
+plc_tag_find_first_bit(int32_t tag, int offset_bit, int count);
+
+extern uint64_t
+plc_tag_get_uint64_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_uint64_path(int32_t tag, int32_t path, uint64_t val);
+
+extern int64_t
+plc_tag_get_int64_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_int64_path(int32_t tag, int32_t path, int64_t val);
+
+extern uint32_t
+plc_tag_get_uint32_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_uint32_path(int32_t tag, int32_t path, uint32_t val);
+
+extern int32_t
+plc_tag_get_int32_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_int32_path(int32_t tag, int32_t path, int32_t val);
+
+extern uint16_t
+plc_tag_get_uint16_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_uint16_path(int32_t tag, int32_t path, uint16_t val);
+
+extern int16_t
+plc_tag_get_int16_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_int16_path(int32_t tag, int32_t path, int16_t val);
+
+extern uint8_t
+plc_tag_get_uint8_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_uint8_path(int32_t tag, int32_t path, uint8_t val);
+
+extern int8_t
+plc_tag_get_int8_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_int8_path(int32_t tag, int32_t path, int8_t val);
+
+extern double
+plc_tag_get_float64_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_float64_path(int32_t tag, int32_t path, double val);
+
+extern float
+plc_tag_get_float32_path(int32_t tag, int32_t path);
+extern int
+plc_tag_set_float32_path(int32_t tag, int32_t path, float val);
+
+/*
+ * Dumps lock profiling statistics to stderr: wait and hold times for every
+ * lock call site, followed by the top_n most contended tags.  Returns
+ * PLCTAG_ERR_UNSUPPORTED unless plcstub was configured with
+ * -DBUILD_WITH_LOCK_PROFILING=ON.
+ */
+extern int
+plc_tag_lock_report(int top_n);
+
+/*
+ * Points *ptr at the tag's data buffer, and sets *len to its size, so that it
+ * can be read and written in place.  The tag must be held by the calling
+ * thread with plc_tag_lock(), and the pointer may only be used until the
+ * matching plc_tag_unlock(); PLCTAG_ERR_NOT_ALLOWED is returned otherwise.
+ * While the tag is held, the accessors may also be called on it from the
+ * same thread.  In debug builds (-DBUILD_WITH_DEBUG=ON), using the pointer
+ * after the tag is unlocked faults.
+ */
+extern int
+plc_tag_get_data_ptr(int32_t tag, void** ptr, int* len);
+
+/*
+ * Removes one callback registered with plc_tag_register_callback_ex(),
+ * leaving the tag's others be.  Returns PLCTAG_ERR_NOT_FOUND if that function
+ * isn't registered with that userdata.
+ */
+extern int
+plc_tag_unregister_callback_ex(int32_t tag_id,
+    void (*tag_callback_func)(int32_t tag_id, int event, int status, void* userdata), void* userdata);
+
+/*
+ * Finds tags by name, a page at a time, without reading "@tags".  The IDs of
+ * up to max_ids tags whose names match pattern, in which '*' matches any run
+ * of characters and '?' any one character, are stored in ids, in order of
+ * name (ignoring case, as is matching).  cursor should hold an empty string
+ * for the first page; each call leaves the name of the last tag it found in
+ * it, and the next carries on from there.  Returns how many were found,
+ * fewer than max_ids only once there are no more, or PLCTAG_ERR_TOO_SMALL,
+ * leaving cursor as it was, if a name doesn't fit in its cursor_len bytes.
+ */
+extern int
+plc_tag_find(const char* pattern, char* cursor, int cursor_len, int32_t* ids, int max_ids);
+
+/*
+ * An event, as delivered to a batch callback.  timestamp_ns is when it
+ * happened, by CLOCK_MONOTONIC.
+ */
+struct plc_tag_event {
+    int64_t timestamp_ns;
+    int32_t tag_id;
+    int16_t event;
+    int16_t status;
+};
+
+/*
+ * Registers a function to be handed every tag's events, an array at a time,
+ * so that callers for which each call is costly, such as other languages'
+ * bindings, make one call per batch rather than one per event.  A batch is
+ * delivered once a thread has recorded max_events events, and any events
+ * recorded are delivered within about max_delay_ms.  Each thread's events
+ * arrive in the order it emitted them; batches from different threads
+ * interleave.  The function is called from a thread of the library's own,
+ * one batch at a time, and the array is only valid during the call.  It may
+ * use tags, but not register, unregister or flush (PLCTAG_ERR_NOT_ALLOWED).
+ * Only one batch callback may be registered at a time; the per-tag
+ * callbacks are still called as well.
+ *
+ * plc_tag_unregister_batch_callback() delivers everything recorded so far
+ * before it returns, as plc_tag_flush_events() does without unregistering.
+ */
+extern int
+plc_tag_register_batch_callback(
+    void (*batch_callback_func)(const struct plc_tag_event* events, int count, void* userdata),
+    void* userdata, int max_events, int max_delay_ms);
+extern int
+plc_tag_unregister_batch_callback(void);
+extern int
+plc_tag_flush_events(void);
+
+/*
+ * Reads several values, from one tag or many, in one call: for each run of
+ * adjacent items on the same tag, the tag is read as by plc_tag_read() and
+ * each item decoded into its dest, all under one lookup and one lock.  An
+ * item's offset and type are as for the accessor its type names (a bit
+ * number for PLCTAG_ITEM_BIT), and dest must be suitably aligned for that
+ * type, an int for bits.  Each item's status is set; the call returns
+ * PLCTAG_STATUS_OK if every item was read, PLCTAG_ERR_PARTIAL otherwise.
+ * The timeout is for the whole call: once it has run out, items on busy
+ * tags time out without being waited for.
+ */
+#define PLCTAG_ITEM_BIT (1)
+#define PLCTAG_ITEM_UINT8 (2)
+#define PLCTAG_ITEM_INT8 (3)
+#define PLCTAG_ITEM_UINT16 (4)
+#define PLCTAG_ITEM_INT16 (5)
+#define PLCTAG_ITEM_UINT32 (6)
+#define PLCTAG_ITEM_INT32 (7)
+#define PLCTAG_ITEM_UINT64 (8)
+#define PLCTAG_ITEM_INT64 (9)
+#define PLCTAG_ITEM_FLOAT32 (10)
+#define PLCTAG_ITEM_FLOAT64 (11)
+
+struct plc_tag_item {
+    int32_t tag_id;
+    int32_t offset;
+    int32_t type;
+    int32_t status;
+    void* dest;
+};
+
+extern int
+plc_tag_read_items(struct plc_tag_item* items, int count, int timeout);
+
+/*
+ * As plc_tag_lock(), but waiting no more than timeout_ms for a tag held by
+ * another thread: PLCTAG_ERR_TIMEOUT is returned if it is still held then,
+ * or PLCTAG_ERR_BUSY straight away if timeout_ms is 0.  plc_tag_read(),
+ * plc_tag_write() and plc_tag_read_items() wait for busy tags in the same
+ * way, bounded by their own timeouts.  The other accessors wait for as long
+ * as it takes, unless the calling thread already holds the tag.
+ */
+extern int
+plc_tag_lock_timeout(int32_t tag, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
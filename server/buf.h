@@ -0,0 +1,102 @@
+/* buf.h
+ *
+ * A growable byte buffer, and little-endian field access, for building and
+ * parsing EtherNet/IP and CIP messages.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct buf {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+};
+
+static inline void
+buf_reserve(struct buf* b, size_t n)
+{
+    size_t cap;
+
+    if (b->len + n <= b->cap) {
+        return;
+    }
+    cap = b->cap ? b->cap * 2 : 256;
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+    b->data = realloc(b->data, cap);
+    if (b->data == NULL) {
+        err(1, "realloc");
+    }
+    b->cap = cap;
+}
+
+/* Appends n bytes, copied from p unless it is NULL, and returns where they
+ * went.  The pointer is only good until the next append. */
+static inline uint8_t*
+buf_put(struct buf* b, const void* p, size_t n)
+{
+    uint8_t* at;
+
+    buf_reserve(b, n);
+    at = b->data + b->len;
+    if (p != NULL) {
+        memcpy(at, p, n);
+    }
+    b->len += n;
+    return at;
+}
+
+static inline void
+set_u16(uint8_t* p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void
+set_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint16_t
+get_u16(const uint8_t* p)
+{
+    return p[0] | (uint16_t)(p[1]) << 8;
+}
+
+static inline uint32_t
+get_u32(const uint8_t* p)
+{
+    return p[0] | (uint32_t)(p[1]) << 8 | (uint32_t)(p[2]) << 16 | (uint32_t)(p[3]) << 24;
+}
+
+static inline void
+buf_u8(struct buf* b, uint8_t v)
+{
+    *buf_put(b, NULL, 1) = v;
+}
+
+static inline void
+buf_u16(struct buf* b, uint16_t v)
+{
+    set_u16(buf_put(b, NULL, 2), v);
+}
+
+static inline void
+buf_u32(struct buf* b, uint32_t v)
+{
+    set_u32(buf_put(b, NULL, 4), v);
+}
+
+#endif
@@ -0,0 +1,584 @@
+/* cip.c
+ *
+ * CIP services over the tag tree (see cip.h).  Tags are addressed the way
+ * Logix does it: a symbolic segment naming the tag, then any mix of member
+ * names and element subscripts, which are compiled into a member path with
+ * path_resolve() so that repeated requests don't re-parse them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cip.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "path.h"
+#include "tagtree.h"
+
+#define CIP_SEG_SYMBOLIC 0x91
+#define CIP_SEG_ELEMENT_8 0x28
+#define CIP_SEG_ELEMENT_16 0x29
+#define CIP_SEG_ELEMENT_32 0x2a
+#define CIP_SEG_CLASS_8 0x20
+#define CIP_SEG_CLASS_16 0x21
+#define CIP_SEG_INSTANCE_8 0x24
+#define CIP_SEG_INSTANCE_16 0x25
+
+#define CIP_CLASS_MESSAGE_ROUTER 0x02
+#define CIP_CLASS_CONNECTION_MANAGER 0x06
+#define CIP_CLASS_SYMBOL 0x6b
+
+/* Symbol object attributes, for tag listing. */
+#define CIP_ATTR_SYMBOL_NAME 1
+#define CIP_ATTR_SYMBOL_TYPE 2
+#define CIP_ATTR_SYMBOL_ELEM_SIZE 7
+#define CIP_ATTR_SYMBOL_DIMS 8
+
+#define CIP_NAME_MAX 256
+
+/* What a tag request addresses: count elements from offset on. */
+struct cip_target {
+    struct tag_tree_node* tag;
+    uint32_t offset;
+    uint32_t limit; /* bytes from offset to the end of the tag */
+    uint16_t code;
+    uint16_t handle; /* for CIP_TYPE_STRUCT */
+    uint32_t elem_size;
+    int bit; /* >= 0 for a BOOL member, which is read and written as a byte */
+};
+
+static uint32_t next_conn_id = 0x10000;
+
+static void
+cip_reply_header(struct buf* out, uint8_t service, uint8_t status, uint16_t ext)
+{
+    buf_u8(out, service | 0x80);
+    buf_u8(out, 0);
+    buf_u8(out, status);
+    if (ext) {
+        buf_u8(out, 1);
+        buf_u16(out, ext);
+    } else {
+        buf_u8(out, 0);
+    }
+}
+
+/* Replies with just a status, returning it. */
+static uint8_t
+cip_error(struct buf* out, uint8_t service, uint8_t status, uint16_t ext)
+{
+    cip_reply_header(out, service, status, ext);
+    return status;
+}
+
+/* Parses a path made of just a class and an instance. */
+static bool
+cip_logical_path(const uint8_t* path, size_t len, uint16_t* cls, uint32_t* inst)
+{
+    size_t i = 0;
+
+    if (len >= 2 && path[0] == CIP_SEG_CLASS_8) {
+        *cls = path[1];
+        i = 2;
+    } else if (len >= 4 && path[0] == CIP_SEG_CLASS_16) {
+        *cls = get_u16(path + 2);
+        i = 4;
+    } else {
+        return false;
+    }
+
+    if (len == i + 2 && path[i] == CIP_SEG_INSTANCE_8) {
+        *inst = path[i + 1];
+    } else if (len == i + 4 && path[i] == CIP_SEG_INSTANCE_16) {
+        *inst = get_u16(path + i + 2);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Appends to a member path string, failing if it is too long. */
+static bool
+cip_path_append(char* s, size_t* len, const char* fmt, const char* name, size_t name_len, uint32_t idx)
+{
+    int n;
+
+    if (name != NULL) {
+        n = snprintf(s + *len, CIP_NAME_MAX - *len, fmt, (int)name_len, name);
+    } else {
+        n = snprintf(s + *len, CIP_NAME_MAX - *len, fmt, idx);
+    }
+    if (n < 0 || *len + n >= CIP_NAME_MAX) {
+        return false;
+    }
+    *len += n;
+    return true;
+}
+
+/* Turns an IOI (a tag's request path) into a target, or returns a status.
+ * Either way, tgt->tag, if found, is left for the caller to release. */
+static uint8_t
+cip_resolve(const uint8_t* path, size_t len, struct cip_target* tgt, uint16_t* ext)
+{
+    char name[CIP_NAME_MAX], member[CIP_NAME_MAX];
+    size_t i = 0, mlen = 0;
+    bool have_name = false, subscript = false;
+    const struct tag_path* p;
+    type_t t;
+    int32_t id, handle;
+
+    *ext = 0;
+    member[0] = '\0';
+    tgt->tag = NULL;
+
+    while (i < len) {
+        uint8_t seg = path[i];
+        uint32_t idx;
+
+        if (seg == CIP_SEG_SYMBOLIC) {
+            size_t n;
+
+            if (i + 2 > len || i + 2 + path[i + 1] > len) {
+                return CIP_STATUS_PATH_SEGMENT;
+            }
+            n = path[i + 1];
+            if (!have_name) {
+                if (n >= sizeof(name)) {
+                    return CIP_STATUS_PATH_SEGMENT;
+                }
+                memcpy(name, path + i + 2, n);
+                name[n] = '\0';
+                have_name = true;
+            } else if ((subscript && !cip_path_append(member, &mlen, "]", NULL, 0, 0))
+                || !cip_path_append(member, &mlen, mlen ? ".%.*s" : "%.*s", (const char*)(path + i + 2), n, 0)) {
+                return CIP_STATUS_PATH_SEGMENT;
+            }
+            subscript = false;
+            i += 2 + n + (n & 1);
+            continue;
+        }
+
+        if (seg == CIP_SEG_ELEMENT_8 && i + 2 <= len) {
+            idx = path[i + 1];
+            i += 2;
+        } else if (seg == CIP_SEG_ELEMENT_16 && i + 4 <= len) {
+            idx = get_u16(path + i + 2);
+            i += 4;
+        } else if (seg == CIP_SEG_ELEMENT_32 && i + 6 <= len) {
+            idx = get_u32(path + i + 2);
+            i += 6;
+        } else {
+            return CIP_STATUS_PATH_SEGMENT;
+        }
+        if (!have_name || !cip_path_append(member, &mlen, subscript ? ",%u" : "[%u", NULL, 0, idx)) {
+            return CIP_STATUS_PATH_SEGMENT;
+        }
+        subscript = true;
+    }
+    if (!have_name || (subscript && !cip_path_append(member, &mlen, "]", NULL, 0, 0))) {
+        return CIP_STATUS_PATH_SEGMENT;
+    }
+
+    id = tag_tree_lookup_name(name);
+    tgt->tag = id < 0 ? NULL : tag_tree_lookup(id);
+    if (tgt->tag == NULL) {
+        pdebug(PLCTAG_DEBUG_DETAIL, "No tag %s", name);
+        return CIP_STATUS_PATH_DESTINATION;
+    }
+
+    t = tgt->tag->type;
+    tgt->offset = 0;
+    tgt->bit = -1;
+    if (mlen) {
+        handle = path_resolve(t, member);
+        if (handle == PLCTAG_ERR_OUT_OF_BOUNDS) {
+            *ext = CIP_EXT_OUT_OF_BOUNDS;
+            return CIP_STATUS_GENERAL;
+        } else if (handle == PLCTAG_ERR_NOT_FOUND) {
+            return CIP_STATUS_PATH_DESTINATION;
+        } else if (handle < 0 || (p = path_get(handle)) == NULL) {
+            return CIP_STATUS_PATH_SEGMENT;
+        }
+        t = p->type;
+        tgt->offset = p->offset;
+        if (type_to_enum(t) == TAG_BOOL) {
+            tgt->bit = p->bit;
+        }
+    }
+    tgt->limit = type_size_bytes(tgt->tag->type) - tgt->offset;
+
+    /* An array is read and written by its elements. */
+    while (type_to_enum(t) == TAG_ARRAY && !type_is_bit_array(t)) {
+        t = ((struct tag_array*)(t))->member_type;
+    }
+
+    if (type_is_bit_array(t)) {
+        tgt->code = 0xd3;
+        tgt->elem_size = 4;
+    } else if (type_to_enum(t) == TAG_STRUCT || type_to_enum(t) == TAG_STRING) {
+        tgt->code = CIP_TYPE_STRUCT;
+        tgt->handle = type_struct_handle(t);
+        tgt->elem_size = type_size_bytes(t);
+    } else {
+        tgt->code = type_cip_code(t);
+        tgt->elem_size = type_size_bytes(t);
+    }
+
+    return CIP_STATUS_OK;
+}
+
+static uint8_t
+cip_read(const struct cip_target* tgt, uint8_t service, const uint8_t* data, size_t len, struct buf* out, size_t max)
+{
+    struct tag_tree_node* t = tgt->tag;
+    uint32_t count, frag = 0, total, n, room, type_len;
+    uint8_t status = CIP_STATUS_OK;
+    uint8_t* p;
+
+    if (len < (service == CIP_SVC_READ_TAG_FRAG ? 6u : 2u)) {
+        return cip_error(out, service, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+    count = get_u16(data);
+    if (service == CIP_SVC_READ_TAG_FRAG) {
+        frag = get_u32(data + 2);
+    }
+    if (count == 0) {
+        count = 1;
+    }
+
+    /* A BOOL goes as a single byte, which can't be split. */
+    total = tgt->bit >= 0 ? 1 : count * tgt->elem_size;
+    if ((tgt->bit >= 0 && (count != 1 || frag != 0)) || total > tgt->limit || frag > total) {
+        return cip_error(out, service, CIP_STATUS_GENERAL, CIP_EXT_OUT_OF_BOUNDS);
+    }
+
+    /* Send as much as fits, in whole elements where we can; the client asks
+     * for the rest with fragmented reads. */
+    type_len = tgt->code == CIP_TYPE_STRUCT ? 4 : 2;
+    room = max > 4 + type_len ? max - 4 - type_len : 0;
+    n = total - frag;
+    if (n > room) {
+        n = room;
+        if (tgt->elem_size <= n) {
+            n -= n % tgt->elem_size;
+        }
+        status = CIP_STATUS_PARTIAL;
+    }
+    if (n == 0 && status == CIP_STATUS_PARTIAL) {
+        /* Not even a byte fits, as in a full Multiple Service Packet. */
+        return cip_error(out, service, CIP_STATUS_PARTIAL, 0);
+    }
+
+    cip_reply_header(out, service, status, 0);
+    buf_u16(out, tgt->code);
+    if (tgt->code == CIP_TYPE_STRUCT) {
+        buf_u16(out, tgt->handle);
+    }
+    p = buf_put(out, NULL, n);
+
+    TAG_LOCK(t);
+    tag_stats_inc(t, STAT_READS);
+    if (tgt->bit >= 0) {
+        *p = (t->data[tgt->offset] >> tgt->bit) & 1;
+    } else {
+        memcpy(p, t->data + tgt->offset + frag, n);
+    }
+    TAG_UNLOCK(t);
+
+    return status;
+}
+
+static uint8_t
+cip_write(const struct cip_target* tgt, uint8_t service, const uint8_t* data, size_t len, struct buf* out)
+{
+    struct tag_tree_node* t = tgt->tag;
+    uint32_t code, count, frag = 0, total, hdr;
+
+    hdr = service == CIP_SVC_WRITE_TAG_FRAG ? 8 : 4;
+    if (len >= 2 && get_u16(data) == CIP_TYPE_STRUCT) {
+        hdr += 2;
+    }
+    if (len < hdr) {
+        return cip_error(out, service, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+
+    code = get_u16(data);
+    count = get_u16(data + hdr - (service == CIP_SVC_WRITE_TAG_FRAG ? 6 : 2));
+    if (service == CIP_SVC_WRITE_TAG_FRAG) {
+        frag = get_u32(data + hdr - 4);
+    }
+    data += hdr;
+    len -= hdr;
+
+    if (code != tgt->code) {
+        return cip_error(out, service, CIP_STATUS_GENERAL, CIP_EXT_TYPE_MISMATCH);
+    }
+
+    total = tgt->bit >= 0 ? 1 : count * tgt->elem_size;
+    if ((tgt->bit >= 0 && count != 1) || total > tgt->limit) {
+        return cip_error(out, service, CIP_STATUS_GENERAL, CIP_EXT_OUT_OF_BOUNDS);
+    }
+    if (frag + len > total) {
+        return cip_error(out, service, CIP_STATUS_TOO_MUCH_DATA, 0);
+    }
+    if ((service == CIP_SVC_WRITE_TAG || tgt->bit >= 0) && len < total) {
+        return cip_error(out, service, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+
+    TAG_LOCK(t);
+    tag_stats_inc(t, STAT_WRITES);
+    if (tgt->bit >= 0) {
+        if (data[0]) {
+            t->data[tgt->offset] |= 1 << tgt->bit;
+        } else {
+            t->data[tgt->offset] &= ~(1 << tgt->bit);
+        }
+    } else {
+        memcpy(t->data + tgt->offset + frag, data, len);
+    }
+    TAG_UNLOCK(t);
+
+    return cip_error(out, service, CIP_STATUS_OK, 0);
+}
+
+static uint8_t
+cip_multiple_service(struct cip_conn* conn, const uint8_t* data, size_t len, struct buf* out, size_t max)
+{
+    size_t start = out->len, offsets, i, cnt, from, to;
+    uint8_t status = CIP_STATUS_OK;
+
+    if (len < 2 || len < 2 + 2 * (size_t)(get_u16(data))) {
+        return cip_error(out, CIP_SVC_MULTIPLE_SERVICE, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+    cnt = get_u16(data);
+
+    cip_reply_header(out, CIP_SVC_MULTIPLE_SERVICE, CIP_STATUS_OK, 0);
+    buf_u16(out, cnt);
+    offsets = out->len;
+    buf_put(out, NULL, 2 * cnt);
+
+    for (i = 0; i < cnt; i++) {
+        size_t used = out->len - start;
+
+        from = get_u16(data + 2 + 2 * i);
+        to = i + 1 < cnt ? get_u16(data + 2 + 2 * (i + 1)) : len;
+        set_u16(out->data + offsets + 2 * i, out->len - (offsets - 2));
+
+        if (from >= to || to > len) {
+            cip_error(out, 0, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+            status = CIP_STATUS_EMBEDDED;
+            continue;
+        }
+        if (cip_dispatch(conn, data + from, to - from, out, used < max ? max - used : 0) != CIP_STATUS_OK) {
+            status = CIP_STATUS_EMBEDDED;
+        }
+    }
+
+    out->data[start + 2] = status;
+    return status;
+}
+
+static uint8_t
+cip_forward_open(struct cip_conn* conn, uint8_t service, const uint8_t* data, size_t len, struct buf* out)
+{
+    bool large = service == CIP_SVC_LARGE_FORWARD_OPEN;
+    size_t params = large ? 4 : 2;
+    uint32_t ot_rpi, to_rpi, ot_params;
+
+    if (len < 32 + 2 * params) {
+        return cip_error(out, service, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+
+    conn->to_id = get_u32(data + 6);
+    conn->serial = get_u16(data + 10);
+    conn->vendor = get_u16(data + 12);
+    conn->orig_serial = get_u32(data + 14);
+    ot_rpi = get_u32(data + 22);
+    ot_params = large ? get_u32(data + 26) : get_u16(data + 26);
+    to_rpi = get_u32(data + 26 + params);
+    conn->size = large ? ot_params & 0xffff : ot_params & 0x1ff;
+    conn->ot_id = __atomic_add_fetch(&next_conn_id, 1, __ATOMIC_RELAXED);
+    conn->open = true;
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Opened connection %08x (%u bytes)", conn->ot_id, conn->size);
+
+    cip_reply_header(out, service, CIP_STATUS_OK, 0);
+    buf_u32(out, conn->ot_id);
+    buf_u32(out, conn->to_id);
+    buf_u16(out, conn->serial);
+    buf_u16(out, conn->vendor);
+    buf_u32(out, conn->orig_serial);
+    buf_u32(out, ot_rpi);
+    buf_u32(out, to_rpi);
+    buf_u8(out, 0); /* application reply size */
+    buf_u8(out, 0);
+
+    return CIP_STATUS_OK;
+}
+
+static uint8_t
+cip_forward_close(struct cip_conn* conn, const uint8_t* data, size_t len, struct buf* out)
+{
+    if (len < 10) {
+        return cip_error(out, CIP_SVC_FORWARD_CLOSE, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+
+    conn->open = false;
+
+    cip_reply_header(out, CIP_SVC_FORWARD_CLOSE, CIP_STATUS_OK, 0);
+    buf_put(out, data + 2, 8); /* serial, vendor and originator serial */
+    buf_u8(out, 0);
+    buf_u8(out, 0);
+
+    return CIP_STATUS_OK;
+}
+
+static uint8_t
+cip_unconnected_send(struct cip_conn* conn, const uint8_t* data, size_t len, struct buf* out)
+{
+    size_t msg_len;
+
+    if (len < 4 || len < 4 + (size_t)(get_u16(data + 2))) {
+        return cip_error(out, CIP_SVC_UNCONNECTED_SEND, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+    msg_len = get_u16(data + 2);
+
+    /* The route path that follows only matters to real backplanes. */
+    return cip_dispatch(conn, data + 4, msg_len, out, CIP_UNCONNECTED_MAX);
+}
+
+struct cip_listing {
+    const uint8_t* attrs;
+    size_t attr_cnt;
+    struct buf* out;
+    size_t start;
+    size_t max;
+};
+
+static int
+cip_list_symbol(struct tag_tree_node* tag, void* arg)
+{
+    struct cip_listing* l = arg;
+    struct buf* out = l->out;
+    size_t mark = out->len, i, name_len = strlen(tag->name);
+    uint32_t dims[3];
+    int ndims;
+
+    ndims = type_array_dims(tag->type, dims);
+
+    /* Instances are numbered by slot, so that they stay dense and in order. */
+    buf_u32(out, TAG_ID_INDEX(tag->tag_id));
+    for (i = 0; i < l->attr_cnt; i++) {
+        switch (get_u16(l->attrs + 2 * i)) {
+        case CIP_ATTR_SYMBOL_NAME:
+            buf_u16(out, name_len);
+            buf_put(out, tag->name, name_len);
+            break;
+        case CIP_ATTR_SYMBOL_TYPE:
+            /* The number of array dimensions goes in bits 13-14. */
+            buf_u16(out, type_cip_code(tag->type) | (ndims << 13));
+            break;
+        case CIP_ATTR_SYMBOL_ELEM_SIZE:
+            buf_u16(out, type_elem_size(tag->type));
+            break;
+        case CIP_ATTR_SYMBOL_DIMS:
+            buf_u32(out, dims[0]);
+            buf_u32(out, dims[1]);
+            buf_u32(out, dims[2]);
+            break;
+        }
+    }
+
+    /* The client carries on from the last instance it got. */
+    if (out->len - l->start > l->max) {
+        out->len = mark;
+        return 1;
+    }
+    return 0;
+}
+
+/* Lists tags from instance (TAG_ID_INDEX() of the tag ID) `first` on. */
+static uint8_t
+cip_list_symbols(uint32_t first, const uint8_t* data, size_t len, struct buf* out, size_t max)
+{
+    struct cip_listing l;
+    uint8_t status;
+
+    if (len < 2 || len < 2 + 2 * (size_t)(get_u16(data))) {
+        return cip_error(out, CIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+
+    l.attr_cnt = get_u16(data);
+    l.attrs = data + 2;
+    l.out = out;
+    l.start = out->len;
+    l.max = max;
+
+    cip_reply_header(out, CIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST, CIP_STATUS_OK, 0);
+    status = tag_tree_foreach(first, cip_list_symbol, &l) ? CIP_STATUS_PARTIAL : CIP_STATUS_OK;
+    out->data[l.start + 2] = status;
+
+    return status;
+}
+
+uint8_t
+cip_dispatch(struct cip_conn* conn, const uint8_t* req, size_t len, struct buf* out, size_t max)
+{
+    struct cip_target tgt;
+    uint8_t service, status;
+    size_t path_len;
+    uint16_t cls, ext;
+    uint32_t inst;
+
+    if (len < 2 || len < 2 + 2 * (size_t)(req[1])) {
+        return cip_error(out, len ? req[0] : 0, CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    }
+    service = req[0];
+    path_len = 2 * req[1];
+
+    if (cip_logical_path(req + 2, path_len, &cls, &inst)) {
+        const uint8_t* data = req + 2 + path_len;
+        size_t data_len = len - 2 - path_len;
+
+        if (cls == CIP_CLASS_MESSAGE_ROUTER && service == CIP_SVC_MULTIPLE_SERVICE) {
+            return cip_multiple_service(conn, data, data_len, out, max);
+        }
+        if (cls == CIP_CLASS_CONNECTION_MANAGER) {
+            switch (service) {
+            case CIP_SVC_FORWARD_OPEN:
+            case CIP_SVC_LARGE_FORWARD_OPEN:
+                return cip_forward_open(conn, service, data, data_len, out);
+            case CIP_SVC_FORWARD_CLOSE:
+                return cip_forward_close(conn, data, data_len, out);
+            case CIP_SVC_UNCONNECTED_SEND:
+                return cip_unconnected_send(conn, data, data_len, out);
+            }
+        }
+        if (cls == CIP_CLASS_SYMBOL && service == CIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST) {
+            return cip_list_symbols(inst, data, data_len, out, max);
+        }
+        return cip_error(out, service, CIP_STATUS_UNSUPPORTED, 0);
+    }
+
+    switch (service) {
+    case CIP_SVC_READ_TAG:
+    case CIP_SVC_READ_TAG_FRAG:
+    case CIP_SVC_WRITE_TAG:
+    case CIP_SVC_WRITE_TAG_FRAG:
+        break;
+    default:
+        return cip_error(out, service, CIP_STATUS_UNSUPPORTED, 0);
+    }
+
+    status = cip_resolve(req + 2, path_len, &tgt, &ext);
+    if (status != CIP_STATUS_OK) {
+        status = cip_error(out, service, status, ext);
+    } else if (service == CIP_SVC_READ_TAG || service == CIP_SVC_READ_TAG_FRAG) {
+        status = cip_read(&tgt, service, req + 2 + path_len, len - 2 - path_len, out, max);
+    } else {
+        status = cip_write(&tgt, service, req + 2 + path_len, len - 2 - path_len, out);
+    }
+    tag_tree_release(tgt.tag);
+
+    return status;
+}
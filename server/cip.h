@@ -0,0 +1,65 @@
+/* cip.h
+ *
+ * The CIP services plcstub-server offers on top of the tag tree: Read Tag,
+ * Write Tag and their fragmented forms, Multiple Service Packet, Get
+ * Instance Attribute List on the Symbol object (for tag listing), and the
+ * Connection Manager's Forward Open, Forward Close and Unconnected Send.
+ */
+
+#ifndef _CIP_H_
+#define _CIP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf.h"
+
+/* The most data an unconnected message may carry. */
+#define CIP_UNCONNECTED_MAX 504
+
+#define CIP_SVC_MULTIPLE_SERVICE 0x0a
+#define CIP_SVC_READ_TAG 0x4c
+#define CIP_SVC_WRITE_TAG 0x4d
+#define CIP_SVC_FORWARD_CLOSE 0x4e
+#define CIP_SVC_READ_TAG_FRAG 0x52
+#define CIP_SVC_UNCONNECTED_SEND 0x52 /* to the Connection Manager */
+#define CIP_SVC_WRITE_TAG_FRAG 0x53
+#define CIP_SVC_FORWARD_OPEN 0x54
+#define CIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST 0x55
+#define CIP_SVC_LARGE_FORWARD_OPEN 0x5b
+
+#define CIP_STATUS_OK 0x00
+#define CIP_STATUS_PATH_SEGMENT 0x04
+#define CIP_STATUS_PATH_DESTINATION 0x05
+#define CIP_STATUS_PARTIAL 0x06
+#define CIP_STATUS_UNSUPPORTED 0x08
+#define CIP_STATUS_NOT_ENOUGH_DATA 0x13
+#define CIP_STATUS_TOO_MUCH_DATA 0x15
+#define CIP_STATUS_EMBEDDED 0x1e
+#define CIP_STATUS_GENERAL 0xff
+
+/* Logix's extended statuses for CIP_STATUS_GENERAL */
+#define CIP_EXT_OUT_OF_BOUNDS 0x2105
+#define CIP_EXT_TYPE_MISMATCH 0x2107
+
+/* The type code Logix uses for structures; a structure handle follows it. */
+#define CIP_TYPE_STRUCT 0x02a0
+
+/* A class 3 connection, made by Forward Open. */
+struct cip_conn {
+    bool open;
+    uint32_t ot_id; /* chosen by us; the client sends with it */
+    uint32_t to_id; /* chosen by the client; we reply with it */
+    uint16_t serial;
+    uint16_t vendor;
+    uint32_t orig_serial;
+    uint32_t size; /* the most data a message on it may carry */
+};
+
+/* Handles one CIP request, appending its reply, which will be no more than
+ * max bytes long, to out.  Returns the reply's general status. */
+uint8_t
+cip_dispatch(struct cip_conn* conn, const uint8_t* req, size_t len, struct buf* out, size_t max);
+
+#endif
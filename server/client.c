@@ -0,0 +1,370 @@
+/* client.c
+ *
+ * The test and benchmark client (see client.h).
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cip.h"
+#include "client.h"
+#include "eip.h"
+
+/* The Connection Manager's path, and the path a connection is opened to. */
+static const uint8_t cm_path[] = { 0x20, 0x06, 0x24, 0x01 };
+static const uint8_t conn_path[] = { 0x01, 0x00, 0x20, 0x02, 0x24, 0x01 };
+
+static int
+eip_client_write_all(struct eip_client* c)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < c->out.len) {
+        n = send(c->fd, c->out.data + off, c->out.len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    c->out.len = 0;
+    return 0;
+}
+
+static void
+eip_client_header(struct eip_client* c, uint16_t cmd, size_t len)
+{
+    uint8_t* h = buf_put(&c->out, NULL, EIP_HEADER_LEN);
+
+    memset(h, 0, EIP_HEADER_LEN);
+    set_u16(h, cmd);
+    set_u16(h + 2, len);
+    set_u32(h + 4, c->session);
+}
+
+/* Reads the next frame into c->in, returning its length, or -1. */
+static ssize_t
+eip_client_read_frame(struct eip_client* c)
+{
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        len = eip_frame_len(c->in.data, c->in.len);
+        if (len != 0 && len <= c->in.len) {
+            return len;
+        }
+        buf_reserve(&c->in, 4096);
+        n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        c->in.len += n;
+    }
+}
+
+static void
+eip_client_consume(struct eip_client* c, size_t len)
+{
+    memmove(c->in.data, c->in.data + len, c->in.len - len);
+    c->in.len -= len;
+}
+
+int
+eip_client_connect(struct eip_client* c, const char* host, uint16_t port)
+{
+    struct addrinfo hints, *ai;
+    char port_str[8];
+    ssize_t len;
+    int one = 1;
+
+    memset(c, 0, sizeof(*c));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    if (getaddrinfo(host, port_str, &hints, &ai)) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (c->fd < 0 || connect(c->fd, ai->ai_addr, ai->ai_addrlen)) {
+        freeaddrinfo(ai);
+        if (c->fd >= 0) {
+            close(c->fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(ai);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    eip_client_header(c, EIP_CMD_REGISTER_SESSION, 4);
+    buf_u16(&c->out, 1); /* protocol version */
+    buf_u16(&c->out, 0); /* options */
+    if (eip_client_write_all(c) || (len = eip_client_read_frame(c)) < 0) {
+        close(c->fd);
+        return -1;
+    }
+    if (get_u32(c->in.data + 8) != EIP_STATUS_OK) {
+        close(c->fd);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    c->session = get_u32(c->in.data + 4);
+    eip_client_consume(c, len);
+
+    return 0;
+}
+
+int
+eip_client_forward_open(struct eip_client* c, uint16_t size)
+{
+    struct buf req = { 0 }, reply = { 0 };
+    int ret;
+
+    buf_u8(&req, CIP_SVC_LARGE_FORWARD_OPEN);
+    buf_u8(&req, sizeof(cm_path) / 2);
+    buf_put(&req, cm_path, sizeof(cm_path));
+    buf_u8(&req, 10); /* priority and tick time */
+    buf_u8(&req, 5); /* timeout ticks */
+    buf_u32(&req, 0); /* O->T connection ID, chosen by the server */
+    buf_u32(&req, c->to_id = 0x1000 + c->session); /* T->O connection ID */
+    buf_u16(&req, c->session); /* connection serial number */
+    buf_u16(&req, 0xf33d); /* vendor */
+    buf_u32(&req, 0x12345678); /* originator serial number */
+    buf_u8(&req, 0); /* timeout multiplier */
+    buf_put(&req, "\0\0\0", 3);
+    buf_u32(&req, 1000000); /* O->T RPI */
+    buf_u32(&req, 0x42000000 | size); /* point to point, fixed size */
+    buf_u32(&req, 1000000); /* T->O RPI */
+    buf_u32(&req, 0x42000000 | size);
+    buf_u8(&req, 0xa3); /* transport class 3, server */
+    buf_u8(&req, sizeof(conn_path) / 2);
+    buf_put(&req, conn_path, sizeof(conn_path));
+
+    ret = eip_client_request(c, req.data, req.len, &reply);
+    if (ret == 0 && reply.len >= 8) {
+        ret = reply.data[2];
+        if (ret == CIP_STATUS_OK) {
+            c->ot_id = get_u32(reply.data + 4);
+        }
+    } else if (ret == 0) {
+        ret = -1;
+    }
+
+    free(req.data);
+    free(reply.data);
+    return ret;
+}
+
+int
+eip_client_forward_close(struct eip_client* c)
+{
+    struct buf req = { 0 }, reply = { 0 };
+    int ret;
+
+    buf_u8(&req, CIP_SVC_FORWARD_CLOSE);
+    buf_u8(&req, sizeof(cm_path) / 2);
+    buf_put(&req, cm_path, sizeof(cm_path));
+    buf_u8(&req, 10);
+    buf_u8(&req, 5);
+    buf_u16(&req, c->session);
+    buf_u16(&req, 0xf33d);
+    buf_u32(&req, 0x12345678);
+    buf_u8(&req, sizeof(conn_path) / 2);
+    buf_u8(&req, 0);
+    buf_put(&req, conn_path, sizeof(conn_path));
+
+    /* Forward Close always goes unconnected. */
+    c->ot_id = 0;
+    ret = eip_client_request(c, req.data, req.len, &reply);
+    if (ret == 0) {
+        ret = reply.len >= 4 ? reply.data[2] : -1;
+    }
+
+    free(req.data);
+    free(reply.data);
+    return ret;
+}
+
+int
+eip_client_send(struct eip_client* c, const uint8_t* req, size_t len)
+{
+    if (c->ot_id) {
+        eip_client_header(c, EIP_CMD_SEND_UNIT_DATA, 22 + len);
+        buf_u32(&c->out, 0); /* interface handle */
+        buf_u16(&c->out, 0); /* timeout */
+        buf_u16(&c->out, 2);
+        buf_u16(&c->out, EIP_ITEM_CONNECTED_ADDRESS);
+        buf_u16(&c->out, 4);
+        buf_u32(&c->out, c->ot_id);
+        buf_u16(&c->out, EIP_ITEM_CONNECTED_DATA);
+        buf_u16(&c->out, 2 + len);
+        buf_u16(&c->out, ++c->seq);
+    } else {
+        eip_client_header(c, EIP_CMD_SEND_RR_DATA, 16 + len);
+        buf_u32(&c->out, 0);
+        buf_u16(&c->out, 0);
+        buf_u16(&c->out, 2);
+        buf_u16(&c->out, EIP_ITEM_NULL_ADDRESS);
+        buf_u16(&c->out, 0);
+        buf_u16(&c->out, EIP_ITEM_UNCONNECTED_DATA);
+        buf_u16(&c->out, len);
+    }
+    buf_put(&c->out, req, len);
+
+    return eip_client_write_all(c);
+}
+
+int
+eip_client_recv(struct eip_client* c, struct buf* reply)
+{
+    ssize_t len;
+    uint32_t status;
+    size_t skip;
+
+    len = eip_client_read_frame(c);
+    if (len < 0) {
+        return -1;
+    }
+
+    status = get_u32(c->in.data + 8);
+    reply->len = 0;
+    if (status == EIP_STATUS_OK) {
+        /* Interface handle, timeout, item count, the address item, and the
+         * data item's header; connected data starts with a sequence count. */
+        skip = get_u16(c->in.data) == EIP_CMD_SEND_UNIT_DATA ? 6 + 2 + 8 + 4 + 2 : 6 + 2 + 4 + 4;
+        if ((size_t)(len) < EIP_HEADER_LEN + skip) {
+            return -1;
+        }
+        buf_put(reply, c->in.data + EIP_HEADER_LEN + skip, len - EIP_HEADER_LEN - skip);
+    }
+    eip_client_consume(c, len);
+
+    return status;
+}
+
+int
+eip_client_request(struct eip_client* c, const uint8_t* req, size_t len, struct buf* reply)
+{
+    if (eip_client_send(c, req, len)) {
+        return -1;
+    }
+    return eip_client_recv(c, reply);
+}
+
+void
+eip_client_close(struct eip_client* c)
+{
+    eip_client_header(c, EIP_CMD_UNREGISTER_SESSION, 0);
+    eip_client_write_all(c);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+}
+
+void
+cip_build_tag_path(struct buf* b, const char* tag)
+{
+    size_t at = b->len, n;
+    const char* p = tag;
+    char* end;
+
+    buf_u8(b, 0);
+    while (*p) {
+        n = strcspn(p, ".[");
+        buf_u8(b, 0x91);
+        buf_u8(b, n);
+        buf_put(b, p, n);
+        if (n & 1) {
+            buf_u8(b, 0);
+        }
+        p += n;
+
+        if (*p == '[') {
+            do {
+                unsigned long idx = strtoul(p + 1, &end, 10);
+                if (idx < 0x100) {
+                    buf_u8(b, 0x28);
+                    buf_u8(b, idx);
+                } else if (idx < 0x10000) {
+                    buf_u8(b, 0x29);
+                    buf_u8(b, 0);
+                    buf_u16(b, idx);
+                } else {
+                    buf_u8(b, 0x2a);
+                    buf_u8(b, 0);
+                    buf_u32(b, idx);
+                }
+                p = end;
+            } while (*p == ',');
+            if (*p == ']') {
+                p++;
+            }
+        }
+        if (*p == '.') {
+            p++;
+        }
+    }
+    b->data[at] = (b->len - at - 1) / 2;
+}
+
+void
+cip_build_read(struct buf* b, const char* tag, uint16_t count)
+{
+    buf_u8(b, CIP_SVC_READ_TAG);
+    cip_build_tag_path(b, tag);
+    buf_u16(b, count);
+}
+
+void
+cip_build_read_frag(struct buf* b, const char* tag, uint16_t count, uint32_t offset)
+{
+    buf_u8(b, CIP_SVC_READ_TAG_FRAG);
+    cip_build_tag_path(b, tag);
+    buf_u16(b, count);
+    buf_u32(b, offset);
+}
+
+void
+cip_build_write(struct buf* b, const char* tag, uint16_t type, uint16_t count, const void* data, size_t len)
+{
+    buf_u8(b, CIP_SVC_WRITE_TAG);
+    cip_build_tag_path(b, tag);
+    buf_u16(b, type);
+    buf_u16(b, count);
+    buf_put(b, data, len);
+}
+
+void
+cip_build_unconnected_send(struct buf* b, const uint8_t* req, size_t len)
+{
+    static const uint8_t route[] = { 0x01, 0x00 }; /* backplane, slot 0 */
+
+    buf_u8(b, CIP_SVC_UNCONNECTED_SEND);
+    buf_u8(b, sizeof(cm_path) / 2);
+    buf_put(b, cm_path, sizeof(cm_path));
+    buf_u8(b, 10);
+    buf_u8(b, 5);
+    buf_u16(b, len);
+    buf_put(b, req, len);
+    if (len & 1) {
+        buf_u8(b, 0);
+    }
+    buf_u8(b, sizeof(route) / 2);
+    buf_u8(b, 0);
+    buf_put(b, route, sizeof(route));
+}
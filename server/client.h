@@ -0,0 +1,71 @@
+/* client.h
+ *
+ * A minimal blocking EtherNet/IP client, enough for the tests and the
+ * benchmark to talk to plcstub-server.
+ */
+
+#ifndef _CLIENT_H_
+#define _CLIENT_H_
+
+#include <stdint.h>
+
+#include "buf.h"
+
+struct eip_client {
+    int fd;
+    uint32_t session;
+    uint32_t ot_id; /* 0 until eip_client_forward_open() */
+    uint32_t to_id;
+    uint16_t seq;
+    struct buf in;
+    struct buf out;
+};
+
+/* Connects and registers a session.  Returns 0, or -1 with errno set. */
+int
+eip_client_connect(struct eip_client* c, const char* host, uint16_t port);
+
+/* Opens a connection (Large Forward Open) carrying messages of up to size
+ * bytes; requests are then sent on it.  Returns the CIP status, or -1. */
+int
+eip_client_forward_open(struct eip_client* c, uint16_t size);
+
+/* Returns the CIP status, or -1. */
+int
+eip_client_forward_close(struct eip_client* c);
+
+/* Sends a CIP request: on the connection if one is open, else unconnected. */
+int
+eip_client_send(struct eip_client* c, const uint8_t* req, size_t len);
+
+/* Waits for the next reply and puts the CIP part of it in reply.  Returns 0,
+ * an encapsulation status, or -1. */
+int
+eip_client_recv(struct eip_client* c, struct buf* reply);
+
+int
+eip_client_request(struct eip_client* c, const uint8_t* req, size_t len, struct buf* reply);
+
+/* Unregisters and disconnects. */
+void
+eip_client_close(struct eip_client* c);
+
+/* Appends a request path for a tag such as "Motor.Speed[3]" or "Grid[1,2]",
+ * preceded by its length in words. */
+void
+cip_build_tag_path(struct buf* b, const char* tag);
+
+void
+cip_build_read(struct buf* b, const char* tag, uint16_t count);
+
+void
+cip_build_read_frag(struct buf* b, const char* tag, uint16_t count, uint32_t offset);
+
+void
+cip_build_write(struct buf* b, const char* tag, uint16_t type, uint16_t count, const void* data, size_t len);
+
+/* Wraps a request in an Unconnected Send to the Connection Manager. */
+void
+cip_build_unconnected_send(struct buf* b, const uint8_t* req, size_t len);
+
+#endif
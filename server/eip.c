@@ -0,0 +1,207 @@
+/* eip.c
+ *
+ * EtherNet/IP encapsulation (see eip.h).  Requests arrive as SendRRData, for
+ * unconnected messages, or SendUnitData, for messages on a connection made
+ * by Forward Open; either way the CIP request is handed to cip_dispatch()
+ * and its reply wrapped the same way it came.
+ */
+
+#include <string.h>
+
+#include "debug.h"
+#include "eip.h"
+#include "libplctag.h"
+
+#define EIP_PRODUCT_NAME "plcstub"
+
+static uint32_t next_session = 0;
+
+/* Finds the first item of the given type in a Common Packet Format list. */
+static const uint8_t*
+eip_find_item(const uint8_t* items, size_t len, uint16_t type, size_t* item_len)
+{
+    size_t off = 2, i, cnt;
+
+    if (len < 2) {
+        return NULL;
+    }
+    cnt = get_u16(items);
+
+    for (i = 0; i < cnt && off + 4 <= len; i++) {
+        size_t n = get_u16(items + off + 2);
+
+        if (off + 4 + n > len) {
+            return NULL;
+        }
+        if (get_u16(items + off) == type) {
+            *item_len = n;
+            return items + off + 4;
+        }
+        off += 4 + n;
+    }
+    return NULL;
+}
+
+/* SendRRData and SendUnitData: unwraps the CIP request and wraps its reply. */
+static uint32_t
+eip_send_data(struct eip_session* s, uint16_t cmd, const uint8_t* data, size_t len, struct buf* out)
+{
+    const uint8_t *addr, *req;
+    size_t addr_len, req_len, max, len_at;
+    uint16_t seq = 0;
+
+    /* Skip the interface handle and timeout. */
+    if (len < 6) {
+        return EIP_STATUS_BAD_LENGTH;
+    }
+    data += 6;
+    len -= 6;
+
+    if (cmd == EIP_CMD_SEND_RR_DATA) {
+        req = eip_find_item(data, len, EIP_ITEM_UNCONNECTED_DATA, &req_len);
+        if (req == NULL) {
+            return EIP_STATUS_BAD_DATA;
+        }
+        max = CIP_UNCONNECTED_MAX;
+    } else {
+        addr = eip_find_item(data, len, EIP_ITEM_CONNECTED_ADDRESS, &addr_len);
+        req = eip_find_item(data, len, EIP_ITEM_CONNECTED_DATA, &req_len);
+        if (addr == NULL || addr_len != 4 || req == NULL || req_len < 2
+            || !s->conn.open || get_u32(addr) != s->conn.ot_id) {
+            pdebug(PLCTAG_DEBUG_WARN, "Connected data for a connection that isn't open");
+            return EIP_STATUS_BAD_DATA;
+        }
+        seq = get_u16(req);
+        req += 2;
+        req_len -= 2;
+        max = s->conn.size > 2 ? s->conn.size - 2 : 0;
+    }
+
+    buf_u32(out, 0); /* interface handle */
+    buf_u16(out, 0); /* timeout */
+    buf_u16(out, 2); /* item count */
+    if (cmd == EIP_CMD_SEND_RR_DATA) {
+        buf_u16(out, EIP_ITEM_NULL_ADDRESS);
+        buf_u16(out, 0);
+        buf_u16(out, EIP_ITEM_UNCONNECTED_DATA);
+        len_at = out->len;
+        buf_u16(out, 0);
+    } else {
+        buf_u16(out, EIP_ITEM_CONNECTED_ADDRESS);
+        buf_u16(out, 4);
+        buf_u32(out, s->conn.to_id);
+        buf_u16(out, EIP_ITEM_CONNECTED_DATA);
+        len_at = out->len;
+        buf_u16(out, 0);
+        buf_u16(out, seq);
+    }
+
+    cip_dispatch(&s->conn, req, req_len, out, max);
+    set_u16(out->data + len_at, out->len - len_at - 2);
+
+    return EIP_STATUS_OK;
+}
+
+static void
+eip_list_identity(struct buf* out)
+{
+    size_t len_at;
+    uint8_t* sa;
+
+    buf_u16(out, 1); /* item count */
+    buf_u16(out, EIP_ITEM_IDENTITY);
+    len_at = out->len;
+    buf_u16(out, 0);
+
+    buf_u16(out, 1); /* protocol version */
+    sa = buf_put(out, NULL, 16); /* a sockaddr_in, in network byte order */
+    memset(sa, 0, 16);
+    sa[1] = 2; /* AF_INET */
+    sa[2] = EIP_PORT >> 8;
+    sa[3] = EIP_PORT & 0xff;
+    buf_u16(out, 1); /* vendor: Rockwell */
+    buf_u16(out, 0x0e); /* device type: PLC */
+    buf_u16(out, 0); /* product code */
+    buf_u8(out, 1); /* revision */
+    buf_u8(out, 0);
+    buf_u16(out, 0); /* status */
+    buf_u32(out, 0); /* serial number */
+    buf_u8(out, strlen(EIP_PRODUCT_NAME));
+    buf_put(out, EIP_PRODUCT_NAME, strlen(EIP_PRODUCT_NAME));
+    buf_u8(out, 3); /* state: operational */
+
+    set_u16(out->data + len_at, out->len - len_at - 2);
+}
+
+static void
+eip_list_services(struct buf* out)
+{
+    uint8_t* name;
+
+    buf_u16(out, 1); /* item count */
+    buf_u16(out, EIP_ITEM_SERVICES);
+    buf_u16(out, 20);
+    buf_u16(out, 1); /* protocol version */
+    buf_u16(out, 0x0020); /* supports CIP over TCP */
+    name = buf_put(out, NULL, 16);
+    memset(name, 0, 16);
+    memcpy(name, "Communications", 14);
+}
+
+bool
+eip_handle(struct eip_session* s, const uint8_t* frame, struct buf* out)
+{
+    uint16_t cmd = get_u16(frame);
+    size_t len = get_u16(frame + 2), start = out->len;
+    uint32_t session = get_u32(frame + 4), status = EIP_STATUS_OK;
+    const uint8_t* data = frame + EIP_HEADER_LEN;
+    uint8_t* hdr;
+
+    /* The reply echoes the request's header, sender context and all. */
+    buf_put(out, frame, EIP_HEADER_LEN);
+
+    switch (cmd) {
+    case EIP_CMD_REGISTER_SESSION:
+        if (len != 4) {
+            status = EIP_STATUS_BAD_LENGTH;
+        } else if (s->handle != 0) {
+            status = EIP_STATUS_INVALID_COMMAND;
+        } else {
+            s->handle = session = __atomic_add_fetch(&next_session, 1, __ATOMIC_RELAXED);
+            buf_put(out, data, 4); /* protocol version and options */
+            pdebug(PLCTAG_DEBUG_DETAIL, "Registered session %08x", s->handle);
+        }
+        break;
+    case EIP_CMD_UNREGISTER_SESSION:
+        pdebug(PLCTAG_DEBUG_DETAIL, "Unregistered session %08x", s->handle);
+        out->len = start;
+        return false;
+    case EIP_CMD_LIST_IDENTITY:
+        eip_list_identity(out);
+        break;
+    case EIP_CMD_LIST_SERVICES:
+        eip_list_services(out);
+        break;
+    case EIP_CMD_SEND_RR_DATA:
+    case EIP_CMD_SEND_UNIT_DATA:
+        if (s->handle == 0 || session != s->handle) {
+            status = EIP_STATUS_BAD_SESSION;
+        } else {
+            status = eip_send_data(s, cmd, data, len, out);
+        }
+        break;
+    default:
+        status = EIP_STATUS_INVALID_COMMAND;
+        break;
+    }
+
+    if (status != EIP_STATUS_OK) {
+        out->len = start + EIP_HEADER_LEN;
+    }
+    hdr = out->data + start;
+    set_u16(hdr + 2, out->len - start - EIP_HEADER_LEN);
+    set_u32(hdr + 4, session);
+    set_u32(hdr + 8, status);
+
+    return true;
+}
@@ -0,0 +1,79 @@
+/* eip.h
+ *
+ * EtherNet/IP encapsulation for plcstub-server: sessions, the explicit
+ * messaging commands that carry CIP (see cip.h), and the event loop that
+ * serves them over TCP.
+ */
+
+#ifndef _EIP_H_
+#define _EIP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf.h"
+#include "cip.h"
+
+#define EIP_PORT 44818
+#define EIP_HEADER_LEN 24
+
+#define EIP_CMD_LIST_SERVICES 0x0004
+#define EIP_CMD_LIST_IDENTITY 0x0063
+#define EIP_CMD_REGISTER_SESSION 0x0065
+#define EIP_CMD_UNREGISTER_SESSION 0x0066
+#define EIP_CMD_SEND_RR_DATA 0x006f
+#define EIP_CMD_SEND_UNIT_DATA 0x0070
+
+#define EIP_STATUS_OK 0x0000
+#define EIP_STATUS_INVALID_COMMAND 0x0001
+#define EIP_STATUS_BAD_DATA 0x0003
+#define EIP_STATUS_BAD_SESSION 0x0064
+#define EIP_STATUS_BAD_LENGTH 0x0065
+
+#define EIP_ITEM_NULL_ADDRESS 0x0000
+#define EIP_ITEM_IDENTITY 0x000c
+#define EIP_ITEM_CONNECTED_ADDRESS 0x00a1
+#define EIP_ITEM_CONNECTED_DATA 0x00b1
+#define EIP_ITEM_UNCONNECTED_DATA 0x00b2
+#define EIP_ITEM_SERVICES 0x0100
+
+/* One client's session, with the one CIP connection it may open on it. */
+struct eip_session {
+    uint32_t handle; /* 0 until registered */
+    struct cip_conn conn;
+};
+
+/* The length of the frame starting at p, or 0 if its header hasn't all
+ * arrived yet. */
+static inline size_t
+eip_frame_len(const uint8_t* p, size_t len)
+{
+    return len < EIP_HEADER_LEN ? 0 : EIP_HEADER_LEN + get_u16(p + 2);
+}
+
+/* Handles one complete frame, appending any reply to out.  Returns false if
+ * the client has unregistered its session and should be disconnected. */
+bool
+eip_handle(struct eip_session* s, const uint8_t* frame, struct buf* out);
+
+struct eip_server_config {
+    const char* addr; /* to listen on; NULL for all */
+    uint16_t port; /* 0 to pick one; see eip_server_port() */
+    int threads; /* event loop threads, each with its own listener */
+};
+
+/* Starts serving the tag tree in background threads.  Returns 0, or -1 (with
+ * a warning printed) if the listeners couldn't be set up. */
+int
+eip_server_start(const struct eip_server_config* cfg);
+
+/* The port the server is listening on. */
+uint16_t
+eip_server_port(void);
+
+/* Stops the threads and disconnects every client. */
+void
+eip_server_stop(void);
+
+#endif
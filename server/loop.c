@@ -0,0 +1,369 @@
+/* loop.c
+ *
+ * The server's event loop.  Each thread has its own epoll instance and its
+ * own listening socket on the same port (SO_REUSEPORT), so the kernel spreads
+ * new connections across threads and a connection never moves between them:
+ * nothing about a client is shared, and nothing but the tags is locked.
+ *
+ * Connections are non-blocking and edge-triggered.  A readable connection is
+ * drained, every complete frame in it is handled, and the replies are written
+ * in one go, so a client that pipelines requests gets its replies batched.
+ * If a client stops reading its replies we stop reading its requests, until
+ * the backlog drains.
+ */
+
+#define _GNU_SOURCE /* for accept4() */
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "eip.h"
+#include "libplctag.h"
+
+#define LOOP_MAX_EVENTS 256
+#define LOOP_READ_CHUNK 16384
+#define LOOP_BACKLOG_MAX (1 << 20) /* unsent reply bytes before we stop reading */
+
+struct client {
+    int fd;
+    struct eip_session session;
+    struct buf in;
+    struct buf out;
+    size_t out_off; /* how much of out has been sent */
+    bool polling_out; /* EPOLLOUT is armed */
+    struct client *prev, *next;
+};
+
+struct worker {
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    struct client* clients;
+};
+
+static struct worker* workers = NULL;
+static int nworkers = 0;
+static int stop_fd = -1;
+static uint16_t server_port = 0;
+
+/* epoll data for the listener and the stop eventfd; clients use their own
+ * address. */
+static char listener_tag, stop_tag;
+
+static void
+client_close(struct worker* w, struct client* c)
+{
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->clients = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+/* Reads what's available.  Returns -1 if the client went away, 0 once the
+ * socket is drained, or 1 if we stopped because of the reply backlog. */
+static int
+client_fill(struct client* c)
+{
+    ssize_t n;
+
+    for (;;) {
+        if (c->out.len - c->out_off >= LOOP_BACKLOG_MAX) {
+            return 1;
+        }
+        buf_reserve(&c->in, LOOP_READ_CHUNK);
+        n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+        if (n > 0) {
+            c->in.len += n;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* Handles every complete frame read so far.  Returns false if the client
+ * unregistered. */
+static bool
+client_process(struct client* c)
+{
+    size_t off = 0, len;
+    bool ok = true;
+
+    while (ok && (len = eip_frame_len(c->in.data + off, c->in.len - off)) != 0 && off + len <= c->in.len) {
+        ok = eip_handle(&c->session, c->in.data + off, &c->out);
+        off += len;
+    }
+
+    memmove(c->in.data, c->in.data + off, c->in.len - off);
+    c->in.len -= off;
+    return ok;
+}
+
+/* Writes what replies we can, arming EPOLLOUT if some are left over. */
+static bool
+client_flush(struct worker* w, struct client* c)
+{
+    struct epoll_event ev;
+    ssize_t n;
+
+    while (c->out_off < c->out.len) {
+        n = send(c->fd, c->out.data + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+
+    if (c->out_off == c->out.len) {
+        c->out.len = c->out_off = 0;
+    }
+
+    if ((c->out.len != 0) != c->polling_out) {
+        c->polling_out = c->out.len != 0;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (c->polling_out ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Returns false if the client should be disconnected. */
+static bool
+client_service(struct worker* w, struct client* c)
+{
+    int r;
+
+    for (;;) {
+        r = client_fill(c);
+        if (r < 0 || !client_process(c) || !client_flush(w, c)) {
+            return false;
+        }
+        /* Stopped for the backlog, but it has now drained: carry on, as the
+         * edge we were woken by won't come again. */
+        if (r == 0 || c->out.len != 0) {
+            return true;
+        }
+    }
+}
+
+static void
+worker_accept(struct worker* w)
+{
+    struct epoll_event ev;
+    struct client* c;
+    int fd, one = 1;
+
+    while ((fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            err(1, "calloc");
+        }
+        c->fd = fd;
+
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            warn("epoll_ctl");
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        c->next = w->clients;
+        if (c->next) {
+            c->next->prev = c;
+        }
+        w->clients = c;
+    }
+}
+
+static void*
+worker_main(void* arg)
+{
+    struct worker* w = arg;
+    struct epoll_event evs[LOOP_MAX_EVENTS];
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(w->epfd, evs, LOOP_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            err(1, "epoll_wait");
+        }
+
+        for (i = 0; i < n; i++) {
+            struct client* c = evs[i].data.ptr;
+
+            if (c == (void*)(&stop_tag)) {
+                while (w->clients) {
+                    client_close(w, w->clients);
+                }
+                return NULL;
+            } else if (c == (void*)(&listener_tag)) {
+                worker_accept(w);
+            } else if ((evs[i].events & EPOLLERR) || !client_service(w, c)) {
+                client_close(w, c);
+            }
+        }
+    }
+}
+
+static int
+listener_open(const struct eip_server_config* cfg, uint16_t port)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    int fd, one = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (cfg->addr != NULL && inet_pton(AF_INET, cfg->addr, &sin.sin_addr) != 1) {
+        warnx("Bad address %s", cfg->addr);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        warn("socket");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+        || bind(fd, (struct sockaddr*)(&sin), sizeof(sin))
+        || listen(fd, SOMAXCONN)
+        || getsockname(fd, (struct sockaddr*)(&sin), &sin_len)) {
+        warn("Couldn't listen on port %u", port);
+        close(fd);
+        return -1;
+    }
+
+    server_port = ntohs(sin.sin_port);
+    return fd;
+}
+
+int
+eip_server_start(const struct eip_server_config* cfg)
+{
+    struct epoll_event ev;
+    struct worker* w;
+    int i;
+
+    nworkers = cfg->threads > 0 ? cfg->threads : 1;
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) {
+        err(1, "calloc");
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        err(1, "eventfd");
+    }
+
+    /* Set everything up before starting any thread, so that failures are
+     * reported to the caller.  Listeners after the first share its port. */
+    server_port = cfg->port;
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        w->listen_fd = listener_open(cfg, server_port);
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->listen_fd < 0 || w->epfd < 0) {
+            while (i >= 0) {
+                close(workers[i].listen_fd);
+                close(workers[i].epfd);
+                i--;
+            }
+            close(stop_fd);
+            free(workers);
+            workers = NULL;
+            return -1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listener_tag;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev)) {
+            err(1, "epoll_ctl");
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stop_tag;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, stop_fd, &ev)) {
+            err(1, "epoll_ctl");
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            errx(1, "pthread_create");
+        }
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Serving EtherNet/IP on port %u with %d threads", server_port, nworkers);
+    return 0;
+}
+
+uint16_t
+eip_server_port(void)
+{
+    return server_port;
+}
+
+void
+eip_server_stop(void)
+{
+    uint64_t one = 1;
+    int i;
+
+    if (workers == NULL) {
+        return;
+    }
+
+    /* Level-triggered and never read, so every worker sees it. */
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        err(1, "write");
+    }
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].listen_fd);
+        close(workers[i].epfd);
+    }
+
+    close(stop_fd);
+    free(workers);
+    workers = NULL;
+}
@@ -0,0 +1,74 @@
+/* main.c
+ *
+ * plcstub-server: serves the tag tree over EtherNet/IP, so that real
+ * EtherNet/IP clients (libplctag itself, HMIs, ...) can be pointed at plcstub.
+ * With PLCSTUB_SHM_NAME set, the tags are those of the shared store, so other
+ * processes using plcstub can drive the tags the server's clients see.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "eip.h"
+#include "libplctag.h"
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: plcstub-server [-b address] [-p port] [-t threads] [-d debug_level]\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct eip_server_config cfg = { NULL, EIP_PORT, 0 };
+    sigset_t sigs;
+    int ch, sig;
+
+    cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((ch = getopt(argc, argv, "b:d:p:t:")) != -1) {
+        switch (ch) {
+        case 'b':
+            cfg.addr = optarg;
+            break;
+        case 'd':
+            plc_tag_set_debug_level(atoi(optarg));
+            break;
+        case 'p':
+            cfg.port = atoi(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc) {
+        usage();
+    }
+
+    /* Block the signals we wait for before any thread starts, so that they
+     * all inherit the mask. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    if (eip_server_start(&cfg)) {
+        return 1;
+    }
+    printf("Listening on port %u\n", eip_server_port());
+    fflush(stdout);
+
+    sigwait(&sigs, &sig);
+    eip_server_stop();
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+/* attrib.c
+ *
+ * Attribute string parsing for plc_tag_create().  The string is walked once,
+ * in place: each key is looked up in a table of the attributes libplctag
+ * knows, which says how to check its value and where in struct tag_attribs to
+ * put it.  Attributes that only matter to a real PLC (gateway, path, byte
+ * orders, ...) are checked for a value and otherwise ignored.
+ *
+ * Clients tend to create the same few hundred tags over and over, so parsed
+ * strings are kept in a small direct-mapped cache keyed by the string's hash.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attrib.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "stats.h"
+
+#define ATTRIB_CACHE_SLOTS 256
+
+enum attrib_kind {
+    ATTRIB_IGNORED, /* any non-empty value */
+    ATTRIB_NAME,
+    ATTRIB_COUNT, /* > 0 */
+    ATTRIB_INT, /* >= 0 */
+    ATTRIB_BOOL, /* 0 or 1 */
+};
+
+struct attrib_def {
+    const char* key;
+    uint8_t len;
+    uint8_t kind;
+    uint16_t offset; /* into struct tag_attribs, for numeric kinds */
+};
+
+#define ATTRIB(key, kind, field) { key, sizeof(key) - 1, kind, offsetof(struct tag_attribs, field) }
+#define ATTRIB_ANY(key) { key, sizeof(key) - 1, ATTRIB_IGNORED, 0 }
+
+static const struct attrib_def attrib_defs[] = {
+    ATTRIB("name", ATTRIB_NAME, name),
+    ATTRIB("elem_size", ATTRIB_COUNT, elem_size),
+    ATTRIB("elem_count", ATTRIB_COUNT, elem_count),
+    ATTRIB("debug", ATTRIB_INT, debug),
+    ATTRIB("read_cache_ms", ATTRIB_INT, read_cache_ms),
+    ATTRIB("auto_sync_read_ms", ATTRIB_INT, auto_sync_read_ms),
+    ATTRIB("auto_sync_write_ms", ATTRIB_INT, auto_sync_write_ms),
+    ATTRIB("use_connected_msg", ATTRIB_BOOL, use_connected_msg),
+    ATTRIB("allow_packing", ATTRIB_BOOL, allow_packing),
+    ATTRIB("share_session", ATTRIB_BOOL, share_session),
+    ATTRIB("connection_group_id", ATTRIB_INT, connection_group_id),
+    ATTRIB("str_max_capacity", ATTRIB_INT, str_max_capacity),
+    ATTRIB_ANY("protocol"),
+    ATTRIB_ANY("gateway"),
+    ATTRIB_ANY("path"),
+    ATTRIB_ANY("cpu"),
+    ATTRIB_ANY("plc"),
+    ATTRIB_ANY("int16_byte_order"),
+    ATTRIB_ANY("int32_byte_order"),
+    ATTRIB_ANY("int64_byte_order"),
+    ATTRIB_ANY("float32_byte_order"),
+    ATTRIB_ANY("float64_byte_order"),
+    ATTRIB_ANY("str_is_counted"),
+    ATTRIB_ANY("str_count_word_bytes"),
+    ATTRIB_ANY("str_is_fixed_length"),
+    ATTRIB_ANY("str_is_zero_terminated"),
+    ATTRIB_ANY("str_is_byte_swapped"),
+    ATTRIB_ANY("str_pad_bytes"),
+    ATTRIB_ANY("str_total_length"),
+    ATTRIB_ANY("allow_field_resize"),
+    ATTRIB_ANY("max_requests_in_flight"),
+};
+
+struct attrib_cache_slot {
+    uint32_t hash;
+    size_t len;
+    char* str; /* NULL if the slot is empty */
+    struct tag_attribs attrs;
+};
+
+static struct attrib_cache_slot attrib_cache[ATTRIB_CACHE_SLOTS];
+static pthread_mutex_t attrib_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct attrib_def*
+attrib_find(const char* key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(attrib_defs) / sizeof(attrib_defs[0]); i++) {
+        if (attrib_defs[i].len == len && memcmp(attrib_defs[i].key, key, len) == 0) {
+            return &attrib_defs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Parses the decimal number in [p, end). */
+static int
+attrib_parse_int(const char* p, const char* end, long* out)
+{
+    long l = 0;
+
+    if (p == end) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9' || l > (INT32_MAX - (*p - '0')) / 10) {
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        l = l * 10 + (*p - '0');
+    }
+    *out = l;
+    return PLCTAG_STATUS_OK;
+}
+
+static int
+attrib_set(const struct attrib_def* def, const char* val, const char* end, struct tag_attribs* out)
+{
+    size_t len = end - val;
+    long l;
+
+    if (def->kind == ATTRIB_NAME) {
+        if (len == 0) {
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+        if (len >= ATTRIB_NAME_MAX) {
+            pdebug(PLCTAG_DEBUG_WARN, "Tag name of %zu characters is too long", len);
+            return PLCTAG_ERR_TOO_LARGE;
+        }
+        if (out->name[0] != '\0') {
+            pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", "name");
+        }
+        memcpy(out->name, val, len);
+        out->name[len] = '\0';
+        return PLCTAG_STATUS_OK;
+    }
+
+    if (def->kind == ATTRIB_IGNORED) {
+        return len ? PLCTAG_STATUS_OK : PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if (attrib_parse_int(val, end, &l) != PLCTAG_STATUS_OK
+        || (def->kind == ATTRIB_COUNT && l == 0)
+        || (def->kind == ATTRIB_BOOL && l > 1)) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    *(int*)((char*)(out) + def->offset) = (int)(l);
+    return PLCTAG_STATUS_OK;
+}
+
+int
+attrib_parse(const char* str, struct tag_attribs* out)
+{
+    const char *p = str, *key_end, *end;
+    const struct attrib_def* def;
+    int ret;
+
+    memset(out, 0, sizeof(*out));
+    out->debug = -1;
+
+    while (*p) {
+        end = p + strcspn(p, "&");
+        key_end = memchr(p, '=', end - p);
+
+        if (key_end == NULL) {
+            /* libplctag allows a bare "protocol", with no value. */
+            if (end - p == 8 && memcmp(p, "protocol", 8) == 0) {
+                p = *end ? end + 1 : end;
+                continue;
+            }
+            pdebug(PLCTAG_DEBUG_WARN, "Missing '=' in non-'protocol' attribute %.*s", (int)(end - p), p);
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+
+        def = attrib_find(p, key_end - p);
+        if (def == NULL) {
+            pdebug(PLCTAG_DEBUG_SPEW, "Ignoring unknown attribute %.*s", (int)(key_end - p), p);
+        } else if ((ret = attrib_set(def, key_end + 1, end, out)) != PLCTAG_STATUS_OK) {
+            pdebug(PLCTAG_DEBUG_WARN, "Invalid value \"%.*s\" for attribute %s",
+                (int)(end - key_end - 1), key_end + 1, def->key);
+            return ret;
+        }
+
+        p = *end ? end + 1 : end;
+    }
+
+    if (out->name[0] == '\0') {
+        pdebug(PLCTAG_DEBUG_WARN, "Missing attribute %s", "name");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return PLCTAG_STATUS_OK;
+}
+
+int
+attrib_parse_cached(const char* str, struct tag_attribs* out)
+{
+    struct attrib_cache_slot* slot;
+    uint32_t h = 2166136261u; /* FNV-1a */
+    const char* p;
+    char* copy;
+    size_t len;
+    int ret;
+
+    for (p = str; *p; p++) {
+        h = (h ^ (uint8_t)(*p)) * 16777619u;
+    }
+    len = p - str;
+    slot = &attrib_cache[h % ATTRIB_CACHE_SLOTS];
+
+    MTX_LOCK(&attrib_cache_mtx);
+    if (slot->str != NULL && slot->hash == h && slot->len == len && memcmp(slot->str, str, len) == 0) {
+        *out = slot->attrs;
+        MTX_UNLOCK(&attrib_cache_mtx);
+        stats_inc(STAT_ATTRIB_CACHE_HITS);
+        return PLCTAG_STATUS_OK;
+    }
+    MTX_UNLOCK(&attrib_cache_mtx);
+
+    stats_inc(STAT_ATTRIB_CACHE_MISSES);
+    ret = attrib_parse(str, out);
+    if (ret != PLCTAG_STATUS_OK) {
+        return ret;
+    }
+
+    /* Take over the slot from whatever string hashed there before, if there
+     * is the memory to. */
+    copy = malloc(len + 1);
+    if (copy == NULL) {
+        return PLCTAG_STATUS_OK;
+    }
+    memcpy(copy, str, len + 1);
+
+    MTX_LOCK(&attrib_cache_mtx);
+    free(slot->str);
+    slot->str = copy;
+    slot->hash = h;
+    slot->len = len;
+    slot->attrs = *out;
+    MTX_UNLOCK(&attrib_cache_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
@@ -0,0 +1,419 @@
+/* events.c
+ *
+ * Batched event delivery (see events.h).
+ *
+ * Each thread appends its events to a batch of its own, under a mutex that
+ * only the flusher thread otherwise takes.  A full batch is queued for the
+ * flusher straight away; partly filled ones are collected by the flusher
+ * every max_delay_ms, or when asked to flush.  Batches are queued while
+ * their thread's mutex is held, so a thread's events are delivered in the
+ * order it emitted them.  The callback is only ever called from the
+ * flusher, holding no locks.
+ *
+ * Lock order: sink_mtx -> bufs_mtx -> a thread's buf.mtx -> ready_mtx.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "debug.h"
+#include "events.h"
+#include "lock_utils.h"
+#include "mem.h"
+#include "stats.h"
+
+struct event_batch {
+    struct event_batch* next; /* in the ready queue */
+    int n, cap;
+    struct plc_tag_event events[];
+};
+
+struct event_buf {
+    pthread_mutex_t mtx;
+    struct event_batch* batch; /* being filled, if any */
+    bool dead; /* its thread has exited */
+    struct event_buf* next;
+};
+
+/* The registered callback.  Only changed under sink_mtx, with no flusher
+ * running. */
+static pthread_mutex_t sink_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static events_batch_func sink_cb;
+static void* sink_userdata;
+static int sink_max_events;
+static int sink_max_delay_ms;
+static pthread_t flusher;
+static __thread bool in_flusher = false;
+
+/* Every thread's buffer. */
+static pthread_mutex_t bufs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct event_buf* bufs = NULL;
+static pthread_once_t events_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buf_key;
+static __thread struct event_buf* my_buf = NULL;
+
+/* Batches waiting for the flusher, and its instructions. */
+static pthread_mutex_t ready_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond;
+static pthread_cond_t flushed_cond = PTHREAD_COND_INITIALIZER;
+static struct event_batch* ready_head = NULL;
+static struct event_batch** ready_tail = &ready_head;
+static bool stopping = false;
+static uint64_t flush_req = 0, flush_done = 0;
+
+static void
+events_buf_exit(void* p)
+{
+    struct event_buf* buf = p;
+
+    /* Its batch is still delivered; the flusher frees it afterwards. */
+    MTX_LOCK(&buf->mtx);
+    buf->dead = true;
+    MTX_UNLOCK(&buf->mtx);
+}
+
+static void
+events_init(void)
+{
+    pthread_condattr_t attr;
+
+    if (pthread_key_create(&buf_key, events_buf_exit)) {
+        err(1, "pthread_key_create");
+    }
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ready_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static size_t
+events_batch_size(int cap)
+{
+    return sizeof(struct event_batch) + cap * sizeof(struct plc_tag_event);
+}
+
+/* Returns NULL if the budget or the system is out of memory. */
+static struct event_batch*
+events_batch_new(int cap)
+{
+    struct event_batch* b = mem_alloc(MEM_EVENTS, events_batch_size(cap));
+
+    if (b == NULL) {
+        return NULL;
+    }
+    b->next = NULL;
+    b->n = 0;
+    b->cap = cap;
+    return b;
+}
+
+static void
+events_batch_free(struct event_batch* b)
+{
+    mem_free(MEM_EVENTS, b, events_batch_size(b->cap));
+}
+
+/* Returns NULL if the budget or the system is out of memory. */
+static struct event_buf*
+events_buf_new(void)
+{
+    struct event_buf* buf = mem_alloc(MEM_EVENTS, sizeof(*buf));
+
+    if (buf == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&buf->mtx, NULL);
+    buf->batch = NULL;
+    buf->dead = false;
+
+    pthread_once(&events_once, events_init);
+    pthread_setspecific(buf_key, buf);
+
+    MTX_LOCK(&bufs_mtx);
+    buf->next = bufs;
+    bufs = buf;
+    MTX_UNLOCK(&bufs_mtx);
+
+    return buf;
+}
+
+/* The caller holds the batch's thread's buf.mtx. */
+static void
+events_queue(struct event_batch* b)
+{
+    MTX_LOCK(&ready_mtx);
+    *ready_tail = b;
+    ready_tail = &b->next;
+    pthread_cond_signal(&ready_cond);
+    MTX_UNLOCK(&ready_mtx);
+}
+
+bool
+events_enabled(void)
+{
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void
+events_record(int32_t tag_id, int event, int status)
+{
+    struct event_buf* buf = my_buf;
+    struct event_batch* b;
+    struct plc_tag_event* e;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (buf == NULL) {
+        buf = my_buf = events_buf_new();
+    }
+    /* An event there's no memory for is dropped, and counted, rather than
+     * failing the access it reports on. */
+    if (buf == NULL) {
+        stats_inc(STAT_EVENTS_DROPPED);
+        return;
+    }
+
+    MTX_LOCK(&buf->mtx);
+    b = buf->batch;
+    if (b == NULL) {
+        b = buf->batch = events_batch_new(__atomic_load_n(&sink_max_events, __ATOMIC_RELAXED));
+    }
+    if (b == NULL) {
+        MTX_UNLOCK(&buf->mtx);
+        stats_inc(STAT_EVENTS_DROPPED);
+        return;
+    }
+    e = &b->events[b->n++];
+    e->timestamp_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e->tag_id = tag_id;
+    e->event = (int16_t)event;
+    e->status = (int16_t)status;
+    if (b->n == b->cap) {
+        buf->batch = NULL;
+        events_queue(b);
+    }
+    MTX_UNLOCK(&buf->mtx);
+}
+
+/* Queues every thread's partly filled batch, and frees the buffers of
+ * threads that have gone. */
+static void
+events_collect(void)
+{
+    struct event_buf **pp, *buf;
+    bool dead;
+
+    MTX_LOCK(&bufs_mtx);
+    pp = &bufs;
+    while ((buf = *pp) != NULL) {
+        MTX_LOCK(&buf->mtx);
+        if (buf->batch != NULL) {
+            events_queue(buf->batch);
+            buf->batch = NULL;
+        }
+        dead = buf->dead;
+        MTX_UNLOCK(&buf->mtx);
+
+        if (dead) {
+            *pp = buf->next;
+            pthread_mutex_destroy(&buf->mtx);
+            mem_free(MEM_EVENTS, buf, sizeof(*buf));
+        } else {
+            pp = &buf->next;
+        }
+    }
+    MTX_UNLOCK(&bufs_mtx);
+}
+
+/* Takes the ready queue.  The caller holds ready_mtx. */
+static struct event_batch*
+events_take(void)
+{
+    struct event_batch* b = ready_head;
+
+    ready_head = NULL;
+    ready_tail = &ready_head;
+    return b;
+}
+
+static void
+events_deliver(struct event_batch* b, bool discard)
+{
+    struct event_batch* next;
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        if (!discard && b->n > 0) {
+            stats_inc(STAT_EVENT_BATCHES);
+            sink_cb(b->events, b->n, sink_userdata);
+        }
+        events_batch_free(b);
+    }
+}
+
+static void
+events_deadline(struct timespec* deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += sink_max_delay_ms / 1000;
+    deadline->tv_nsec += (long)(sink_max_delay_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static void*
+events_flusher(void* arg)
+{
+    struct timespec deadline, now;
+    uint64_t req;
+    bool stop, timed_out = false;
+    struct event_batch* b;
+
+    (void)arg;
+    in_flusher = true;
+    events_deadline(&deadline);
+
+    MTX_LOCK(&ready_mtx);
+    for (;;) {
+        while (ready_head == NULL && !stopping && flush_req == flush_done && !timed_out) {
+            timed_out = pthread_cond_timedwait(&ready_cond, &ready_mtx, &deadline) == ETIMEDOUT;
+        }
+        req = flush_req;
+        stop = stopping;
+        if (!timed_out) {
+            /* Busy enough never to wait: partly filled batches are due too. */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timed_out = now.tv_sec > deadline.tv_sec
+                || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+        }
+
+        if (timed_out || stop || req != flush_done) {
+            MTX_UNLOCK(&ready_mtx);
+            events_collect();
+            events_deadline(&deadline);
+            timed_out = false;
+            MTX_LOCK(&ready_mtx);
+        }
+
+        b = events_take();
+        MTX_UNLOCK(&ready_mtx);
+        events_deliver(b, false);
+        MTX_LOCK(&ready_mtx);
+
+        if (req != flush_done) {
+            flush_done = req;
+            pthread_cond_broadcast(&flushed_cond);
+        }
+        if (stop) {
+            break;
+        }
+    }
+    MTX_UNLOCK(&ready_mtx);
+
+    return NULL;
+}
+
+int
+events_register(events_batch_func cb, void* userdata, int max_events, int max_delay_ms)
+{
+    struct event_batch* stale;
+    int ret;
+
+    pthread_once(&events_once, events_init);
+
+    if (in_flusher) {
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+    MTX_LOCK(&sink_mtx);
+    if (enabled) {
+        MTX_UNLOCK(&sink_mtx);
+        return PLCTAG_ERR_DUPLICATE;
+    }
+
+    /* Drop whatever was recorded after the last callback's final flush. */
+    events_collect();
+    MTX_LOCK(&ready_mtx);
+    stale = events_take();
+    stopping = false;
+    MTX_UNLOCK(&ready_mtx);
+    events_deliver(stale, true);
+
+    sink_cb = cb;
+    sink_userdata = userdata;
+    __atomic_store_n(&sink_max_events, max_events, __ATOMIC_RELAXED);
+    sink_max_delay_ms = max_delay_ms;
+
+    ret = pthread_create(&flusher, NULL, events_flusher, NULL);
+    if (ret) {
+        pdebug(PLCTAG_DEBUG_WARN, "pthread_create: %d", ret);
+        MTX_UNLOCK(&sink_mtx);
+        return PLCTAG_ERR_CREATE;
+    }
+    __atomic_store_n(&enabled, true, __ATOMIC_RELAXED);
+    MTX_UNLOCK(&sink_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+int
+events_unregister(void)
+{
+    /* The callback can't wait for itself. */
+    if (in_flusher) {
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+    MTX_LOCK(&sink_mtx);
+    if (!enabled) {
+        MTX_UNLOCK(&sink_mtx);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+    __atomic_store_n(&enabled, false, __ATOMIC_RELAXED);
+
+    /* The flusher delivers everything recorded so far before it exits. */
+    MTX_LOCK(&ready_mtx);
+    stopping = true;
+    pthread_cond_signal(&ready_cond);
+    MTX_UNLOCK(&ready_mtx);
+    pthread_join(flusher, NULL);
+
+    sink_cb = NULL;
+    sink_userdata = NULL;
+    MTX_UNLOCK(&sink_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
+
+int
+events_flush(void)
+{
+    uint64_t req;
+
+    /* The callback can't wait for itself. */
+    if (in_flusher) {
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+    MTX_LOCK(&sink_mtx);
+    if (!enabled) {
+        MTX_UNLOCK(&sink_mtx);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    MTX_LOCK(&ready_mtx);
+    req = ++flush_req;
+    pthread_cond_signal(&ready_cond);
+    while (flush_done < req) {
+        pthread_cond_wait(&flushed_cond, &ready_mtx);
+    }
+    MTX_UNLOCK(&ready_mtx);
+    MTX_UNLOCK(&sink_mtx);
+
+    return PLCTAG_STATUS_OK;
+}
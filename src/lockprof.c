@@ -0,0 +1,216 @@
+/* lockprof.c
+ *
+ * Wait- and hold-time histograms for the locks taken through lock_utils.h.
+ *
+ * Each thread keeps a small stack of the locks it currently holds, along with
+ * when it took them, so that the release side can attribute the hold time to
+ * the site (and object) that took the lock.  Histogram updates are relaxed
+ * atomic adds: cheap, and precise enough for profiling.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lockprof.h"
+
+#define LOCKPROF_MAX_HELD 32
+
+struct lockprof_held {
+    const void* lock;
+    struct lockprof_site* site;
+    struct lockprof_obj* obj;
+    uint64_t acquired_ns;
+};
+
+static __thread struct lockprof_held held[LOCKPROF_MAX_HELD];
+static __thread int held_cnt = 0;
+
+/* Every site that has ever taken a lock, for reporting. */
+static pthread_mutex_t sites_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct lockprof_site* sites = NULL;
+
+static uint64_t hold_warn_ns = 0;
+
+uint64_t
+lockprof_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+lockprof_hist_record(struct lockprof_hist* h, uint64_t ns)
+{
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    uint64_t max;
+
+    if (b >= LOCKPROF_BUCKETS) {
+        b = LOCKPROF_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total_ns, ns, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max
+        && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void
+lockprof_register(struct lockprof_site* site)
+{
+    pthread_mutex_lock(&sites_mtx);
+    if (!site->registered) {
+        site->next = sites;
+        sites = site;
+        __atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sites_mtx);
+}
+
+void
+lockprof_acquired(const void* lock, struct lockprof_site* site, struct lockprof_obj* obj, uint64_t wait_ns)
+{
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) {
+        lockprof_register(site);
+    }
+
+    lockprof_hist_record(&site->prof.wait, wait_ns);
+    if (wait_ns >= LOCKPROF_CONTENDED_NS) {
+        __atomic_add_fetch(&site->prof.contended, 1, __ATOMIC_RELAXED);
+    }
+    if (obj) {
+        lockprof_hist_record(&obj->wait, wait_ns);
+        if (wait_ns >= LOCKPROF_CONTENDED_NS) {
+            __atomic_add_fetch(&obj->contended, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* If we're holding an unreasonable number of locks, just stop tracking
+     * hold times for the extras rather than fail. */
+    if (held_cnt < LOCKPROF_MAX_HELD) {
+        held[held_cnt].lock = lock;
+        held[held_cnt].site = site;
+        held[held_cnt].obj = obj;
+        held[held_cnt].acquired_ns = lockprof_now();
+        held_cnt++;
+    }
+}
+
+static int
+lockprof_find_held(const void* lock)
+{
+    int i;
+
+    for (i = held_cnt - 1; i >= 0; i--) {
+        if (held[i].lock == lock) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void
+lockprof_releasing(const void* lock)
+{
+    uint64_t hold_ns;
+    int i = lockprof_find_held(lock);
+
+    if (i < 0) {
+        return;
+    }
+
+    hold_ns = lockprof_now() - held[i].acquired_ns;
+    lockprof_hist_record(&held[i].site->prof.hold, hold_ns);
+    if (held[i].obj) {
+        lockprof_hist_record(&held[i].obj->hold, hold_ns);
+    }
+
+    /* Locks aren't necessarily released in LIFO order. */
+    memmove(&held[i], &held[i + 1], (held_cnt - i - 1) * sizeof(held[0]));
+    held_cnt--;
+}
+
+uint64_t
+lockprof_held_ns(const void* lock)
+{
+    int i = lockprof_find_held(lock);
+
+    if (i < 0) {
+        return 0;
+    }
+    return lockprof_now() - held[i].acquired_ns;
+}
+
+uint64_t
+lockprof_get_hold_warn_ns(void)
+{
+    return __atomic_load_n(&hold_warn_ns, __ATOMIC_RELAXED);
+}
+
+void
+lockprof_set_hold_warn_ns(uint64_t ns)
+{
+    __atomic_store_n(&hold_warn_ns, ns, __ATOMIC_RELAXED);
+}
+
+/* Approximates a percentile by the upper bound of the bucket it falls in
+ * (or the largest sample, if that's smaller). */
+static uint64_t
+lockprof_hist_percentile(const struct lockprof_hist* h, int pct)
+{
+    int b;
+    uint64_t seen = 0, want;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    want = (h->count * pct + 99) / 100;
+    for (b = 0; b < LOCKPROF_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            uint64_t bound = b ? (1ull << b) - 1 : 0;
+            return bound < h->max_ns ? bound : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+void
+lockprof_obj_print(FILE* f, const struct lockprof_obj* prof)
+{
+    fprintf(f, "%10lu acq %8lu contended | wait total %12lu ns p50 %9lu p99 %9lu max %9lu | hold p50 %9lu p99 %9lu max %9lu",
+        (unsigned long)prof->wait.count,
+        (unsigned long)prof->contended,
+        (unsigned long)prof->wait.total_ns,
+        (unsigned long)lockprof_hist_percentile(&prof->wait, 50),
+        (unsigned long)lockprof_hist_percentile(&prof->wait, 99),
+        (unsigned long)prof->wait.max_ns,
+        (unsigned long)lockprof_hist_percentile(&prof->hold, 50),
+        (unsigned long)lockprof_hist_percentile(&prof->hold, 99),
+        (unsigned long)prof->hold.max_ns);
+}
+
+void
+lockprof_report_sites(FILE* f)
+{
+    struct lockprof_site* site;
+
+    fprintf(f, "lock sites:\n");
+
+    pthread_mutex_lock(&sites_mtx);
+    for (site = sites; site != NULL; site = site->next) {
+        fprintf(f, "  %s:%d %s\n    ", site->file, site->line, site->what);
+        lockprof_obj_print(f, &site->prof);
+        fprintf(f, "\n");
+    }
+    pthread_mutex_unlock(&sites_mtx);
+}
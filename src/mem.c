@@ -0,0 +1,144 @@
+/* mem.c
+ *
+ * Memory accounting, and the optional budget (see mem.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+static uint64_t counters[MEM_COUNT];
+static uint64_t total = 0;
+static uint64_t budget = 0;
+
+static const char* mem_names[MEM_COUNT] = {
+    [MEM_TAGS] = "mem_tags",
+    [MEM_NAMES] = "mem_names",
+    [MEM_TYPES] = "mem_types",
+    [MEM_METATAG] = "mem_metatag",
+    [MEM_CATALOG] = "mem_catalog",
+    [MEM_EVENTS] = "mem_events",
+};
+
+void
+mem_init(void)
+{
+    const char* s = getenv("PLCSTUB_MEM_BUDGET");
+
+    if (s != NULL) {
+        mem_budget_set(strtoull(s, NULL, 0));
+    }
+}
+
+bool
+mem_charge(enum mem_e m, size_t n)
+{
+    uint64_t limit = __atomic_load_n(&budget, __ATOMIC_RELAXED);
+    uint64_t t = __atomic_load_n(&total, __ATOMIC_RELAXED);
+
+    do {
+        if (limit != 0 && t + n > limit) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&total, &t, t + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&counters[m], n, __ATOMIC_RELAXED);
+    return true;
+}
+
+void
+mem_account(enum mem_e m, int64_t n)
+{
+    __atomic_add_fetch(&total, (uint64_t)n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters[m], (uint64_t)n, __ATOMIC_RELAXED);
+}
+
+void*
+mem_alloc(enum mem_e m, size_t n)
+{
+    void* p;
+
+    if (!mem_charge(m, n)) {
+        return NULL;
+    }
+    p = malloc(n);
+    if (p == NULL) {
+        mem_account(m, -(int64_t)n);
+    }
+    return p;
+}
+
+void*
+mem_alloc_aligned(enum mem_e m, size_t n)
+{
+    void* p;
+
+    if (!mem_charge(m, n)) {
+        return NULL;
+    }
+    if (posix_memalign(&p, CACHE_LINE, (n + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)) {
+        mem_account(m, -(int64_t)n);
+        return NULL;
+    }
+    return p;
+}
+
+char*
+mem_strdup(enum mem_e m, const char* s)
+{
+    size_t n = strlen(s) + 1;
+    char* p = mem_alloc(m, n);
+
+    if (p != NULL) {
+        memcpy(p, s, n);
+    }
+    return p;
+}
+
+void
+mem_free(enum mem_e m, void* p, size_t n)
+{
+    if (p == NULL) {
+        return;
+    }
+    free(p);
+    mem_account(m, -(int64_t)n);
+}
+
+uint64_t
+mem_get(enum mem_e m)
+{
+    return __atomic_load_n(&counters[m], __ATOMIC_RELAXED);
+}
+
+uint64_t
+mem_total(void)
+{
+    return __atomic_load_n(&total, __ATOMIC_RELAXED);
+}
+
+uint64_t
+mem_budget_get(void)
+{
+    return __atomic_load_n(&budget, __ATOMIC_RELAXED);
+}
+
+void
+mem_budget_set(uint64_t b)
+{
+    __atomic_store_n(&budget, b, __ATOMIC_RELAXED);
+}
+
+int
+mem_lookup(const char* name)
+{
+    int i;
+
+    for (i = 0; i < MEM_COUNT; i++) {
+        if (strcmp(name, mem_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,206 @@
+/* nameindex.c
+ *
+ * The ordered name index (see nameindex.h).
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "nameindex.h"
+
+/* Orders names, then nodes with equal names by address.  A NULL node comes
+ * before every node with the name, and UINTPTR_MAX after them all. */
+static int
+name_index_cmp(const char* name, uintptr_t node, const struct name_index_node* n)
+{
+    int c = strcasecmp(name, n->name);
+
+    if (c != 0) {
+        return c;
+    }
+    return node < (uintptr_t)(n) ? -1 : node > (uintptr_t)(n);
+}
+
+static int
+name_index_height(const struct name_index_node* n)
+{
+    return n != NULL ? n->height : 0;
+}
+
+static void
+name_index_fix_height(struct name_index_node* n)
+{
+    int l = name_index_height(n->child[0]), r = name_index_height(n->child[1]);
+
+    n->height = 1 + (l > r ? l : r);
+}
+
+/* Rotates n's child on the side opposite `dir` up into its place, and returns
+ * it: dir 1 rotates right, 0 left. */
+static struct name_index_node*
+name_index_rotate(struct name_index_node* n, int dir)
+{
+    struct name_index_node* c = n->child[!dir];
+
+    n->child[!dir] = c->child[dir];
+    c->child[dir] = n;
+    name_index_fix_height(n);
+    name_index_fix_height(c);
+    return c;
+}
+
+/* Restores the AVL invariant at n, whose subtrees' heights differ by at most
+ * two, returning the subtree's new root. */
+static struct name_index_node*
+name_index_balance(struct name_index_node* n)
+{
+    int b;
+
+    name_index_fix_height(n);
+    b = name_index_height(n->child[0]) - name_index_height(n->child[1]);
+    if (b > 1) {
+        if (name_index_height(n->child[0]->child[0]) < name_index_height(n->child[0]->child[1])) {
+            n->child[0] = name_index_rotate(n->child[0], 0);
+        }
+        n = name_index_rotate(n, 1);
+    } else if (b < -1) {
+        if (name_index_height(n->child[1]->child[1]) < name_index_height(n->child[1]->child[0])) {
+            n->child[1] = name_index_rotate(n->child[1], 1);
+        }
+        n = name_index_rotate(n, 0);
+    }
+    return n;
+}
+
+static struct name_index_node*
+name_index_insert_at(struct name_index_node* t, struct name_index_node* n)
+{
+    int dir;
+
+    if (t == NULL) {
+        n->child[0] = n->child[1] = NULL;
+        n->height = 1;
+        return n;
+    }
+    dir = name_index_cmp(n->name, (uintptr_t)(n), t) > 0;
+    t->child[dir] = name_index_insert_at(t->child[dir], n);
+    return name_index_balance(t);
+}
+
+void
+name_index_insert(struct name_index* idx, struct name_index_node* n)
+{
+    idx->root = name_index_insert_at(idx->root, n);
+    idx->count++;
+}
+
+/* Unlinks the leftmost node of the subtree t, storing it in *min. */
+static struct name_index_node*
+name_index_remove_min(struct name_index_node* t, struct name_index_node** min)
+{
+    if (t->child[0] == NULL) {
+        *min = t;
+        return t->child[1];
+    }
+    t->child[0] = name_index_remove_min(t->child[0], min);
+    return name_index_balance(t);
+}
+
+static struct name_index_node*
+name_index_remove_at(struct name_index_node* t, struct name_index_node* n)
+{
+    struct name_index_node* m;
+    int dir;
+
+    if (t != n) {
+        dir = name_index_cmp(n->name, (uintptr_t)(n), t) > 0;
+        t->child[dir] = name_index_remove_at(t->child[dir], n);
+        return name_index_balance(t);
+    }
+
+    if (t->child[0] == NULL || t->child[1] == NULL) {
+        return t->child[t->child[0] == NULL];
+    }
+    /* Put n's successor in its place. */
+    t->child[1] = name_index_remove_min(t->child[1], &m);
+    m->child[0] = t->child[0];
+    m->child[1] = t->child[1];
+    return name_index_balance(m);
+}
+
+void
+name_index_remove(struct name_index* idx, struct name_index_node* n)
+{
+    idx->root = name_index_remove_at(idx->root, n);
+    idx->count--;
+}
+
+/* The first node after (name, node) in the index's order. */
+static struct name_index_node*
+name_index_upper(const struct name_index* idx, const char* name, uintptr_t node)
+{
+    struct name_index_node *t = idx->root, *ret = NULL;
+
+    while (t != NULL) {
+        if (name_index_cmp(name, node, t) < 0) {
+            ret = t;
+            t = t->child[0];
+        } else {
+            t = t->child[1];
+        }
+    }
+    return ret;
+}
+
+struct name_index_node*
+name_index_first(const struct name_index* idx, const char* name)
+{
+    return name_index_upper(idx, name, 0);
+}
+
+struct name_index_node*
+name_index_after(const struct name_index* idx, const char* name)
+{
+    return name_index_upper(idx, name, UINTPTR_MAX);
+}
+
+struct name_index_node*
+name_index_next(const struct name_index* idx, const struct name_index_node* n)
+{
+    return name_index_upper(idx, n->name, (uintptr_t)(n));
+}
+
+bool
+name_glob_match(const char* pattern, const char* name)
+{
+    const char *star = NULL, *retry = NULL;
+
+    /* On a mismatch, let the last '*' swallow one more character. */
+    while (*name != '\0') {
+        if (*pattern == '*') {
+            star = ++pattern;
+            retry = name;
+        } else if (*pattern == '?'
+            || (*pattern != '\0' && tolower((unsigned char)(*pattern)) == tolower((unsigned char)(*name)))) {
+            pattern++;
+            name++;
+        } else if (star != NULL) {
+            pattern = star;
+            name = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+size_t
+name_glob_prefix(const char* pattern)
+{
+    return strcspn(pattern, "*?");
+}
@@ -0,0 +1,316 @@
+/* path.c
+ *
+ * Compiles member paths such as "Motor.Status.Speed[3]" or "[2,1].Value"
+ * into an offset and type within a complex tag.
+ *
+ * Compiled paths live in a table of fixed-size chunks, which is never shrunk,
+ * so a handle is turned back into a path with two array indexes and no
+ * locking.  The slots of paths whose type has been freed are reused.
+ * Each complex type also caches the paths compiled against it, keyed by the
+ * path string, so clients that re-resolve the same member don't re-parse it.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "lock_utils.h"
+#include "path.h"
+
+#define PATH_CHUNK_SIZE 1024
+#define PATH_CHUNKS 1024
+#define PATH_CACHE_BUCKETS 64
+
+/* Characters that may appear in a Logix member name. */
+#define PATH_NAME_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_:"
+
+/* The members common to every complex type. */
+struct tag_base {
+    BASE_TAG_MEMBERS
+};
+
+struct path_cache_entry {
+    char* path;
+    int32_t handle;
+    struct path_cache_entry* next;
+};
+
+struct path_cache {
+    struct path_cache_entry* buckets[PATH_CACHE_BUCKETS];
+};
+
+/* Serialises compilation and cache maintenance; lookups by handle don't
+ * need it. */
+static pthread_mutex_t path_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static struct tag_path* path_chunks[PATH_CHUNKS];
+static int32_t path_cnt = 1; /* handle 0 is never handed out */
+static int32_t path_free_slot = 0; /* chained through next_free; 0 ends it */
+
+/* FNV-1a */
+static uint32_t
+path_hash(const char* s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s) {
+        h = (h ^ (uint8_t)(*s++)) * 16777619u;
+    }
+    return h;
+}
+
+static int
+path_compile(type_t root, const char* str, struct tag_path* out)
+{
+    type_t cur = root;
+    uint32_t off = 0;
+    uint8_t bit = 0;
+    const char* p = str;
+    int first = 1;
+
+    if (*p == '\0') {
+        pdebug(PLCTAG_DEBUG_WARN, "Empty member path");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    while (*p) {
+        if (*p == '[') {
+            /* One or more comma-separated subscripts, each descending into
+             * a (nested) array. */
+            p++;
+            for (;;) {
+                struct tag_array* a;
+                unsigned long idx;
+                char* end;
+
+                if (type_to_enum(cur) != TAG_ARRAY) {
+                    pdebug(PLCTAG_DEBUG_WARN, "%s: subscript of non-array type %s", str, type_str(cur));
+                    return PLCTAG_ERR_BAD_PARAM;
+                }
+                a = (struct tag_array*)(cur);
+
+                if (!isdigit((unsigned char)*p)) {
+                    pdebug(PLCTAG_DEBUG_WARN, "%s: malformed subscript", str);
+                    return PLCTAG_ERR_BAD_PARAM;
+                }
+                idx = strtoul(p, &end, 10);
+                if (idx >= a->len) {
+                    pdebug(PLCTAG_DEBUG_WARN, "%s: subscript %lu not in [0, %u)", str, idx, a->len);
+                    return PLCTAG_ERR_OUT_OF_BOUNDS;
+                }
+                if (type_to_enum(a->member_type) == TAG_BOOL) {
+                    off += idx / 8;
+                    bit = idx % 8;
+                } else {
+                    off += idx * a->stride;
+                    bit = 0;
+                }
+                cur = a->member_type;
+                p = end;
+
+                if (*p == ',') {
+                    p++;
+                    continue;
+                }
+                if (*p == ']') {
+                    p++;
+                    break;
+                }
+                pdebug(PLCTAG_DEBUG_WARN, "%s: malformed subscript", str);
+                return PLCTAG_ERR_BAD_PARAM;
+            }
+        } else {
+            struct tag_struct* s;
+            size_t len;
+            int i;
+
+            if (!first) {
+                if (*p != '.') {
+                    pdebug(PLCTAG_DEBUG_WARN, "%s: expected '.' at \"%s\"", str, p);
+                    return PLCTAG_ERR_BAD_PARAM;
+                }
+                p++;
+            }
+
+            len = strspn(p, PATH_NAME_CHARS);
+            if (len == 0) {
+                pdebug(PLCTAG_DEBUG_WARN, "%s: expected a member name at \"%s\"", str, p);
+                return PLCTAG_ERR_BAD_PARAM;
+            }
+            if (type_to_enum(cur) != TAG_STRUCT) {
+                pdebug(PLCTAG_DEBUG_WARN, "%s: member of non-struct type %s", str, type_str(cur));
+                return PLCTAG_ERR_BAD_PARAM;
+            }
+            s = (struct tag_struct*)(cur);
+
+            /* Logix names are case-insensitive. */
+            for (i = 0; i < s->field_cnt; i++) {
+                if (strncasecmp(s->fields[i].name, p, len) == 0 && s->fields[i].name[len] == '\0') {
+                    break;
+                }
+            }
+            if (i == s->field_cnt) {
+                pdebug(PLCTAG_DEBUG_WARN, "%s: no member \"%.*s\"", str, (int)len, p);
+                return PLCTAG_ERR_NOT_FOUND;
+            }
+
+            off += s->fields[i].offset;
+            bit = s->fields[i].bit;
+            cur = s->fields[i].type;
+            p += len;
+        }
+        first = 0;
+    }
+
+    out->root = root;
+    out->type = cur;
+    out->offset = off;
+    out->bit = bit;
+    return PLCTAG_STATUS_OK;
+}
+
+static struct tag_path*
+path_slot(int32_t handle)
+{
+    return &path_chunks[handle / PATH_CHUNK_SIZE][handle % PATH_CHUNK_SIZE];
+}
+
+int32_t
+path_resolve(type_t root, const char* str)
+{
+    enum tag_type_e e = type_to_enum(root);
+    struct tag_base* base = (struct tag_base*)(root);
+    struct path_cache_entry* entry;
+    struct tag_path compiled;
+    uint32_t bucket;
+    int32_t handle;
+    int ret;
+
+    if (e != TAG_ARRAY && e != TAG_STRUCT) {
+        pdebug(PLCTAG_DEBUG_WARN, "%s has no members", type_str(root));
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    bucket = path_hash(str) % PATH_CACHE_BUCKETS;
+
+    MTX_LOCK(&path_mtx);
+
+    if (base->paths == NULL) {
+        base->paths = calloc(1, sizeof(struct path_cache));
+        if (base->paths == NULL) {
+            MTX_UNLOCK(&path_mtx);
+            return PLCTAG_ERR_NO_MEM;
+        }
+    }
+
+    for (entry = base->paths->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, str) == 0) {
+            handle = entry->handle;
+            MTX_UNLOCK(&path_mtx);
+            return handle;
+        }
+    }
+
+    ret = path_compile(root, str, &compiled);
+    if (ret != PLCTAG_STATUS_OK) {
+        MTX_UNLOCK(&path_mtx);
+        return ret;
+    }
+
+    entry = malloc(sizeof(struct path_cache_entry));
+    if (entry == NULL || (entry->path = strdup(str)) == NULL) {
+        free(entry);
+        MTX_UNLOCK(&path_mtx);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    handle = path_free_slot ? path_free_slot : path_cnt;
+    if (handle >= PATH_CHUNKS * PATH_CHUNK_SIZE) {
+        pdebug(PLCTAG_DEBUG_WARN, "Out of member path handles");
+        free(entry->path);
+        free(entry);
+        MTX_UNLOCK(&path_mtx);
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
+    if (path_chunks[handle / PATH_CHUNK_SIZE] == NULL) {
+        path_chunks[handle / PATH_CHUNK_SIZE] = calloc(PATH_CHUNK_SIZE, sizeof(struct tag_path));
+        if (path_chunks[handle / PATH_CHUNK_SIZE] == NULL) {
+            free(entry->path);
+            free(entry);
+            MTX_UNLOCK(&path_mtx);
+            return PLCTAG_ERR_NO_MEM;
+        }
+    }
+    /* Publish the slot to lock-free readers in path_get(), root last. */
+    if (handle == path_free_slot) {
+        path_free_slot = path_slot(handle)->next_free;
+    }
+    path_slot(handle)->type = compiled.type;
+    path_slot(handle)->offset = compiled.offset;
+    path_slot(handle)->bit = compiled.bit;
+    __atomic_store_n(&path_slot(handle)->root, compiled.root, __ATOMIC_RELEASE);
+    if (handle == path_cnt) {
+        __atomic_store_n(&path_cnt, handle + 1, __ATOMIC_RELEASE);
+    }
+
+    entry->handle = handle;
+    entry->next = base->paths->buckets[bucket];
+    base->paths->buckets[bucket] = entry;
+
+    MTX_UNLOCK(&path_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Compiled member path %s to handle %d (offset %u, %s)",
+        str, handle, compiled.offset, type_str(compiled.type));
+
+    return handle;
+}
+
+const struct tag_path*
+path_get(int32_t handle)
+{
+    struct tag_path* p;
+
+    if (handle <= 0 || handle >= __atomic_load_n(&path_cnt, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    p = path_slot(handle);
+    if (__atomic_load_n(&p->root, __ATOMIC_ACQUIRE) == NULL) {
+        return NULL;
+    }
+    return p;
+}
+
+void
+path_cache_free(type_t root)
+{
+    struct tag_base* base = (struct tag_base*)(root);
+    struct path_cache_entry *entry, *next;
+    int i;
+
+    MTX_LOCK(&path_mtx);
+
+    if (base->paths == NULL) {
+        MTX_UNLOCK(&path_mtx);
+        return;
+    }
+
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (entry = base->paths->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            __atomic_store_n(&path_slot(entry->handle)->root, NULL, __ATOMIC_RELEASE);
+            path_slot(entry->handle)->next_free = path_free_slot;
+            path_free_slot = entry->handle;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    free(base->paths);
+    base->paths = NULL;
+
+    MTX_UNLOCK(&path_mtx);
+}
@@ -11,10 +11,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef DEBUG
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
+#include "attrib.h"
 #include "debug.h"
+#include "events.h"
 #include "libplctag.h"
 #include "lock_utils.h"
+#include "lockprof.h"
+#include "mem.h"
+#include "path.h"
 #include "plcstub.h"
 #include "tagtree.h"
 #include "types.h"
@@ -45,7 +55,8 @@ typedef void(setter_fn)(char* buf, int offset, void* val);
     {                                                                               \
         int impl_ret;                                                               \
         type val;                                                                   \
-        impl_ret = plcstub_get_impl(tag, offset, &val, plcstub_##name##_getter_cb); \
+        impl_ret = plcstub_get_impl(tag, offset, &val, sizeof(type),                \
+            plcstub_##name##_getter_cb);                                            \
         if (impl_ret != PLCTAG_STATUS_OK) {                                         \
             return (type)(impl_ret);                                                \
         }                                                                           \
@@ -64,12 +75,39 @@ typedef void(setter_fn)(char* buf, int offset, void* val);
     int                                                                         \
         plc_tag_set_##name(int32_t tag, int offset, type val)                   \
     {                                                                           \
-        return plcstub_set_impl(tag, offset, &val, plcstub_##name##_setter_cb); \
+        return plcstub_set_impl(tag, offset, &val, sizeof(type),                \
+            plcstub_##name##_setter_cb);                                        \
     }
 
-#define TYPEMAP                       \
+/* Accessors for a member reached through a compiled path handle (see
+ * plc_tag_resolve_path()).  The getter/setter callbacks are shared with the
+ * offset-based accessors above. */
+#define PATH_GETTER(name, type, fprintf_type)                                  \
+    type                                                                       \
+        plc_tag_get_##name##_path(int32_t tag, int32_t path)                   \
+    {                                                                          \
+        int impl_ret;                                                          \
+        type val;                                                              \
+        impl_ret = plcstub_path_impl(tag, path, &val, sizeof(type), false,     \
+            plcstub_##name##_getter_cb);                                       \
+        if (impl_ret != PLCTAG_STATUS_OK) {                                    \
+            return (type)(impl_ret);                                           \
+        }                                                                      \
+        return val;                                                            \
+    }
+
+#define PATH_SETTER(name, type, fprintf_type)                                  \
+    int                                                                        \
+        plc_tag_set_##name##_path(int32_t tag, int32_t path, type val)         \
+    {                                                                          \
+        return plcstub_path_impl(tag, path, &val, sizeof(type), true,          \
+            plcstub_##name##_setter_cb);                                       \
+    }
+
+/* Everything but bits, which need addressing below the byte and are
+ * handled separately. */
+#define SCALAR_TYPEMAP                \
     /* X(name, type, fprintf_type) */ \
-    X(bit, int, PRId32)               \
     X(uint64, uint64_t, PRIu64)       \
     X(int64, int64_t, PRId64)         \
     X(uint32, uint32_t, PRIu32)       \
@@ -81,72 +119,227 @@ typedef void(setter_fn)(char* buf, int offset, void* val);
     X(float64, double, "%f")          \
     X(float32, float, "%f")
 
-static int
-plcstub_get_impl(int32_t tag, int offset, void* buf, getter_fn fn)
+static const char*
+plcstub_event_str(int event)
 {
-    struct tag_tree_node* t;
-    size_t sz;
+    switch (event) {
+    case PLCTAG_EVENT_READ_STARTED:
+        return "PLCTAG_EVENT_READ_STARTED";
+    case PLCTAG_EVENT_READ_COMPLETED:
+        return "PLCTAG_EVENT_READ_COMPLETED";
+    case PLCTAG_EVENT_WRITE_STARTED:
+        return "PLCTAG_EVENT_WRITE_STARTED";
+    case PLCTAG_EVENT_WRITE_COMPLETED:
+        return "PLCTAG_EVENT_WRITE_COMPLETED";
+    case PLCTAG_EVENT_ABORTED:
+        return "PLCTAG_EVENT_ABORTED";
+    case PLCTAG_EVENT_DESTROYED:
+        return "PLCTAG_EVENT_DESTROYED";
+    }
+    return "???";
+}
 
-    t = tag_tree_lookup(tag);
-    if (!t) {
-        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
-        return PLCTAG_ERR_NOT_FOUND;
+/* Serialises changes to handles' subscriber lists, though not their use. */
+static pthread_mutex_t subscribe_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* How deep in callbacks the thread is.  A callback may, holding the tag with
+ * plc_tag_lock(), unregister itself and then use the tag, so lists retired
+ * meanwhile may still be walked further up the stack. */
+static __thread int emit_depth = 0;
+
+/* Records the outcome of an operation through a handle, as its status and
+ * for any batch callback.  This much needs no lock. */
+static void
+plcstub_note(struct tag_handle* h, int event, int status)
+{
+    /* Only stored if it changes, so that lock-free readers of a handle don't
+     * all write its line. */
+    if ((event == PLCTAG_EVENT_ABORTED || event == PLCTAG_EVENT_READ_COMPLETED
+            || event == PLCTAG_EVENT_WRITE_COMPLETED)
+        && __atomic_load_n(&h->status, __ATOMIC_RELAXED) != status) {
+        __atomic_store_n(&h->status, status, __ATOMIC_RELAXED);
+    }
+    if (events_enabled()) {
+        events_record(h->id, event, status);
+    }
+}
+
+/* Records the outcome of an operation through a handle, and invokes the
+ * handle's callbacks, in the order they were registered.  The tag's lock is
+ * assumed to be held by the caller, which is all that makes it safe to free
+ * retired subscriber lists and to walk the current one (see tagtree.h). */
+static void
+plcstub_emit(struct tag_handle* h, struct tag_tree_node* t, int event, int status)
+{
+    struct tag_subscribers* subs;
+    int i;
+
+    plcstub_note(h, event, status);
+
+    /* Free retired lists before picking up the current one, which is only
+     * retired, and so freed, by somebody else after this. */
+    if (emit_depth == 0 && __atomic_load_n(&h->retired, __ATOMIC_RELAXED) != NULL) {
+        tag_subscribers_free(__atomic_exchange_n(&h->retired, NULL, __ATOMIC_ACQUIRE));
     }
 
-    /* TODO: I'm not thrilled about holding the lock through the course of all
-     * these callbacks, especially until we know the overhead of doing golang<->native
-     * interop.  Maybe it's better to make a defensive copy where possible? */
-    MTX_LOCK(&t->mtx);
+    subs = __atomic_load_n(&h->subs, __ATOMIC_ACQUIRE);
+    if (subs == NULL) {
+        return;
+    }
+
+    pdebug(PLCTAG_DEBUG_SPEW,
+        "Calling %d callbacks for %d with %s", subs->n, h->id, plcstub_event_str(event));
+    emit_depth++;
+    for (i = 0; i < subs->n; i++) {
+        tag_stats_inc(t, STAT_CALLBACKS);
+        if (subs->subs[i].cb_ex != NULL) {
+            subs->subs[i].cb_ex(h->id, event, status, subs->subs[i].userdata);
+        } else {
+            subs->subs[i].cb(h->id, event, status);
+        }
+    }
+    emit_depth--;
+}
+
+/* Whether reads through the handle may peek at the tag's data without its
+ * lock (see plcstub_peek()).  Not for tags whose data is rebuilt, nor shared
+ * with other processes, whose writers don't keep our seq, nor while the
+ * handle has callbacks, which are only walked under the lock.  Debug builds
+ * never peek: their guarded copies of data are unmapped at unlock. */
+static bool
+plcstub_peekable(struct tag_handle* h, struct tag_tree_node* t)
+{
+#ifdef DEBUG
+    (void)(h);
+    (void)(t);
+    return false;
+#else
+    return t->refresh == NULL && t->shm == NULL && __atomic_load_n(&h->subs, __ATOMIC_RELAXED) == NULL;
+#endif
+}
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_STARTED", tag);
-        t->cb(tag, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+/* Reads a value out of the tag's data with fn, as the locked accessors do,
+ * but without the tag's lock, so that readers don't exclude each other: the
+ * value is good if the tag's seq was even, and unchanged, throughout.  Returns
+ * false if it wasn't, for the caller to read again under the lock, which
+ * writers and plc_tag_lock() holders keep to themselves. */
+static bool
+plcstub_peek(struct tag_handle* h, struct tag_tree_node* t, int offset, void* val, getter_fn fn)
+{
+    uint32_t seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1) {
+        return false;
+    }
+    fn(t->data, offset, val);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != seq) {
+        return false;
+    }
+
+    tag_stats_inc(t, STAT_GETS);
+    plcstub_note(h, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    plcstub_note(h, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+    return true;
+}
+
+/* Turns an accessor's offset into a byte offset into the tag's data, or
+ * returns a PLCTAG_ERR_* code.  For arrays the offset is an index into the
+ * array's (flattened) elements; other tags only accept an offset of 0.
+ * Needs no lock, as a tag's type and size are fixed once it is created. */
+static int
+plcstub_data_offset(struct tag_tree_node* t, int offset, size_t width)
+{
+    size_t off = offset;
+
+    if (offset < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Negative offset %d", offset);
+        return PLCTAG_ERR_BAD_PARAM;
     }
 
     if (type_to_enum(t->type) != TAG_ARRAY) {
         if (offset > 0) {
             pdebug(PLCTAG_DEBUG_WARN,
                 "Offset %d specified for non-array type %s", offset, type_str(t->type));
-            if (t->cb) {
-                pdebug(PLCTAG_DEBUG_SPEW,
-                    "Calling cb for %d with PLCTAG_EVENT_ABORTED", tag);
-                t->cb(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
-            }
-            MTX_UNLOCK(&t->mtx);
             return PLCTAG_ERR_BAD_PARAM;
         }
     } else {
         struct tag_array* a = (struct tag_array*)(t->type);
-        if (offset >= a->len) {
+        if ((uint32_t)offset >= a->elem_count) {
             pdebug(PLCTAG_DEBUG_WARN,
-                "Offset %d not in [0, %d)", offset, a->len);
-            MTX_UNLOCK(&t->mtx);
+                "Offset %d not in [0, %u)", offset, a->elem_count);
             return PLCTAG_ERR_BAD_PARAM;
         }
-        offset = offset * type_size_bytes(a->member_type);
+        off = off * a->elem_size;
     }
 
-    fn(t->data, offset, buf);
+    if (off + width > t->data_len) {
+        pdebug(PLCTAG_DEBUG_WARN,
+            "%zu-byte access at byte %zu overruns the %zu-byte tag", width, off, t->data_len);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+
+    /* No tag is larger than TYPE_SIZE_MAX, so this fits. */
+    return (int)(off);
+}
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_COMPLETED", tag);
-        t->cb(tag, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+static int
+plcstub_get_impl(int32_t tag, int offset, void* buf, size_t width, getter_fn fn)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    bool locked;
+    int off;
+
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if (plcstub_peekable(h, t)) {
+        off = plcstub_data_offset(t, offset, width);
+        if (off >= 0 && plcstub_peek(h, t, off, buf, fn)) {
+            tag_tree_release(t);
+            return PLCTAG_STATUS_OK;
+        }
     }
 
-    MTX_UNLOCK(&t->mtx);
+    /* TODO: I'm not thrilled about holding the lock through the course of all
+     * these callbacks, especially until we know the overhead of doing golang<->native
+     * interop.  Maybe it's better to make a defensive copy where possible? */
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, STAT_GETS);
+
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+
+    offset = plcstub_data_offset(t, offset, width);
+    if (offset < 0) {
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, offset);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return offset;
+    }
+
+    fn(t->data, offset, buf);
+
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
 
     return PLCTAG_STATUS_OK;
 }
 
 static int
-plcstub_set_impl(int32_t tag, int offset, void* value, setter_fn fn)
+plcstub_set_impl(int32_t tag, int offset, void* value, size_t width, setter_fn fn)
 {
+    struct tag_handle* h;
     struct tag_tree_node* t;
+    bool locked;
 
-    t = tag_tree_lookup(tag);
-    if (!t) {
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
         return PLCTAG_ERR_NOT_FOUND;
     }
@@ -154,49 +347,403 @@ plcstub_set_impl(int32_t tag, int offset, void* value, setter_fn fn)
     /* TODO: I'm not thrilled about holding the lock through the course of all
      * these callbacks, especially until we know the overhead of doing golang<->native
      * interop.  Maybe it's better to make a defensive copy where possible? */
-    MTX_LOCK(&t->mtx);
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, STAT_SETS);
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_STARTED", tag);
-        t->cb(tag, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+    plcstub_emit(h, t, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+
+    offset = plcstub_data_offset(t, offset, width);
+    if (offset < 0) {
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, offset);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return offset;
     }
 
-    if (type_to_enum(t->type) != TAG_ARRAY) {
-        if (offset > 0) {
-            pdebug(PLCTAG_DEBUG_WARN,
-                "Offset %d specified for non-array type %s", offset, type_str(t->type));
-            if (t->cb) {
-                pdebug(PLCTAG_DEBUG_SPEW,
-                    "Calling cb for %d with PLCTAG_EVENT_ABORTED", tag);
-                t->cb(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
+    fn(t->data, offset, value);
+
+    plcstub_emit(h, t, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
+
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Shared by the path-based accessors.  A width of 0 denotes a bit access,
+ * for which the callback is handed a bit offset rather than a byte offset. */
+static int
+plcstub_path_impl(int32_t tag, int32_t path, void* val, size_t width, bool write, getter_fn fn)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    bool locked;
+    const struct tag_path* p;
+    int start = write ? PLCTAG_EVENT_WRITE_STARTED : PLCTAG_EVENT_READ_STARTED;
+    int done = write ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED;
+
+    p = path_get(path);
+    if (!p) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown member path %d", path);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if (!write && p->root == t->type && plcstub_peekable(h, t)
+        && (width == 0 ? type_to_enum(p->type) == TAG_BOOL : type_size_bytes(p->type) == width)
+        && plcstub_peek(h, t, width == 0 ? p->offset * 8 + p->bit : p->offset, val, fn)) {
+        tag_tree_release(t);
+        return PLCTAG_STATUS_OK;
+    }
+
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, write ? STAT_SETS : STAT_GETS);
+
+    plcstub_emit(h, t, start, PLCTAG_STATUS_OK);
+
+    if (p->root != t->type) {
+        pdebug(PLCTAG_DEBUG_WARN, "Member path %d was not resolved against tag %d", path, tag);
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    if (width == 0 ? type_to_enum(p->type) != TAG_BOOL : type_size_bytes(p->type) != width) {
+        pdebug(PLCTAG_DEBUG_WARN, "Member path %d is a %s, not a %zu-byte value",
+            path, type_str(p->type), width);
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_BAD_PARAM);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    fn(t->data, width == 0 ? p->offset * 8 + p->bit : p->offset, val);
+
+    plcstub_emit(h, t, done, PLCTAG_STATUS_OK);
+
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Bit callbacks take a bit offset rather than a byte offset.  Bits are
+ * numbered little-endian, as Logix packs them. */
+static void
+plcstub_bit_getter_cb(char* buf, int offset, void* val)
+{
+    *(int*)(val) = (buf[offset / 8] >> (offset % 8)) & 1;
+}
+
+static void
+plcstub_bit_setter_cb(char* buf, int offset, void* val)
+{
+    if (*(int*)(val)) {
+        buf[offset / 8] |= 1 << (offset % 8);
+    } else {
+        buf[offset / 8] &= ~(1 << (offset % 8));
+    }
+}
+
+/* The number of bit-addressable bits in a tag: a BOOL array's length, or
+ * every bit of anything else. */
+static uint32_t
+plcstub_bit_count(struct tag_tree_node* t)
+{
+    if (type_is_bit_array(t->type)) {
+        return ((struct tag_array*)(t->type))->len;
+    }
+    return type_size_bytes(t->type) * 8;
+}
+
+/* Checks that bits [offset_bit, offset_bit + count) are addressable.  The
+ * tag's lock is assumed to be held by the caller. */
+static int
+plcstub_bit_range(struct tag_tree_node* t, int offset_bit, int count)
+{
+    uint32_t nbits = plcstub_bit_count(t);
+
+    if (offset_bit < 0 || count < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Negative bit offset %d or count %d", offset_bit, count);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    if ((uint32_t)offset_bit > nbits || (uint32_t)count > nbits - offset_bit) {
+        pdebug(PLCTAG_DEBUG_WARN,
+            "Bits [%d, %d) not in [0, %u)", offset_bit, offset_bit + count, nbits);
+        return PLCTAG_ERR_OUT_OF_BOUNDS;
+    }
+    return PLCTAG_STATUS_OK;
+}
+
+static int
+plcstub_bit_impl(int32_t tag, int offset_bit, int* val, bool write)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    bool locked;
+    int ret;
+
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if (!write && plcstub_peekable(h, t) && plcstub_bit_range(t, offset_bit, 1) == PLCTAG_STATUS_OK
+        && plcstub_peek(h, t, offset_bit, val, plcstub_bit_getter_cb)) {
+        tag_tree_release(t);
+        return PLCTAG_STATUS_OK;
+    }
+
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, write ? STAT_SETS : STAT_GETS);
+
+    plcstub_emit(h, t, write ? PLCTAG_EVENT_WRITE_STARTED : PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+
+    ret = plcstub_bit_range(t, offset_bit, 1);
+    if (ret != PLCTAG_STATUS_OK) {
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, ret);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return ret;
+    }
+
+    if (write) {
+        plcstub_bit_setter_cb(t->data, offset_bit, val);
+    } else {
+        plcstub_bit_getter_cb(t->data, offset_bit, val);
+    }
+
+    plcstub_emit(h, t, write ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Loads n (1 to 64) bits, starting at bit `bit`, as a single word; bit
+ * `bit` ends up in bit 0.  Only the bytes holding the bits are touched. */
+static uint64_t
+plcstub_bits_load(const char* buf, uint32_t bit, int n)
+{
+    uint8_t b[16] = { 0 };
+    uint32_t shift = bit % 8;
+    uint64_t w;
+
+    memcpy(b, buf + bit / 8, (shift + n + 7) / 8);
+    memcpy(&w, b, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    if (shift) {
+        w = (w >> shift) | ((uint64_t)(b[8]) << (64 - shift));
+    }
+    return n < 64 ? w & ((1ull << n) - 1) : w;
+}
+
+enum plcstub_bits_op {
+    BITS_GET,
+    BITS_COUNT,
+    BITS_FIND_FIRST,
+};
+
+/* Shared by the bulk bit operations, which all walk a range of bits 64 at a
+ * time.  Returns a count or bit index for BITS_COUNT and BITS_FIND_FIRST. */
+static int
+plcstub_bits_impl(int32_t tag, int offset_bit, int count, enum plcstub_bits_op op, uint32_t* out)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    bool locked;
+    int ret, i, n;
+    uint64_t w;
+
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, STAT_GETS);
+
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+
+    ret = plcstub_bit_range(t, offset_bit, count);
+    if (ret != PLCTAG_STATUS_OK) {
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, ret);
+        TAG_LEAVE(t, locked);
+        tag_tree_release(t);
+        return ret;
+    }
+
+    ret = op == BITS_FIND_FIRST ? offset_bit + count : 0;
+    for (i = 0; i < count; i += 64) {
+        n = count - i < 64 ? count - i : 64;
+        w = plcstub_bits_load(t->data, offset_bit + i, n);
+
+        if (op == BITS_GET) {
+            out[i / 32] = (uint32_t)(w);
+            if (n > 32) {
+                out[i / 32 + 1] = (uint32_t)(w >> 32);
             }
-            MTX_UNLOCK(&t->mtx);
-            return PLCTAG_ERR_BAD_PARAM;
+        } else if (op == BITS_COUNT) {
+            ret += __builtin_popcountll(w);
+        } else if (w != 0) {
+            ret = offset_bit + i + __builtin_ctzll(w);
+            break;
         }
-    } else {
-        struct tag_array* a = (struct tag_array*)(t->type);
-        if (offset >= a->len) {
-            pdebug(PLCTAG_DEBUG_WARN,
-                "Offset %d not in [0, %d)", offset, a->len);
-            MTX_UNLOCK(&t->mtx);
-            return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return ret;
+}
+
+enum plcstub_string_op {
+    STRING_GET,
+    STRING_SET,
+    STRING_LENGTH,
+};
+
+/* Reads or writes a whole STRING, the offset'th of a STRING tag or array, in
+ * one go.  For STRING_GET, buf has room for len bytes, including the NUL;
+ * for STRING_SET it holds the NUL-terminated string.  Returns the string's
+ * length or a PLCTAG_ERR_* code. */
+static int
+plcstub_string_impl(int32_t tag, int offset, enum plcstub_string_op op, char* buf, int len)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    type_t elem;
+    bool locked;
+    int32_t n;
+    int ret;
+
+    h = tag_tree_handle(tag, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    TAG_ENTER(t, locked);
+    tag_stats_inc(t, op == STRING_SET ? STAT_SETS : STAT_GETS);
+
+    plcstub_emit(h, t, op == STRING_SET ? PLCTAG_EVENT_WRITE_STARTED : PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+
+    for (elem = t->type; type_to_enum(elem) == TAG_ARRAY;) {
+        elem = ((struct tag_array*)(elem))->member_type;
+    }
+    if (type_to_enum(elem) != TAG_STRING) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d is a %s, not a STRING", tag, type_str(t->type));
+        ret = PLCTAG_ERR_UNSUPPORTED;
+        goto out;
+    }
+
+    ret = plcstub_data_offset(t, offset, TAG_STRING_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+    offset = ret;
+
+    if (op == STRING_SET) {
+        n = strlen(buf);
+        if (n > TAG_STRING_CAPACITY) {
+            pdebug(PLCTAG_DEBUG_WARN, "%d-character string is too long for a STRING", n);
+            ret = PLCTAG_ERR_TOO_LARGE;
+            goto out;
         }
-        offset = offset * type_size_bytes(a->member_type);
+        memcpy(t->data + offset, &n, sizeof(n));
+        memcpy(t->data + offset + TAG_STRING_DATA, buf, n);
+        memset(t->data + offset + TAG_STRING_DATA + n, 0, TAG_STRING_CAPACITY - n);
+        ret = n;
+        goto out;
     }
 
-    fn(t->data, offset, value);
+    memcpy(&n, t->data + offset, sizeof(n));
+    if (n < 0 || n > TAG_STRING_CAPACITY) {
+        pdebug(PLCTAG_DEBUG_WARN, "STRING %d of tag %d has a bad length %d", offset / TAG_STRING_SIZE, tag, n);
+        ret = PLCTAG_ERR_BAD_DATA;
+        goto out;
+    }
+    if (op == STRING_GET) {
+        if (len < n + 1) {
+            ret = PLCTAG_ERR_TOO_SMALL;
+            goto out;
+        }
+        memcpy(buf, t->data + offset + TAG_STRING_DATA, n);
+        buf[n] = '\0';
+    }
+    ret = n;
 
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_COMPLETED", tag);
-        t->cb(tag, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
+out:
+    if (ret < 0) {
+        plcstub_emit(h, t, PLCTAG_EVENT_ABORTED, ret);
+    } else {
+        plcstub_emit(h, t, op == STRING_SET ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED,
+            PLCTAG_STATUS_OK);
     }
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return ret;
+}
 
-    MTX_UNLOCK(&t->mtx);
+#ifdef DEBUG
+/* In debug builds, plc_tag_get_data_ptr() hands out a page-aligned copy of
+ * the tag's data, which stands in for it until the tag is unlocked.  It is
+ * then copied back and made inaccessible, so that a pointer used after
+ * plc_tag_unlock() faults instead of silently racing other threads.  The
+ * tag is held by the calling thread. */
+static void
+plcstub_shadow_begin(struct tag_tree_node* t)
+{
+    long page = sysconf(_SC_PAGESIZE);
 
-    return PLCTAG_STATUS_OK;
+    if (t->shadowed_data) {
+        return;
+    }
+
+    if (t->shadow == NULL) {
+        t->shadow_len = (t->data_len + page - 1) / page * page;
+        t->shadow = mmap(NULL, t->shadow_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (t->shadow == MAP_FAILED) {
+            err(1, "mmap");
+        }
+    }
+
+    if (mprotect(t->shadow, t->shadow_len, PROT_READ | PROT_WRITE)) {
+        err(1, "mprotect");
+    }
+    memcpy(t->shadow, t->data, t->data_len);
+    t->shadowed_data = t->data;
+    t->data = t->shadow;
+}
+
+static void
+plcstub_shadow_end(struct tag_tree_node* t)
+{
+    if (!t->shadowed_data) {
+        return;
+    }
+
+    memcpy(t->shadowed_data, t->shadow, t->data_len);
+    t->data = t->shadowed_data;
+    t->shadowed_data = NULL;
+    if (mprotect(t->shadow, t->shadow_len, PROT_NONE)) {
+        err(1, "mprotect");
+    }
 }
+#endif
 
 /************************ Public API ************************/
 
@@ -215,72 +762,79 @@ plc_tag_get_debug_level()
     return debug_get_level();
 }
 
+/* Builds the type for a tag created with the given elem_size and elem_count
+ * attributes (0 if absent).  Element sizes that match an atomic type, or a
+ * STRING, are given that type; anything else is an opaque element of that
+ * size, so that the tag reports the elem_size and elem_count it was made with.
+ * The caller checks that the tag isn't larger than TYPE_SIZE_MAX. */
+static type_t
+plcstub_type_from_attribs(int elem_size, int elem_count)
+{
+    type_t elem, ret;
+
+    switch (elem_size) {
+    case 0:
+        elem = type_new_simple(TAG_LINT);
+        break;
+    case 1:
+        elem = type_new_simple(TAG_SINT);
+        break;
+    case 2:
+        elem = type_new_simple(TAG_INT);
+        break;
+    case 4:
+        elem = type_new_simple(TAG_DINT);
+        break;
+    case 8:
+        elem = type_new_simple(TAG_LINT);
+        break;
+    case TAG_STRING_SIZE:
+        elem = type_new_simple(TAG_STRING);
+        break;
+    default:
+        elem = type_new_opaque(elem_size);
+        break;
+    }
+
+    if (elem_count <= 1) {
+        return elem;
+    }
+
+    ret = type_new_array(elem_count, elem);
+    type_free(elem);
+    return ret;
+}
+
 int
 plc_tag_create(const char* attrib, int timeout)
 {
-    int ret = PLCTAG_STATUS_OK;
-    char *kv_ctx, *kv;
-    char* kv_sep = "&";
-    struct tag_tree_node* tag;
-
-    /* There are three attributes that we are interested in at the moment:
-     * 1) name: the name of the tag
-     * 
-     * Additionally, two more attributes may be set, that we ignore:
-     * 1) elem_size: the width of each element in the tag
-     * 2) elem_count: how many elements. (TODO: how does this work with multi-dim arrays?)
-     */
-    char* name = NULL;
-
-    char* str = strdup(attrib);
-
-    for (kv = strtok_r(str, kv_sep, &kv_ctx);
-         kv != NULL;
-         kv = strtok_r(NULL, kv_sep, &kv_ctx)) {
-        char *key, *val;
-        pdebug(PLCTAG_DEBUG_SPEW, "Current kv-pair: %s", kv);
-
-        key = kv;
-        val = strchr(key, '=');
-        if (val == NULL && (strcmp("protocol", kv) != 0)) {
-            /* At the moment, the only attribute we've seen that isn't a key-value pair
-             * is "protocol".  If we encounter others, we can either check for them or
-             * just ignore them altogether, depending on our confidence of things. */
-            pdebug(PLCTAG_DEBUG_WARN, "Missing '=' in non-'protocol' attribute %s", kv);
-            ret = PLCTAG_ERR_BAD_PARAM;
-            goto done;
-        }
-        *val = '\0';
-        val++;
-        pdebug(PLCTAG_DEBUG_SPEW, "key=%s,val=%s", key, val);
-
-        /* We have a key and value parsed out at ths point. */
+    struct tag_attribs attrs;
+    type_t type;
+    int ret;
 
-        if (strcmp("name", key) == 0) {
-            if (name != NULL) {
-                pdebug(PLCTAG_DEBUG_WARN, "Overwriting attribute %s", "name");
-            }
-            name = val;
-        } else if (strcmp("elem_size", key) == 0) {
-            pdebug(PLCTAG_DEBUG_WARN, "plcstub dicards attribute %s", "elem_size");
-        } else if (strcmp("elem_count", key) == 0) {
-            pdebug(PLCTAG_DEBUG_WARN, "plcstub dicards attribute %s", "elem_count");
-        }
+    ret = attrib_parse_cached(attrib, &attrs);
+    if (ret != PLCTAG_STATUS_OK) {
+        return ret;
+    }
+    if (attrs.debug >= 0) {
+        plc_tag_set_debug_level(attrs.debug);
     }
 
-    if (name == NULL) {
-        pdebug(PLCTAG_DEBUG_WARN, "Missing attribute %s", "name");
-        ret = PLCTAG_ERR_BAD_PARAM;
-        goto done;
+    if ((uint64_t)(attrs.elem_size ? attrs.elem_size : 8) * (attrs.elem_count ? attrs.elem_count : 1) > TYPE_SIZE_MAX) {
+        pdebug(PLCTAG_DEBUG_WARN, "%d elements of %d bytes are too many", attrs.elem_count, attrs.elem_size);
+        return PLCTAG_ERR_TOO_LARGE;
     }
 
-    /* XXX: This needs to go away immediately, as it hinges on Nathan's misunderstanding
-     * of creating a tag ID. Another patch will be put out that returns a new
-     * handle to an existing tag rather than creating a new one. */
-    ret = tag_tree_insert(name, type_new_simple(TAG_LINT));
+    /* Creating a tag that already exists gets a new handle on it, whatever
+     * its type, unless the size attributes say otherwise.  The size was
+     * checked above, so only memory can be short of a type for it. */
+    type = plcstub_type_from_attribs(attrs.elem_size, attrs.elem_count);
+    if (type_to_enum(type) == TAG_ERROR) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+    ret = tag_tree_insert_sized(attrs.name, type, attrs.elem_size, attrs.elem_count);
+    type_free(type);
 
-done:
-    free(str);
     return ret;
 }
 
@@ -381,27 +935,313 @@ plc_tag_destroy(int32_t tag)
     return tag_tree_remove(tag);
 }
 
+/* Library-wide attributes are looked up with a tag ID of 0, as in libplctag.
+ * Both the library and individual tags answer with the counters from stats.h;
+ * counters wider than an int are truncated.  Tags also report their size,
+ * elem_size and elem_count. */
+int
+plc_tag_get_int_attribute(int32_t id, const char* attrib_name, int default_value)
+{
+    struct tag_tree_node* t;
+    int s, m, ret;
+
+    if (attrib_name == NULL) {
+        return default_value;
+    }
+
+    s = stats_lookup(attrib_name);
+
+    if (id == 0) {
+        if (strcmp(attrib_name, "lock_hold_warn_ms") == 0) {
+            return (int)(lockprof_get_hold_warn_ns() / 1000000);
+        }
+        if (strcmp(attrib_name, "mem_total") == 0) {
+            return (int)mem_total();
+        }
+        if (strcmp(attrib_name, "mem_budget") == 0) {
+            return (int)mem_budget_get();
+        }
+        if ((m = mem_lookup(attrib_name)) >= 0) {
+            return (int)mem_get(m);
+        }
+        if (s < 0) {
+            pdebug(PLCTAG_DEBUG_WARN, "Unknown library attribute %s", attrib_name);
+            return default_value;
+        }
+        return (int)stats_get(s);
+    }
+
+    t = tag_tree_lookup(id);
+    if (!t) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
+        return default_value;
+    }
+
+    if (strcmp(attrib_name, "size") == 0) {
+        ret = (int)type_size_bytes(t->type);
+    } else if (strcmp(attrib_name, "elem_size") == 0) {
+        ret = (int)type_elem_size(t->type);
+    } else if (strcmp(attrib_name, "elem_count") == 0) {
+        ret = (int)type_elem_count(t->type);
+    } else if (s < 0 || s >= TAG_STAT_COUNT) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown attribute %s for tag %d", attrib_name, id);
+        ret = default_value;
+    } else {
+        ret = (int)tag_stats_get(t, s);
+    }
+
+    tag_tree_release(t);
+    return ret;
+}
+
+/* Library-wide settings are changed with a tag ID of 0:
+ *  lock_hold_warn_ms: with lock profiling built in, warn about plc_tag_lock()
+ *                     holds longer than this many ms (0 disables).
+ */
+int
+plc_tag_set_int_attribute(int32_t id, const char* attrib_name, int new_value)
+{
+    struct tag_tree_node* t;
+
+    if (attrib_name == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if (id == 0) {
+        if (strcmp(attrib_name, "lock_hold_warn_ms") == 0) {
+            if (new_value < 0) {
+                return PLCTAG_ERR_OUT_OF_BOUNDS;
+            }
+            lockprof_set_hold_warn_ns((uint64_t)new_value * 1000000);
+            return PLCTAG_STATUS_OK;
+        }
+        if (strcmp(attrib_name, "mem_budget") == 0) {
+            if (new_value < 0) {
+                return PLCTAG_ERR_OUT_OF_BOUNDS;
+            }
+            mem_budget_set((uint64_t)new_value);
+            return PLCTAG_STATUS_OK;
+        }
+        pdebug(PLCTAG_DEBUG_WARN, "Unsupported library attribute %s", attrib_name);
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    t = tag_tree_lookup(id);
+    if (!t) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+    tag_tree_release(t);
+
+    pdebug(PLCTAG_DEBUG_WARN, "Unsupported attribute %s for tag %d", attrib_name, id);
+    return PLCTAG_ERR_UNSUPPORTED;
+}
+
+int32_t
+plc_tag_resolve_path(int32_t id, const char* path)
+{
+    struct tag_tree_node* t;
+    int32_t ret;
+
+    if (path == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    t = tag_tree_lookup(id);
+    if (!t) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /* A tag's type never changes, so there's no need to lock it. */
+    ret = path_resolve(t->type, path);
+    tag_tree_release(t);
+    return ret;
+}
+
+int
+plc_tag_get_bit_path(int32_t tag, int32_t path)
+{
+    int impl_ret, val;
+
+    impl_ret = plcstub_path_impl(tag, path, &val, 0, false, plcstub_bit_getter_cb);
+    if (impl_ret != PLCTAG_STATUS_OK) {
+        return impl_ret;
+    }
+    return val;
+}
+
+int
+plc_tag_set_bit_path(int32_t tag, int32_t path, int val)
+{
+    return plcstub_path_impl(tag, path, &val, 0, true, plcstub_bit_setter_cb);
+}
+
+int
+plc_tag_get_bit(int32_t tag, int offset_bit)
+{
+    int impl_ret, val;
+
+    impl_ret = plcstub_bit_impl(tag, offset_bit, &val, false);
+    if (impl_ret != PLCTAG_STATUS_OK) {
+        return impl_ret;
+    }
+    return val;
+}
+
+int
+plc_tag_set_bit(int32_t tag, int offset_bit, int val)
+{
+    return plcstub_bit_impl(tag, offset_bit, &val, true);
+}
+
+int
+plc_tag_get_bits(int32_t tag, int offset_bit, int count, uint32_t* buf)
+{
+    int ret;
+
+    if (buf == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    ret = plcstub_bits_impl(tag, offset_bit, count, BITS_GET, buf);
+    return ret < 0 ? ret : PLCTAG_STATUS_OK;
+}
+
+int
+plc_tag_count_bits(int32_t tag, int offset_bit, int count)
+{
+    return plcstub_bits_impl(tag, offset_bit, count, BITS_COUNT, NULL);
+}
+
+int
+plc_tag_find_first_bit(int32_t tag, int offset_bit, int count)
+{
+    return plcstub_bits_impl(tag, offset_bit, count, BITS_FIND_FIRST, NULL);
+}
+
+int
+plc_tag_get_string(int32_t tag, int string_start_offset, char* buffer, int buffer_length)
+{
+    int ret;
+
+    if (buffer == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    ret = plcstub_string_impl(tag, string_start_offset, STRING_GET, buffer, buffer_length);
+    return ret < 0 ? ret : PLCTAG_STATUS_OK;
+}
+
+int
+plc_tag_set_string(int32_t tag, int string_start_offset, const char* string_val)
+{
+    int ret;
+
+    if (string_val == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    ret = plcstub_string_impl(tag, string_start_offset, STRING_SET, (char*)(string_val), 0);
+    return ret < 0 ? ret : PLCTAG_STATUS_OK;
+}
+
+int
+plc_tag_get_string_length(int32_t tag, int string_start_offset)
+{
+    return plcstub_string_impl(tag, string_start_offset, STRING_LENGTH, NULL, 0);
+}
+
+int
+plc_tag_lock_report(int top_n)
+{
+#ifdef LOCK_PROFILING
+    if (top_n < 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    tag_tree_lock_report(stderr, top_n);
+    return PLCTAG_STATUS_OK;
+#else
+    (void)(top_n);
+    pdebug(PLCTAG_DEBUG_WARN, "plcstub was built without lock profiling");
+    return PLCTAG_ERR_UNSUPPORTED;
+#endif
+}
+
+int
+plc_tag_find(const char* pattern, char* cursor, int cursor_len, int32_t* ids, int max_ids)
+{
+    if (pattern == NULL || cursor == NULL || ids == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if (cursor_len <= 0 || max_ids < 0 || strnlen(cursor, cursor_len) == (size_t)(cursor_len)) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return tag_tree_find(pattern, cursor, cursor_len, ids, max_ids);
+}
+
 int
 plc_tag_get_size(int32_t id)
 {
-    int size;
+    struct tag_tree_node* t;
+    int ret;
+
+    t = tag_tree_lookup(id);
+    if (!t) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    /* A tag's type never changes, and its size is cached on it. */
+    ret = (int)type_size_bytes(t->type);
+    tag_tree_release(t);
+    return ret;
+}
 
+static int
+plcstub_lock_impl(int32_t id, int timeout_ms)
+{
     struct tag_tree_node* t;
+    int ret;
 
     t = tag_tree_lookup(id);
     if (!t) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
         return PLCTAG_ERR_NOT_FOUND;
     }
-    MTX_LOCK(&t->mtx);
-    size = t;
-    MTX_UNLOCK(&t->mtx);
 
-    return size;
+    /* Like libplctag, nested locks by the same thread are fine. */
+    if (tag_lock_held(t)) {
+        t->lock_depth++;
+        tag_tree_release(t);
+        return PLCTAG_STATUS_OK;
+    }
+
+    ret = tag_tree_lock_timeout(t, timeout_ms);
+    if (ret == PLCTAG_STATUS_OK) {
+        __atomic_store_n(&t->lock_owner, pthread_self(), __ATOMIC_RELAXED);
+        __atomic_store_n(&t->lock_depth, 1, __ATOMIC_RELAXED);
+    }
+
+    tag_tree_release(t);
+    return ret;
 }
 
 extern int
 plc_tag_lock(int32_t id)
+{
+    return plcstub_lock_impl(id, -1);
+}
+
+int
+plc_tag_lock_timeout(int32_t id, int timeout_ms)
+{
+    if (timeout_ms < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Timeout must not be negative");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return plcstub_lock_impl(id, timeout_ms);
+}
+
+extern int
+plc_tag_unlock(int32_t id)
 {
     struct tag_tree_node* t;
 
@@ -410,22 +1250,66 @@ plc_tag_lock(int32_t id)
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
         return PLCTAG_ERR_NOT_FOUND;
     }
-    MTX_LOCK(&t->mtx);
+
+    if (!tag_lock_held(t)) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d is not locked by this thread", id);
+        tag_tree_release(t);
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+    if (--t->lock_depth > 0) {
+        tag_tree_release(t);
+        return PLCTAG_STATUS_OK;
+    }
+
+#ifdef DEBUG
+    plcstub_shadow_end(t);
+#endif
+    __atomic_store_n(&t->lock_owner, (pthread_t)(0), __ATOMIC_RELAXED);
+
+#ifdef LOCK_PROFILING
+    uint64_t held = lockprof_held_ns(t->mtxp);
+    uint64_t warn = lockprof_get_hold_warn_ns();
+    if (warn && held > warn) {
+        __atomic_add_fetch(&t->lockprof.long_holds, 1, __ATOMIC_RELAXED);
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d (%s) was held for %lu us by plc_tag_lock()",
+            id, t->name, (unsigned long)(held / 1000));
+    }
+#endif
+
+    TAG_UNLOCK(t);
+    tag_tree_release(t);
 
     return PLCTAG_STATUS_OK;
 }
 
-extern int
-plc_tag_unlock(int32_t id)
+int
+plc_tag_get_data_ptr(int32_t id, void** ptr, int* len)
 {
     struct tag_tree_node* t;
 
+    if (ptr == NULL || len == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
     t = tag_tree_lookup(id);
     if (!t) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", id);
         return PLCTAG_ERR_NOT_FOUND;
     }
-    MTX_UNLOCK(&t->mtx);
+
+    if (!tag_lock_held(t)) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %d must be held with plc_tag_lock()", id);
+        tag_tree_release(t);
+        return PLCTAG_ERR_NOT_ALLOWED;
+    }
+
+#ifdef DEBUG
+    plcstub_shadow_begin(t);
+#endif
+    *ptr = t->data;
+    *len = (int)type_size_bytes(t->type);
+    /* Held, the tag is kept as it is until it's unlocked. */
+    tag_tree_release(t);
 
     return PLCTAG_STATUS_OK;
 }
@@ -433,57 +1317,170 @@ plc_tag_unlock(int32_t id)
 /* Stubs out the tag read path.  Only checks that the arguments
  * are valid.  It might be interesting to stub out "in-flight"
  * reads and writes for a heavily-concurrent integration test
- * but I suspect that isn't worth our effort.
+ * but I suspect that isn't worth our effort.  The timeout bounds the wait
+ * for a tag held by another thread.
  */
 int
 plc_tag_read(int32_t tag_id, int timeout)
 {
-    (void)(timeout);
+    struct tag_handle* h;
     struct tag_tree_node* t;
+    bool locked;
+    int ret;
 
     if (timeout < 0) {
         pdebug(PLCTAG_DEBUG_WARN, "Timeout must not be negative");
         return PLCTAG_ERR_BAD_PARAM;
     }
 
-    t = tag_tree_lookup(tag_id);
-    if (!t) {
+    h = tag_tree_handle(tag_id, &t);
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    MTX_LOCK(&t->mtx);
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_STARTED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_READ_EVENT_COMPLETED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+    TAG_ENTER_TIMEOUT(t, locked, timeout, ret);
+    if (ret != PLCTAG_STATUS_OK) {
+        __atomic_store_n(&h->status, ret, __ATOMIC_RELAXED);
+        tag_tree_release(t);
+        return ret;
     }
-    MTX_UNLOCK(&t->mtx);
+    tag_stats_inc(t, STAT_READS);
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    if (t->refresh) {
+        t->refresh(t);
+    }
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
 
     return PLCTAG_STATUS_OK;
 }
 
-int
-plc_tag_register_callback(int32_t tag_id, tag_callback_func cb)
+static bool
+plcstub_subscriber_eq(const struct tag_subscriber* a, const struct tag_subscriber* b)
 {
-    struct tag_tree_node* t;
+    return a->cb == b->cb && a->cb_ex == b->cb_ex && a->userdata == b->userdata;
+}
 
-    t = tag_tree_lookup(tag_id);
-    if (!t) {
+/* Adds a callback to a handle or, if remove is set, removes it (or, if sub is
+ * NULL, every callback), by publishing a changed copy of its subscribers and
+ * retiring the old list.  The tag's lock isn't needed, so registering never
+ * holds up the tag's accessors. */
+static int
+plcstub_subscribe(int32_t tag_id, const struct tag_subscriber* sub, bool remove)
+{
+    struct tag_subscribers *old, *subs = NULL, *retired;
+    struct tag_handle* h;
+    int i, n = 0, found = 0;
+
+    h = tag_tree_handle(tag_id, NULL);
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    MTX_LOCK(&t->mtx);
-    t->cb = cb;
-    MTX_UNLOCK(&t->mtx);
+    MTX_LOCK(&subscribe_mtx);
+
+    /* Only changed under subscribe_mtx, so it can't be retired meanwhile. */
+    old = h->subs;
+    if (old != NULL) {
+        n = old->n;
+        for (i = 0; i < n; i++) {
+            found += sub == NULL || plcstub_subscriber_eq(&old->subs[i], sub);
+        }
+    }
+    if (remove ? found == 0 : found > 0) {
+        MTX_UNLOCK(&subscribe_mtx);
+        return remove ? PLCTAG_ERR_NOT_FOUND : PLCTAG_ERR_DUPLICATE;
+    }
+
+    n = remove ? n - found : n + 1;
+    if (n > 0) {
+        subs = mem_alloc(MEM_CATALOG, sizeof(*subs) + n * sizeof(subs->subs[0]));
+        if (subs == NULL) {
+            MTX_UNLOCK(&subscribe_mtx);
+            return PLCTAG_ERR_NO_MEM;
+        }
+        subs->next_retired = NULL;
+        subs->n = 0;
+        for (i = 0; old != NULL && i < old->n; i++) {
+            if (!remove || (sub != NULL && !plcstub_subscriber_eq(&old->subs[i], sub))) {
+                subs->subs[subs->n++] = old->subs[i];
+            }
+        }
+        if (!remove) {
+            subs->subs[subs->n++] = *sub;
+        }
+    }
+    __atomic_store_n(&h->subs, subs, __ATOMIC_RELEASE);
+
+    if (old != NULL) {
+        retired = __atomic_load_n(&h->retired, __ATOMIC_RELAXED);
+        do {
+            old->next_retired = retired;
+        } while (!__atomic_compare_exchange_n(&h->retired, &retired, old, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    MTX_UNLOCK(&subscribe_mtx);
 
     return PLCTAG_STATUS_OK;
 }
 
+int
+plc_tag_register_callback(int32_t tag_id, tag_callback_func cb)
+{
+    struct tag_subscriber sub = { .cb = cb };
+
+    if (cb == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    return plcstub_subscribe(tag_id, &sub, false);
+}
+
+int
+plc_tag_register_callback_ex(int32_t tag_id, tag_callback_ex_func cb, void* userdata)
+{
+    struct tag_subscriber sub = { .cb_ex = cb, .userdata = userdata };
+
+    if (cb == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    return plcstub_subscribe(tag_id, &sub, false);
+}
+
+int
+plc_tag_unregister_callback_ex(int32_t tag_id, tag_callback_ex_func cb, void* userdata)
+{
+    struct tag_subscriber sub = { .cb_ex = cb, .userdata = userdata };
+
+    return plcstub_subscribe(tag_id, &sub, true);
+}
+
+int
+plc_tag_register_batch_callback(events_batch_func cb, void* userdata, int max_events, int max_delay_ms)
+{
+    if (cb == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if (max_events <= 0 || max_delay_ms <= 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+    return events_register(cb, userdata, max_events, max_delay_ms);
+}
+
+int
+plc_tag_unregister_batch_callback(void)
+{
+    return events_unregister();
+}
+
+int
+plc_tag_flush_events(void)
+{
+    return events_flush();
+}
+
 void
 plc_tag_set_debug_level(int level)
 {
@@ -493,56 +1490,58 @@ plc_tag_set_debug_level(int level)
 int
 plc_tag_status(int32_t tag)
 {
-    struct tag_tree_node* t;
+    struct tag_handle* h;
 
-    t = tag_tree_lookup(tag);
-    if (!t) {
+    h = tag_tree_handle(tag, NULL);
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    /* For the stub, let's always just treat the tag status as
-     * okay.  If we stub out in-flight reads and writes later on,
-     * this would change.
-     */
-    return PLCTAG_STATUS_OK;
+    /* Operations complete synchronously, so there is never one in flight:
+     * this is how the last one through this handle went. */
+    return __atomic_load_n(&h->status, __ATOMIC_RELAXED);
 }
 
 int
 plc_tag_unregister_callback(int32_t tag_id)
 {
-    return plc_tag_register_callback(tag_id, NULL);
+    return plcstub_subscribe(tag_id, NULL, true);
 }
 
-/* Stubs out the tag write path.
+/* Stubs out the tag write path.  As for plc_tag_read(), the timeout bounds
+ * the wait for a tag held by another thread.
  */
 int
 plc_tag_write(int32_t tag_id, int timeout)
 {
-    (void)(timeout);
+    struct tag_handle* h;
     struct tag_tree_node* t;
+    bool locked;
+    int ret;
 
     if (timeout < 0) {
         pdebug(PLCTAG_DEBUG_WARN, "Timeout must not be negative");
         return PLCTAG_ERR_BAD_PARAM;
     }
 
-    t = tag_tree_lookup(tag_id);
-    if (!t) {
+    h = tag_tree_handle(tag_id, &t);
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", tag_id);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    MTX_LOCK(&t->mtx);
-    if (t->cb) {
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_STARTED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
-        pdebug(PLCTAG_DEBUG_SPEW,
-            "Calling cb for %d with PLCTAG_WRITE_EVENT_COMPLETED", tag_id);
-        t->cb(tag_id, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
+    TAG_ENTER_TIMEOUT(t, locked, timeout, ret);
+    if (ret != PLCTAG_STATUS_OK) {
+        __atomic_store_n(&h->status, ret, __ATOMIC_RELAXED);
+        tag_tree_release(t);
+        return ret;
     }
-    MTX_UNLOCK(&t->mtx);
+    tag_stats_inc(t, STAT_WRITES);
+    plcstub_emit(h, t, PLCTAG_EVENT_WRITE_STARTED, PLCTAG_STATUS_OK);
+    plcstub_emit(h, t, PLCTAG_EVENT_WRITE_COMPLETED, PLCTAG_STATUS_OK);
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
 
     return PLCTAG_STATUS_OK;
 }
@@ -550,8 +1549,152 @@ plc_tag_write(int32_t tag_id, int timeout)
 /* macro expansions */
 
 #define X(name, type, fprintf_type) SETTER(name, type, fprintf_type);
-TYPEMAP
+SCALAR_TYPEMAP
 #undef X
 #define X(name, type, fprintf_type) GETTER(name, type, fprintf_type);
-TYPEMAP
+SCALAR_TYPEMAP
 #undef X
+#define X(name, type, fprintf_type) PATH_SETTER(name, type, fprintf_type);
+SCALAR_TYPEMAP
+#undef X
+#define X(name, type, fprintf_type) PATH_GETTER(name, type, fprintf_type);
+SCALAR_TYPEMAP
+#undef X
+
+/* The getter behind each PLCTAG_ITEM_* type but bits. */
+static const struct {
+    size_t width;
+    getter_fn* fn;
+} plcstub_item_getters[] = {
+    [PLCTAG_ITEM_UINT8] = { sizeof(uint8_t), plcstub_uint8_getter_cb },
+    [PLCTAG_ITEM_INT8] = { sizeof(int8_t), plcstub_int8_getter_cb },
+    [PLCTAG_ITEM_UINT16] = { sizeof(uint16_t), plcstub_uint16_getter_cb },
+    [PLCTAG_ITEM_INT16] = { sizeof(int16_t), plcstub_int16_getter_cb },
+    [PLCTAG_ITEM_UINT32] = { sizeof(uint32_t), plcstub_uint32_getter_cb },
+    [PLCTAG_ITEM_INT32] = { sizeof(int32_t), plcstub_int32_getter_cb },
+    [PLCTAG_ITEM_UINT64] = { sizeof(uint64_t), plcstub_uint64_getter_cb },
+    [PLCTAG_ITEM_INT64] = { sizeof(int64_t), plcstub_int64_getter_cb },
+    [PLCTAG_ITEM_FLOAT32] = { sizeof(float), plcstub_float32_getter_cb },
+    [PLCTAG_ITEM_FLOAT64] = { sizeof(double), plcstub_float64_getter_cb },
+};
+
+/* Decodes one item, returning its status.  The tag's lock is assumed to be
+ * held by the caller. */
+static int
+plcstub_read_item(struct tag_tree_node* t, struct plc_tag_item* item)
+{
+    int offset, ret;
+
+    if (item->dest == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if (item->type == PLCTAG_ITEM_BIT) {
+        ret = plcstub_bit_range(t, item->offset, 1);
+        if (ret != PLCTAG_STATUS_OK) {
+            return ret;
+        }
+        plcstub_bit_getter_cb(t->data, item->offset, item->dest);
+        return PLCTAG_STATUS_OK;
+    }
+
+    if (item->type <= 0 || (size_t)item->type >= sizeof(plcstub_item_getters) / sizeof(plcstub_item_getters[0])
+        || plcstub_item_getters[item->type].fn == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown item type %d", item->type);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    offset = plcstub_data_offset(t, item->offset, plcstub_item_getters[item->type].width);
+    if (offset < 0) {
+        return offset;
+    }
+    plcstub_item_getters[item->type].fn(t->data, offset, item->dest);
+
+    return PLCTAG_STATUS_OK;
+}
+
+/* Reads the run of items on the same tag that starts the array, waiting up
+ * to timeout ms for the tag, and returns how long it was. */
+static int
+plcstub_read_items_run(struct plc_tag_item* items, int count, int timeout)
+{
+    struct tag_handle* h;
+    struct tag_tree_node* t;
+    bool locked;
+    int i, n, ret;
+
+    for (n = 1; n < count && items[n].tag_id == items[0].tag_id; n++) {
+    }
+
+    h = tag_tree_handle(items[0].tag_id, &t);
+    if (!h) {
+        pdebug(PLCTAG_DEBUG_WARN, "Unknown tag %d", items[0].tag_id);
+        for (i = 0; i < n; i++) {
+            items[i].status = PLCTAG_ERR_NOT_FOUND;
+        }
+        return n;
+    }
+
+    TAG_ENTER_TIMEOUT(t, locked, timeout, ret);
+    if (ret != PLCTAG_STATUS_OK) {
+        for (i = 0; i < n; i++) {
+            items[i].status = ret;
+        }
+        tag_tree_release(t);
+        return n;
+    }
+    tag_stats_inc(t, STAT_READS);
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_STARTED, PLCTAG_STATUS_OK);
+    if (t->refresh) {
+        t->refresh(t);
+    }
+    for (i = 0; i < n; i++) {
+        tag_stats_inc(t, STAT_GETS);
+        items[i].status = plcstub_read_item(t, &items[i]);
+    }
+    plcstub_emit(h, t, PLCTAG_EVENT_READ_COMPLETED, PLCTAG_STATUS_OK);
+    TAG_LEAVE(t, locked);
+    tag_tree_release(t);
+
+    return n;
+}
+
+int
+plc_tag_read_items(struct plc_tag_item* items, int count, int timeout)
+{
+    struct timespec start, now;
+    int i, j, n, left = timeout, ret = PLCTAG_STATUS_OK;
+
+    if (items == NULL) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+    if (count < 0 || timeout < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Count and timeout must not be negative");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* The timeout is for the whole call; once it has run out, the rest of
+     * the tags are only tried, and busy ones time out without being waited
+     * for. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i += n) {
+        n = plcstub_read_items_run(&items[i], count - i, left);
+        for (j = i; timeout > 0 && left == 0 && j < i + n; j++) {
+            if (items[j].status == PLCTAG_ERR_BUSY) {
+                items[j].status = PLCTAG_ERR_TIMEOUT;
+            }
+        }
+        if (timeout > 0 && left > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeout - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+            left = left > 0 ? left : 0;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (items[i].status != PLCTAG_STATUS_OK) {
+            ret = PLCTAG_ERR_PARTIAL;
+        }
+    }
+
+    return ret;
+}
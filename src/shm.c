@@ -0,0 +1,381 @@
+/* shm.c
+ *
+ * The shared-memory tag store (see shm.h).
+ *
+ * The segment starts with a header holding the catalog, and tag data is
+ * carved out of the rest of it with a bump allocator.  Appends to the catalog
+ * are serialised by a process-shared mutex in the header; the entry count is
+ * published with release semantics, so readers need no lock.  A dead entry
+ * is only ever brought back to life, data and all, for a tag of the same
+ * name, type and size, so that nodes other processes still have for it stay
+ * good.  All the locks
+ * are robust, so that a process dying while it holds one doesn't wedge the
+ * others.
+ */
+
+#define _GNU_SOURCE /* for pthread_mutex_clocklock() */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "shm.h"
+
+#define SHM_MAGIC 0x504c4353 /* "PLCS" */
+#define SHM_VERSION 6
+#define SHM_DEFAULT_SIZE (16 << 20)
+#define SHM_DATA_ALIGN CACHE_LINE
+#define SHM_ATTACH_TIMEOUT_MS 5000
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ready;
+    uint32_t tag_cnt;
+    uint32_t kill_cnt;
+    uint32_t revive_cnt;
+    uint64_t size;
+    uint64_t data_used;
+    pthread_mutex_t mtx;
+    struct shm_tag tags[SHM_MAX_TAGS];
+};
+
+static struct shm_header* shm = NULL;
+
+static void
+shm_mutex_init(pthread_mutex_t* mtx)
+{
+    pthread_mutexattr_t attr;
+
+    if (pthread_mutexattr_init(&attr)
+        || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)
+#ifndef __APPLE__
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)
+#endif
+        || pthread_mutex_init(mtx, &attr)) {
+        errx(1, "Couldn't create a process-shared mutex");
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+int
+shm_mutex_lock(pthread_mutex_t* mtx)
+{
+    int ret = pthread_mutex_lock(mtx);
+
+#ifndef __APPLE__ /* which has no robust mutexes */
+    if (ret == EOWNERDEAD) {
+        pdebug(PLCTAG_DEBUG_WARN, "Recovering a lock whose holder died");
+        ret = pthread_mutex_consistent(mtx);
+    }
+#endif
+    return ret;
+}
+
+static void
+shm_sleep_ms(int ms)
+{
+    struct timespec ts = { 0, ms * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+int
+shm_mutex_timedlock(pthread_mutex_t* mtx, int timeout_ms)
+{
+    int ret;
+
+    if (timeout_ms == 0) {
+        ret = pthread_mutex_trylock(mtx);
+    } else {
+#ifdef __APPLE__
+        /* which has no timed locks either */
+        while ((ret = pthread_mutex_trylock(mtx)) == EBUSY && timeout_ms-- > 0) {
+            shm_sleep_ms(1);
+        }
+        if (ret == EBUSY) {
+            ret = ETIMEDOUT;
+        }
+#else
+        struct timespec deadline;
+
+        /* Against the monotonic clock where we can, so that setting the
+         * time doesn't stretch the wait. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 30)
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+        clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 30)
+        ret = pthread_mutex_clocklock(mtx, CLOCK_MONOTONIC, &deadline);
+#else
+        ret = pthread_mutex_timedlock(mtx, &deadline);
+#endif
+#endif
+    }
+
+#ifndef __APPLE__
+    if (ret == EOWNERDEAD) {
+        pdebug(PLCTAG_DEBUG_WARN, "Recovering a lock whose holder died");
+        ret = pthread_mutex_consistent(mtx);
+    }
+#endif
+    return ret;
+}
+
+int
+shm_attach(void)
+{
+    const char* name = getenv("PLCSTUB_SHM_NAME");
+    const char* size_str = getenv("PLCSTUB_SHM_SIZE");
+    size_t size = SHM_DEFAULT_SIZE;
+    struct stat st;
+    int fd, created = 1, waited;
+    void* p;
+
+    if (name == NULL || *name == '\0') {
+        return -1;
+    }
+    if (size_str != NULL) {
+        size = strtoull(size_str, NULL, 0);
+    }
+    if (size < sizeof(struct shm_header)) {
+        size = sizeof(struct shm_header) + SHM_DEFAULT_SIZE;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        err(1, "shm_open(%s)", name);
+    }
+
+    if (created) {
+        if (ftruncate(fd, size)) {
+            err(1, "ftruncate");
+        }
+    } else {
+        /* The creator may not have sized it yet. */
+        for (waited = 0;; waited++) {
+            if (fstat(fd, &st)) {
+                err(1, "fstat");
+            }
+            if ((size_t)(st.st_size) >= sizeof(struct shm_header)) {
+                break;
+            }
+            if (waited == SHM_ATTACH_TIMEOUT_MS) {
+                errx(1, "Timed out waiting for %s to be created", name);
+            }
+            shm_sleep_ms(1);
+        }
+        size = st.st_size;
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        err(1, "mmap");
+    }
+    close(fd);
+
+    if (created) {
+        /* ftruncate() zero-fills, so only the non-zero fields need setting. */
+        struct shm_header* h = p;
+        h->magic = SHM_MAGIC;
+        h->version = SHM_VERSION;
+        h->size = size;
+        h->data_used = (sizeof(struct shm_header) + SHM_DATA_ALIGN - 1) / SHM_DATA_ALIGN * SHM_DATA_ALIGN;
+        shm_mutex_init(&h->mtx);
+        shm = h;
+        pdebug(PLCTAG_DEBUG_DETAIL, "Created shared tag store %s (%zu bytes)", name, size);
+        return 1;
+    }
+
+    shm = p;
+    for (waited = 0; !__atomic_load_n(&shm->ready, __ATOMIC_ACQUIRE); waited++) {
+        if (waited == SHM_ATTACH_TIMEOUT_MS) {
+            errx(1, "Timed out waiting for %s to be initialised", name);
+        }
+        shm_sleep_ms(1);
+    }
+    if (shm->magic != SHM_MAGIC || shm->version != SHM_VERSION) {
+        errx(1, "%s is not a version %d plcstub tag store", name, SHM_VERSION);
+    }
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Attached to shared tag store %s (%d tags)", name, shm->tag_cnt);
+    return 0;
+}
+
+void
+shm_ready(void)
+{
+    __atomic_store_n(&shm->ready, 1, __ATOMIC_RELEASE);
+}
+
+bool
+shm_enabled(void)
+{
+    return shm != NULL;
+}
+
+int
+shm_tag_create(const char* name, type_t type, size_t len)
+{
+    uint8_t enc[SHM_TYPE_MAX];
+    struct shm_tag *tag, *reuse = NULL;
+    uint64_t off;
+    int enc_len, i, cnt;
+
+    if (strlen(name) >= SHM_NAME_MAX) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag name %s is too long for the shared store", name);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+    enc_len = type_encode(type, enc, sizeof(enc));
+    if (enc_len < 0) {
+        pdebug(PLCTAG_DEBUG_WARN, "Type of %s is too complex for the shared store", name);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    if (shm_mutex_lock(&shm->mtx)) {
+        errx(1, "shm_mutex_lock");
+    }
+
+    /* Another process may have created it already, or it may have been
+     * destroyed, leaving an entry to reuse.  Names ignore case, as they do
+     * in the catalog. */
+    cnt = shm->tag_cnt;
+    for (i = 0; i < cnt; i++) {
+        tag = &shm->tags[i];
+        if (strcasecmp(tag->name, name) != 0 || tag->type_len != enc_len || memcmp(tag->type, enc, enc_len) != 0) {
+            continue;
+        }
+        if (!__atomic_load_n(&tag->dead, __ATOMIC_RELAXED)) {
+            tag->users++;
+            pthread_mutex_unlock(&shm->mtx);
+            return i;
+        }
+        if (reuse == NULL && tag->data_len == len) {
+            reuse = tag;
+        }
+    }
+
+    if (reuse != NULL) {
+        strcpy(reuse->name, name);
+        reuse->users = 1;
+        memset(shm_tag_data(reuse), 0x42, len);
+        type_init_data(type, shm_tag_data(reuse));
+        __atomic_store_n(&reuse->dead, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->revive_cnt, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&shm->mtx);
+        return reuse - shm->tags;
+    }
+
+    off = shm->data_used;
+    if (cnt == SHM_MAX_TAGS || off + len > shm->size) {
+        pthread_mutex_unlock(&shm->mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "The shared tag store is full");
+        return PLCTAG_ERR_NO_RESOURCES;
+    }
+    shm->data_used = (off + len + SHM_DATA_ALIGN - 1) / SHM_DATA_ALIGN * SHM_DATA_ALIGN;
+
+    tag = &shm->tags[cnt];
+    strcpy(tag->name, name);
+    memcpy(tag->type, enc, enc_len);
+    tag->type_len = enc_len;
+    tag->dead = 0;
+    tag->users = 1;
+    tag->data_off = off;
+    tag->data_len = len;
+    shm_mutex_init(&tag->mtx);
+    memset(shm_tag_data(tag), 0x42, len);
+    type_init_data(type, shm_tag_data(tag));
+
+    /* Publish the entry to lock-free readers. */
+    __atomic_store_n(&shm->tag_cnt, cnt + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&shm->mtx);
+
+    return cnt;
+}
+
+int
+shm_tag_count(void)
+{
+    return __atomic_load_n(&shm->tag_cnt, __ATOMIC_ACQUIRE);
+}
+
+struct shm_tag*
+shm_tag_get(int idx)
+{
+    if (idx < 0 || idx >= shm_tag_count()) {
+        return NULL;
+    }
+    return &shm->tags[idx];
+}
+
+char*
+shm_tag_data(struct shm_tag* tag)
+{
+    return (char*)(shm) + tag->data_off;
+}
+
+bool
+shm_tag_open(int idx)
+{
+    struct shm_tag* tag = shm_tag_get(idx);
+    bool ret;
+
+    if (shm_mutex_lock(&shm->mtx)) {
+        errx(1, "shm_mutex_lock");
+    }
+    ret = !__atomic_load_n(&tag->dead, __ATOMIC_RELAXED);
+    if (ret) {
+        tag->users++;
+    }
+    pthread_mutex_unlock(&shm->mtx);
+
+    return ret;
+}
+
+void
+shm_tag_close(int idx)
+{
+    struct shm_tag* tag = shm_tag_get(idx);
+
+    if (shm_mutex_lock(&shm->mtx)) {
+        errx(1, "shm_mutex_lock");
+    }
+    if (--tag->users == 0) {
+        __atomic_store_n(&tag->dead, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->kill_cnt, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shm->mtx);
+}
+
+int
+shm_tag_kill_count(void)
+{
+    return __atomic_load_n(&shm->kill_cnt, __ATOMIC_ACQUIRE);
+}
+
+int
+shm_tag_revive_count(void)
+{
+    return __atomic_load_n(&shm->revive_cnt, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,101 @@
+/* stats.c
+ *
+ * Global runtime counters.
+ *
+ * Counters are striped across cache-line-sized slots, and each thread is
+ * handed its own slot the first time it bumps a counter.  Increments therefore
+ * never bounce a cache line between threads (unless we have more threads than
+ * stripes, in which case a few of them share); reading a counter sums over
+ * every stripe.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mem.h"
+#include "stats.h"
+
+#define STATS_STRIPES 64
+
+struct stats_stripe {
+    uint64_t counters[STAT_COUNT];
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct stats_stripe stripes[STATS_STRIPES];
+static unsigned next_stripe = 0;
+static __thread struct stats_stripe* my_stripe = NULL;
+
+static const char* stat_names[STAT_COUNT] = {
+    [STAT_READS] = "reads",
+    [STAT_WRITES] = "writes",
+    [STAT_GETS] = "gets",
+    [STAT_SETS] = "sets",
+    [STAT_CALLBACKS] = "callbacks",
+    [STAT_CREATES] = "creates",
+    [STAT_DESTROYS] = "destroys",
+    [STAT_METATAG_REBUILDS] = "metatag_rebuilds",
+    [STAT_ATTRIB_CACHE_HITS] = "attrib_cache_hits",
+    [STAT_ATTRIB_CACHE_MISSES] = "attrib_cache_misses",
+    [STAT_HANDLE_CACHE_HITS] = "handle_cache_hits",
+    [STAT_HANDLE_CACHE_MISSES] = "handle_cache_misses",
+    [STAT_EVENT_BATCHES] = "event_batches",
+    [STAT_LOCK_TIMEOUTS] = "lock_timeouts",
+    [STAT_EVENTS_DROPPED] = "events_dropped",
+};
+
+static struct stats_stripe*
+stats_my_stripe(void)
+{
+    if (my_stripe == NULL) {
+        unsigned i = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED);
+        my_stripe = &stripes[i % STATS_STRIPES];
+    }
+    return my_stripe;
+}
+
+void
+stats_inc(enum stat_e s)
+{
+    /* Relaxed, since stripes can be shared once threads outnumber them. */
+    __atomic_add_fetch(&stats_my_stripe()->counters[s], 1, __ATOMIC_RELAXED);
+}
+
+unsigned
+stats_stripe(void)
+{
+    return stats_my_stripe() - stripes;
+}
+
+uint64_t
+stats_get(enum stat_e s)
+{
+    int i;
+    uint64_t sum = 0;
+
+    for (i = 0; i < STATS_STRIPES; i++) {
+        sum += __atomic_load_n(&stripes[i].counters[s], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+const char*
+stats_name(enum stat_e s)
+{
+    if (s < 0 || s >= STAT_COUNT) {
+        return "???";
+    }
+    return stat_names[s];
+}
+
+int
+stats_lookup(const char* name)
+{
+    int i;
+
+    for (i = 0; i < STAT_COUNT; i++) {
+        if (strcmp(name, stat_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
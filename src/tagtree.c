@@ -1,6 +1,6 @@
 /* tagtree.c
- * 
- * Manages the red-black tree of tags.
+ *
+ * Manages the table of tag handles, and the tags they refer to.
  * author: ntaylor
  */
 
@@ -8,106 +8,666 @@
 #define __uintptr_t uintptr_t
 #endif
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#ifdef DEBUG
+#include <sys/mman.h>
+#endif
 
 #include "debug.h"
 #include "libplctag.h"
 #include "lock_utils.h"
+#include "mem.h"
 #include "plcstub.h"
+#include "shm.h"
 #include "tagtree.h"
 
-/* 
- * Ensures mutual exclusion on the tag tree and metatag. Does not ensure mutual
- * exclusion on individual tags in the tree, however! *
- */
-static pthread_rwlock_t tag_tree_mtx = PTHREAD_RWLOCK_INITIALIZER;
-
-/* Tag storage and lookup. */
+/* The catalog is split into shards, so that threads working on different tags
+ * don't contend on one lock.  A tag belongs to the shard its name hashes to;
+ * a handle's slot to the shard its index falls in.
+ *
+ * Locks are taken in this order: metatag_mtx, shm_sync_mtx, a shard's
+ * names_mtx, a shard's slots_mtx, and lastly tags' own locks.  Only one
+ * shard's lock of each kind is held at a time, except by those reading the
+ * whole catalog, who take them all in shard order. */
+#define TAG_SHARDS 16
+
+/* A slot in the handle table.  Slot i lives at position i / TAG_SHARDS in
+ * shard i % TAG_SHARDS; each shard chains its free slots, by index, through
+ * next_free, most recently freed first.  Slot 0 is never used, so that 0 can
+ * end the chain, and neither is METATAG_ID's. */
+struct tag_slot {
+    struct tag_handle* h; /* NULL if the slot is free */
+    uint32_t gen; /* of the handle in the slot, or of the next one */
+    uint32_t next_free;
+};
+
+struct tag_shard {
+    /* Guards the shard's tags by name, a chained hash table doubled whenever
+     * it fills up, along with the tags' handle lists, refs and tag_ids.  The
+     * same tags are kept in order of name for tag_tree_find(), which merges
+     * the shards' orders. */
+    pthread_rwlock_t names_mtx;
+    struct tag_tree_node** names;
+    size_t name_buckets; /* a power of two */
+    size_t name_count;
+    struct name_index name_index;
+
+    /* Guards the shard's slots. */
+    pthread_rwlock_t slots_mtx;
+    struct tag_slot* slots;
+    uint32_t slot_cap;
+    uint32_t free_slot;
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct tag_shard shards[TAG_SHARDS];
+
+static uint32_t next_slot = 0; /* the lowest slot never handed out */
+static uint32_t free_slots = 0; /* on the shards' free lists, all told */
+
+/* Bumped, with the names_mtx of the shard concerned held for writing, whenever
+ * a tag comes or goes or is listed under another handle. */
+static uint32_t catalog_gen = 0;
+
+/* The "@tags" and "@stats" pseudo-tags.  Their handles never live in the
+ * table; tag_tree_handle() hands them out directly.  The metatag's node is
+ * rebuilt, under metatag_mtx, once catalog_gen moves on from metatag_gen, but
+ * only while nobody can be using it: metatag_pins counts the callers of
+ * tag_tree_handle() yet to call tag_tree_release(), and a locked node is kept
+ * for its holder.  Until then, metatag_stale is set. */
+static pthread_mutex_t metatag_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t metatag_gen = 0;
+static unsigned metatag_pins = 0;
+static bool metatag_stale = false;
+static struct tag_handle metahandle = { .id = METATAG_ID };
+static struct tag_handle statshandle = { .id = STATSTAG_ID };
+static struct tag_tree_node* statstag = NULL;
+
+/* The "@udt/<id>" pseudo-tags, made by the first tag_tree_insert() of each,
+ * under metatag_mtx, and then kept for good, along with a reference to their
+ * type, so that the UDT ID stays the type's. */
+struct udt_tag {
+    struct tag_handle h;
+    type_t type;
+};
+static struct udt_tag* udttags[TYPE_UDT_ID_MAX + 1];
+
+/* Serialises catching up with the shared store, and creating tags in it. */
+static pthread_mutex_t shm_sync_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each thread keeps the handles it has looked up lately, by ID, so that the
+ * accessors needn't touch the catalog for the tags a control loop polls.
+ * Entries only hold while no handle has been freed since they were filled:
+ * handle_epoch is bumped as a handle is taken out of its slot, under the
+ * slot's lock, before it is freed. */
+#define HANDLE_CACHE_SLOTS 64
+
+struct handle_cache_slot {
+    int32_t id; /* 0 if the slot is empty */
+    uint32_t epoch;
+    struct tag_handle* h;
+    struct tag_tree_node* tag;
+};
 
-RB_HEAD(tag_tree_t, tag_tree_node)
-tag_tree = RB_INITIALIZER(&tag_tree);
-static size_t tree_size = 0;
+static __thread struct handle_cache_slot handle_cache[HANDLE_CACHE_SLOTS];
+static uint32_t handle_epoch __attribute__((aligned(CACHE_LINE))) = 0;
 
+static void
+tag_tree_init();
 static int
-tagcmp(struct tag_tree_node* lhs, struct tag_tree_node* rhs);
+tag_tree_create(const char*, type_t, int, int, struct tag_tree_node**);
+static void
+tag_tree_node_destroy();
+static void
+tag_tree_define_array(const char*, enum tag_type_e, uint32_t[3]);
+static struct tag_tree_node*
+tag_tree_statsnode_create();
+static struct tag_tree_node*
+tag_tree_shm_import(struct tag_shard*, int, int*);
+static void
+tag_tree_shm_sync();
+
+static bool
+tag_tree_node_dead(struct tag_tree_node* tag)
+{
+    return tag->shm && __atomic_load_n(&tag->shm->dead, __ATOMIC_ACQUIRE);
+}
 
-RB_PROTOTYPE(tag_tree_t, tag_tree_node, rb_entry, tagcmp);
-RB_GENERATE(tag_tree_t, tag_tree_node, rb_entry, tagcmp);
+/* Counts a handle on a shared tag as in use by this process, and so the
+ * process as one of the store's users of the tag if it is its first.  Returns
+ * false, for non-shared tags true, if another process has just destroyed it.
+ * The tag's shard's names_mtx must be held for writing by the caller. */
+static bool
+tag_tree_shm_open(struct tag_tree_node* tag)
+{
+    if (tag->shm == NULL) {
+        return true;
+    }
+    if (tag->shm_opens == 0 && !shm_tag_open(tag->shm - shm_tag_get(0))) {
+        return false;
+    }
+    tag->shm_opens++;
+    return true;
+}
 
+/* Undoes tag_tree_shm_open(), destroying the tag in the store once no process
+ * uses it any more. */
 static void
-tag_tree_init();
-static struct tag_tree_node*
-tag_tree_node_create(const char*, type_t);
+tag_tree_shm_close(struct tag_tree_node* tag)
+{
+    if (tag->shm != NULL && --tag->shm_opens == 0) {
+        shm_tag_close(tag->shm - shm_tag_get(0));
+    }
+}
+
+/* Whether a handle is the one a tag is listed under. */
+static bool
+tag_tree_handle_primary(struct tag_handle* h)
+{
+    return h->id == h->tag->tag_id;
+}
+
+static uint32_t
+tag_tree_name_hash(const char* name)
+{
+    uint32_t h = 2166136261u; /* FNV-1a, folding case */
+
+    for (; *name; name++) {
+        h = (h ^ (uint8_t)(tolower((unsigned char)(*name)))) * 16777619u;
+    }
+    return h;
+}
+
+/* The shard of a tag with the given name hash.  The rest of the hash picks
+ * the bucket within it. */
+static struct tag_shard*
+tag_tree_name_shard(uint32_t hash)
+{
+    return &shards[hash % TAG_SHARDS];
+}
+
+#define NAME_BUCKET(s, hash) (((hash) / TAG_SHARDS) & ((s)->name_buckets - 1))
+
+static struct tag_shard*
+tag_tree_slot_shard(uint32_t idx)
+{
+    return &shards[idx % TAG_SHARDS];
+}
+
+/* Read-locks every shard's names, for a consistent view of the catalog. */
 static void
-tag_tree_node_destroy();
+tag_tree_names_rdlock_all()
+{
+    int i;
 
-/* Compares two tag structures by ID. */
+    for (i = 0; i < TAG_SHARDS; i++) {
+        RW_RDLOCK(&shards[i].names_mtx);
+    }
+}
+
+static void
+tag_tree_names_unlock_all()
+{
+    int i;
+
+    for (i = TAG_SHARDS - 1; i >= 0; i--) {
+        RW_UNLOCK(&shards[i].names_mtx);
+    }
+}
+
+/* The shard's names_mtx must be held for writing by the caller of these. */
+
+/* Makes room in the shard's name table for another tag, returning false if
+ * there is no memory for it. */
+static bool
+tag_tree_names_reserve(struct tag_shard* s)
+{
+    struct tag_tree_node **table, *t, *next, **old = s->names;
+    size_t i, n = s->name_buckets, cap = n ? n * 2 : 16;
+
+    if (s->name_count < n) {
+        return true;
+    }
+    if (!mem_charge(MEM_NAMES, (cap - n) * sizeof(*table))) {
+        return false;
+    }
+    table = calloc(cap, sizeof(*table));
+    if (table == NULL) {
+        mem_account(MEM_NAMES, -(int64_t)((cap - n) * sizeof(*table)));
+        return false;
+    }
+
+    s->name_buckets = cap;
+    for (i = 0; i < n; i++) {
+        for (t = old[i]; t != NULL; t = next) {
+            next = t->name_next;
+            t->name_next = table[NAME_BUCKET(s, t->name_hash)];
+            table[NAME_BUCKET(s, t->name_hash)] = t;
+        }
+    }
+    free(old);
+    s->names = table;
+    return true;
+}
+
+/* Room must have been made with tag_tree_names_reserve(). */
+static void
+tag_tree_name_insert(struct tag_shard* s, struct tag_tree_node* tag)
+{
+    tag->name_next = s->names[NAME_BUCKET(s, tag->name_hash)];
+    s->names[NAME_BUCKET(s, tag->name_hash)] = tag;
+    s->name_count++;
+
+    tag->name_idx.name = tag->name;
+    name_index_insert(&s->name_index, &tag->name_idx);
+}
+
+static void
+tag_tree_name_remove(struct tag_shard* s, struct tag_tree_node* tag)
+{
+    struct tag_tree_node** p = &s->names[NAME_BUCKET(s, tag->name_hash)];
+
+    while (*p != tag) {
+        p = &(*p)->name_next;
+    }
+    *p = tag->name_next;
+    s->name_count--;
+    name_index_remove(&s->name_index, &tag->name_idx);
+}
+
+/* Finds the live tag with the given name, ignoring case.  The name's shard's
+ * names_mtx must be held by the caller. */
+static struct tag_tree_node*
+tag_tree_name_find(struct tag_shard* s, const char* name, uint32_t hash)
+{
+    struct tag_tree_node* tag;
+
+    if (s->name_count == 0) {
+        return NULL;
+    }
+    for (tag = s->names[NAME_BUCKET(s, hash)]; tag != NULL; tag = tag->name_next) {
+        if (tag->name_hash == hash && strcasecmp(tag->name, name) == 0 && !tag_tree_node_dead(tag)) {
+            return tag;
+        }
+    }
+    return NULL;
+}
+
+/* Puts a handle in the given slot, making room for it in the slot's shard,
+ * whose slots_mtx must be held for writing by the caller.  New slots are
+ * free, and of generation 0.  Returns false if there is no memory for
+ * them. */
+static bool
+tag_tree_slot_fill(struct tag_shard* s, uint32_t idx, struct tag_handle* h)
+{
+    uint32_t cap, pos = idx / TAG_SHARDS;
+    struct tag_slot* slots;
+
+    if (pos >= s->slot_cap) {
+        for (cap = s->slot_cap ? s->slot_cap : 64; cap <= pos; cap *= 2)
+            ;
+        if (!mem_charge(MEM_CATALOG, (cap - s->slot_cap) * sizeof(*s->slots))) {
+            return false;
+        }
+        slots = realloc(s->slots, cap * sizeof(*s->slots));
+        if (slots == NULL) {
+            mem_account(MEM_CATALOG, -(int64_t)((cap - s->slot_cap) * sizeof(*s->slots)));
+            return false;
+        }
+        memset(slots + s->slot_cap, 0, (cap - s->slot_cap) * sizeof(*s->slots));
+        s->slots = slots;
+        s->slot_cap = cap;
+    }
+
+    h->id = TAG_ID(s->slots[pos].gen, idx);
+    s->slots[pos].h = h;
+    return true;
+}
+
+/* Finds the handle with the given ID, turning away IDs whose slot has been
+ * freed since.  The slot's shard's slots_mtx must be held by the caller. */
+static struct tag_handle*
+tag_tree_slot_find(int32_t id)
+{
+    struct tag_shard* s = tag_tree_slot_shard(TAG_ID_INDEX(id));
+    struct tag_slot* slot;
+
+    if (id <= 0 || TAG_ID_INDEX(id) / TAG_SHARDS >= s->slot_cap) {
+        return NULL;
+    }
+    slot = &s->slots[TAG_ID_INDEX(id) / TAG_SHARDS];
+    if (slot->h == NULL || slot->gen != TAG_ID_GEN(id)) {
+        return NULL;
+    }
+    return slot->h;
+}
+
+/* As tag_tree_slot_find(), taking the lock.  The tag, which is stored in
+ * *tag unless tag is NULL, may be destroyed as soon as the lock is dropped,
+ * except by those holding its shard's names_mtx. */
+static struct tag_handle*
+tag_tree_slot_get(int32_t id, struct tag_tree_node** tag)
+{
+    struct tag_shard* s = tag_tree_slot_shard(TAG_ID_INDEX(id));
+    struct tag_handle* h;
+
+    RW_RDLOCK(&s->slots_mtx);
+    h = tag_tree_slot_find(id);
+    if (tag != NULL) {
+        *tag = h != NULL ? h->tag : NULL;
+    }
+    RW_UNLOCK(&s->slots_mtx);
+
+    return h;
+}
+
+/* Creates a handle on a tag, in the given slot, or in a free one if idx is 0:
+ * preferably one from the tag's own shard, then from any other, then a new
+ * one.  Returns NULL, with *status set, if there are no free slots or no
+ * memory left.  The tag's shard's names_mtx must be held for writing by the
+ * caller. */
+static struct tag_handle*
+tag_tree_handle_alloc(struct tag_tree_node* tag, uint32_t idx, int* status)
+{
+    struct tag_handle* h;
+    struct tag_shard* s;
+    uint32_t next;
+    bool filled;
+    int i;
+
+    h = mem_alloc(MEM_CATALOG, sizeof(*h));
+    if (h == NULL) {
+        *status = PLCTAG_ERR_NO_MEM;
+        return NULL;
+    }
+    memset(h, 0, sizeof(*h));
+    h->tag = tag;
+
+    if (idx != 0) {
+        /* The shared store's tags have slots set aside for them. */
+        s = tag_tree_slot_shard(idx);
+        RW_WRLOCK(&s->slots_mtx);
+        filled = tag_tree_slot_fill(s, idx, h);
+        RW_UNLOCK(&s->slots_mtx);
+        if (!filled) {
+            mem_free(MEM_CATALOG, h, sizeof(*h));
+            *status = PLCTAG_ERR_NO_MEM;
+            return NULL;
+        }
+    }
+
+    for (i = 0; idx == 0 && i < TAG_SHARDS && __atomic_load_n(&free_slots, __ATOMIC_RELAXED) > 0; i++) {
+        s = tag_tree_slot_shard(tag->name_hash + i);
+        RW_WRLOCK(&s->slots_mtx);
+        if (s->free_slot != 0) {
+            idx = s->free_slot;
+            s->free_slot = s->slots[idx / TAG_SHARDS].next_free;
+            __atomic_sub_fetch(&free_slots, 1, __ATOMIC_RELAXED);
+            tag_tree_slot_fill(s, idx, h);
+        }
+        RW_UNLOCK(&s->slots_mtx);
+    }
+
+    if (idx == 0) {
+        idx = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+        if (idx >= UDTTAG_ID_BASE) {
+            pdebug(PLCTAG_DEBUG_WARN, "Out of tag IDs");
+            __atomic_store_n(&next_slot, UDTTAG_ID_BASE, __ATOMIC_RELAXED);
+            mem_free(MEM_CATALOG, h, sizeof(*h));
+            *status = PLCTAG_ERR_NO_RESOURCES;
+            return NULL;
+        }
+        s = tag_tree_slot_shard(idx);
+        RW_WRLOCK(&s->slots_mtx);
+        filled = tag_tree_slot_fill(s, idx, h);
+        RW_UNLOCK(&s->slots_mtx);
+        if (!filled) {
+            /* Give the index back if nobody has taken one since; otherwise
+             * it is lost, as its slot couldn't be made. */
+            next = idx + 1;
+            __atomic_compare_exchange_n(&next_slot, &next, idx, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            mem_free(MEM_CATALOG, h, sizeof(*h));
+            *status = PLCTAG_ERR_NO_MEM;
+            return NULL;
+        }
+    }
+
+    h->next = tag->handles;
+    tag->handles = h;
+    tag->refs++;
+
+    return h;
+}
+
+void
+tag_subscribers_free(struct tag_subscribers* subs)
+{
+    struct tag_subscribers* next;
+
+    for (; subs != NULL; subs = next) {
+        next = subs->next_retired;
+        mem_free(MEM_CATALOG, subs, sizeof(*subs) + subs->n * sizeof(subs->subs[0]));
+    }
+}
+
+/* Frees a handle and its slot, returning how many handles are left on its
+ * tag.  If the tag was listed under the handle, it is listed under another.
+ * The tag's shard's names_mtx must be held for writing by the caller. */
 static int
-tagcmp(struct tag_tree_node* lhs, struct tag_tree_node* rhs)
+tag_tree_handle_free(struct tag_handle* h)
 {
-    return (lhs->tag_id < rhs->tag_id ? -1 : (lhs->tag_id > rhs->tag_id));
+    struct tag_tree_node* tag = h->tag;
+    struct tag_handle** p;
+    uint32_t idx = TAG_ID_INDEX(h->id);
+    struct tag_shard* s = tag_tree_slot_shard(idx);
+    struct tag_slot* slot;
+
+    for (p = &tag->handles; *p != h; p = &(*p)->next)
+        ;
+    *p = h->next;
+    tag->refs--;
+
+    RW_WRLOCK(&s->slots_mtx);
+    slot = &s->slots[idx / TAG_SHARDS];
+    slot->h = NULL;
+    /* Only once the handle can't be found any more, so that a lookup that
+     * still found it read the old epoch. */
+    __atomic_add_fetch(&handle_epoch, 1, __ATOMIC_RELEASE);
+    /* The shared store's tags keep their slots, and IDs, for when the tag is
+     * attached to again. */
+    if (!shm_enabled() || idx >= SHM_TAG_ID(SHM_MAX_TAGS)) {
+        slot->gen = (slot->gen + 1) & TAG_ID_GEN_MASK;
+        slot->next_free = s->free_slot;
+        s->free_slot = idx;
+        __atomic_add_fetch(&free_slots, 1, __ATOMIC_RELAXED);
+    }
+    /* Under the slot's lock, for tag_tree_foreach(). */
+    if (tag->tag_id == h->id && tag->handles != NULL) {
+        __atomic_store_n(&tag->tag_id, tag->handles->id, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&catalog_gen, 1, __ATOMIC_RELEASE);
+    }
+    RW_UNLOCK(&s->slots_mtx);
+
+    tag_subscribers_free(h->subs);
+    tag_subscribers_free(h->retired);
+    mem_free(MEM_CATALOG, h, sizeof(*h));
+
+    return tag->refs;
 }
 
 /* invoked the first time the user of the library tries to do anything
  * with the the PLC.
- * 
- * Assumes that tag_tree_mtx is NOT held.
  */
 static void
 tag_tree_init()
 {
     static bool tag_tree_inited = false; /* Have we called tag_tree_init() yet? */
+    static pthread_mutex_t tag_tree_init_mtx = PTHREAD_MUTEX_INITIALIZER;
+    int shm_created, i;
 
     /* Check to see if we've inited.  If so, nothing to do. */
-    RW_RDLOCK(&tag_tree_mtx);
-
-    if (tag_tree_inited) {
-        RW_UNLOCK(&tag_tree_mtx);
+    if (__atomic_load_n(&tag_tree_inited, __ATOMIC_ACQUIRE)) {
         return;
     }
 
-    /* Upgrade to a writer lock and initialise. */
-    RW_UNLOCK(&tag_tree_mtx);
-    RW_WRLOCK(&tag_tree_mtx);
+    MTX_LOCK(&tag_tree_init_mtx);
 
     /* Did somebody beat us to initing? If so, lucky us. */
     if (tag_tree_inited) {
-        RW_UNLOCK(&tag_tree_mtx);
+        MTX_UNLOCK(&tag_tree_init_mtx);
         return;
     }
-    tag_tree_inited = true;
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Initing");
 
+    mem_init();
+
+    for (i = 0; i < TAG_SHARDS; i++) {
+        if (pthread_rwlock_init(&shards[i].names_mtx, NULL) || pthread_rwlock_init(&shards[i].slots_mtx, NULL)) {
+            err(1, "pthread_rwlock_init");
+        }
+    }
+
+    /* With a shared store, only the process that creates it defines the
+     * built-in tags; the others pick them up from it. */
+    shm_created = shm_attach();
+
+    /* With a shared store, the slots up to SHM_TAG_ID(SHM_MAX_TAGS) are kept
+     * for the tags in its catalog, so that they have the same IDs in every
+     * process. */
+    next_slot = shm_enabled() ? SHM_TAG_ID(SHM_MAX_TAGS) : METATAG_ID + 1;
+
+    if (shm_created != 0) {
 /* TODO: these should likely be functions. */
-#define DEFINE_SCALAR(name, type, val)                           \
-    do {                                                         \
-        struct tag_tree_node* tag;                               \
-        tag = tag_tree_node_create(name, type_new_simple(type)); \
-        *tag->data = val;                                        \
-        MTX_UNLOCK(&tag->mtx);                                   \
+#define DEFINE_SCALAR(name, type, val)                                             \
+    do {                                                                           \
+        struct tag_tree_node* tag;                                                 \
+        int status = tag_tree_create(name, type_new_simple(type), -1, -1, &tag);   \
+        if (tag == NULL) {                                                         \
+            errx(1, "Couldn't create %s: %s", name, plc_tag_decode_error(status)); \
+        }                                                                          \
+        *tag->data = val;                                                          \
+        TAG_UNLOCK(tag);                                                           \
     } while (0);
-#define DEFINE_ARRAY(name, element_type, size, val) err(1, "DEFINE_ARRAY: not implemented yet");
+#define DEFINE_ARRAY(name, element_type, ...) \
+    tag_tree_define_array(name, element_type, (uint32_t[3]) { __VA_ARGS__ });
 #include "tags.inc"
 #undef DEFINE_SCALAR
+#undef DEFINE_ARRAY
+    }
+    if (shm_created == 1) {
+        shm_ready();
+    }
+    if (shm_enabled()) {
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+        MTX_UNLOCK(&shm_sync_mtx);
+    }
+
+    statstag = tag_tree_statsnode_create();
+    statshandle.tag = statstag;
+
+    __atomic_store_n(&tag_tree_inited, true, __ATOMIC_RELEASE);
+    MTX_UNLOCK(&tag_tree_init_mtx);
+}
+
+/* Creates a zero-filled array tag of up to three dimensions, outermost first;
+ * unused dimensions are 0. */
+static void
+tag_tree_define_array(const char* name, enum tag_type_e element_type, uint32_t dims[3])
+{
+    struct tag_tree_node* tag;
+    type_t type, outer;
+    int i, status;
+
+    type = type_new_simple(element_type);
+    for (i = 2; i >= 0; i--) {
+        if (dims[i] == 0) {
+            continue;
+        }
+        outer = type_new_array(dims[i], type);
+        type_free(type);
+        type = outer;
+    }
+
+    status = tag_tree_create(name, type, -1, -1, &tag);
+    if (tag == NULL) {
+        errx(1, "Couldn't create %s: %s", name, plc_tag_decode_error(status));
+    }
+    memset(tag->data, 0, tag->data_len);
+    TAG_UNLOCK(tag);
+
+    type_free(type);
+}
+
+/* Allocates a node for a tag and inserts it, with a handle on it in the given
+ * slot (see tag_tree_handle_alloc()), into its shard, s.  Returns NULL, with
+ * *status set, if there is no slot or no memory for it.  s's names_mtx must
+ * be held for writing by the caller. */
+static struct tag_tree_node*
+tag_tree_node_alloc(struct tag_shard* s, uint32_t idx, const char* name, uint32_t hash, type_t type, int* status)
+{
+    struct tag_tree_node* tag;
+    struct tag_handle* h;
+
+    tag = mem_alloc_aligned(MEM_TAGS, sizeof(struct tag_tree_node));
+    if (tag == NULL) {
+        *status = PLCTAG_ERR_NO_MEM;
+        return NULL;
+    }
+    memset(tag, 0, sizeof(struct tag_tree_node));
+
+    if (pthread_mutex_init(&tag->mtx, NULL)) {
+        err(1, "pthread_mutex_init");
+    }
+    tag->mtxp = &tag->mtx;
+
+    tag->name_hash = hash;
+    tag->type = type_dup(type);
 
-    RW_UNLOCK(&tag_tree_mtx);
+    tag->name = mem_strdup(MEM_NAMES, name);
+    if (!tag->name || !tag_tree_names_reserve(s)) {
+        tag_tree_node_destroy(tag);
+        *status = PLCTAG_ERR_NO_MEM;
+        return NULL;
+    }
+
+    h = tag_tree_handle_alloc(tag, idx, status);
+    if (h == NULL) {
+        tag_tree_node_destroy(tag);
+        return NULL;
+    }
+    tag->tag_id = h->id;
+    tag_tree_name_insert(s, tag);
+    __atomic_add_fetch(&catalog_gen, 1, __ATOMIC_RELEASE);
+
+    return tag;
 }
 
-/* Allocates and initialises a fresh tag  In order to ensure no tags
- * are duplicated, tag_tree_mtx must already be held by the caller. 
- * The node that is returned is inserted into the tree BUT has its
- * mutex held.  The caller will populate its fields and unlock it
- * when it is ready to be visible. */
+/* Allocates and initialises a fresh tag.  In order to ensure no tags
+ * are duplicated, the names_mtx of its shard, s, must already be held
+ * for writing by the caller.  The node that is returned is inserted
+ * into the catalog BUT has its mutex held.  The caller will populate
+ * its fields and unlock it when it is ready to be visible.
+ *
+ * With a shared store, the tag is created there (or, if another process
+ * already created an identical one, reused) and its ID is derived from its
+ * place in the store's catalog, so that it is the same in every process.
+ * shm_sync_mtx must be held by the caller too.  Returns NULL, with *status
+ * set, if the store can't take the tag. */
 static struct tag_tree_node*
-tag_tree_node_create(const char* name, type_t type)
+tag_tree_node_create(struct tag_shard* s, const char* name, uint32_t hash, type_t type, int* status)
 {
-    struct tag_tree_node *tag, *metatag, find;
+    struct tag_tree_node* tag;
+    struct tag_handle* h;
+    char* data;
     size_t sz;
     int id;
 
@@ -118,83 +678,348 @@ tag_tree_node_create(const char* name, type_t type)
         sz = sizeof(uintptr_t);
     }
 
-    /* TODO: special case for the empty tree?. */
-    tag = RB_MAX(tag_tree_t, &tag_tree);
-    if (tag == NULL) {
-        id = METATAG_ID + 1;
-    } else {
-        id = tag->tag_id + 1;
+    if (shm_enabled()) {
+        id = shm_tag_create(name, type, sz);
+        if (id < 0) {
+            *status = id;
+            return NULL;
+        }
+        h = tag_tree_slot_get(SHM_TAG_ID(id), &tag);
+        if (h == NULL) {
+            tag = tag_tree_shm_import(s, id, status);
+            h = tag != NULL ? tag->handles : NULL;
+        }
+        if (tag == NULL) {
+            shm_tag_close(id);
+            return NULL;
+        }
+        /* shm_tag_create() has counted this process as one of the tag's
+         * users, which it may have been already. */
+        if (tag->shm_opens > 0) {
+            shm_tag_close(id);
+        }
+        if (!h->shm_open) {
+            h->shm_open = true;
+            tag->shm_opens++;
+        }
+        stats_inc(STAT_CREATES);
+        TAG_LOCK(tag);
+        return tag;
     }
 
-    tag = malloc(sizeof(struct tag_tree_node));
-    if (tag == NULL) {
-        err(1, "malloc");
+    /* Get the data first, since the node can't be taken back out of the
+     * catalog quietly once it is in. */
+    data = mem_alloc_aligned(MEM_TAGS, sz);
+    if (data == NULL) {
+        *status = PLCTAG_ERR_NO_MEM;
+        return NULL;
     }
-    memset(tag, 0, sizeof(struct tag_tree_node));
 
-    if (pthread_mutex_init(&tag->mtx, NULL)) {
-        err(1, "pthread_mutex_init");
+    tag = tag_tree_node_alloc(s, 0, name, hash, type, status);
+    if (tag == NULL) {
+        mem_free(MEM_TAGS, data, sz);
+        return NULL;
     }
 
-    tag->name = strdup(name);
-    if (!tag->name) {
-        errx(1, "strdup");
+    tag->data = data;
+    memset(tag->data, 0x42, sz);
+    type_init_data(type, tag->data);
+    tag->data_len = sz;
+
+    stats_inc(STAT_CREATES);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Created new tag %d (%s)", tag->tag_id, name);
+
+    TAG_LOCK(tag);
+    return tag;
+}
+
+/* Whether an existing tag of type `have` will do for a create that asked for
+ * `want`.  It must be exactly that type, unless elem_size and elem_count are
+ * the attributes `want` was built from (0 for those not given, which any tag
+ * agrees with), in which case it need only agree with them. */
+static bool
+tag_tree_type_fits(type_t have, type_t want, int elem_size, int elem_count)
+{
+    if (have == want) {
+        return true;
+    }
+    if (elem_size < 0 || elem_count < 0) {
+        return false;
     }
+    return (elem_size == 0 || (uint32_t)(elem_size) == type_elem_size(have))
+        && (elem_count == 0 || (uint32_t)(elem_count) == type_elem_count(have));
+}
 
-    tag->type = type_dup(type);
-    if (!tag->type) {
-        err(1, "type_dup");
+/* Creates a handle on the tag with the given name, creating the tag if there
+ * isn't one, and returns its ID or a PLCTAG_ERR_* code.  An existing tag is
+ * only attached to if its type fits (see tag_tree_type_fits()).  A tag that
+ * had to be created is also stored, locked, in *created, for the caller to
+ * populate and unlock; otherwise *created is NULL. */
+static int
+tag_tree_create(const char* name, type_t type, int elem_size, int elem_count, struct tag_tree_node** created)
+{
+    uint32_t hash = tag_tree_name_hash(name);
+    struct tag_shard* s = tag_tree_name_shard(hash);
+    struct tag_tree_node* tag;
+    struct tag_handle* h;
+    int ret;
+
+    *created = NULL;
+
+    if (shm_enabled()) {
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+    }
+    RW_WRLOCK(&s->names_mtx);
+
+    tag = tag_tree_name_find(s, name, hash);
+    if (tag != NULL && !tag_tree_type_fits(tag->type, type, elem_size, elem_count)) {
+        pdebug(PLCTAG_DEBUG_WARN, "Tag %s exists as a %s of %u %u-byte elements, not a %s of %u %u-byte elements", name,
+            type_str(tag->type), type_elem_count(tag->type), type_elem_size(tag->type),
+            type_str(type), type_elem_count(type), type_elem_size(type));
+        ret = PLCTAG_ERR_BAD_PARAM;
+    } else if (tag != NULL && tag_tree_shm_open(tag)) {
+        h = tag_tree_handle_alloc(tag, 0, &ret);
+        if (h == NULL) {
+            tag_tree_shm_close(tag);
+        } else {
+            h->shm_open = tag->shm != NULL;
+            ret = h->id;
+            stats_inc(STAT_CREATES);
+            pdebug(PLCTAG_DEBUG_DETAIL, "Created handle %d on tag %d (%s)", ret, tag->tag_id, name);
+        }
+    } else {
+        /* There is no such tag, or another process destroyed it just now. */
+        *created = tag_tree_node_create(s, name, hash, type, &ret);
+        if (*created != NULL) {
+            ret = (*created)->tag_id;
+        }
     }
 
-    tag->data = malloc(sz);
-    if (tag->data == NULL) {
-        err(1, "malloc");
+    RW_UNLOCK(&s->names_mtx);
+    if (shm_enabled()) {
+        MTX_UNLOCK(&shm_sync_mtx);
     }
-    memset(tag->data, 0x42, sz);
 
-    tag->tag_id = id;
-    RB_INSERT(tag_tree_t, &tag_tree, tag);
-    tree_size++;
+    return ret;
+}
+
+/* Adds a node for the given entry in the shared store to its shard, s, whose
+ * names_mtx must be held for writing by the caller.  Returns NULL, with
+ * *status set, if it can't. */
+static struct tag_tree_node*
+tag_tree_shm_import(struct tag_shard* s, int idx, int* status)
+{
+    struct tag_tree_node* tag;
+    struct shm_tag* entry = shm_tag_get(idx);
+    type_t type;
+
+    type = type_decode(entry->type, entry->type_len);
+    if (type_to_enum(type) == TAG_ERROR) {
+        pdebug(PLCTAG_DEBUG_WARN, "Skipping shared tag %s with a malformed type", entry->name);
+        *status = PLCTAG_ERR_CREATE;
+        return NULL;
+    }
 
-    /* Invalidate the metatag, if one exists. */
-    find.tag_id = METATAG_ID;
-    metatag = RB_FIND(tag_tree_t, &tag_tree, &find);
-    if (metatag != NULL) {
-        RB_REMOVE(tag_tree_t, &tag_tree, metatag);
-        tree_size--;
-        tag_tree_node_destroy(metatag);
+    tag = tag_tree_node_alloc(s, SHM_TAG_ID(idx), entry->name, tag_tree_name_hash(entry->name), type, status);
+    type_free(type);
+    if (tag == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "Couldn't attach to shared tag %s: %s", entry->name, plc_tag_decode_error(*status));
+        return NULL;
     }
 
-    pdebug(PLCTAG_DEBUG_DETAIL, "Created new tag %d (%s)", id, name);
+    tag->shm = entry;
+    tag->mtxp = &entry->mtx;
+    tag->data = shm_tag_data(entry);
+    tag->data_len = entry->data_len;
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Attached to shared tag %d (%s)", tag->tag_id, tag->name);
 
-    MTX_LOCK(&tag->mtx);
     return tag;
 }
 
+/* Adds nodes for the tags that have been added to, or brought back in, the
+ * shared store since we last looked, and drops those for tags that other
+ * processes have destroyed.  shm_sync_mtx must be held by the caller, but no
+ * shard's locks. */
+static void
+tag_tree_shm_sync()
+{
+    static int synced = 0; /* catalog entries we have looked at */
+    static int reaped = 0; /* kills we have dealt with */
+    static int revived = 0; /* and reuses */
+    struct tag_tree_node **p, *tag;
+    struct tag_shard* s;
+    struct shm_tag* entry;
+    size_t i;
+    int j, status, cnt = shm_tag_count(), kills = shm_tag_kill_count(), revives = shm_tag_revive_count();
+
+    if (kills != reaped) {
+        /* A dead tag takes all of its handles with it. */
+        for (j = 0; j < TAG_SHARDS; j++) {
+            s = &shards[j];
+            RW_WRLOCK(&s->names_mtx);
+            for (i = 0; i < s->name_buckets; i++) {
+                for (p = &s->names[i]; (tag = *p) != NULL;) {
+                    if (!tag_tree_node_dead(tag)) {
+                        p = &tag->name_next;
+                        continue;
+                    }
+                    while (tag->handles != NULL) {
+                        tag_tree_handle_free(tag->handles);
+                    }
+                    *p = tag->name_next;
+                    s->name_count--;
+                    name_index_remove(&s->name_index, &tag->name_idx);
+                    __atomic_add_fetch(&catalog_gen, 1, __ATOMIC_RELEASE);
+                    tag_tree_node_destroy(tag);
+                }
+            }
+            RW_UNLOCK(&s->names_mtx);
+        }
+        reaped = kills;
+    }
+
+    /* Reused entries may be anywhere, so look at them all again. */
+    if (revives != revived) {
+        synced = 0;
+        revived = revives;
+    }
+
+    for (; synced < cnt; synced++) {
+        entry = shm_tag_get(synced);
+        if (__atomic_load_n(&entry->dead, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        /* tag_tree_node_create() may have got to it first. */
+        if (tag_tree_slot_get(SHM_TAG_ID(synced), NULL) != NULL) {
+            continue;
+        }
+
+        s = tag_tree_name_shard(tag_tree_name_hash(entry->name));
+        RW_WRLOCK(&s->names_mtx);
+        tag_tree_shm_import(s, synced, &status);
+        RW_UNLOCK(&s->names_mtx);
+    }
+}
+
 static void
 tag_tree_node_destroy(struct tag_tree_node* tag)
 {
+    enum mem_e m = tag != NULL && tag->tag_id == METATAG_ID ? MEM_METATAG : MEM_TAGS;
+
     if (!tag) {
         return;
     }
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Destroying node %d", tag->tag_id);
 
-    MTX_LOCK(&tag->mtx);
+    /* Wait out anybody still holding the tag.  A pthread mutex can't be
+     * copied, so it has to be unlocked and destroyed in place. */
+    TAG_LOCK(tag);
+    TAG_UNLOCK(tag);
+    pthread_mutex_destroy(&tag->mtx);
 
-    pthread_mutex_t mtx = tag->mtx;
-    free(tag->data);
-    free(tag->name);
-    free(tag);
+#ifdef DEBUG
+    if (tag->shadow) {
+        munmap(tag->shadow, tag->shadow_len);
+    }
+#endif
+    type_free(tag->type);
+    /* Shared tags' data, and locks, belong to the store. */
+    if (!tag->shm) {
+        mem_free(m, tag->data, tag->data_len);
+    }
+    mem_free(m == MEM_TAGS ? MEM_NAMES : m, tag->name, tag->name ? strlen(tag->name) + 1 : 0);
+    mem_free(m, tag, sizeof(*tag));
+}
 
-    MTX_UNLOCK(&mtx);
+static int
+tag_tree_slot_cmp(const void* lhs, const void* rhs)
+{
+    uint32_t l = TAG_ID_INDEX((*(struct tag_tree_node* const*)(lhs))->tag_id);
+    uint32_t r = TAG_ID_INDEX((*(struct tag_tree_node* const*)(rhs))->tag_id);
 
-    pthread_mutex_destroy(&mtx);
+    return (l < r ? -1 : (l > r));
+}
+
+/* Returns every live tag, in order of the slots they are listed under, in a
+ * malloc()ed array with room for two more, or NULL if there is no memory for
+ * it; their number is stored in *n.  Every shard's names_mtx must be held by
+ * the caller. */
+static struct tag_tree_node**
+tag_tree_collect(size_t* n)
+{
+    struct tag_tree_node **tags, *tag;
+    size_t i, cnt = 0;
+    int j;
+
+    for (j = 0; j < TAG_SHARDS; j++) {
+        cnt += shards[j].name_count;
+    }
+    tags = calloc(cnt + 2, sizeof(*tags));
+    if (tags == NULL) {
+        return NULL;
+    }
+
+    *n = 0;
+    for (j = 0; j < TAG_SHARDS; j++) {
+        for (i = 0; i < shards[j].name_buckets; i++) {
+            for (tag = shards[j].names[i]; tag != NULL; tag = tag->name_next) {
+                if (!tag_tree_node_dead(tag)) {
+                    tags[(*n)++] = tag;
+                }
+            }
+        }
+    }
+    qsort(tags, *n, sizeof(*tags), tag_tree_slot_cmp);
+
+    return tags;
+}
+
+/* Allocates a pseudo-tag's node, with room for data of the given type, which
+ * it takes over.  Returns NULL, having freed the type, if there is no memory
+ * for it.  The caller accounts for the memory. */
+static struct tag_tree_node*
+tag_tree_pseudonode_create(const char* name, int32_t tag_id, type_t type)
+{
+    struct tag_tree_node* tag;
+    size_t len = type_size_bytes(type);
+    char *dup, *data;
+
+    if (type_to_enum(type) == TAG_ERROR) {
+        return NULL;
+    }
+    tag = aligned_alloc(CACHE_LINE, sizeof(struct tag_tree_node));
+    dup = strdup(name);
+    data = malloc(len);
+    if (tag == NULL || dup == NULL || (data == NULL && len > 0)) {
+        free(tag);
+        free(dup);
+        free(data);
+        type_free(type);
+        return NULL;
+    }
+    memset(tag, 0, sizeof(struct tag_tree_node));
+    if (pthread_mutex_init(&tag->mtx, NULL)) {
+        err(1, "pthread_mutex_init");
+    }
+
+    tag->mtxp = &tag->mtx;
+    tag->name = dup;
+    tag->tag_id = tag_id;
+    tag->type = type;
+    tag->data = data;
+    tag->data_len = len;
+
+    return tag;
 }
 
 /* Creates the special "@tags" metanode, the tag containing an array
- * of all tags.  The tag tree node lock is assumed to be held by the caller!
- * 
+ * of all tags, or returns NULL if there is no memory for it.  Every shard's
+ * names_mtx is assumed to be held by the caller!
+ *
  * Unlike tag_tree_create(), because no population of fields is necessary,
  * the metanode is _not_ locked before it is returned to the caller.  (Would
  * it be better if we did that, for API consistency?)
@@ -202,65 +1027,52 @@ tag_tree_node_destroy(struct tag_tree_node* tag)
 static struct tag_tree_node*
 tag_tree_metanode_create()
 {
-    size_t total_data_size = 0;
-    struct tag_tree_node *tag, *ret;
+    size_t total_data_size = 0, i, n;
+    struct tag_tree_node *tag, *ret, **tags;
     char* p;
 
-    RB_FOREACH(tag, tag_tree_t, &tag_tree)
-    {
-        total_data_size += sizeof(struct metatag_t) + strlen(tag->name);
+    /* Each tag is listed once, under its primary handle. */
+    tags = tag_tree_collect(&n);
+    if (tags == NULL) {
+        return NULL;
     }
-
-    struct tag_tree_node find;
-    find.tag_id = METATAG_ID;
-    tag = RB_FIND(tag_tree_t, &tag_tree, &find);
-    if (tag != NULL) {
-        RB_REMOVE(tag_tree_t, &tag_tree, tag);
-        tree_size--;
-        tag_tree_node_destroy(tag);
+    for (i = 0; i < n; i++) {
+        total_data_size += sizeof(struct metatag_t) + strlen(tags[i]->name);
     }
 
-    ret = tag = malloc(sizeof(struct tag_tree_node));
-    if (tag == NULL) {
-        err(1, "malloc");
-    }
-    if (pthread_mutex_init(&tag->mtx, NULL)) {
-        err(1, "pthread_mutex_init");
-    }
-
-    tag->name = strdup("@tags");
-    tag->tag_id = METATAG_ID;
-    tag->cb = NULL;
-
     /* XXX: because the entries are variable in length, this can't really be represented
      * in plcstub's type system.  So, make it an array of bytes.
      */
-    tag->type = type_new_array(total_data_size, type_new_simple(TAG_SINT));
-
-    tag->data = p = malloc(total_data_size);
-    if (!p) {
-        err(1, "malloc");
+    ret = tag = tag_tree_pseudonode_create("@tags", METATAG_ID,
+        type_new_array_unbudgeted(total_data_size, type_new_simple(TAG_SINT)));
+    if (tag == NULL) {
+        free(tags);
+        return NULL;
     }
+    p = tag->data;
+
+    /* Rebuilding the metatag is a read, which can't be refused. */
+    mem_account(MEM_METATAG, sizeof(struct tag_tree_node) + sizeof("@tags") + total_data_size);
+    stats_inc(STAT_METATAG_REBUILDS);
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Creating @tags metatag (node ID %d) (%d bytes)", METATAG_ID, type_size_bytes(tag->type));
 
     /* XXX: Currently these results should not be relied upon too much :-( */
-    RB_FOREACH(tag, tag_tree_t, &tag_tree)
-    {
+    for (i = 0; i < n; i++) {
         struct metatag_t* mt = (struct metatag_t*)(p);
+        uint32_t dims[3];
+        int ndims;
+
+        tag = tags[i];
+
         mt->id = tag->tag_id;
-        /* TODO: need a way of converting a type_t to this representation */
-        mt->type = (1 << 13); /* TODO: type needs more than the dimensions mask */
 
-        mt->elem_size = type_size_bytes(tag->type); /* TODO: this is wrong for arrays */
+        /* The type word holds the number of array dimensions in bits 13-14. */
+        ndims = type_array_dims(tag->type, dims);
+        mt->type = type_cip_code(tag->type) | (ndims << 13);
 
-        if (type_is_scalar(tag->type) || type_to_enum(tag->type) == TAG_STRUCT) {
-            mt->array_dims[0] = 0;
-        } else {
-            struct tag_array* a = (struct tag_array*)(tag->type);
-            mt->array_dims[0] = a->len;
-        }
-        mt->array_dims[1] = mt->array_dims[2] = 0;
+        mt->elem_size = type_elem_size(tag->type);
+        memcpy(mt->array_dims, dims, sizeof(dims));
         mt->length = strlen(tag->name);
         memcpy(mt->data, tag->name, mt->length);
 
@@ -269,40 +1081,353 @@ tag_tree_metanode_create()
 
     pdebug(PLCTAG_DEBUG_SPEW, "Wrote %d of %d bytes as metatag data", (p - ret->data), total_data_size);
 
-    RB_INSERT(tag_tree_t, &tag_tree, ret);
-
+    free(tags);
     return ret;
 }
 
-/* 
- * Allocates and inserts a new tag node into the tag tree with the given name
- * and sizing metadata.  If the magic name "@tags" is given, the tag metanode
- * is revalidated instead.
+/* Rebuilds the metatag if the catalog has changed since it was built, or if
+ * `force` is set.  metatag_mtx must be held by the caller.  If there is no
+ * memory to, the old one is kept, and metahandle.tag is NULL if there was
+ * none. */
+static void
+tag_tree_metatag_refresh(bool force)
+{
+    struct tag_tree_node *old = metahandle.tag, *tag;
+
+    if (shm_enabled()) {
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+        MTX_UNLOCK(&shm_sync_mtx);
+    }
+    if (!force && !metatag_stale && old != NULL
+        && metatag_gen == __atomic_load_n(&catalog_gen, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    /* Anybody locking the node has pinned it first, so once it is unpinned
+     * and unlocked, nobody can reach it but through metahandle. */
+    if (old != NULL && (metatag_pins > 0 || __atomic_load_n(&old->lock_depth, __ATOMIC_RELAXED) > 0)) {
+        metatag_stale = true;
+        return;
+    }
+    metatag_stale = false;
+
+    /* Lookups, and other readers of the catalog, carry on meanwhile; only
+     * creates and destroys wait. */
+    tag_tree_names_rdlock_all();
+    metatag_gen = __atomic_load_n(&catalog_gen, __ATOMIC_ACQUIRE);
+    tag = tag_tree_metanode_create();
+    tag_tree_names_unlock_all();
+
+    if (tag == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "No memory to rebuild @tags");
+        metatag_stale = true;
+        return;
+    }
+    metahandle.tag = tag;
+    tag_tree_node_destroy(old);
+}
+
+/* Snapshots the global counters into the "@stats" tag's data buffer, one LINT
+ * per counter, in enum stat_e order.  The tag's lock is held by the caller. */
+static void
+tag_tree_statsnode_refresh(struct tag_tree_node* tag)
+{
+    int i;
+    int64_t* p = (int64_t*)(tag->data);
+
+    for (i = 0; i < STAT_COUNT; i++) {
+        p[i] = (int64_t)stats_get(i);
+    }
+}
+
+/* Creates the special "@stats" pseudo-tag, or returns NULL if there is no
+ * memory for it.  Like the metanode, the node is returned unlocked. */
+static struct tag_tree_node*
+tag_tree_statsnode_create()
+{
+    struct tag_tree_node* tag;
+
+    tag = tag_tree_pseudonode_create("@stats", STATSTAG_ID,
+        type_new_array_unbudgeted(STAT_COUNT, type_new_simple(TAG_LINT)));
+    if (tag == NULL) {
+        pdebug(PLCTAG_DEBUG_WARN, "No memory for @stats");
+        return NULL;
+    }
+    tag->refresh = tag_tree_statsnode_refresh;
+    mem_account(MEM_TAGS, sizeof(struct tag_tree_node) + tag->data_len);
+    mem_account(MEM_NAMES, sizeof("@stats"));
+    tag_tree_statsnode_refresh(tag);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Created @stats pseudo-tag (node ID %d)", STATSTAG_ID);
+
+    return tag;
+}
+
+/* Copies a "@udt/<id>" pseudo-tag's template, cached by its type, back into
+ * its data buffer.  The tag's lock is held by the caller. */
+static void
+tag_tree_udtnode_refresh(struct tag_tree_node* tag)
+{
+    struct udt_tag* u = __atomic_load_n(&udttags[tag->tag_id - UDTTAG_ID_BASE], __ATOMIC_ACQUIRE);
+    const uint8_t* tpl;
+    size_t len;
+
+    tpl = type_udt_template(u->type, &len);
+    memcpy(tag->data, tpl, len);
+}
+
+/* Returns the ID of the "@udt/<id>" pseudo-tag for the given name, creating
+ * it if it is the first time it is asked for. */
+static int
+tag_tree_udt_insert(const char* name)
+{
+    struct tag_tree_node* tag;
+    struct udt_tag* u;
+    unsigned long id;
+    char buf[16], *end, *tag_name;
+    size_t len;
+    type_t type, elem;
+    void* data;
+
+    id = strtoul(name + strlen("@udt/"), &end, 10);
+    if (end == name + strlen("@udt/") || *end != '\0' || id == 0 || id > TYPE_UDT_ID_MAX) {
+        pdebug(PLCTAG_DEBUG_WARN, "Bad UDT ID in %s", name);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    MTX_LOCK(&metatag_mtx);
+    if (udttags[id] != NULL) {
+        MTX_UNLOCK(&metatag_mtx);
+        return UDTTAG_ID(id);
+    }
+
+    type = type_udt_lookup(id);
+    if (type_to_enum(type) == TAG_ERROR) {
+        MTX_UNLOCK(&metatag_mtx);
+        pdebug(PLCTAG_DEBUG_WARN, "No UDT has ID %lu", id);
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+    if (type_udt_template(type, &len) == NULL) {
+        MTX_UNLOCK(&metatag_mtx);
+        type_free(type);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    snprintf(buf, sizeof(buf), "@udt/%lu", id);
+    tag = mem_alloc_aligned(MEM_METATAG, sizeof(struct tag_tree_node));
+    u = mem_alloc(MEM_METATAG, sizeof(struct udt_tag));
+    tag_name = mem_strdup(MEM_METATAG, buf);
+    data = mem_alloc(MEM_METATAG, len);
+    elem = type_new_array(len, type_new_simple(TAG_SINT));
+    if (tag == NULL || u == NULL || tag_name == NULL || data == NULL || type_to_enum(elem) == TAG_ERROR) {
+        MTX_UNLOCK(&metatag_mtx);
+        mem_free(MEM_METATAG, tag, sizeof(struct tag_tree_node));
+        mem_free(MEM_METATAG, u, sizeof(struct udt_tag));
+        mem_free(MEM_METATAG, tag_name, strlen(buf) + 1);
+        mem_free(MEM_METATAG, data, len);
+        type_free(elem);
+        type_free(type);
+        return PLCTAG_ERR_NO_MEM;
+    }
+    memset(tag, 0, sizeof(struct tag_tree_node));
+    if (pthread_mutex_init(&tag->mtx, NULL)) {
+        err(1, "pthread_mutex_init");
+    }
+
+    tag->mtxp = &tag->mtx;
+    tag->name = tag_name;
+    tag->tag_id = UDTTAG_ID(id);
+    tag->refresh = tag_tree_udtnode_refresh;
+    tag->type = elem;
+    tag->data_len = len;
+    tag->data = data;
+
+    u->h = (struct tag_handle) { .id = tag->tag_id, .tag = tag };
+    u->type = type;
+    __atomic_store_n(&udttags[id], u, __ATOMIC_RELEASE);
+    tag_tree_udtnode_refresh(tag);
+    MTX_UNLOCK(&metatag_mtx);
+
+    pdebug(PLCTAG_DEBUG_DETAIL, "Created %s pseudo-tag (node ID %d) (%zu bytes)", tag->name, tag->tag_id, len);
+
+    return UDTTAG_ID(id);
+}
+
+/*
+ * Creates a handle on the tag with the given name, allocating and inserting a
+ * new tag node into the tag tree, with the given sizing metadata, if there is
+ * no such tag yet.  If the magic name "@tags" is given, the tag metanode is
+ * revalidated instead, and "@udt/<id>" names get the template of the struct
+ * type with that UDT ID.
  */
-int
-tag_tree_insert(const char* name, type_t type)
+static int
+tag_tree_insert_impl(const char* name, type_t type, int elem_size, int elem_count)
 {
     int ret;
     struct tag_tree_node* tag;
 
     tag_tree_init();
 
-    RW_WRLOCK(&tag_tree_mtx);
     if (strcmp(name, "@tags") == 0) {
-        tag = tag_tree_metanode_create();
-        if (tag == NULL) {
-            err(1, "tag_tree_metanode_create");
-        }
-        ret = tag->tag_id;
+        MTX_LOCK(&metatag_mtx);
+        tag_tree_metatag_refresh(true);
+        ret = metahandle.tag != NULL ? metahandle.id : PLCTAG_ERR_NO_MEM;
+        MTX_UNLOCK(&metatag_mtx);
+    } else if (strcmp(name, "@stats") == 0) {
+        ret = statstag != NULL ? statshandle.id : PLCTAG_ERR_NO_MEM;
+    } else if (strncmp(name, "@udt/", strlen("@udt/")) == 0) {
+        ret = tag_tree_udt_insert(name);
     } else {
-        tag = tag_tree_node_create(name, type);
-        if (tag == NULL) {
-            err(1, "tag_tree_node_create");
+        ret = tag_tree_create(name, type, elem_size, elem_count, &tag);
+        if (tag != NULL) {
+            TAG_UNLOCK(tag);
+        }
+    }
+    return ret;
+}
+
+int
+tag_tree_insert(const char* name, type_t type)
+{
+    return tag_tree_insert_impl(name, type, -1, -1);
+}
+
+int
+tag_tree_insert_sized(const char* name, type_t type, int elem_size, int elem_count)
+{
+    return tag_tree_insert_impl(name, type, elem_size, elem_count);
+}
+
+/* Looks a tag up by name, ignoring case as Logix does, for clients, like the
+ * EtherNet/IP server, that address tags by name. */
+int32_t
+tag_tree_lookup_name(const char* name)
+{
+    uint32_t hash = tag_tree_name_hash(name);
+    struct tag_shard* s = tag_tree_name_shard(hash);
+    struct tag_tree_node* tag;
+    int32_t ret;
+
+    tag_tree_init();
+
+    RW_RDLOCK(&s->names_mtx);
+    tag = tag_tree_name_find(s, name, hash);
+    ret = tag != NULL ? tag->tag_id : PLCTAG_ERR_NOT_FOUND;
+    RW_UNLOCK(&s->names_mtx);
+
+    if (tag == NULL && shm_enabled()) {
+        /* Another process may have created it. */
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+        MTX_UNLOCK(&shm_sync_mtx);
+
+        RW_RDLOCK(&s->names_mtx);
+        tag = tag_tree_name_find(s, name, hash);
+        ret = tag != NULL ? tag->tag_id : PLCTAG_ERR_NOT_FOUND;
+        RW_UNLOCK(&s->names_mtx);
+    }
+
+    return ret;
+}
+
+int
+tag_tree_find(const char* pattern, char* cursor, size_t cursor_len, int32_t* ids, int max)
+{
+    struct name_index_node *n[TAG_SHARDS], *last = NULL;
+    struct tag_tree_node* tag;
+    size_t prefix = name_glob_prefix(pattern);
+    char* lo;
+    int i, j, ret = 0;
+
+    tag_tree_init();
+
+    if (shm_enabled()) {
+        /* Another process may have created some. */
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+        MTX_UNLOCK(&shm_sync_mtx);
+    }
+
+    /* Every match starts with the pattern's literal prefix, and so lies in
+     * the run of names that do. */
+    lo = malloc(prefix + 1);
+    if (lo == NULL) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+    memcpy(lo, pattern, prefix);
+    lo[prefix] = '\0';
+
+    tag_tree_names_rdlock_all();
+
+    /* Merge the shards' runs, each starting after the cursor if it is in
+     * them. */
+    for (i = 0; i < TAG_SHARDS; i++) {
+        if (cursor[0] != '\0' && strcasecmp(cursor, lo) >= 0) {
+            n[i] = name_index_after(&shards[i].name_index, cursor);
+        } else {
+            n[i] = name_index_first(&shards[i].name_index, lo);
+        }
+    }
+    while (ret < max) {
+        for (i = 0, j = -1; i < TAG_SHARDS; i++) {
+            if (n[i] != NULL && (j < 0 || strcasecmp(n[i]->name, n[j]->name) < 0)) {
+                j = i;
+            }
+        }
+        if (j < 0 || strncasecmp(n[j]->name, pattern, prefix) != 0) {
+            break;
+        }
+        tag = (struct tag_tree_node*)((char*)(n[j]) - offsetof(struct tag_tree_node, name_idx));
+        if (!tag_tree_node_dead(tag) && name_glob_match(pattern, n[j]->name)) {
+            /* Any of them may end up in the cursor. */
+            if (strlen(n[j]->name) + 1 > cursor_len) {
+                ret = PLCTAG_ERR_TOO_SMALL;
+                break;
+            }
+            ids[ret++] = tag->tag_id;
+            last = n[j];
+        }
+        n[j] = name_index_next(&shards[j].name_index, n[j]);
+    }
+    if (ret > 0) {
+        memcpy(cursor, last->name, strlen(last->name) + 1);
+    }
+
+    tag_tree_names_unlock_all();
+
+    free(lo);
+    return ret;
+}
+
+int
+tag_tree_foreach(int32_t first, int (*fn)(struct tag_tree_node* tag, void* arg), void* arg)
+{
+    struct tag_handle* h;
+    struct tag_shard* s;
+    uint32_t i, end;
+    int j, ret = 0;
+
+    tag_tree_init();
+
+    for (j = 0; j < TAG_SHARDS; j++) {
+        RW_RDLOCK(&shards[j].slots_mtx);
+    }
+    end = __atomic_load_n(&next_slot, __ATOMIC_RELAXED);
+    for (i = first > 0 ? first : 0; i < end && ret == 0; i++) {
+        s = tag_tree_slot_shard(i);
+        if (i / TAG_SHARDS >= s->slot_cap) {
+            continue;
+        }
+        h = s->slots[i / TAG_SHARDS].h;
+        if (h == NULL || !tag_tree_handle_primary(h) || tag_tree_node_dead(h->tag)) {
+            continue;
         }
-        MTX_UNLOCK(&tag->mtx);
-        ret = tag->tag_id;
+        ret = fn(h->tag, arg);
     }
-    RW_UNLOCK(&tag_tree_mtx);
+    for (j = TAG_SHARDS - 1; j >= 0; j--) {
+        RW_UNLOCK(&shards[j].slots_mtx);
+    }
+
     return ret;
 }
 
@@ -310,8 +1435,11 @@ int
 tag_tree_remove(int32_t id)
 {
     struct tag_tree_node* tag;
+    struct tag_handle* h;
+    struct tag_shard* s;
+    uint32_t hash = 0;
 
-    if (id == METATAG_ID) {
+    if (id == METATAG_ID || id == STATSTAG_ID || (id >= UDTTAG_ID_BASE && id < STATSTAG_ID)) {
         // Unclear why we would want to remove this, but
         // silently accept it.
         return PLCTAG_STATUS_OK;
@@ -319,25 +1447,53 @@ tag_tree_remove(int32_t id)
 
     tag_tree_init();
 
-    RW_WRLOCK(&tag_tree_mtx);
-
-    struct tag_tree_node find;
-    find.tag_id = id;
-    tag = RB_FIND(tag_tree_t, &tag_tree, &find);
-    if (!tag) {
+    /* Find out which shard the tag is in, then look again with that locked,
+     * in case somebody destroyed the handle meanwhile.  Holding the slot's
+     * lock keeps the tag alive long enough to read its hash. */
+    s = tag_tree_slot_shard(TAG_ID_INDEX(id));
+    RW_RDLOCK(&s->slots_mtx);
+    h = tag_tree_slot_find(id);
+    if (h != NULL) {
+        hash = h->tag->name_hash;
+    }
+    RW_UNLOCK(&s->slots_mtx);
+
+    if (h != NULL) {
+        s = tag_tree_name_shard(hash);
+        RW_WRLOCK(&s->names_mtx);
+        h = tag_tree_slot_get(id, &tag);
+        if (!h) {
+            RW_UNLOCK(&s->names_mtx);
+        }
+    }
+    if (!h) {
         pdebug(PLCTAG_DEBUG_WARN, "Lookup for tag %d failed", id);
-        RW_UNLOCK(&tag_tree_mtx);
         return PLCTAG_ERR_NOT_FOUND;
     }
 
-    MTX_LOCK(&tag->mtx);
+    stats_inc(STAT_DESTROYS);
+
+    if (h->shm_open) {
+        tag_tree_shm_close(tag);
+    }
+    if (tag_tree_handle_free(h) > 0) {
+        /* Other handles keep the tag alive. */
+        RW_UNLOCK(&s->names_mtx);
+
+        pdebug(PLCTAG_DEBUG_DETAIL, "Removed handle %d on tag %d", id, tag->tag_id);
+        return PLCTAG_STATUS_OK;
+    }
 
-    /* TODO: special case for the empty tree?. */
-    RB_REMOVE(tag_tree_t, &tag_tree, tag);
-    tree_size--;
+    /* This process is done with the tag.  A shared one lives on in the store
+     * while other processes use it, and is attached to again if this one
+     * creates it again. */
+    TAG_LOCK(tag);
 
-    RW_UNLOCK(&tag_tree_mtx);
-    MTX_UNLOCK(&tag->mtx);
+    tag_tree_name_remove(s, tag);
+    __atomic_add_fetch(&catalog_gen, 1, __ATOMIC_RELEASE);
+
+    RW_UNLOCK(&s->names_mtx);
+    TAG_UNLOCK(tag);
 
     tag_tree_node_destroy(tag);
 
@@ -346,36 +1502,216 @@ tag_tree_remove(int32_t id)
     return PLCTAG_STATUS_OK;
 }
 
-/* Looks up a tag by ID; returns NULL if no such tag exists. 
+int
+tag_tree_lock_timeout(struct tag_tree_node* t, int timeout_ms)
+{
+    int ret;
+
+    if (timeout_ms < 0) {
+        TAG_LOCK(t);
+        return PLCTAG_STATUS_OK;
+    }
+
+#ifdef LOCK_PROFILING
+    static struct lockprof_site site = LOCKPROF_SITE_INIT("(t)->mtxp, timed");
+    uint64_t start = lockprof_now();
+#endif
+    ret = shm_mutex_timedlock(t->mtxp, timeout_ms);
+    if (ret == EBUSY || ret == ETIMEDOUT) {
+        stats_inc(STAT_LOCK_TIMEOUTS);
+        pdebug(PLCTAG_DEBUG_DETAIL, "Tag %d (%s) still busy after %d ms", t->tag_id, t->name, timeout_ms);
+        return timeout_ms == 0 ? PLCTAG_ERR_BUSY : PLCTAG_ERR_TIMEOUT;
+    }
+    if (ret) {
+        errx(1, "%s:%d: shm_mutex_timedlock: %s", __FILE__, __LINE__, strerror(ret));
+    }
+#ifdef LOCK_PROFILING
+    lockprof_acquired(t->mtxp, &site, &t->lockprof, lockprof_now() - start);
+#endif
+    tag_seq_begin(t);
+
+    return PLCTAG_STATUS_OK;
+}
+
+#ifdef LOCK_PROFILING
+static int
+lockprof_wait_cmp(const void* lhs, const void* rhs)
+{
+    const struct tag_tree_node* l = *(const struct tag_tree_node**)(lhs);
+    const struct tag_tree_node* r = *(const struct tag_tree_node**)(rhs);
+
+    if (l->lockprof.wait.total_ns != r->lockprof.wait.total_ns) {
+        return l->lockprof.wait.total_ns > r->lockprof.wait.total_ns ? -1 : 1;
+    }
+    return (l->tag_id < r->tag_id ? -1 : (l->tag_id > r->tag_id));
+}
+#endif
+
+void
+tag_tree_lock_report(FILE* f, int top_n)
+{
+#ifdef LOCK_PROFILING
+    struct tag_tree_node** tags;
+    size_t i, n;
+
+    tag_tree_init();
+
+    lockprof_report_sites(f);
+
+    MTX_LOCK(&metatag_mtx);
+    tag_tree_names_rdlock_all();
+
+    tags = tag_tree_collect(&n);
+    if (tags == NULL) {
+        tag_tree_names_unlock_all();
+        MTX_UNLOCK(&metatag_mtx);
+        fprintf(f, "no memory for the contended tags\n");
+        return;
+    }
+    if (metahandle.tag != NULL) {
+        tags[n++] = metahandle.tag;
+    }
+    if (statstag != NULL) {
+        tags[n++] = statstag;
+    }
+    qsort(tags, n, sizeof(*tags), lockprof_wait_cmp);
+
+    fprintf(f, "top %d contended tags:\n", top_n);
+    for (i = 0; i < n && i < (size_t)top_n; i++) {
+        fprintf(f, "  %d (%s), %lu long holds\n    ", tags[i]->tag_id, tags[i]->name,
+            (unsigned long)tags[i]->lockprof.long_holds);
+        lockprof_obj_print(f, &tags[i]->lockprof);
+        fprintf(f, "\n");
+    }
+
+    tag_tree_names_unlock_all();
+    MTX_UNLOCK(&metatag_mtx);
+
+    free(tags);
+#else
+    (void)(top_n);
+    fprintf(f, "plcstub was built without lock profiling\n");
+#endif
+}
+
+/* Looks up a handle by ID; returns NULL if no such handle exists.  Its tag
+ * is stored in *tag, which may be NULL.
  *
- * This function does NOT eagerly lock the returned tag; it
- * falls to the caller to do so!
+ * This function does NOT eagerly lock the tag; it falls to the caller to do
+ * so!
  */
-struct tag_tree_node*
-tag_tree_lookup(int32_t tag_id)
+struct tag_handle*
+tag_tree_handle(int32_t tag_id, struct tag_tree_node** tag)
 {
-    struct tag_tree_node* ret;
+    struct handle_cache_slot* slot;
+    struct tag_handle* ret;
+    struct tag_tree_node* t;
+    struct udt_tag* udt;
+    uint32_t epoch;
 
     tag_tree_init();
 
     pdebug(PLCTAG_DEBUG_DETAIL, "Looking up tag id %d", tag_id);
 
+    if (tag_id == STATSTAG_ID) {
+        /* Created once by tag_tree_init() and never freed. */
+        if (statstag == NULL) {
+            return NULL;
+        }
+        if (tag != NULL) {
+            *tag = statstag;
+        }
+        return &statshandle;
+    }
+
     if (tag_id == METATAG_ID) {
-        /* we may have to refresh the metanode tag, so we need
-         * exclusive access to the rwlock for the metatag. */
-        RW_WRLOCK(&tag_tree_mtx);
-    } else {
-        RW_RDLOCK(&tag_tree_mtx);
+        /* we may have to refresh the metanode tag. */
+        MTX_LOCK(&metatag_mtx);
+        tag_tree_metatag_refresh(false);
+        if (metahandle.tag == NULL) {
+            MTX_UNLOCK(&metatag_mtx);
+            return NULL;
+        }
+        if (tag != NULL) {
+            *tag = metahandle.tag;
+            metatag_pins++;
+        }
+        MTX_UNLOCK(&metatag_mtx);
+        return &metahandle;
+    }
+
+    if (tag_id >= UDTTAG_ID_BASE && tag_id < STATSTAG_ID) {
+        /* Created by tag_tree_udt_insert() and never freed. */
+        udt = __atomic_load_n(&udttags[tag_id - UDTTAG_ID_BASE], __ATOMIC_ACQUIRE);
+        if (udt == NULL) {
+            return NULL;
+        }
+        if (tag != NULL) {
+            *tag = udt->h.tag;
+        }
+        return &udt->h;
+    }
+
+    slot = &handle_cache[TAG_ID_INDEX(tag_id) % HANDLE_CACHE_SLOTS];
+    epoch = __atomic_load_n(&handle_epoch, __ATOMIC_ACQUIRE);
+    if (slot->id == tag_id && slot->epoch == epoch && !tag_tree_node_dead(slot->tag)) {
+        stats_inc(STAT_HANDLE_CACHE_HITS);
+        if (tag != NULL) {
+            *tag = slot->tag;
+        }
+        return slot->h;
+    }
+    stats_inc(STAT_HANDLE_CACHE_MISSES);
+
+    ret = tag_tree_slot_get(tag_id, &t);
+
+    /* Another process may have created the tag since we last looked. */
+    if (ret == NULL && shm_enabled()
+        && SHM_TAG_IDX(tag_id) >= 0 && SHM_TAG_IDX(tag_id) < shm_tag_count()) {
+        MTX_LOCK(&shm_sync_mtx);
+        tag_tree_shm_sync();
+        MTX_UNLOCK(&shm_sync_mtx);
+        ret = tag_tree_slot_get(tag_id, &t);
     }
 
-    struct tag_tree_node find;
-    find.tag_id = tag_id;
-    ret = RB_FIND(tag_tree_t, &tag_tree, &find);
+    /* ...or destroyed it. */
+    if (ret != NULL && tag_tree_node_dead(t)) {
+        ret = NULL;
+    }
+    if (tag != NULL) {
+        *tag = ret != NULL ? t : NULL;
+    }
 
-    if (ret == NULL && tag_id == METATAG_ID) {
-        ret = tag_tree_metanode_create();
+    /* A handle found was still in its slot after `epoch` was read, so if it
+     * has been freed since, the epoch has moved on too. */
+    if (ret != NULL) {
+        slot->id = tag_id;
+        slot->epoch = epoch;
+        slot->h = ret;
+        slot->tag = t;
     }
 
-    RW_UNLOCK(&tag_tree_mtx);
+    return ret;
+}
+
+void
+tag_tree_metatag_release(void)
+{
+    MTX_LOCK(&metatag_mtx);
+    metatag_pins--;
+    MTX_UNLOCK(&metatag_mtx);
+}
+
+/* Looks up a tag by ID; returns NULL if no such tag exists.
+ *
+ * This function does NOT eagerly lock the returned tag; it
+ * falls to the caller to do so!
+ */
+struct tag_tree_node*
+tag_tree_lookup(int32_t tag_id)
+{
+    struct tag_tree_node* ret;
+
+    tag_tree_handle(tag_id, &ret);
     return ret;
 }
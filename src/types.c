@@ -3,26 +3,137 @@
  * Routines for tag typechecking
  */
 
-#include <err.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "debug.h"
 #include "libplctag.h"
+#include "lock_utils.h"
+#include "mem.h"
+#include "path.h"
 #include "plcstub.h"
 #include "types.h"
 
 #define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
 
+#define ALIGN_UP(n, a) (((n) + (a)-1) / (a) * (a))
+
+/* Sizes of the simple types, which are also their alignments. */
+static const uint8_t simple_sizes[TAG_STRING + 1] = {
+    [TAG_ERROR] = 0,
+    [TAG_BOOL] = 1,
+    [TAG_SINT] = 1,
+    [TAG_INT] = 2,
+    [TAG_DINT] = 4,
+    [TAG_REAL] = 4,
+    [TAG_LINT] = 8,
+    [TAG_STRING] = TAG_STRING_SIZE,
+};
+
+/* Lays out complex types the way a Logix controller does:
+ *  - atomic members are aligned to their own size;
+ *  - arrays and structures are aligned to at least 4 bytes (8 if they contain
+ *    a LINT), and a structure is padded out to a multiple of its alignment;
+ *  - consecutive BOOL members share a hidden host byte, eight to a byte;
+ *  - BOOL arrays are packed into little-endian DWORDs, so bit i is bit i % 8
+ *    of byte i / 8.
+ */
+static void
+type_layout_array(struct tag_array* a)
+{
+    a->align = type_align_bytes(a->member_type);
+    if (a->align < 4) {
+        a->align = 4;
+    }
+
+    /* BOOL arrays are packed, 32 to a DWORD, and are accessed a DWORD at a
+     * time; the stride is left at 0 since members aren't byte-addressable. */
+    if (type_to_enum(a->member_type) == TAG_BOOL) {
+        a->stride = 0;
+        a->size = ((uint64_t)(a->len) + 31) / 32 * 4;
+        a->dims = 1;
+        a->elem_count = a->size / 4;
+        a->elem_size = 4;
+        return;
+    }
+
+    a->stride = type_size_bytes(a->member_type);
+    a->size = a->stride * a->len;
+
+    if (a->opaque) {
+        a->dims = 0;
+        a->elem_count = 1;
+        a->elem_size = a->size;
+    } else if (type_to_enum(a->member_type) == TAG_ARRAY) {
+        struct tag_array* m = (struct tag_array*)(a->member_type);
+        a->dims = m->dims + 1;
+        a->elem_count = a->len * m->elem_count;
+        a->elem_size = m->elem_size;
+    } else {
+        a->dims = 1;
+        a->elem_count = a->len;
+        a->elem_size = a->stride;
+    }
+}
+
+/* Returns false if the struct would be larger than TYPE_SIZE_MAX. */
+static bool
+type_layout_struct(struct tag_struct* s)
+{
+    int i, bits = 0;
+    uint64_t off = 0;
+    uint32_t host = 0;
+    uint16_t align = 4;
+
+    for (i = 0; i < s->field_cnt; i++) {
+        struct tag_struct_pair* f = &s->fields[i];
+        size_t fa;
+
+        if (type_to_enum(f->type) == TAG_BOOL) {
+            if (bits == 0 || bits == 8) {
+                host = off++;
+                bits = 0;
+            }
+            f->offset = host;
+            f->bit = bits++;
+            continue;
+        }
+        bits = 0;
+
+        fa = type_align_bytes(f->type);
+        off = ALIGN_UP(off, fa);
+        f->offset = off;
+        f->bit = 0;
+        off += type_size_bytes(f->type);
+        if (fa > align) {
+            align = fa;
+        }
+        if (off > TYPE_SIZE_MAX) {
+            break;
+        }
+    }
+
+    off = ALIGN_UP(off, align);
+    if (off > TYPE_SIZE_MAX) {
+        pdebug(PLCTAG_DEBUG_WARN, "A struct of %d fields would be too large", s->field_cnt);
+        return false;
+    }
+    s->align = align;
+    s->size = off;
+    return true;
+}
+
 enum tag_type_e
 type_to_enum(type_t t)
 {
     uintptr_t as_simple = (uintptr_t)(t);
     enum tag_type_e* as_complex = (enum tag_type_e*)(t);
 
-    if (as_simple <= TAG_LINT) {
+    if (as_simple <= TAG_STRING) {
         return (enum tag_type_e)(as_simple);
     }
     if (*as_complex == TAG_ARRAY) {
@@ -34,140 +145,866 @@ type_to_enum(type_t t)
     return TAG_ERROR;
 }
 
-type_t
-type_dup(type_t t)
+/* The intern table.  Member types are themselves interned, so comparing two
+ * candidate types only needs a shallow look at their members. */
+#define TYPE_TABLE_MIN_BUCKETS 64
+
+struct tag_base {
+    BASE_TAG_MEMBERS
+};
+
+static pthread_mutex_t type_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct tag_base** type_table = NULL;
+static size_t type_table_buckets = 0;
+static size_t type_table_cnt = 0;
+
+/* Struct types by UDT ID, also guarded by type_mtx.  The search for a free ID
+ * starts from udt_next, so that IDs aren't reused sooner than they must be. */
+static struct tag_struct* udt_table[TYPE_UDT_ID_MAX + 1];
+static uint16_t udt_next = 1;
+
+/* A serialised UDT template; see type_udt_template(). */
+struct udt_template {
+    size_t len;
+    uint8_t data[];
+};
+
+/* STRING's template, which, unlike a struct's, has no type to live in. */
+static struct udt_template* string_template = NULL;
+
+/* FNV-1a, fed a word or a string at a time. */
+#define TYPE_HASH_INIT 2166136261u
+
+static uint32_t
+type_hash_bytes(uint32_t h, const void* p, size_t len)
 {
-    enum tag_type_e e = type_to_enum(t);
+    const uint8_t* b = p;
 
-    if (e == TAG_ARRAY) {
+    while (len--) {
+        h = (h ^ *b++) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t
+type_hash(type_t t)
+{
+    uint32_t h = TYPE_HASH_INIT;
+    int i;
+
+    if (type_to_enum(t) == TAG_ARRAY) {
         struct tag_array* a = (struct tag_array*)(t);
-        return type_new_array(a->len, a->member_type);
-    } else if (e == TAG_STRUCT) {
-        int i;
-        struct tag_struct *s, *new;
+        h = type_hash_bytes(h, &a->t, sizeof(a->t));
+        h = type_hash_bytes(h, &a->len, sizeof(a->len));
+        h = type_hash_bytes(h, &a->member_type, sizeof(a->member_type));
+        h = type_hash_bytes(h, &a->opaque, sizeof(a->opaque));
+    } else {
+        struct tag_struct* s = (struct tag_struct*)(t);
+        h = type_hash_bytes(h, &s->t, sizeof(s->t));
+        for (i = 0; i < s->field_cnt; i++) {
+            h = type_hash_bytes(h, s->fields[i].name, strlen(s->fields[i].name) + 1);
+            h = type_hash_bytes(h, &s->fields[i].type, sizeof(s->fields[i].type));
+        }
+    }
+    return h;
+}
+
+static bool
+type_same(type_t a, type_t b)
+{
+    enum tag_type_e e = type_to_enum(a);
+    int i;
 
-        /* XXX: by my own petard, no clean way to call the variadic
-         * type_new_struct().  Duplicate the functionality here. */
-        s = (struct tag_struct*)(t);
-        new = malloc(sizeof(struct tag_struct) + s->field_cnt * sizeof(type_t));
-        if (new == NULL) {
-            err(1, "malloc");
+    if (e != type_to_enum(b)) {
+        return false;
+    }
+    if (e == TAG_ARRAY) {
+        struct tag_array *x = (struct tag_array*)(a), *y = (struct tag_array*)(b);
+        return x->len == y->len && x->member_type == y->member_type && x->opaque == y->opaque;
+    } else {
+        struct tag_struct *x = (struct tag_struct*)(a), *y = (struct tag_struct*)(b);
+        if (x->field_cnt != y->field_cnt) {
+            return false;
+        }
+        for (i = 0; i < x->field_cnt; i++) {
+            if (x->fields[i].type != y->fields[i].type || strcmp(x->fields[i].name, y->fields[i].name) != 0) {
+                return false;
+            }
         }
-        new->t = TAG_STRUCT;
-        new->field_cnt = s->field_cnt;
+        return true;
+    }
+}
 
-        for (i = 0; i < s->field_cnt; i++) {
-            new->fields[i].name = strdup(s->fields[i].name);
-            new->fields[i].type = type_dup(s->fields[i].type);
+/* Doubles the table, returning false if there is no memory for it.  type_mtx
+ * must be held by the caller. */
+static bool
+type_table_grow(bool budgeted)
+{
+    size_t i, n = type_table_buckets ? type_table_buckets * 2 : TYPE_TABLE_MIN_BUCKETS;
+    size_t more = (n - type_table_buckets) * sizeof(struct tag_base*);
+    struct tag_base** table;
+
+    if (budgeted && !mem_charge(MEM_TYPES, more)) {
+        return false;
+    }
+    table = calloc(n, sizeof(struct tag_base*));
+    if (table == NULL) {
+        if (budgeted) {
+            mem_account(MEM_TYPES, -(int64_t)(more));
+        }
+        return false;
+    }
+
+    for (i = 0; i < type_table_buckets; i++) {
+        struct tag_base *b, *next;
+        for (b = type_table[i]; b != NULL; b = next) {
+            next = b->intern_next;
+            b->intern_next = table[b->hash % n];
+            table[b->hash % n] = b;
+        }
+    }
+
+    free(type_table);
+    if (!budgeted) {
+        mem_account(MEM_TYPES, more);
+    }
+    type_table = table;
+    type_table_buckets = n;
+    return true;
+}
+
+/* How much memory an interned type is accounted for: its struct, and for a
+ * struct type its fields and their names. */
+static size_t
+type_mem_size(type_t t)
+{
+    struct tag_struct* s = (struct tag_struct*)(t);
+    size_t n;
+    int i;
+
+    if (type_to_enum(t) == TAG_ARRAY) {
+        return sizeof(struct tag_array);
+    }
+    n = sizeof(struct tag_struct) + s->field_cnt * sizeof(struct tag_struct_pair);
+    for (i = 0; i < s->field_cnt; i++) {
+        n += strlen(s->fields[i].name) + 1;
+    }
+    return n;
+}
+
+/* Gives a newly interned struct type a free UDT ID.  type_mtx must be held by
+ * the caller. */
+static void
+type_udt_assign(struct tag_struct* s)
+{
+    uint16_t id = udt_next;
+    int i;
+
+    for (i = 0; i < TYPE_UDT_ID_MAX; i++, id = id % TYPE_UDT_ID_MAX + 1) {
+        if (id != TAG_STRING_HANDLE && udt_table[id] == NULL) {
+            udt_table[id] = s;
+            s->udt_id = id;
+            udt_next = id % TYPE_UDT_ID_MAX + 1;
+            return;
+        }
+    }
+    pdebug(PLCTAG_DEBUG_WARN, "Out of UDT IDs");
+}
+
+/* Frees a candidate that wasn't interned, with the references to its members
+ * if it owns them. */
+static void
+type_discard(type_t candidate, bool owns_members)
+{
+    struct tag_struct* s = (struct tag_struct*)(candidate);
+    int i;
+
+    if (owns_members) {
+        if (s->t == TAG_ARRAY) {
+            type_free(((struct tag_array*)(candidate))->member_type);
+        } else {
+            for (i = 0; i < s->field_cnt; i++) {
+                type_free(s->fields[i].type);
+            }
+        }
+    }
+    free(candidate);
+}
+
+/* Returns the interned copy of a freshly built candidate type, which is
+ * either consumed or freed, or TAG_ERROR if a new type won't fit the memory
+ * budget (or, unless budgeted, the system's memory).  If owns_members, the
+ * candidate comes with references to its members, which it hands over. */
+static type_t
+type_intern(type_t candidate, bool owns_members, bool budgeted)
+{
+    struct tag_base* c = (struct tag_base*)(candidate);
+    struct tag_base* b;
+    int i;
+
+    c->hash = type_hash(candidate);
+
+    MTX_LOCK(&type_mtx);
+
+    if (type_table_buckets) {
+        for (b = type_table[c->hash % type_table_buckets]; b != NULL; b = b->intern_next) {
+            if (b->hash == c->hash && type_same(b, c)) {
+                __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+                MTX_UNLOCK(&type_mtx);
+                type_discard(candidate, owns_members);
+                return b;
+            }
         }
+    }
+
+    if (budgeted && !mem_charge(MEM_TYPES, type_mem_size(candidate))) {
+        MTX_UNLOCK(&type_mtx);
+        type_discard(candidate, owns_members);
+        return (type_t)(TAG_ERROR);
+    }
+    if (!budgeted) {
+        mem_account(MEM_TYPES, type_mem_size(candidate));
+    }
+
+    /* A full table only needs to grow if it is empty; chains can grow long
+     * instead. */
+    if (type_table_cnt >= type_table_buckets && !type_table_grow(budgeted) && type_table_buckets == 0) {
+        mem_account(MEM_TYPES, -(int64_t)type_mem_size(candidate));
+        MTX_UNLOCK(&type_mtx);
+        type_discard(candidate, owns_members);
+        return (type_t)(TAG_ERROR);
+    }
+
+    /* New type: it now owns references to its members. */
+    if (c->t == TAG_ARRAY) {
+        if (!owns_members) {
+            type_dup(((struct tag_array*)(c))->member_type);
+        }
+    } else {
+        struct tag_struct* s = (struct tag_struct*)(c);
+        for (i = 0; !owns_members && i < s->field_cnt; i++) {
+            type_dup(s->fields[i].type);
+        }
+        type_udt_assign(s);
+    }
 
-        return new;
+    c->refs = 1;
+    c->intern_next = type_table[c->hash % type_table_buckets];
+    type_table[c->hash % type_table_buckets] = c;
+    type_table_cnt++;
+
+    MTX_UNLOCK(&type_mtx);
+
+    return candidate;
+}
+
+type_t
+type_dup(type_t t)
+{
+    enum tag_type_e e = type_to_enum(t);
+
+    if (e == TAG_ARRAY || e == TAG_STRUCT) {
+        __atomic_add_fetch(&((struct tag_base*)(t))->refs, 1, __ATOMIC_RELAXED);
     }
-    /* primitive type; return "copy" by value. */
+    /* primitive types are passed by value. */
     return t;
 }
 
 type_t
 type_new_simple(enum tag_type_e e)
 {
-    if (e >= TAG_BOOL && e <= TAG_LINT) {
+    if (e >= TAG_BOOL && e <= TAG_STRING) {
         return (type_t)(e);
     }
     return (type_t)(TAG_ERROR);
 }
 
-type_t
-type_new_array(uint16_t cnt, type_t member_type)
+static type_t
+type_new_array_impl(uint32_t cnt, type_t member_type, bool opaque, bool budgeted)
 {
     struct tag_array* a;
+    uint64_t size;
 
-    a = malloc(sizeof(struct tag_array));
+    if (type_to_enum(member_type) == TAG_ERROR) {
+        return (type_t)(TAG_ERROR);
+    }
+    if (type_to_enum(member_type) == TAG_BOOL) {
+        size = ((uint64_t)(cnt) + 31) / 32 * 4;
+    } else {
+        size = (uint64_t)(cnt) * type_size_bytes(member_type);
+    }
+    if (size > TYPE_SIZE_MAX) {
+        pdebug(PLCTAG_DEBUG_WARN, "An array of %u %s would be too large", cnt, type_str(member_type));
+        return (type_t)(TAG_ERROR);
+    }
+
+    a = calloc(1, sizeof(struct tag_array));
     if (a == NULL) {
-        err(1, "malloc");
+        return (type_t)(TAG_ERROR);
     }
 
     a->t = TAG_ARRAY;
     a->len = cnt;
-    a->member_type = type_dup(member_type);
+    a->member_type = member_type;
+    a->opaque = opaque;
+    type_layout_array(a);
+
+    return type_intern(a, false, budgeted);
+}
+
+type_t
+type_new_array(uint32_t cnt, type_t member_type)
+{
+    return type_new_array_impl(cnt, member_type, false, true);
+}
 
-    return a;
+type_t
+type_new_array_unbudgeted(uint32_t cnt, type_t member_type)
+{
+    return type_new_array_impl(cnt, member_type, false, false);
+}
+
+type_t
+type_new_opaque(uint32_t size)
+{
+    return type_new_array_impl(size, type_new_simple(TAG_SINT), true, true);
 }
 
 type_t
 type_new_struct(int cnt, ...)
 {
     int i;
+    size_t names_len = 0, fields_len = cnt * sizeof(struct tag_struct_pair);
     struct tag_struct* s;
-    va_list ap;
+    char* names;
+    va_list ap, ap2;
+
     va_start(ap, cnt);
+    va_copy(ap2, ap);
+    for (i = 0; i < cnt; i++) {
+        names_len += strlen(va_arg(ap2, char*)) + 1;
+        if (type_to_enum(va_arg(ap2, type_t)) == TAG_ERROR) {
+            names_len = SIZE_MAX;
+        }
+    }
+    va_end(ap2);
 
-    s = malloc(sizeof(struct tag_struct) + cnt * sizeof(struct tag_struct_pair));
+    /* The field names live after the fields, so a struct is one allocation. */
+    s = names_len == SIZE_MAX ? NULL : calloc(1, sizeof(struct tag_struct) + fields_len + names_len);
     if (s == NULL) {
-        err(1, "malloc");
+        va_end(ap);
+        return (type_t)(TAG_ERROR);
     }
     s->t = TAG_STRUCT;
     s->field_cnt = cnt;
 
+    names = (char*)(s->fields) + fields_len;
     for (i = 0; i < cnt; i++) {
-        s->fields[i].name = strdup(va_arg(ap, char*));
-        s->fields[i].type = type_dup(va_arg(ap, type_t));
+        const char* name = va_arg(ap, char*);
+        size_t len = strlen(name) + 1;
+
+        memcpy(names, name, len);
+        s->fields[i].name = names;
+        s->fields[i].type = va_arg(ap, type_t);
+        names += len;
+    }
+    va_end(ap);
+
+    /* Lay out the candidate before interning it, so that an existing type is
+     * never written to. */
+    if (!type_layout_struct(s)) {
+        type_discard(s, false);
+        return (type_t)(TAG_ERROR);
     }
 
-    return s;
+    return type_intern(s, false, true);
 }
 
 void
 type_free(type_t t)
 {
     enum tag_type_e e = type_to_enum(t);
-    if (e == TAG_ARRAY) {
-        struct tag_array* a = (struct tag_array*)(t);
-        type_free(a->member_type);
-        free(a);
+    struct tag_base* b = (struct tag_base*)(t);
+    struct tag_base** pp;
+    uint32_t refs;
+    int i;
+
+    if (e != TAG_ARRAY && e != TAG_STRUCT) {
+        return;
+    }
+
+    /* Dropping a reference that isn't the last doesn't need the table. */
+    refs = __atomic_load_n(&b->refs, __ATOMIC_RELAXED);
+    while (refs > 1) {
+        if (__atomic_compare_exchange_n(&b->refs, &refs, refs - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
     }
-    if (e == TAG_STRUCT) {
-        int i;
+
+    /* The last one may race with type_intern() handing out a new one. */
+    MTX_LOCK(&type_mtx);
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        MTX_UNLOCK(&type_mtx);
+        return;
+    }
+    for (pp = &type_table[b->hash % type_table_buckets]; *pp != b; pp = (struct tag_base**)&(*pp)->intern_next)
+        ;
+    *pp = b->intern_next;
+    type_table_cnt--;
+    if (e == TAG_STRUCT && ((struct tag_struct*)(t))->udt_id != 0) {
+        udt_table[((struct tag_struct*)(t))->udt_id] = NULL;
+    }
+    MTX_UNLOCK(&type_mtx);
+
+    path_cache_free(t);
+    mem_account(MEM_TYPES, -(int64_t)type_mem_size(t));
+    if (e == TAG_ARRAY) {
+        type_free(((struct tag_array*)(t))->member_type);
+    } else {
         struct tag_struct* s = (struct tag_struct*)(t);
         for (i = 0; i < s->field_cnt; i++) {
-            free(s->fields[i].name);
             type_free(s->fields[i].type);
         }
+        if (s->udt_template != NULL) {
+            mem_account(MEM_TYPES, -(int64_t)(sizeof(struct udt_template) + s->udt_template->len));
+            free(s->udt_template);
+        }
+    }
+    free(t);
+}
+
+/* The encoding is a preorder walk of the type: a byte holding the
+ * enum tag_type_e, then for an array its u32 length and member type, and for
+ * a struct its u16 field count and, per field, a length-prefixed name and
+ * the field's type.  Integers are in host order. */
+static int
+type_encode_at(type_t t, uint8_t* buf, size_t cap, size_t off)
+{
+    enum tag_type_e e = type_to_enum(t);
+    int i;
+
+#define PUT(p, n)                    \
+    do {                             \
+        if (off + (n) > cap) {       \
+            return -1;               \
+        }                            \
+        memcpy(buf + off, (p), (n)); \
+        off += (n);                  \
+    } while (0)
+
+    PUT(&(uint8_t) { e }, 1);
+    if (e == TAG_ARRAY) {
+        struct tag_array* a = (struct tag_array*)(t);
+        PUT(&a->len, sizeof(a->len));
+        PUT(&(uint8_t) { a->opaque }, 1);
+        return type_encode_at(a->member_type, buf, cap, off);
+    } else if (e == TAG_STRUCT) {
+        struct tag_struct* s = (struct tag_struct*)(t);
+        PUT(&s->field_cnt, sizeof(s->field_cnt));
+        for (i = 0; i < s->field_cnt; i++) {
+            size_t len = strlen(s->fields[i].name);
+            if (len > UINT8_MAX) {
+                return -1;
+            }
+            PUT(&(uint8_t) { len }, 1);
+            PUT(s->fields[i].name, len);
+            int ret = type_encode_at(s->fields[i].type, buf, cap, off);
+            if (ret < 0) {
+                return ret;
+            }
+            off = ret;
+        }
+    }
+#undef PUT
+
+    return off;
+}
+
+int
+type_encode(type_t t, uint8_t* buf, size_t cap)
+{
+    return type_encode_at(t, buf, cap, 0);
+}
+
+static type_t
+type_decode_at(const uint8_t* buf, size_t len, size_t* off)
+{
+    uint8_t e;
+
+#define GET(p, n)                    \
+    do {                             \
+        if (*off + (n) > len) {      \
+            return (type_t)(TAG_ERROR);        \
+        }                            \
+        memcpy((p), buf + *off, (n)); \
+        *off += (n);                 \
+    } while (0)
+
+    GET(&e, 1);
+    if (e == TAG_ARRAY) {
+        uint32_t cnt;
+        uint8_t opaque;
+        type_t member, ret;
+
+        GET(&cnt, sizeof(cnt));
+        GET(&opaque, 1);
+        member = type_decode_at(buf, len, off);
+        if (type_to_enum(member) == TAG_ERROR || (opaque && member != type_new_simple(TAG_SINT))) {
+            return (type_t)(TAG_ERROR);
+        }
+        ret = type_new_array_impl(cnt, member, opaque != 0, true);
+        type_free(member);
+        return ret;
+    } else if (e == TAG_STRUCT) {
+        uint16_t cnt, i;
+        uint8_t name_len;
+        struct tag_struct* s;
+        char* names;
+        size_t names_len = 0;
+
+        GET(&cnt, sizeof(cnt));
+
+        /* Build the candidate in one allocation, as type_new_struct() does;
+         * names can't be longer than the encoding itself. */
+        s = calloc(1, sizeof(struct tag_struct) + cnt * sizeof(struct tag_struct_pair) + len + cnt);
+        if (s == NULL) {
+            return (type_t)(TAG_ERROR);
+        }
+        s->t = TAG_STRUCT;
+        names = (char*)(s->fields) + cnt * sizeof(struct tag_struct_pair);
+
+        for (i = 0; i < cnt; i++) {
+            if (*off + 1 > len || *off + 1 + buf[*off] > len) {
+                break;
+            }
+            name_len = buf[(*off)++];
+            memcpy(names + names_len, buf + *off, name_len);
+            *off += name_len;
+            s->fields[i].name = names + names_len;
+            names_len += name_len + 1;
+
+            s->fields[i].type = type_decode_at(buf, len, off);
+            if (type_to_enum(s->fields[i].type) == TAG_ERROR) {
+                break;
+            }
+            s->field_cnt++;
+        }
+
+        if (s->field_cnt != cnt) {
+            for (i = 0; i < s->field_cnt; i++) {
+                type_free(s->fields[i].type);
+            }
+            free(s);
+            return (type_t)(TAG_ERROR);
+        }
+
+        /* The candidate hands the references to its fields over. */
+        if (!type_layout_struct(s)) {
+            type_discard(s, true);
+            return (type_t)(TAG_ERROR);
+        }
+        return type_intern(s, true, true);
     }
+#undef GET
+
+    return type_new_simple(e);
+}
+
+type_t
+type_decode(const uint8_t* buf, size_t len)
+{
+    size_t off = 0;
+    type_t ret = type_decode_at(buf, len, &off);
+
+    if (off != len) {
+        type_free(ret);
+        return (type_t)(TAG_ERROR);
+    }
+    return ret;
 }
 
 size_t
 type_size_bytes(type_t t)
+{
+    enum tag_type_e e = type_to_enum(t);
+    switch (e) {
+    case TAG_ARRAY:
+        return ((struct tag_array*)(t))->size;
+    case TAG_STRUCT:
+        return ((struct tag_struct*)(t))->size;
+    default:
+        return simple_sizes[e];
+    }
+}
+
+size_t
+type_align_bytes(type_t t)
 {
     enum tag_type_e e = type_to_enum(t);
     switch (e) {
     case TAG_ERROR:
-        return 0;
-    case TAG_BOOL:
         return 1;
+    case TAG_STRING:
+        return 4; /* as the DINT it starts with */
+    case TAG_ARRAY:
+        return ((struct tag_array*)(t))->align;
+    case TAG_STRUCT:
+        return ((struct tag_struct*)(t))->align;
+    default:
+        return simple_sizes[e];
+    }
+}
+
+void
+type_init_data(type_t t, char* data)
+{
+    struct tag_array* a;
+    struct tag_struct* s;
+    uint32_t i;
+
+    switch (type_to_enum(t)) {
+    case TAG_STRING:
+        memset(data, 0, sizeof(int32_t));
+        break;
+    case TAG_ARRAY:
+        a = t;
+        for (i = 0; a->stride && i < a->len; i++) {
+            type_init_data(a->member_type, data + i * a->stride);
+        }
+        break;
+    case TAG_STRUCT:
+        s = t;
+        for (i = 0; i < s->field_cnt; i++) {
+            type_init_data(s->fields[i].type, data + s->fields[i].offset);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+uint32_t
+type_elem_count(type_t t)
+{
+    if (type_to_enum(t) == TAG_ARRAY) {
+        return ((struct tag_array*)(t))->elem_count;
+    }
+    return 1;
+}
+
+uint32_t
+type_elem_size(type_t t)
+{
+    if (type_to_enum(t) == TAG_ARRAY) {
+        return ((struct tag_array*)(t))->elem_size;
+    }
+    return type_size_bytes(t);
+}
+
+uint16_t
+type_cip_code(type_t t)
+{
+    if (type_is_bit_array(t)) {
+        return 0xd3; /* DWORD: a BOOL array's 32-bit words */
+    }
+    while (type_to_enum(t) == TAG_ARRAY) {
+        t = ((struct tag_array*)(t))->member_type;
+    }
+
+    switch (type_to_enum(t)) {
+    case TAG_BOOL:
+        return 0xc1;
     case TAG_SINT:
-        return 1;
+        return 0xc2;
     case TAG_INT:
-        return 2;
+        return 0xc3;
     case TAG_DINT:
-        return 4;
-    case TAG_REAL:
-        return 4;
+        return 0xc4;
     case TAG_LINT:
-        return 8;
-    case TAG_ARRAY: {
-        struct tag_array* a = (struct tag_array*)(t);
-        return type_size_bytes(a->member_type) * a->len;
+        return 0xc5;
+    case TAG_REAL:
+        return 0xca;
+    case TAG_STRING:
+        return 0x8000 | TAG_STRING_HANDLE;
+    case TAG_STRUCT:
+        return 0x8000 | ((struct tag_struct*)(t))->udt_id;
+    default:
+        return 0;
     }
-    case TAG_STRUCT: {
-        int i;
-        size_t sz = 0;
-        struct tag_struct* s = (struct tag_struct*)(t);
-        for (i = 0; i < s->field_cnt; i++) {
-            sz += type_size_bytes(s->fields[i].type);
+}
+
+uint16_t
+type_struct_handle(type_t t)
+{
+    while (type_to_enum(t) == TAG_ARRAY) {
+        t = ((struct tag_array*)(t))->member_type;
+    }
+
+    switch (type_to_enum(t)) {
+    case TAG_STRING:
+        return TAG_STRING_HANDLE;
+    case TAG_STRUCT:
+        return ((struct tag_struct*)(t))->hash & 0xffff;
+    default:
+        return 0;
+    }
+}
+
+type_t
+type_udt_lookup(uint16_t udt_id)
+{
+    type_t ret = SIMPLE_TYPE(TAG_ERROR);
+
+    if (udt_id == TAG_STRING_HANDLE) {
+        return SIMPLE_TYPE(TAG_STRING);
+    }
+    if (udt_id == 0 || udt_id > TYPE_UDT_ID_MAX) {
+        return ret;
+    }
+
+    MTX_LOCK(&type_mtx);
+    if (udt_table[udt_id] != NULL) {
+        ret = type_dup(udt_table[udt_id]);
+    }
+    MTX_UNLOCK(&type_mtx);
+
+    return ret;
+}
+
+static uint8_t*
+type_put_u16(uint8_t* p, uint16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static uint8_t*
+type_put_u32(uint8_t* p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+/* Serialises the template of a struct with the given fields.  Integers are
+ * in host order, as in the "@tags" listing. */
+static struct udt_template*
+type_udt_template_build(const char* name, uint16_t udt_id, uint16_t handle, uint32_t size,
+    const struct tag_struct_pair* fields, int cnt)
+{
+    struct udt_template* tpl;
+    size_t names_len, len;
+    uint16_t info, code;
+    uint8_t* p;
+    int i;
+
+    names_len = strlen(name) + 1;
+    for (i = 0; i < cnt; i++) {
+        names_len += strlen(fields[i].name) + 1;
+    }
+    len = 14 + cnt * 8 + names_len;
+
+    tpl = mem_alloc(MEM_TYPES, sizeof(struct udt_template) + len);
+    if (tpl == NULL) {
+        return NULL;
+    }
+    tpl->len = len;
+
+    p = type_put_u16(tpl->data, udt_id);
+    p = type_put_u32(p, (cnt * 8 + names_len + 3) / 4);
+    p = type_put_u32(p, size);
+    p = type_put_u16(p, cnt);
+    p = type_put_u16(p, handle);
+
+    for (i = 0; i < cnt; i++) {
+        /* Array members have bit 13 of their type code set. */
+        if (type_to_enum(fields[i].type) == TAG_ARRAY) {
+            info = type_elem_count(fields[i].type);
+            code = type_cip_code(fields[i].type) | 0x2000;
+        } else {
+            info = type_to_enum(fields[i].type) == TAG_BOOL ? fields[i].bit : 0;
+            code = type_cip_code(fields[i].type);
         }
-        return sz;
+        p = type_put_u16(p, info);
+        p = type_put_u16(p, code);
+        p = type_put_u32(p, fields[i].offset);
     }
+
+    memcpy(p, name, strlen(name) + 1);
+    p += strlen(name) + 1;
+    for (i = 0; i < cnt; i++) {
+        memcpy(p, fields[i].name, strlen(fields[i].name) + 1);
+        p += strlen(fields[i].name) + 1;
     }
+
+    return tpl;
+}
+
+const uint8_t*
+type_udt_template(type_t t, size_t* len)
+{
+    struct tag_struct* s = (struct tag_struct*)(t);
+    struct udt_template **cache, *tpl, *expected = NULL;
+    struct tag_struct_pair string_fields[2];
+    char name[16];
+
+    if (type_to_enum(t) == TAG_STRUCT) {
+        cache = &s->udt_template;
+    } else if (type_to_enum(t) == TAG_STRING) {
+        cache = &string_template;
+    } else {
+        return NULL;
+    }
+
+    tpl = __atomic_load_n(cache, __ATOMIC_ACQUIRE);
+    if (tpl == NULL) {
+        if (type_to_enum(t) == TAG_STRING) {
+            string_fields[0] = (struct tag_struct_pair) { "LEN", SIMPLE_TYPE(TAG_DINT), 0, 0 };
+            string_fields[1] = (struct tag_struct_pair) {
+                "DATA", type_new_array(TAG_STRING_CAPACITY, SIMPLE_TYPE(TAG_SINT)), TAG_STRING_DATA, 0
+            };
+            tpl = type_to_enum(string_fields[1].type) == TAG_ERROR
+                ? NULL
+                : type_udt_template_build("STRING", TAG_STRING_HANDLE, TAG_STRING_HANDLE, TAG_STRING_SIZE,
+                    string_fields, 2);
+            type_free(string_fields[1].type);
+        } else {
+            snprintf(name, sizeof(name), "UDT_%u", s->udt_id);
+            tpl = type_udt_template_build(name, s->udt_id, type_struct_handle(t), s->size, s->fields, s->field_cnt);
+        }
+        if (tpl == NULL) {
+            return NULL;
+        }
+
+        /* Another thread may have got there first. */
+        if (!__atomic_compare_exchange_n(cache, &expected, tpl, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            mem_free(MEM_TYPES, tpl, sizeof(struct udt_template) + tpl->len);
+            tpl = expected;
+        }
+    }
+
+    *len = tpl->len;
+    return tpl->data;
+}
+
+int
+type_array_dims(type_t t, uint32_t dims[3])
+{
+    int n = 0;
+
+    dims[0] = dims[1] = dims[2] = 0;
+    while (type_to_enum(t) == TAG_ARRAY && !((struct tag_array*)(t))->opaque && n < 3) {
+        struct tag_array* a = (struct tag_array*)(t);
+        dims[n++] = a->len;
+        t = a->member_type;
+    }
+    return n;
+}
+
+bool
+type_is_bit_array(type_t t)
+{
+    return type_to_enum(t) == TAG_ARRAY
+        && type_to_enum(((struct tag_array*)(t))->member_type) == TAG_BOOL;
 }
 
 bool
@@ -182,6 +1019,7 @@ type_is_scalar(type_t t)
     case TAG_DINT:
     case TAG_REAL:
     case TAG_LINT:
+    case TAG_STRING:
         return true;
     case TAG_ARRAY:
     case TAG_STRUCT:
@@ -206,6 +1044,8 @@ type_str(type_t t)
         return "REAL";
     case TAG_LINT:
         return "LINT";
+    case TAG_STRING:
+        return "STRING";
     case TAG_ARRAY:
         return "ARRAY";
     case TAG_STRUCT:
@@ -1,4 +1,6 @@
 #include <err.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "debug.h"
@@ -9,6 +11,32 @@
 /* This is the name of the first tag that will be reported back. */
 #define TAG_NAME_LENGTH (uint16_t)(strlen("DUMMY_AQUA_DATA_0"))
 
+#define CHURNS 2000
+
+static volatile int done;
+
+/* Walks the metatag's entries, as a client listing the tags would. */
+static void*
+lister(void* arg)
+{
+    int size, offset;
+
+    (void)(arg);
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        plc_tag_lock(METATAG_ID);
+        size = plc_tag_get_size(METATAG_ID);
+        for (offset = 0; offset + (int)sizeof(struct metatag_t) <= size;
+             offset += sizeof(struct metatag_t) + plc_tag_get_uint16(METATAG_ID, offset + offsetof(struct metatag_t, length))) {
+        }
+        if (offset != size) {
+            errx(1, "@tags entries end at %d of %d bytes", offset, size);
+        }
+        plc_tag_unlock(METATAG_ID);
+        plc_tag_get_int32(METATAG_ID, 0);
+    }
+    return NULL;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -66,5 +94,40 @@ main(int argc, char** argv)
         printf("tag_tree_node creation successful with return value %d\n", ret);
     }
 
+    /* Held, the metatag stays as it was, however the catalog changes. */
+    plc_tag_lock(METATAG_ID);
+    s4 = plc_tag_get_size(METATAG_ID);
+    ret = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=WhileHeld", 1000);
+    if (ret < 0) {
+        errx(1, "plc_tag_create returned %d", ret);
+    }
+    if ((ret = plc_tag_get_size(METATAG_ID)) != s4) {
+        errx(1, "@tags changed from %d to %d bytes while held", s4, ret);
+    }
+    plc_tag_unlock(METATAG_ID);
+    if ((ret = plc_tag_get_size(METATAG_ID)) <= s4) {
+        errx(1, "@tags is still %d bytes after a tag was added", ret);
+    }
+
+    /* ...and isn't freed from under its readers as tags come and go. */
+    pthread_t th[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        pthread_create(&th[i], NULL, lister, NULL);
+    }
+    for (i = 0; i < CHURNS; i++) {
+        ret = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1&name=Churn", 1000);
+        if (ret < 0) {
+            errx(1, "plc_tag_create returned %d", ret);
+        }
+        plc_tag_get_size(METATAG_ID);
+        plc_tag_destroy(ret);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < 2; i++) {
+        pthread_join(th[i], NULL);
+    }
+
     return 0;
 }
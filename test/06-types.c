@@ -2,6 +2,7 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "libplctag.h"
@@ -22,6 +23,9 @@ type_t array_of_16_bools;
 type_t array_of_7_dints;
 
 type_t struct_of_three_ints;
+type_t struct_mixed;
+type_t struct_with_lint;
+type_t array_of_structs;
 
 void
 test_tag_type()
@@ -45,6 +49,8 @@ test_tag_type()
 void
 test_tag_size()
 {
+    type_t big;
+
     assert(type_size_bytes(NULL) == 0);
     assert(type_size_bytes(nonsense) == 0);
 
@@ -55,10 +61,62 @@ test_tag_size()
     assert(type_size_bytes(real_literal) == 4);
     assert(type_size_bytes(lint_literal) == 8);
 
-    assert(type_size_bytes(array_of_16_bools) == 16);
+    /* BOOL arrays are packed into DWORDs. */
+    assert(type_size_bytes(array_of_16_bools) == 4);
     assert(type_size_bytes(array_of_7_dints) == 4 * 7);
 
-    assert(type_size_bytes(struct_of_three_ints) == 2 * 3);
+    /* Logix pads structures out to a multiple of four bytes. */
+    assert(type_size_bytes(struct_of_three_ints) == 8);
+
+    /* Structs, like arrays, may not be larger than TYPE_SIZE_MAX. */
+    big = type_new_array(TYPE_SIZE_MAX - 8, sint_literal);
+    assert(type_to_enum(big) == TAG_ARRAY);
+    assert(type_to_enum(type_new_struct(2, "a", big, "b", big)) == TAG_ERROR);
+    assert(type_to_enum(type_new_struct(3, "a", big, "b", big, "c", big)) == TAG_ERROR);
+    type_free(big);
+}
+
+void
+test_tag_layout()
+{
+    struct tag_struct* s;
+    struct tag_array* a;
+
+    assert(type_align_bytes(int_literal) == 2);
+    assert(type_align_bytes(lint_literal) == 8);
+    assert(type_align_bytes(struct_of_three_ints) == 4);
+
+    s = (struct tag_struct*)(struct_of_three_ints);
+    assert(s->fields[0].offset == 0);
+    assert(s->fields[1].offset == 2);
+    assert(s->fields[2].offset == 4);
+
+    /* SINT a; DINT b; BOOL c; BOOL d; INT e; SINT[3] f */
+    s = (struct tag_struct*)(struct_mixed);
+    assert(s->fields[0].offset == 0);
+    assert(s->fields[1].offset == 4);
+    assert(s->fields[2].offset == 8 && s->fields[2].bit == 0);
+    assert(s->fields[3].offset == 8 && s->fields[3].bit == 1);
+    assert(s->fields[4].offset == 10);
+    assert(s->fields[5].offset == 12);
+    assert(type_size_bytes(struct_mixed) == 16);
+
+    /* SINT a; LINT b */
+    s = (struct tag_struct*)(struct_with_lint);
+    assert(s->fields[1].offset == 8);
+    assert(type_align_bytes(struct_with_lint) == 8);
+    assert(type_size_bytes(struct_with_lint) == 16);
+
+    a = (struct tag_array*)(array_of_structs);
+    assert(a->stride == 16);
+    assert(type_size_bytes(array_of_structs) == 16 * 5);
+
+    a = (struct tag_array*)(array_of_7_dints);
+    assert(a->stride == 4);
+
+    a = (struct tag_array*)(array_of_16_bools);
+    assert(a->elem_count == 1 && a->elem_size == 4);
+    assert(type_cip_code(array_of_16_bools) == 0xd3);
 }
 
 void
@@ -75,6 +133,41 @@ test_tag_dup()
     assert(type_to_enum(type_dup(lint_literal)) == TAG_LINT);
 }
 
+void
+test_tag_interning()
+{
+    type_t a, b, c;
+
+    /* Identical types are shared... */
+    a = type_new_struct(2,
+        "Value", SIMPLE_TYPE(TAG_DINT),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    b = type_new_struct(2,
+        "Value", SIMPLE_TYPE(TAG_DINT),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    assert(a == b);
+    assert(type_new_array(7, SIMPLE_TYPE(TAG_DINT)) == array_of_7_dints);
+    type_free(array_of_7_dints);
+
+    /* ...but anything that differs is not. */
+    c = type_new_struct(2,
+        "Value", SIMPLE_TYPE(TAG_DINT),
+        "Speed", type_new_array(5, SIMPLE_TYPE(TAG_REAL)));
+    assert(c != a);
+    type_free(c);
+    c = type_new_struct(2,
+        "value", SIMPLE_TYPE(TAG_DINT),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    assert(c != a);
+    type_free(c);
+
+    /* A type outlives all but its last reference. */
+    type_free(a);
+    assert(type_size_bytes(b) == 20);
+    assert(strcmp(((struct tag_struct*)(b))->fields[1].name, "Speed") == 0);
+    type_free(b);
+}
+
 void
 init()
 {
@@ -84,6 +177,17 @@ init()
         "field_1", SIMPLE_TYPE(TAG_INT),
         "field_2", SIMPLE_TYPE(TAG_INT),
         "field_3", SIMPLE_TYPE(TAG_INT));
+    struct_mixed = type_new_struct(6,
+        "a", SIMPLE_TYPE(TAG_SINT),
+        "b", SIMPLE_TYPE(TAG_DINT),
+        "c", SIMPLE_TYPE(TAG_BOOL),
+        "d", SIMPLE_TYPE(TAG_BOOL),
+        "e", SIMPLE_TYPE(TAG_INT),
+        "f", type_new_array(3, SIMPLE_TYPE(TAG_SINT)));
+    struct_with_lint = type_new_struct(2,
+        "a", SIMPLE_TYPE(TAG_SINT),
+        "b", SIMPLE_TYPE(TAG_LINT));
+    array_of_structs = type_new_array(5, struct_mixed);
 }
 
 void
@@ -92,6 +196,9 @@ tidy()
     type_free(array_of_16_bools);
     type_free(array_of_7_dints);
     type_free(struct_of_three_ints);
+    type_free(struct_mixed);
+    type_free(struct_with_lint);
+    type_free(array_of_structs);
 }
 
 int
@@ -101,6 +208,8 @@ main(int argc, char** argv)
 
     test_tag_type();
     test_tag_size();
+    test_tag_interning();
+    test_tag_layout();
 
     tidy();
 
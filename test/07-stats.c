@@ -0,0 +1,93 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "stats.h"
+#include "tagtree.h"
+
+#define TAGID 2
+#define THREADS 8
+#define ITERS 1000
+
+void*
+thread_entry(void* arg)
+{
+    int i;
+
+    for (i = 0; i < ITERS; i++) {
+        plc_tag_set_int16(TAGID, 0, i);
+        (void)plc_tag_get_int16(TAGID, 0);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    int i, ret;
+    int64_t v;
+    int32_t stats_id;
+    pthread_t threads[THREADS];
+
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_entry, NULL)) {
+            errx(1, "pthread_create");
+        }
+    }
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            errx(1, "pthread_join");
+        }
+    }
+
+    /* Per-tag counters */
+    if ((ret = plc_tag_get_int_attribute(TAGID, "gets", -1)) != THREADS * ITERS) {
+        errx(1, "tag %d: expected %d gets, got %d", TAGID, THREADS * ITERS, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(TAGID, "sets", -1)) != THREADS * ITERS) {
+        errx(1, "tag %d: expected %d sets, got %d", TAGID, THREADS * ITERS, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(TAGID + 1, "gets", -1)) != 0) {
+        errx(1, "tag %d: expected 0 gets, got %d", TAGID + 1, ret);
+    }
+    /* Library-wide counters are per-tag only for a subset. */
+    if ((ret = plc_tag_get_int_attribute(TAGID, "creates", -1)) != -1) {
+        errx(1, "tag %d: expected no creates attribute, got %d", TAGID, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "creates", -1)) != NTAGS) {
+        errx(1, "expected %d creates, got %d", NTAGS, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "bogus", -1)) != -1) {
+        errx(1, "expected default value for unknown attribute, got %d", ret);
+    }
+
+    /* The @stats pseudo-tag */
+    stats_id = plc_tag_create("protocol=ab_eip&name=@stats", 1000);
+    if (stats_id != STATSTAG_ID) {
+        errx(1, "plc_tag_create(@stats) returned %d", stats_id);
+    }
+    if ((ret = plc_tag_read(stats_id, 1000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read(@stats) returned %d", ret);
+    }
+    if ((v = plc_tag_get_int64(stats_id, STAT_GETS)) != THREADS * ITERS) {
+        errx(1, "@stats: expected %d gets, got %ld", THREADS * ITERS, v);
+    }
+    if ((v = plc_tag_get_int64(stats_id, STAT_READS)) != 1) {
+        errx(1, "@stats: expected 1 read, got %ld", v);
+    }
+
+    /* The snapshot only moves on a read. */
+    (void)plc_tag_get_int16(TAGID, 0);
+    if ((v = plc_tag_get_int64(stats_id, STAT_GETS)) != THREADS * ITERS) {
+        errx(1, "@stats: expected %d gets, got %ld", THREADS * ITERS, v);
+    }
+    plc_tag_read(stats_id, 1000);
+    if ((v = plc_tag_get_int64(stats_id, STAT_GETS)) != THREADS * ITERS + 4) {
+        errx(1, "@stats: expected %d gets, got %ld", THREADS * ITERS + 4, v);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
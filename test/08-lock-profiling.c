@@ -0,0 +1,66 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+
+#define TAGID 5
+#define THREADS 8
+#define ITERS 1000
+
+void*
+thread_entry(void* arg)
+{
+    int i;
+
+    for (i = 0; i < ITERS; i++) {
+        plc_tag_set_int32(TAGID, 0, i);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    int i, ret;
+    pthread_t threads[THREADS];
+
+    if ((ret = plc_tag_set_int_attribute(0, "lock_hold_warn_ms", 1)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_int_attribute returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "lock_hold_warn_ms", -1)) != 1) {
+        errx(1, "lock_hold_warn_ms: expected 1, got %d", ret);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_entry, NULL)) {
+            errx(1, "pthread_create");
+        }
+    }
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            errx(1, "pthread_join");
+        }
+    }
+
+    /* Should be flagged as a long hold when profiling. */
+    plc_tag_lock(TAGID);
+    usleep(5000);
+    plc_tag_unlock(TAGID);
+
+    ret = plc_tag_lock_report(3);
+#ifdef LOCK_PROFILING
+    if (ret != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_lock_report returned %s", plc_tag_decode_error(ret));
+    }
+#else
+    if (ret != PLCTAG_ERR_UNSUPPORTED) {
+        errx(1, "plc_tag_lock_report returned %s", plc_tag_decode_error(ret));
+    }
+#endif
+
+    printf("Test passed!\n");
+    return 0;
+}
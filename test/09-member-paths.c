@@ -0,0 +1,125 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "path.h"
+#include "tagtree.h"
+#include "types.h"
+
+#define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
+
+int
+main(int argc, char** argv)
+{
+    type_t status, motor, line, scratch;
+    int32_t tag, other, unrelated, speed, speed_again, running, fault, id, ret, first;
+    int i;
+    float f;
+
+    /* Line { DINT Id; Motor[2] Motors; } where
+     * Motor { INT Rpm; Status Status; } and
+     * Status { BOOL Running; BOOL Fault; REAL Speed[4]; } */
+    status = type_new_struct(3,
+        "Running", SIMPLE_TYPE(TAG_BOOL),
+        "Fault", SIMPLE_TYPE(TAG_BOOL),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    motor = type_new_struct(2,
+        "Rpm", SIMPLE_TYPE(TAG_INT),
+        "Status", status);
+    line = type_new_struct(2,
+        "Id", SIMPLE_TYPE(TAG_DINT),
+        "Motors", type_new_array(2, motor));
+
+    tag = tag_tree_insert("Line1", line);
+    other = tag_tree_insert("Line2", line);
+    unrelated = tag_tree_insert("Motor1", motor);
+
+    speed = plc_tag_resolve_path(tag, "Motors[1].Status.Speed[3]");
+    if (speed <= 0) {
+        errx(1, "plc_tag_resolve_path returned %s", plc_tag_decode_error(speed));
+    }
+    /* Cached: the same string resolves to the same handle. */
+    speed_again = plc_tag_resolve_path(tag, "Motors[1].Status.Speed[3]");
+    if (speed_again != speed) {
+        errx(1, "expected cached handle %d, got %d", speed, speed_again);
+    }
+
+    running = plc_tag_resolve_path(tag, "motors[1].status.running");
+    fault = plc_tag_resolve_path(tag, "Motors[1].Status.Fault");
+    id = plc_tag_resolve_path(tag, "Id");
+    if (running <= 0 || fault <= 0 || id <= 0) {
+        errx(1, "plc_tag_resolve_path failed: %d %d %d", running, fault, id);
+    }
+
+    if ((ret = plc_tag_set_float32_path(tag, speed, 42.5f)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_float32_path returned %s", plc_tag_decode_error(ret));
+    }
+    if ((f = plc_tag_get_float32_path(tag, speed)) != 42.5f) {
+        errx(1, "expected 42.5, got %f", f);
+    }
+
+    plc_tag_set_bit_path(tag, running, 0);
+    plc_tag_set_bit_path(tag, fault, 1);
+    if (plc_tag_get_bit_path(tag, running) != 0 || plc_tag_get_bit_path(tag, fault) != 1) {
+        errx(1, "BOOL members share a byte but should not clobber one another");
+    }
+
+    plc_tag_set_int32_path(tag, id, 1234);
+    if ((ret = plc_tag_get_int32_path(tag, id)) != 1234) {
+        errx(1, "expected 1234, got %d", ret);
+    }
+
+    /* Tags of the same type share it, and so share compiled paths. */
+    plc_tag_set_int32_path(other, id, 5678);
+    if ((ret = plc_tag_get_int32_path(other, id)) != 5678 || plc_tag_get_int32_path(tag, id) != 1234) {
+        errx(1, "expected 5678 and 1234, got %d", ret);
+    }
+
+    /* Bad accesses */
+    if ((ret = plc_tag_get_int16_path(tag, id)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "width mismatch: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_get_int32_path(unrelated, id)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "wrong tag: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_get_int32_path(tag, 9999)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "bad handle: expected PLCTAG_ERR_NOT_FOUND, got %d", ret);
+    }
+    if ((ret = plc_tag_resolve_path(tag, "Motors[2].Rpm")) != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        errx(1, "expected PLCTAG_ERR_OUT_OF_BOUNDS, got %d", ret);
+    }
+    if ((ret = plc_tag_resolve_path(tag, "Motors[0].Torque")) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected PLCTAG_ERR_NOT_FOUND, got %d", ret);
+    }
+    if ((ret = plc_tag_resolve_path(tag, "Id.Foo")) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_resolve_path(tag, "Motors[0")) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_resolve_path(2, "Id")) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "scalar tag: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+
+    /* The handles of paths into a freed type are reused. */
+    first = 0;
+    for (i = 0; i < 10000; i++) {
+        scratch = type_new_array(7, SIMPLE_TYPE(TAG_DINT));
+        if ((ret = path_resolve(scratch, "[1]")) <= 0) {
+            errx(1, "path_resolve returned %d", ret);
+        }
+        if (first == 0) {
+            first = ret;
+        } else if (ret != first) {
+            errx(1, "path %d: expected handle %d to be reused, got %d", i, first, ret);
+        }
+        type_free(scratch);
+        if (path_get(ret) != NULL) {
+            errx(1, "handle %d outlived its type", ret);
+        }
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+
+/* From tags.inc */
+#define DINT_ARRAY_ID 12 /* DINT[10] */
+#define REAL_2D_ID 13 /* REAL[2,3] */
+
+void
+check_attr(int32_t tag, const char* attr, int expected)
+{
+    int got = plc_tag_get_int_attribute(tag, attr, -1);
+    if (got != expected) {
+        errx(1, "tag %d: expected %s %d, got %d", tag, attr, expected, got);
+    }
+}
+
+/* Walks the @tags buffer looking for the given tag's entry. */
+int
+find_metatag_entry(int32_t id)
+{
+    int offset = 0, size;
+
+    plc_tag_read(METATAG_ID, 1000);
+    size = plc_tag_get_size(METATAG_ID);
+
+    while (offset < size) {
+        if (plc_tag_get_uint32(METATAG_ID, offset) == (uint32_t)id) {
+            return offset;
+        }
+        offset += sizeof(struct metatag_t) + plc_tag_get_uint16(METATAG_ID, offset + 20);
+    }
+    errx(1, "tag %d not found in @tags", id);
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t tag;
+    int ret, offset;
+
+    tag = plc_tag_create("protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=4&elem_count=16&name=TestBigArray[0]", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(tag));
+    }
+
+    if ((ret = plc_tag_get_size(tag)) != 4 * 16) {
+        errx(1, "expected size %d, got %d", 4 * 16, ret);
+    }
+    check_attr(tag, "elem_size", 4);
+    check_attr(tag, "elem_count", 16);
+
+    if ((ret = plc_tag_set_int32(tag, 15, 0x12345678)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_int32 returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_get_int32(tag, 15)) != 0x12345678) {
+        errx(1, "expected %d, got %d", 0x12345678, ret);
+    }
+    if ((ret = plc_tag_get_int32(tag, 16)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "index 16: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_set_int64(tag, 15, 0)) != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        errx(1, "overrun: expected PLCTAG_ERR_OUT_OF_BOUNDS, got %d", ret);
+    }
+
+    /* Odd element sizes are opaque byte arrays. */
+    tag = plc_tag_create("protocol=ab_eip&elem_size=88&elem_count=3&name=Strings", 1000);
+    if ((ret = plc_tag_get_size(tag)) != 88 * 3) {
+        errx(1, "expected size %d, got %d", 88 * 3, ret);
+    }
+
+    /* ...which keep the elem_size and elem_count they were made with. */
+    tag = plc_tag_create("protocol=ab_eip&elem_size=5&elem_count=10&name=Odd", 1000);
+    check_attr(tag, "size", 50);
+    check_attr(tag, "elem_size", 5);
+    check_attr(tag, "elem_count", 10);
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=5&name=Odd", 1000)) < 0) {
+        errx(1, "attaching to Odd by elem_size: got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_count=10&name=Odd", 1000)) < 0) {
+        errx(1, "attaching to Odd by elem_count: got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=1&name=Odd", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "attaching to Odd as SINTs: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    offset = find_metatag_entry(tag);
+    if ((ret = plc_tag_get_uint16(METATAG_ID, offset + 6)) != 5) {
+        errx(1, "Odd: expected elem_size 5 in @tags, got %d", ret);
+    }
+    if (plc_tag_get_uint32(METATAG_ID, offset + 8) != 10 || plc_tag_get_uint32(METATAG_ID, offset + 12) != 0) {
+        errx(1, "Odd: wrong dimensions in @tags");
+    }
+
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=0&name=Bad", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "elem_size=0: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_count=x&name=Bad", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "elem_count=x: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=1073741825&name=Bad", 1000)) != PLCTAG_ERR_TOO_LARGE) {
+        errx(1, "4 x 1073741825: expected PLCTAG_ERR_TOO_LARGE, got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=2147483647&elem_count=2147483647&name=Bad", 1000)) != PLCTAG_ERR_TOO_LARGE) {
+        errx(1, "2147483647 x 2147483647: expected PLCTAG_ERR_TOO_LARGE, got %d", ret);
+    }
+
+    /* Arrays from tags.inc */
+    check_attr(DINT_ARRAY_ID, "elem_count", 10);
+    check_attr(REAL_2D_ID, "elem_count", 6);
+    check_attr(REAL_2D_ID, "elem_size", 4);
+    check_attr(REAL_2D_ID, "size", 24);
+
+    plc_tag_set_float32(REAL_2D_ID, 5, 1.5f);
+    if (plc_tag_get_float32(REAL_2D_ID, 5) != 1.5f) {
+        errx(1, "REAL[2,3]: read back the wrong value");
+    }
+
+    offset = find_metatag_entry(REAL_2D_ID);
+    if ((ret = plc_tag_get_uint16(METATAG_ID, offset + 4)) != ((2 << 13) | 0xca)) {
+        errx(1, "REAL[2,3]: expected type 0x%x, got 0x%x", (2 << 13) | 0xca, ret);
+    }
+    if ((ret = plc_tag_get_uint16(METATAG_ID, offset + 6)) != 4) {
+        errx(1, "REAL[2,3]: expected elem_size 4, got %d", ret);
+    }
+    if (plc_tag_get_uint32(METATAG_ID, offset + 8) != 2
+        || plc_tag_get_uint32(METATAG_ID, offset + 12) != 3
+        || plc_tag_get_uint32(METATAG_ID, offset + 16) != 0) {
+        errx(1, "REAL[2,3]: wrong dimensions in @tags");
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "tagtree.h"
+#include "types.h"
+
+#define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
+
+#define NBITS 200
+
+/* The reference the bulk operations are checked against. */
+static int bits[NBITS];
+
+int
+main(int argc, char** argv)
+{
+    type_t alarms;
+    int32_t tag;
+    uint32_t words[(NBITS + 31) / 32];
+    int i, first, count, ret, expected;
+
+    alarms = type_new_array(NBITS, SIMPLE_TYPE(TAG_BOOL));
+    tag = tag_tree_insert("Alarms", alarms);
+
+    /* 200 BOOLs pack into seven DWORDs. */
+    if ((ret = plc_tag_get_size(tag)) != 7 * 4) {
+        errx(1, "expected size %d, got %d", 7 * 4, ret);
+    }
+
+    srand(1);
+    for (i = 0; i < NBITS; i++) {
+        bits[i] = rand() % 7 == 0;
+        if ((ret = plc_tag_set_bit(tag, i, bits[i])) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_set_bit(%d) returned %s", i, plc_tag_decode_error(ret));
+        }
+    }
+    for (i = 0; i < NBITS; i++) {
+        if (plc_tag_get_bit(tag, i) != bits[i]) {
+            errx(1, "bit %d: expected %d", i, bits[i]);
+        }
+    }
+
+    /* Bit i lives in bit i % 32 of DWORD i / 32. */
+    for (i = 0; i < NBITS; i++) {
+        if ((int)((plc_tag_get_uint32(tag, i / 32) >> (i % 32)) & 1) != bits[i]) {
+            errx(1, "bit %d is not where Logix would put it", i);
+        }
+    }
+
+    if ((ret = plc_tag_get_bit(tag, NBITS)) != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        errx(1, "bit %d: expected PLCTAG_ERR_OUT_OF_BOUNDS, got %d", NBITS, ret);
+    }
+    if ((ret = plc_tag_set_bit(tag, -1, 1)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "bit -1: expected PLCTAG_ERR_BAD_PARAM, got %d", ret);
+    }
+
+    /* Bulk operations, at awkward offsets and lengths. */
+    for (first = 0; first < NBITS; first += 13) {
+        for (count = 0; first + count <= NBITS; count += 29) {
+            expected = 0;
+            for (i = first; i < first + count; i++) {
+                expected += bits[i];
+            }
+            if ((ret = plc_tag_count_bits(tag, first, count)) != expected) {
+                errx(1, "count [%d, %d): expected %d, got %d", first, first + count, expected, ret);
+            }
+
+            for (expected = first; expected < first + count && !bits[expected]; expected++)
+                ;
+            if ((ret = plc_tag_find_first_bit(tag, first, count)) != expected) {
+                errx(1, "find [%d, %d): expected %d, got %d", first, first + count, expected, ret);
+            }
+
+            if ((ret = plc_tag_get_bits(tag, first, count, words)) != PLCTAG_STATUS_OK) {
+                errx(1, "plc_tag_get_bits returned %s", plc_tag_decode_error(ret));
+            }
+            for (i = 0; i < count; i++) {
+                if ((int)((words[i / 32] >> (i % 32)) & 1) != bits[first + i]) {
+                    errx(1, "get [%d, %d): bit %d is wrong", first, first + count, first + i);
+                }
+            }
+        }
+    }
+
+    if ((ret = plc_tag_count_bits(tag, 100, NBITS)) != PLCTAG_ERR_OUT_OF_BOUNDS) {
+        errx(1, "overlong count: expected PLCTAG_ERR_OUT_OF_BOUNDS, got %d", ret);
+    }
+
+    /* Other tags are bit-addressable too, from bit 0 of their first byte. */
+    tag = tag_tree_insert("Word", SIMPLE_TYPE(TAG_DINT));
+    plc_tag_set_int32(tag, 0, 0x00010100);
+    if (plc_tag_count_bits(tag, 0, 32) != 2 || plc_tag_find_first_bit(tag, 0, 32) != 8) {
+        errx(1, "DINT bits are wrong");
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+/* DUMMY_AQUA_ARRAY_0, a DINT[10] from tags.inc */
+#define TAG_ID 12
+
+static volatile int other_done = 0;
+
+static void*
+other_thread(void* arg)
+{
+    (void)(arg);
+    /* Blocks until main() unlocks the tag. */
+    plc_tag_set_int32(TAG_ID, 9, 99);
+    other_done = 1;
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t* data;
+    void* ptr;
+    int len, ret;
+    pthread_t thr;
+
+    if ((ret = plc_tag_get_data_ptr(TAG_ID, &ptr, &len)) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "unlocked tag: expected PLCTAG_ERR_NOT_ALLOWED, got %d", ret);
+    }
+    if ((ret = plc_tag_unlock(TAG_ID)) != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "unlock of unlocked tag: expected PLCTAG_ERR_NOT_ALLOWED, got %d", ret);
+    }
+
+    plc_tag_lock(TAG_ID);
+    if ((ret = plc_tag_get_data_ptr(TAG_ID, &ptr, &len)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_get_data_ptr returned %s", plc_tag_decode_error(ret));
+    }
+    if (len != 10 * 4) {
+        errx(1, "expected length %d, got %d", 10 * 4, len);
+    }
+    data = ptr;
+
+    pthread_create(&thr, NULL, other_thread, NULL);
+
+    /* The accessors still work from the thread holding the lock, and see
+     * (and make) the same changes as the pointer. */
+    data[3] = 1234;
+    if ((ret = plc_tag_get_int32(TAG_ID, 3)) != 1234) {
+        errx(1, "expected 1234, got %d", ret);
+    }
+    plc_tag_set_int32(TAG_ID, 4, 5678);
+    if (data[4] != 5678) {
+        errx(1, "expected 5678, got %d", data[4]);
+    }
+
+    /* Nested locking. */
+    plc_tag_lock(TAG_ID);
+    plc_tag_unlock(TAG_ID);
+    data[5] = 42;
+
+    usleep(10000);
+    if (other_done) {
+        errx(1, "another thread got at a locked tag");
+    }
+
+    plc_tag_unlock(TAG_ID);
+    pthread_join(thr, NULL);
+
+    if (plc_tag_get_int32(TAG_ID, 3) != 1234 || plc_tag_get_int32(TAG_ID, 5) != 42
+        || plc_tag_get_int32(TAG_ID, 9) != 99) {
+        errx(1, "writes through the pointer were lost");
+    }
+
+#ifdef DEBUG
+    /* Using the pointer after unlocking must fault. */
+    pid_t pid = fork();
+    if (pid == 0) {
+        plc_tag_lock(TAG_ID);
+        plc_tag_get_data_ptr(TAG_ID, &ptr, &len);
+        plc_tag_unlock(TAG_ID);
+        ((volatile int32_t*)(ptr))[0] = 1;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+        errx(1, "use after unlock did not fault");
+    }
+#endif
+
+    printf("Test passed!\n");
+    return 0;
+}
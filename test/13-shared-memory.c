@@ -0,0 +1,166 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "plcstub.h"
+
+#define INCREMENTS 20000
+#define CHURNS 5000 /* more than the store has entries */
+
+static const char* create_str = "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=4&elem_count=4&name=Shared";
+
+static void
+increment(int32_t tag)
+{
+    int i;
+
+    for (i = 0; i < INCREMENTS; i++) {
+        plc_tag_lock(tag);
+        plc_tag_set_int32(tag, 1, plc_tag_get_int32(tag, 1) + 1);
+        plc_tag_unlock(tag);
+    }
+}
+
+/* The second process: attaches to the store the first one made. */
+static int
+child(int rfd, int wfd)
+{
+    int32_t tag, id, other;
+    int ret;
+
+    if (read(rfd, &id, sizeof(id)) != sizeof(id)) {
+        err(1, "read");
+    }
+
+    /* Tags from tags.inc, and the one the parent made, are visible... */
+    if ((ret = plc_tag_get_size(12)) != 10 * 4) {
+        errx(1, "child: expected DINT[10] at 12, got size %d", ret);
+    }
+    if ((ret = plc_tag_get_int32(id, 0)) != 1234) {
+        errx(1, "child: expected 1234, got %d", ret);
+    }
+
+    /* ...and creating one with the same name and type gets a new handle on
+     * the same tag. */
+    if ((tag = plc_tag_create(create_str, 1000)) < 0 || tag == id) {
+        errx(1, "child: expected a new handle on tag %d, got %d", id, tag);
+    }
+    if ((ret = plc_tag_get_int32(tag, 0)) != 1234) {
+        errx(1, "child: expected 1234 through the new handle, got %d", ret);
+    }
+    plc_tag_set_int32(tag, 2, 5678);
+
+    if (write(wfd, &id, sizeof(id)) != sizeof(id)) {
+        err(1, "write");
+    }
+    increment(tag);
+
+    /* Leaving out the size attributes gets a handle on it whatever its type. */
+    if ((other = plc_tag_create("protocol=ab_eip&name=shared", 1000)) < 0) {
+        errx(1, "child: plc_tag_create without a size returned %s", plc_tag_decode_error(other));
+    }
+    if ((ret = plc_tag_get_int32(other, 2)) != 5678) {
+        errx(1, "child: expected 5678 through the unsized handle, got %d", ret);
+    }
+
+    /* Letting go of every handle here leaves the tag to the parent. */
+    plc_tag_destroy(other);
+    plc_tag_destroy(tag);
+    plc_tag_destroy(id);
+
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    char name[64];
+    int to_child[2], to_parent[2];
+    int32_t tag, again;
+    int i, ret, status;
+    pid_t pid;
+
+    snprintf(name, sizeof(name), "/plcstub-test-%d", (int)getpid());
+    setenv("PLCSTUB_SHM_NAME", name, 1);
+    shm_unlink(name);
+
+    if (pipe(to_child) || pipe(to_parent)) {
+        err(1, "pipe");
+    }
+
+    /* Fork before touching the library, so that each process maps the store
+     * for itself. */
+    pid = fork();
+    if (pid == 0) {
+        exit(child(to_child[0], to_parent[1]));
+    }
+    /* So that the reads below see EOF if the child dies. */
+    close(to_parent[1]);
+
+    tag = plc_tag_create(create_str, 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(tag));
+    }
+    if (tag != NTAGS + 2) {
+        errx(1, "expected the first new tag to be %d, got %d", NTAGS + 2, tag);
+    }
+    plc_tag_set_int32(tag, 0, 1234);
+    plc_tag_set_int32(tag, 1, 0);
+
+    if (write(to_child[1], &tag, sizeof(tag)) != sizeof(tag)) {
+        err(1, "write");
+    }
+    if (read(to_parent[0], &ret, sizeof(ret)) != sizeof(ret)) {
+        err(1, "read");
+    }
+
+    if ((ret = plc_tag_get_int32(tag, 2)) != 5678) {
+        errx(1, "expected the child's 5678, got %d", ret);
+    }
+
+    /* The tag lock is shared too. */
+    increment(tag);
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        shm_unlink(name);
+        errx(1, "child failed");
+    }
+
+    ret = plc_tag_get_int32(tag, 1);
+    if (ret != 2 * INCREMENTS) {
+        shm_unlink(name);
+        errx(1, "expected %d increments, got %d", 2 * INCREMENTS, ret);
+    }
+
+    /* With the last handle on it gone, the tag goes, and creating it again
+     * makes a new one, reusing its space in the store. */
+    plc_tag_destroy(tag);
+    again = plc_tag_create(create_str, 1000);
+    if (again < 0 || (ret = plc_tag_get_int32(again, 1)) == 2 * INCREMENTS) {
+        shm_unlink(name);
+        errx(1, "expected a new tag, got %d holding %d", again, ret);
+    }
+    plc_tag_destroy(again);
+
+    /* So tags can come and go for good, whatever the case of their names. */
+    for (i = 0; i < CHURNS; i++) {
+        again = plc_tag_create(i % 2 ? "protocol=ab_eip&elem_size=4&elem_count=4&name=Churn"
+                                     : "protocol=ab_eip&elem_size=4&elem_count=4&name=CHURN",
+            1000);
+        if (again < 0) {
+            shm_unlink(name);
+            errx(1, "churn %d: plc_tag_create returned %s", i, plc_tag_decode_error(again));
+        }
+        plc_tag_destroy(again);
+    }
+    shm_unlink(name);
+
+    printf("Test passed!\n");
+    return 0;
+}
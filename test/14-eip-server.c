@@ -0,0 +1,323 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip.h"
+#include "client.h"
+#include "debug.h"
+#include "eip.h"
+#include "libplctag.h"
+#include "tagtree.h"
+#include "types.h"
+
+#define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
+
+/* From tags.inc */
+#define DINT_ARRAY_ID 12 /* DUMMY_AQUA_ARRAY_0, DINT[10] */
+
+#define BIG_COUNT 1000
+#define PIPELINE_DEPTH 100
+
+static struct buf req, reply;
+
+/* Sends req and checks the reply's general and extended status. */
+static void
+request(struct eip_client* c, const char* what, uint8_t status, uint16_t ext)
+{
+    int ret = eip_client_request(c, req.data, req.len, &reply);
+
+    if (ret != 0) {
+        errx(1, "%s: request failed (%d)", what, ret);
+    }
+    if (reply.len < 4 || reply.data[0] != (req.data[0] | 0x80)) {
+        errx(1, "%s: malformed reply", what);
+    }
+    if (reply.data[2] != status) {
+        errx(1, "%s: expected status %#x, got %#x", what, status, reply.data[2]);
+    }
+    if (ext && (reply.data[3] != 1 || get_u16(reply.data + 4) != ext)) {
+        errx(1, "%s: expected extended status %#x", what, ext);
+    }
+    req.len = 0;
+}
+
+/* Reads a scalar tag or member, checking its type code. */
+static const uint8_t*
+read_scalar(struct eip_client* c, const char* tag, uint16_t code)
+{
+    cip_build_read(&req, tag, 1);
+    request(c, tag, CIP_STATUS_OK, 0);
+    if (get_u16(reply.data + 4) != code) {
+        errx(1, "%s: expected type %#x, got %#x", tag, code, get_u16(reply.data + 4));
+    }
+    return reply.data + 6;
+}
+
+static void
+test_struct_members(struct eip_client* c)
+{
+    type_t status, motor, line;
+    struct cip_conn conn = { 0 };
+    struct buf inner = { 0 }, out = { 0 };
+    int32_t tag, running;
+    float f = 42.5f;
+    uint8_t one = 1;
+    int ret;
+
+    status = type_new_struct(3,
+        "Running", SIMPLE_TYPE(TAG_BOOL),
+        "Fault", SIMPLE_TYPE(TAG_BOOL),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    motor = type_new_struct(2,
+        "Rpm", SIMPLE_TYPE(TAG_INT),
+        "Status", status);
+    line = type_new_struct(2,
+        "Id", SIMPLE_TYPE(TAG_DINT),
+        "Motors", type_new_array(2, motor));
+    tag = tag_tree_insert("Line1", line);
+
+    plc_tag_set_float32_path(tag, plc_tag_resolve_path(tag, "Motors[1].Status.Speed[3]"), f);
+    if (memcmp(read_scalar(c, "Line1.Motors[1].Status.Speed[3]", 0xca), &f, sizeof(f))) {
+        errx(1, "wrong value for Line1.Motors[1].Status.Speed[3]");
+    }
+
+    /* BOOL members go as a byte, but only touch their own bit. */
+    running = plc_tag_resolve_path(tag, "Motors[1].Status.Running");
+    plc_tag_set_bit_path(tag, plc_tag_resolve_path(tag, "Motors[1].Status.Fault"), 1);
+    cip_build_write(&req, "Line1.Motors[1].Status.Running", 0xc1, 1, &one, 1);
+    request(c, "write BOOL member", CIP_STATUS_OK, 0);
+    if (plc_tag_get_bit_path(tag, running) != 1
+        || plc_tag_get_bit_path(tag, plc_tag_resolve_path(tag, "Motors[1].Status.Fault")) != 1) {
+        errx(1, "BOOL member write didn't land");
+    }
+
+    /* A BOOL's byte can't be split into fragments... */
+    cip_build_read_frag(&req, "Line1.Motors[1].Status.Running", 1, 1);
+    request(c, "BOOL read fragment", CIP_STATUS_GENERAL, CIP_EXT_OUT_OF_BOUNDS);
+    buf_u8(&req, CIP_SVC_WRITE_TAG_FRAG);
+    cip_build_tag_path(&req, "Line1.Motors[1].Status.Running");
+    buf_u16(&req, 0xc1);
+    buf_u16(&req, 1);
+    buf_u32(&req, 0);
+    request(c, "empty BOOL write fragment", CIP_STATUS_NOT_ENOUGH_DATA, 0);
+
+    /* ...nor squeezed into a reply with no room for it. */
+    cip_build_read(&inner, "Line1.Motors[1].Status.Running", 1);
+    if ((ret = cip_dispatch(&conn, inner.data, inner.len, &out, 6)) != CIP_STATUS_PARTIAL || out.len > 6) {
+        errx(1, "BOOL read without room: expected a partial reply, got %#x in %zu bytes", ret, out.len);
+    }
+    free(inner.data);
+    free(out.data);
+
+    /* A whole structure comes with its handle. */
+    cip_build_read(&req, "Line1.Motors[0]", 1);
+    request(c, "read struct", CIP_STATUS_OK, 0);
+    if (get_u16(reply.data + 4) != CIP_TYPE_STRUCT || reply.len != 8 + type_size_bytes(motor)) {
+        errx(1, "bad structure read");
+    }
+
+    cip_build_read(&req, "Line1.Motors[2]", 1);
+    request(c, "member out of bounds", CIP_STATUS_GENERAL, CIP_EXT_OUT_OF_BOUNDS);
+    cip_build_read(&req, "Line1.Nope", 1);
+    request(c, "unknown member", CIP_STATUS_PATH_DESTINATION, 0);
+}
+
+/* Reads a large array in fragments, as libplctag does when a read doesn't
+ * fit in one reply. */
+static void
+test_fragmented_read(struct eip_client* c)
+{
+    int32_t tag;
+    uint32_t off = 0;
+    int i;
+
+    tag = plc_tag_create("protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=4&elem_count=1000&name=BigArray", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(tag));
+    }
+    for (i = 0; i < BIG_COUNT; i++) {
+        plc_tag_set_int32(tag, i, i * 7);
+    }
+
+    for (;;) {
+        cip_build_read_frag(&req, "BigArray", BIG_COUNT, off);
+        if (eip_client_request(c, req.data, req.len, &reply) || reply.len < 6) {
+            errx(1, "fragmented read failed");
+        }
+        req.len = 0;
+        if (reply.data[2] != CIP_STATUS_OK && reply.data[2] != CIP_STATUS_PARTIAL) {
+            errx(1, "fragmented read returned %#x", reply.data[2]);
+        }
+        /* Fragments are whole elements. */
+        if ((reply.len - 6) % 4 != 0) {
+            errx(1, "fragment of %zu bytes", reply.len - 6);
+        }
+        for (i = 0; (size_t)(i) < (reply.len - 6) / 4; i++) {
+            if ((int32_t)(get_u32(reply.data + 6 + 4 * i)) != (int32_t)((off / 4 + i) * 7)) {
+                errx(1, "wrong value at element %d", off / 4 + i);
+            }
+        }
+        off += reply.len - 6;
+        if (reply.data[2] == CIP_STATUS_OK) {
+            break;
+        }
+    }
+    if (off != 4 * BIG_COUNT) {
+        errx(1, "expected %d bytes, got %u", 4 * BIG_COUNT, off);
+    }
+}
+
+static void
+test_multiple_service(struct eip_client* c)
+{
+    struct buf a = { 0 }, b = { 0 };
+    static const uint8_t router[] = { 0x20, 0x02, 0x24, 0x01 };
+
+    cip_build_read(&a, "DUMMY_AQUA_DATA_4", 1);
+    cip_build_read(&b, "NoSuchTag", 1);
+
+    buf_u8(&req, CIP_SVC_MULTIPLE_SERVICE);
+    buf_u8(&req, sizeof(router) / 2);
+    buf_put(&req, router, sizeof(router));
+    buf_u16(&req, 2);
+    buf_u16(&req, 6);
+    buf_u16(&req, 6 + a.len);
+    buf_put(&req, a.data, a.len);
+    buf_put(&req, b.data, b.len);
+    request(c, "multiple service", CIP_STATUS_EMBEDDED, 0);
+
+    /* count, two offsets, then the replies they point at */
+    if (get_u16(reply.data + 4) != 2) {
+        errx(1, "expected 2 replies");
+    }
+    if (reply.data[4 + get_u16(reply.data + 6) + 2] != CIP_STATUS_OK
+        || reply.data[4 + get_u16(reply.data + 6) + 6] != 4) {
+        errx(1, "first embedded read failed");
+    }
+    if (reply.data[4 + get_u16(reply.data + 8) + 2] != CIP_STATUS_PATH_DESTINATION) {
+        errx(1, "second embedded read should have failed");
+    }
+
+    free(a.data);
+    free(b.data);
+}
+
+static void
+test_pipelining(struct eip_client* c)
+{
+    int i;
+
+    cip_build_read(&req, "DUMMY_AQUA_DATA_5", 1);
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        if (eip_client_send(c, req.data, req.len)) {
+            errx(1, "send failed");
+        }
+    }
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        if (eip_client_recv(c, &reply) || reply.data[2] != CIP_STATUS_OK || reply.data[6] != 5) {
+            errx(1, "pipelined read %d failed", i);
+        }
+    }
+    req.len = 0;
+}
+
+static void
+test_list_tags(struct eip_client* c)
+{
+    static const uint8_t symbols[] = { 0x20, 0x6b, 0x25, 0x00, 0x00, 0x00 };
+    size_t off;
+    bool found = false;
+
+    buf_u8(&req, CIP_SVC_GET_INSTANCE_ATTRIBUTE_LIST);
+    buf_u8(&req, sizeof(symbols) / 2);
+    buf_put(&req, symbols, sizeof(symbols));
+    buf_u16(&req, 2);
+    buf_u16(&req, 1); /* name */
+    buf_u16(&req, 2); /* type */
+    request(c, "list tags", CIP_STATUS_OK, 0);
+
+    for (off = 4; off < reply.len; off += 4 + 2 + get_u16(reply.data + off + 4) + 2) {
+        const char* name = (const char*)(reply.data + off + 6);
+        if (get_u16(reply.data + off + 4) == 17 && strncmp(name, "DUMMY_AQUA_DATA_7", 17) == 0) {
+            found = true;
+        }
+    }
+    if (!found) {
+        errx(1, "DUMMY_AQUA_DATA_7 wasn't listed");
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    struct eip_server_config cfg = { "127.0.0.1", 0, 2 };
+    struct buf inner = { 0 };
+    struct eip_client c;
+    int32_t val = 1234;
+    int ret;
+
+    if (eip_server_start(&cfg)) {
+        errx(1, "eip_server_start failed");
+    }
+    if (eip_client_connect(&c, "127.0.0.1", eip_server_port())) {
+        err(1, "eip_client_connect");
+    }
+
+    /* Unconnected, both directly and wrapped in an Unconnected Send. */
+    if (get_u16(read_scalar(&c, "DUMMY_AQUA_DATA_3", 0xc3)) != (uint16_t)(plc_tag_get_int16(tag_tree_lookup_name("DUMMY_AQUA_DATA_3"), 0))) {
+        errx(1, "wrong value for DUMMY_AQUA_DATA_3");
+    }
+    cip_build_read(&inner, "dummy_aqua_data_6", 1);
+    cip_build_unconnected_send(&req, inner.data, inner.len);
+    /* The reply is the embedded request's own. */
+    if (eip_client_request(&c, req.data, req.len, &reply) || reply.len < 8
+        || reply.data[0] != (CIP_SVC_READ_TAG | 0x80) || reply.data[2] != CIP_STATUS_OK || reply.data[6] != 6) {
+        errx(1, "wrong reply to unconnected send");
+    }
+    req.len = 0;
+
+    cip_build_read(&req, "NoSuchTag", 1);
+    request(&c, "unknown tag", CIP_STATUS_PATH_DESTINATION, 0);
+
+    if ((ret = eip_client_forward_open(&c, 4000)) != CIP_STATUS_OK) {
+        errx(1, "forward open returned %d", ret);
+    }
+
+    /* Connected from here on. */
+    cip_build_write(&req, "DUMMY_AQUA_ARRAY_0[2]", 0xc4, 1, &val, sizeof(val));
+    request(&c, "write element", CIP_STATUS_OK, 0);
+    if ((ret = plc_tag_get_int32(DINT_ARRAY_ID, 2)) != val) {
+        errx(1, "expected %d in the tag, got %d", val, ret);
+    }
+    if ((int32_t)(get_u32(read_scalar(&c, "DUMMY_AQUA_ARRAY_0[2]", 0xc4))) != val) {
+        errx(1, "wrong value read back");
+    }
+
+    cip_build_write(&req, "DUMMY_AQUA_ARRAY_0[2]", 0xc3, 1, &val, 2);
+    request(&c, "type mismatch", CIP_STATUS_GENERAL, CIP_EXT_TYPE_MISMATCH);
+    cip_build_write(&req, "DUMMY_AQUA_ARRAY_0[2]", 0xc4, 1, &val, 2);
+    request(&c, "short write", CIP_STATUS_NOT_ENOUGH_DATA, 0);
+    cip_build_read(&req, "DUMMY_AQUA_ARRAY_0[5]", 6);
+    request(&c, "read past the end", CIP_STATUS_GENERAL, CIP_EXT_OUT_OF_BOUNDS);
+
+    test_struct_members(&c);
+    test_multiple_service(&c);
+    test_pipelining(&c);
+    test_list_tags(&c);
+
+    /* Unconnected replies are small enough that this takes several. */
+    if ((ret = eip_client_forward_close(&c)) != CIP_STATUS_OK) {
+        errx(1, "forward close returned %d", ret);
+    }
+    test_fragmented_read(&c);
+
+    eip_client_close(&c);
+    eip_server_stop();
+
+    free(inner.data);
+    free(req.data);
+    free(reply.data);
+
+    return 0;
+}
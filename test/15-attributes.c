@@ -0,0 +1,77 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "attrib.h"
+#include "debug.h"
+#include "libplctag.h"
+#include "stats.h"
+
+static void
+expect_error(const char* str, int expected)
+{
+    struct tag_attribs a;
+    int ret = attrib_parse(str, &a);
+
+    if (ret != expected) {
+        errx(1, "\"%s\": expected %s, got %s", str, plc_tag_decode_error(expected), plc_tag_decode_error(ret));
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    struct tag_attribs a;
+    const char* str = "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=4&elem_count=16"
+                      "&name=Motor.Speed[3]&auto_sync_read_ms=250&use_connected_msg=1&debug=2&frobnicate=7";
+    uint64_t hits, misses;
+    int32_t tag, again;
+    int ret;
+
+    if ((ret = attrib_parse(str, &a)) != PLCTAG_STATUS_OK) {
+        errx(1, "attrib_parse returned %s", plc_tag_decode_error(ret));
+    }
+    if (strcmp(a.name, "Motor.Speed[3]") != 0 || a.elem_size != 4 || a.elem_count != 16
+        || a.auto_sync_read_ms != 250 || a.use_connected_msg != 1 || a.debug != 2
+        || a.auto_sync_write_ms != 0 || a.read_cache_ms != 0) {
+        errx(1, "attributes parsed wrongly");
+    }
+
+    /* A bare "protocol" is allowed; debug defaults to -1. */
+    if (attrib_parse("protocol&name=X", &a) != PLCTAG_STATUS_OK || strcmp(a.name, "X") != 0 || a.debug != -1) {
+        errx(1, "bare protocol rejected");
+    }
+
+    expect_error("protocol=ab_eip&elem_size=4", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&elem_count=0", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&elem_size=4x", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&elem_size=99999999999", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&use_connected_msg=2", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&gateway=", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=X&cpu", PLCTAG_ERR_BAD_PARAM);
+    expect_error("name=", PLCTAG_ERR_BAD_PARAM);
+
+    /* Creating the same tag again is answered from the cache. */
+    str = "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=2&elem_count=3&name=Cached";
+    hits = stats_get(STAT_ATTRIB_CACHE_HITS);
+    misses = stats_get(STAT_ATTRIB_CACHE_MISSES);
+    tag = plc_tag_create(str, 1000);
+    again = plc_tag_create(str, 1000);
+    if (tag < 0 || again < 0) {
+        errx(1, "plc_tag_create failed: %d %d", tag, again);
+    }
+    if (stats_get(STAT_ATTRIB_CACHE_MISSES) != misses + 1 || stats_get(STAT_ATTRIB_CACHE_HITS) != hits + 1) {
+        errx(1, "expected one miss and one hit");
+    }
+    if ((ret = plc_tag_get_size(again)) != 2 * 3) {
+        errx(1, "cached create: expected size 6, got %d", ret);
+    }
+
+    /* Bad strings aren't cached. */
+    if (plc_tag_create("name=X&elem_count=-1", 1000) != PLCTAG_ERR_BAD_PARAM
+        || plc_tag_create("name=X&elem_count=-1", 1000) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "bad attribute string accepted");
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "tagtree.h"
+
+static const char* create_str = "protocol=ab_eip&gateway=10.206.1.40&path=1,4&cpu=lgx&elem_size=4&elem_count=4&name=Motor";
+
+static int32_t last_cb_tag = 0;
+static int cb_calls = 0;
+
+static void
+callback(int32_t tag_id, int event, int status)
+{
+    (void)(event);
+    (void)(status);
+    last_cb_tag = tag_id;
+    cb_calls++;
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t a, b, c;
+    int ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_DETAIL);
+
+    /* Creating the same tag twice gets two handles on one tag. */
+    a = plc_tag_create(create_str, 1000);
+    b = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=4&name=motor", 1000);
+    if (a < 0 || b < 0 || a == b) {
+        errx(1, "expected two handles, got %d and %d", a, b);
+    }
+    plc_tag_set_int32(a, 3, 1234);
+    if ((ret = plc_tag_get_int32(b, 3)) != 1234) {
+        errx(1, "expected 1234 through the second handle, got %d", ret);
+    }
+    if ((ret = tag_tree_lookup_name("MOTOR")) != a) {
+        errx(1, "expected the tag to be listed under %d, got %d", a, ret);
+    }
+
+    /* ...unless the types disagree. */
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_size=2&elem_count=4&name=Motor", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected PLCTAG_ERR_BAD_PARAM for a different type, got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&elem_count=2&name=Motor", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected PLCTAG_ERR_BAD_PARAM for a different length, got %d", ret);
+    }
+
+    /* Size attributes left out, or agreeing, are no conflict. */
+    c = plc_tag_create("protocol=ab_eip&name=Motor", 1000);
+    if (c < 0 || plc_tag_get_int32(c, 3) != 1234) {
+        errx(1, "expected a handle without a size to share the DINT[4], got %d", c);
+    }
+    plc_tag_destroy(c);
+    c = plc_tag_create("protocol=ab_eip&elem_size=4&name=Motor", 1000);
+    if (c < 0 || plc_tag_get_int32(c, 3) != 1234) {
+        errx(1, "expected a handle with only elem_size to share the DINT[4], got %d", c);
+    }
+    plc_tag_destroy(c);
+
+    /* Callbacks and status belong to the handle. */
+    plc_tag_register_callback(a, callback);
+    plc_tag_get_int32(b, 0);
+    if (cb_calls != 0) {
+        errx(1, "callback on %d called for an access through %d", a, b);
+    }
+    plc_tag_get_int32(a, 0);
+    if (cb_calls != 2 || last_cb_tag != a) {
+        errx(1, "expected 2 calls for %d, got %d for %d", a, cb_calls, last_cb_tag);
+    }
+    plc_tag_get_int32(b, 4);
+    if ((ret = plc_tag_status(b)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected %d's status to be PLCTAG_ERR_BAD_PARAM, got %d", b, ret);
+    }
+    if ((ret = plc_tag_status(a)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected %d's status to be PLCTAG_STATUS_OK, got %d", a, ret);
+    }
+
+    /* The tag outlives all but its last handle. */
+    c = plc_tag_create(create_str, 1000);
+    plc_tag_destroy(a);
+    if ((ret = plc_tag_get_int32(c, 3)) != 1234) {
+        errx(1, "expected 1234 after destroying %d, got %d", a, ret);
+    }
+    if ((ret = plc_tag_get_int32(a, 3)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected %d to be gone, got %d", a, ret);
+    }
+    if ((ret = tag_tree_lookup_name("Motor")) != b && ret != c) {
+        errx(1, "expected the tag to be listed under %d or %d, got %d", b, c, ret);
+    }
+    plc_tag_destroy(b);
+    plc_tag_destroy(c);
+    if ((ret = tag_tree_lookup_name("Motor")) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected the tag to be gone, got %d", ret);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "tagtree.h"
+
+#define NCREATES 100
+
+int
+main(int argc, char** argv)
+{
+    char buf[128];
+    int32_t ids[NCREATES], old, id;
+    uint32_t max_idx = 0;
+    int i, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* A destroyed tag's slot is reused, under a new generation... */
+    old = plc_tag_create("protocol=ab_eip&elem_size=4&name=First", 1000);
+    if (old < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(old));
+    }
+    plc_tag_destroy(old);
+    id = plc_tag_create("protocol=ab_eip&elem_size=4&name=Second", 1000);
+    if (TAG_ID_INDEX(id) != TAG_ID_INDEX(old) || TAG_ID_GEN(id) != TAG_ID_GEN(old) + 1) {
+        errx(1, "expected %d to reuse the slot of %d", id, old);
+    }
+
+    /* ...so that the old ID doesn't reach the new tag. */
+    if ((ret = plc_tag_set_int32(old, 0, 1)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "set through stale ID %d returned %d", old, ret);
+    }
+    if ((ret = plc_tag_destroy(old)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "destroying stale ID %d returned %d", old, ret);
+    }
+    if ((ret = plc_tag_get_size(id)) != 4) {
+        errx(1, "expected %d to survive, got size %d", id, ret);
+    }
+    plc_tag_destroy(id);
+
+    /* IDs that were never handed out are turned away too. */
+    if (plc_tag_status(0) != PLCTAG_ERR_NOT_FOUND || plc_tag_status(-5) != PLCTAG_ERR_NOT_FOUND
+        || plc_tag_status(TAG_ID(3, 100000)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "bogus IDs accepted");
+    }
+
+    /* Churning through tags keeps the IDs' slots dense. */
+    for (i = 0; i < 2 * NCREATES; i++) {
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&name=Churn%d", i);
+        ids[i % NCREATES] = plc_tag_create(buf, 1000);
+        if (ids[i % NCREATES] < 0) {
+            errx(1, "plc_tag_create returned %d", ids[i % NCREATES]);
+        }
+        if (TAG_ID_INDEX(ids[i % NCREATES]) > max_idx) {
+            max_idx = TAG_ID_INDEX(ids[i % NCREATES]);
+        }
+        if (i % NCREATES == NCREATES - 1) {
+            for (ret = 0; ret < NCREATES; ret++) {
+                plc_tag_destroy(ids[ret]);
+            }
+        }
+    }
+    if (max_idx > NTAGS + 1 + NCREATES) {
+        errx(1, "expected slots up to %d, got %u", NTAGS + 1 + NCREATES, max_idx);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
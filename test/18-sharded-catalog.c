@@ -0,0 +1,108 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "stats.h"
+#include "tagtree.h"
+
+#define THREADS 8
+#define ITERS 500
+
+static volatile int done = 0;
+
+void*
+thread_entry(void* arg)
+{
+    char buf[128];
+    int32_t a, b, shared;
+    int i, n = (int)(intptr_t)(arg), ret;
+
+    for (i = 0; i < ITERS; i++) {
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&name=T%d_%d", n, i);
+        a = plc_tag_create(buf, 1000);
+        snprintf(buf, sizeof(buf), "protocol=ab_eip&elem_size=4&name=t%d_%d", n, i);
+        b = plc_tag_create(buf, 1000);
+        shared = plc_tag_create("protocol=ab_eip&elem_size=4&name=Shared", 1000);
+        if (a < 0 || b < 0 || shared < 0) {
+            errx(1, "plc_tag_create returned %d, %d, %d", a, b, shared);
+        }
+
+        plc_tag_set_int32(a, 0, n * ITERS + i);
+        if ((ret = plc_tag_get_int32(b, 0)) != n * ITERS + i) {
+            errx(1, "expected %d through %d, got %d", n * ITERS + i, b, ret);
+        }
+
+        plc_tag_destroy(a);
+        plc_tag_destroy(b);
+        plc_tag_destroy(shared);
+    }
+    return NULL;
+}
+
+void*
+metatag_entry(void* arg)
+{
+    (void)(arg);
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        if (plc_tag_read(METATAG_ID, 1000) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_read(@tags) failed");
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t threads[THREADS], reader;
+    char buf[32];
+    int i, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Tags come and go on every thread while @tags is rebuilt under them. */
+    if (pthread_create(&reader, NULL, metatag_entry, NULL)) {
+        errx(1, "pthread_create");
+    }
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread_entry, (void*)(intptr_t)(i))) {
+            errx(1, "pthread_create");
+        }
+    }
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            errx(1, "pthread_join");
+        }
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    if (pthread_join(reader, NULL)) {
+        errx(1, "pthread_join");
+    }
+
+    /* Every handle was accounted for, and every tag is gone. */
+    if ((ret = plc_tag_get_int_attribute(0, "creates", -1)) != NTAGS + 3 * THREADS * ITERS) {
+        errx(1, "expected %d creates, got %d", NTAGS + 3 * THREADS * ITERS, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "destroys", -1)) != 3 * THREADS * ITERS) {
+        errx(1, "expected %d destroys, got %d", 3 * THREADS * ITERS, ret);
+    }
+    for (i = 0; i < THREADS; i++) {
+        snprintf(buf, sizeof(buf), "T%d_%d", i, ITERS - 1);
+        if ((ret = tag_tree_lookup_name(buf)) != PLCTAG_ERR_NOT_FOUND) {
+            errx(1, "expected %s to be gone, got %d", buf, ret);
+        }
+    }
+    if ((ret = tag_tree_lookup_name("Shared")) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected Shared to be gone, got %d", ret);
+    }
+
+    /* The built-in tags kept their IDs throughout. */
+    if ((ret = tag_tree_lookup_name("DUMMY_AQUA_ARRAY_0")) < 2 || ret > NTAGS + 1) {
+        errx(1, "expected a built-in ID for DUMMY_AQUA_ARRAY_0, got %d", ret);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
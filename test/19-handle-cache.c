@@ -0,0 +1,165 @@
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "stats.h"
+#include "tagtree.h"
+
+#define ITERS 1000
+#define CHURNS 1000 /* fewer than a slot's generations, so IDs aren't reused */
+#define LOOKERS 3
+
+static int32_t victim;
+
+/* The handle being churned, and the last one destroyed. */
+static int32_t churn_id, churn_gone;
+static int churning = 1;
+
+void*
+destroy_entry(void* arg)
+{
+    (void)(arg);
+    plc_tag_destroy(victim);
+    return NULL;
+}
+
+void*
+lookup_entry(void* arg)
+{
+    uint64_t* misses = arg;
+    uint64_t before = stats_get(STAT_HANDLE_CACHE_MISSES);
+
+    (void)plc_tag_get_int32(victim, 0);
+    *misses = stats_get(STAT_HANDLE_CACHE_MISSES) - before;
+    return NULL;
+}
+
+/* Creates and destroys handles on a tag that another handle keeps alive. */
+void*
+churn_entry(void* arg)
+{
+    int32_t id;
+    int i;
+
+    (void)(arg);
+    for (i = 0; i < CHURNS; i++) {
+        id = plc_tag_create("protocol=ab_eip&elem_size=4&name=Churn", 1000);
+        __atomic_store_n(&churn_id, id, __ATOMIC_SEQ_CST);
+        sched_yield();
+        plc_tag_destroy(id);
+        __atomic_store_n(&churn_gone, id, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&churning, 0, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/* Looks the churned handles up, checking that destroyed ones stay gone.  The
+ * handles found aren't used, since they may be being destroyed. */
+void*
+look_entry(void* arg)
+{
+    struct tag_tree_node* tag;
+    int32_t id;
+
+    (void)(arg);
+    while (__atomic_load_n(&churning, __ATOMIC_SEQ_CST)) {
+        id = __atomic_load_n(&churn_id, __ATOMIC_SEQ_CST);
+        tag_tree_handle(id, &tag);
+        id = __atomic_load_n(&churn_gone, __ATOMIC_SEQ_CST);
+        if (id != 0 && tag_tree_handle(id, &tag) != NULL) {
+            errx(1, "expected destroyed handle %d to be gone", id);
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    uint64_t hits, misses, thread_misses;
+    pthread_t thread, lookers[LOOKERS];
+    int32_t id, old, keep;
+    int i, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    id = plc_tag_create("protocol=ab_eip&elem_size=4&name=Hot", 1000);
+    victim = plc_tag_create("protocol=ab_eip&elem_size=4&name=Victim", 1000);
+    if (id < 0 || victim < 0) {
+        errx(1, "plc_tag_create returned %d, %d", id, victim);
+    }
+
+    /* After the first lookup, a hot tag's accesses are served from the
+     * cache. */
+    plc_tag_set_int32(id, 0, 0);
+    hits = stats_get(STAT_HANDLE_CACHE_HITS);
+    misses = stats_get(STAT_HANDLE_CACHE_MISSES);
+    for (i = 0; i < ITERS; i++) {
+        plc_tag_set_int32(id, 0, plc_tag_get_int32(id, 0) + 1);
+    }
+    if ((ret = plc_tag_get_int32(id, 0)) != ITERS) {
+        errx(1, "expected %d, got %d", ITERS, ret);
+    }
+    if (stats_get(STAT_HANDLE_CACHE_MISSES) != misses
+        || stats_get(STAT_HANDLE_CACHE_HITS) - hits < 2 * ITERS) {
+        errx(1, "expected %d hits and no misses, got %lu and %lu", 2 * ITERS,
+            (unsigned long)(stats_get(STAT_HANDLE_CACHE_HITS) - hits),
+            (unsigned long)(stats_get(STAT_HANDLE_CACHE_MISSES) - misses));
+    }
+
+    /* Each thread has its own cache. */
+    (void)plc_tag_get_int32(victim, 0);
+    if (pthread_create(&thread, NULL, lookup_entry, &thread_misses) || pthread_join(thread, NULL)) {
+        errx(1, "pthread_create");
+    }
+    if (thread_misses != 1) {
+        errx(1, "expected a miss on a new thread, got %lu", (unsigned long)thread_misses);
+    }
+
+    /* A handle destroyed by another thread doesn't linger in ours. */
+    if (pthread_create(&thread, NULL, destroy_entry, NULL) || pthread_join(thread, NULL)) {
+        errx(1, "pthread_create");
+    }
+    if ((ret = plc_tag_get_int32(victim, 0)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected destroyed %d to be gone, got %d", victim, ret);
+    }
+
+    /* ...nor does a reused slot's old ID reach its new tag. */
+    plc_tag_destroy(id);
+    old = victim;
+    victim = plc_tag_create("protocol=ab_eip&elem_size=4&name=Reuse", 1000);
+    if (TAG_ID_INDEX(victim) != TAG_ID_INDEX(id) && TAG_ID_INDEX(victim) != TAG_ID_INDEX(old)) {
+        errx(1, "expected %d to reuse the slot of %d or %d", victim, id, old);
+    }
+    if ((ret = plc_tag_get_int32(id, 0)) != PLCTAG_ERR_NOT_FOUND
+        || (ret = plc_tag_get_int32(old, 0)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected stale IDs to be gone, got %d", ret);
+    }
+    if ((ret = plc_tag_get_int32(victim, 0)) != 0x42424242) {
+        errx(1, "expected a fresh tag through %d, got %d", victim, ret);
+    }
+
+    /* Handles destroyed while other threads look them up aren't cached. */
+    keep = plc_tag_create("protocol=ab_eip&elem_size=4&name=Churn", 1000);
+    plc_tag_set_int32(keep, 0, 1234);
+    churn_id = keep;
+    for (i = 0; i < LOOKERS; i++) {
+        if (pthread_create(&lookers[i], NULL, look_entry, NULL)) {
+            errx(1, "pthread_create");
+        }
+    }
+    if (pthread_create(&thread, NULL, churn_entry, NULL)) {
+        errx(1, "pthread_create");
+    }
+    pthread_join(thread, NULL);
+    for (i = 0; i < LOOKERS; i++) {
+        pthread_join(lookers[i], NULL);
+    }
+    plc_tag_destroy(keep);
+
+    printf("Test passed!\n");
+    return 0;
+}
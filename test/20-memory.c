@@ -0,0 +1,109 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "libplctag.h"
+#include "mem.h"
+#include "tagtree.h"
+#include "types.h"
+
+#define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
+
+static const char* small_str = "protocol=ab_eip&elem_size=4&elem_count=100&name=Small";
+static const char* big_str = "protocol=ab_eip&elem_size=4&elem_count=100000&name=Big";
+
+int
+main(int argc, char** argv)
+{
+    int32_t id, other;
+    int before[MEM_COUNT], i, ret;
+    char str[128];
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* The built-in tags are accounted for. */
+    plc_tag_destroy(plc_tag_create(small_str, 1000));
+    if (plc_tag_get_int_attribute(0, "mem_tags", -1) <= 0 || plc_tag_get_int_attribute(0, "mem_names", -1) <= 0
+        || plc_tag_get_int_attribute(0, "mem_types", -1) <= 0) {
+        errx(1, "expected the built-in tags to be accounted for");
+    }
+
+    /* A tag's memory comes back when it is destroyed. */
+    for (i = 0; i < MEM_COUNT; i++) {
+        before[i] = (int)mem_get(i);
+    }
+    id = plc_tag_create(small_str, 1000);
+    if ((ret = plc_tag_get_int_attribute(0, "mem_tags", -1)) < before[MEM_TAGS] + 400) {
+        errx(1, "expected at least %d bytes of tags, got %d", before[MEM_TAGS] + 400, ret);
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "mem_catalog", -1)) <= before[MEM_CATALOG]) {
+        errx(1, "expected the handle to be accounted for, got %d", ret);
+    }
+    plc_tag_destroy(id);
+    for (i = 0; i < MEM_COUNT; i++) {
+        if (i != MEM_METATAG && mem_get(i) != (uint64_t)before[i]) {
+            errx(1, "category %d: expected %d bytes, got %d", i, before[i], (int)mem_get(i));
+        }
+    }
+
+    /* The metatag is accounted for while it is built. */
+    plc_tag_read(METATAG_ID, 1000);
+    if ((ret = plc_tag_get_int_attribute(0, "mem_metatag", -1)) <= 0) {
+        errx(1, "expected the metatag to be accounted for, got %d", ret);
+    }
+
+    /* Over budget, creates fail rather than the process. */
+    if ((ret = plc_tag_set_int_attribute(0, "mem_budget", plc_tag_get_int_attribute(0, "mem_total", -1) + 4096))
+        != PLCTAG_STATUS_OK) {
+        errx(1, "setting mem_budget returned %d", ret);
+    }
+    if ((ret = plc_tag_create(big_str, 1000)) != PLCTAG_ERR_NO_MEM) {
+        errx(1, "expected PLCTAG_ERR_NO_MEM over budget, got %d", ret);
+    }
+    if ((id = plc_tag_create(small_str, 1000)) < 0) {
+        errx(1, "expected a small tag to fit the budget, got %d", id);
+    }
+    for (i = 0; (other = plc_tag_create(small_str, 1000)) >= 0; i++) {
+        if (i > 4096) {
+            errx(1, "expected handles to run into the budget");
+        }
+    }
+    if (other != PLCTAG_ERR_NO_MEM) {
+        errx(1, "expected PLCTAG_ERR_NO_MEM for a handle over budget, got %d", other);
+    }
+
+    /* New types are charged to it too... */
+    plc_tag_set_int_attribute(0, "mem_budget", plc_tag_get_int_attribute(0, "mem_total", -1));
+    before[MEM_TYPES] = (int)mem_get(MEM_TYPES);
+    if (type_to_enum(type_new_array(12345, SIMPLE_TYPE(TAG_DINT))) != TAG_ERROR) {
+        errx(1, "expected no new type over budget");
+    }
+    if ((ret = (int)mem_get(MEM_TYPES)) != before[MEM_TYPES]) {
+        errx(1, "expected %d bytes of types after a refused one, got %d", before[MEM_TYPES], ret);
+    }
+
+    /* ...and tags of new types, and the tables that grow with them, run into
+     * it rather than exiting. */
+    plc_tag_set_int_attribute(0, "mem_budget", plc_tag_get_int_attribute(0, "mem_total", -1) + 65536);
+    for (i = 0;; i++) {
+        snprintf(str, sizeof(str), "protocol=ab_eip&elem_size=4&elem_count=%d&name=Grow%d", i + 2, i);
+        if ((other = plc_tag_create(str, 1000)) < 0) {
+            break;
+        }
+    }
+    if (other != PLCTAG_ERR_NO_MEM || i < 16) {
+        errx(1, "expected PLCTAG_ERR_NO_MEM after a few new types, got %d after %d", other, i);
+    }
+
+    /* Lifting it lets them through again. */
+    plc_tag_set_int_attribute(0, "mem_budget", 0);
+    if ((other = plc_tag_create(big_str, 1000)) < 0) {
+        errx(1, "expected the tag to fit without a budget, got %d", other);
+    }
+    if ((ret = plc_tag_set_int32(other, 99999, 7)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_int32 returned %d", ret);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libplctag.h"
+
+int
+main(int argc, char** argv)
+{
+    char buf[128], name[16];
+    int32_t s, a, d, n;
+    void* ptr;
+    int i, len, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    s = plc_tag_create("protocol=ab_eip&elem_size=88&name=Message", 1000);
+    if (s < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(s));
+    }
+    if ((ret = plc_tag_get_size(s)) != 88) {
+        errx(1, "expected a STRING to be 88 bytes, got %d", ret);
+    }
+
+    /* A new STRING is empty. */
+    if ((ret = plc_tag_get_string_length(s, 0)) != 0) {
+        errx(1, "expected an empty string, got length %d", ret);
+    }
+
+    if ((ret = plc_tag_set_string(s, 0, "Hello, world")) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_string returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_get_string_length(s, 0)) != 12) {
+        errx(1, "expected length 12, got %d", ret);
+    }
+    if ((ret = plc_tag_get_string(s, 0, buf, sizeof(buf))) != PLCTAG_STATUS_OK || strcmp(buf, "Hello, world")) {
+        errx(1, "plc_tag_get_string returned %d, \"%s\"", ret, buf);
+    }
+
+    /* The layout is Logix's: a DINT length, then the characters. */
+    plc_tag_lock(s);
+    plc_tag_get_data_ptr(s, &ptr, &len);
+    memcpy(&n, ptr, sizeof(n));
+    if (len != 88 || n != 12 || memcmp((char*)(ptr) + 4, "Hello, world", 12) != 0) {
+        errx(1, "unexpected STRING layout");
+    }
+    plc_tag_unlock(s);
+
+    /* The buffer must have room for the NUL. */
+    if ((ret = plc_tag_get_string(s, 0, buf, 12)) != PLCTAG_ERR_TOO_SMALL) {
+        errx(1, "expected a 12-byte buffer to be too small, got %d", ret);
+    }
+    if ((ret = plc_tag_get_string(s, 0, buf, 13)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected a 13-byte buffer to do, got %d", ret);
+    }
+
+    /* Writing a shorter string clears what was left of the longer one. */
+    plc_tag_set_string(s, 0, "Bye");
+    plc_tag_lock(s);
+    plc_tag_get_data_ptr(s, &ptr, &len);
+    if (((char*)(ptr))[4 + 3] != '\0') {
+        errx(1, "expected the old characters to be cleared");
+    }
+    plc_tag_unlock(s);
+
+    memset(buf, 'x', 83);
+    buf[83] = '\0';
+    if ((ret = plc_tag_set_string(s, 0, buf)) != PLCTAG_ERR_TOO_LARGE) {
+        errx(1, "expected 83 characters to be too many, got %d", ret);
+    }
+    buf[82] = '\0';
+    if ((ret = plc_tag_set_string(s, 0, buf)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected 82 characters to fit, got %d", ret);
+    }
+
+    /* A corrupt length is reported rather than overrunning the buffer. */
+    plc_tag_lock(s);
+    plc_tag_get_data_ptr(s, &ptr, &len);
+    n = 1000;
+    memcpy(ptr, &n, sizeof(n));
+    plc_tag_unlock(s);
+    if ((ret = plc_tag_get_string(s, 0, buf, sizeof(buf))) != PLCTAG_ERR_BAD_DATA) {
+        errx(1, "expected a bad length to be caught, got %d", ret);
+    }
+
+    /* Arrays of STRINGs are indexed by element. */
+    a = plc_tag_create("protocol=ab_eip&elem_size=88&elem_count=5&name=Messages", 1000);
+    if (a < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(a));
+    }
+    if ((ret = plc_tag_get_size(a)) != 5 * 88) {
+        errx(1, "expected 5 STRINGs to be %d bytes, got %d", 5 * 88, ret);
+    }
+    for (i = 0; i < 5; i++) {
+        snprintf(name, sizeof(name), "Line %d", i);
+        if ((ret = plc_tag_set_string(a, i, name)) != PLCTAG_STATUS_OK) {
+            errx(1, "plc_tag_set_string(%d) returned %s", i, plc_tag_decode_error(ret));
+        }
+    }
+    for (i = 0; i < 5; i++) {
+        snprintf(name, sizeof(name), "Line %d", i);
+        if (plc_tag_get_string(a, i, buf, sizeof(buf)) != PLCTAG_STATUS_OK || strcmp(buf, name)) {
+            errx(1, "expected \"%s\" at %d, got \"%s\"", name, i, buf);
+        }
+    }
+    if ((ret = plc_tag_get_string_length(a, 5)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected index 5 to be refused, got %d", ret);
+    }
+
+    /* Other tags aren't STRINGs. */
+    d = plc_tag_create("protocol=ab_eip&elem_size=4&name=Counter", 1000);
+    if ((ret = plc_tag_set_string(d, 0, "x")) != PLCTAG_ERR_UNSUPPORTED) {
+        errx(1, "expected a DINT to refuse a string, got %d", ret);
+    }
+
+    plc_tag_destroy(s);
+    plc_tag_destroy(a);
+    plc_tag_destroy(d);
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libplctag.h"
+#include "plcstub.h"
+#include "tagtree.h"
+#include "types.h"
+
+#define SIMPLE_TYPE(t) (type_t)(uintptr_t)(t)
+
+/* Reads the NUL-terminated string at *offset in a tag, and moves past it. */
+static void
+get_name(int32_t tag, int* offset, char* buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len - 1 && (buf[i] = plc_tag_get_uint8(tag, *offset + i)) != '\0'; i++)
+        ;
+    buf[i] = '\0';
+    *offset += i + 1;
+}
+
+/* Creates and reads the "@udt/<id>" tag for a type, checking its header. */
+static int32_t
+read_template(uint16_t udt_id, uint32_t size, uint16_t members, uint16_t handle)
+{
+    char attrs[64];
+    int32_t tag;
+    int ret;
+
+    snprintf(attrs, sizeof(attrs), "protocol=ab_eip&name=@udt/%u", udt_id);
+    tag = plc_tag_create(attrs, 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create(%s) returned %s", attrs, plc_tag_decode_error(tag));
+    }
+    if ((ret = plc_tag_read(tag, 1000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read returned %s", plc_tag_decode_error(ret));
+    }
+    if (plc_tag_get_uint16(tag, 0) != udt_id || plc_tag_get_uint32(tag, 6) != size
+        || plc_tag_get_uint16(tag, 10) != members || plc_tag_get_uint16(tag, 12) != handle) {
+        errx(1, "bad header for UDT %u", udt_id);
+    }
+    return tag;
+}
+
+static void
+check_member(int32_t tag, int i, uint16_t info, uint16_t code, uint32_t offset)
+{
+    int off = 14 + 8 * i;
+
+    if (plc_tag_get_uint16(tag, off) != info || plc_tag_get_uint16(tag, off + 2) != code
+        || plc_tag_get_uint32(tag, off + 4) != offset) {
+        errx(1, "member %d: expected (%u, %04x, %u), got (%u, %04x, %u)", i, info, code, offset,
+            plc_tag_get_uint16(tag, off), plc_tag_get_uint16(tag, off + 2), plc_tag_get_uint32(tag, off + 4));
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    type_t status, motor, other;
+    uint16_t status_id, motor_id;
+    const uint8_t *tpl, *again;
+    char name[32], expected[32];
+    int32_t tag, t;
+    size_t len, len2;
+    int offset, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Motor { INT Rpm; Status Status; } where
+     * Status { BOOL Running; BOOL Fault; REAL Speed[4]; } */
+    status = type_new_struct(3,
+        "Running", SIMPLE_TYPE(TAG_BOOL),
+        "Fault", SIMPLE_TYPE(TAG_BOOL),
+        "Speed", type_new_array(4, SIMPLE_TYPE(TAG_REAL)));
+    motor = type_new_struct(2,
+        "Rpm", SIMPLE_TYPE(TAG_INT),
+        "Status", status);
+    status_id = type_cip_code(status) & 0x0fff;
+    motor_id = type_cip_code(motor) & 0x0fff;
+    if (status_id == 0 || motor_id == 0 || status_id == motor_id) {
+        errx(1, "expected distinct UDT IDs, got %u and %u", status_id, motor_id);
+    }
+
+    /* Identical structs are the same type, with the same ID. */
+    other = type_new_struct(2, "Rpm", SIMPLE_TYPE(TAG_INT), "Status", status);
+    if ((type_cip_code(other) & 0x0fff) != motor_id) {
+        errx(1, "expected an identical struct to share UDT ID %u", motor_id);
+    }
+    type_free(other);
+
+    tag = tag_tree_insert("Motor1", motor);
+
+    /* @tags gives the tag's UDT ID in its type word. */
+    plc_tag_read(METATAG_ID, 1000);
+    for (offset = 0; offset < plc_tag_get_size(METATAG_ID);) {
+        if (plc_tag_get_int32(METATAG_ID, offset) == tag) {
+            break;
+        }
+        offset += sizeof(struct metatag_t) + plc_tag_get_uint16(METATAG_ID, offset + 20);
+    }
+    if (offset >= plc_tag_get_size(METATAG_ID)) {
+        errx(1, "Motor1 isn't listed");
+    }
+    if ((ret = plc_tag_get_uint16(METATAG_ID, offset + 4)) != (0x8000 | motor_id)) {
+        errx(1, "expected Motor1's type to be %04x, got %04x", 0x8000 | motor_id, ret);
+    }
+
+    /* Its template describes its members, down to the struct they nest. */
+    t = read_template(motor_id, type_size_bytes(motor), 2, type_struct_handle(motor));
+    check_member(t, 0, 0, 0xc3, 0);
+    check_member(t, 1, 0, 0x8000 | status_id, 4);
+    offset = 14 + 2 * 8;
+    snprintf(expected, sizeof(expected), "UDT_%u", motor_id);
+    get_name(t, &offset, name, sizeof(name));
+    if (strcmp(name, expected) != 0) {
+        errx(1, "expected the UDT to be called %s, got %s", expected, name);
+    }
+    get_name(t, &offset, name, sizeof(name));
+    if (strcmp(name, "Rpm") != 0) {
+        errx(1, "expected Rpm, got %s", name);
+    }
+    get_name(t, &offset, name, sizeof(name));
+    if (strcmp(name, "Status") != 0 || offset != plc_tag_get_size(t)) {
+        errx(1, "expected Status to end the template, got %s", name);
+    }
+
+    /* BOOLs give their bit; arrays their length, with bit 13 of the type. */
+    t = read_template(status_id, type_size_bytes(status), 3, type_struct_handle(status));
+    check_member(t, 0, 0, 0xc1, 0);
+    check_member(t, 1, 1, 0xc1, 0);
+    check_member(t, 2, 4, 0x20ca, 4);
+
+    /* Asking again gets the same pseudo-tag... */
+    if ((ret = plc_tag_create("protocol=ab_eip&name=@udt/%u", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected a malformed ID to be refused, got %d", ret);
+    }
+    snprintf(name, sizeof(name), "protocol=ab_eip&name=@udt/%u", status_id);
+    if ((ret = plc_tag_create(name, 1000)) != t) {
+        errx(1, "expected @udt/%u to be %d again, got %d", status_id, t, ret);
+    }
+
+    /* ...whose template is only serialised once. */
+    tpl = type_udt_template(status, &len);
+    again = type_udt_template(status, &len2);
+    if (tpl != again || len != len2 || (int)(len) != plc_tag_get_size(t)) {
+        errx(1, "expected the template to be cached");
+    }
+
+    /* STRING has a template too. */
+    t = read_template(TAG_STRING_HANDLE, TAG_STRING_SIZE, 2, TAG_STRING_HANDLE);
+    check_member(t, 0, 0, 0xc4, 0);
+    check_member(t, 1, TAG_STRING_CAPACITY, 0x20c2, TAG_STRING_DATA);
+    offset = 14 + 2 * 8;
+    get_name(t, &offset, name, sizeof(name));
+    if (strcmp(name, "STRING") != 0) {
+        errx(1, "expected STRING, got %s", name);
+    }
+
+    /* IDs that name no type aren't found. */
+    if ((ret = plc_tag_create("protocol=ab_eip&name=@udt/4000", 1000)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected an unused ID not to be found, got %d", ret);
+    }
+    if ((ret = plc_tag_create("protocol=ab_eip&name=@udt/5000", 1000)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected an ID beyond 12 bits to be refused, got %d", ret);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
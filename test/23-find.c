@@ -0,0 +1,118 @@
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "libplctag.h"
+
+#define NMOTORS 50
+#define PAGE 7
+
+int
+main(int argc, char** argv)
+{
+    char attrs[128], cursor[64], names[NMOTORS][32];
+    int32_t ids[NMOTORS + 10], motors[NMOTORS], id;
+    int i, n, total, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    /* Created out of order, and with their case varied. */
+    for (i = 0; i < NMOTORS; i++) {
+        snprintf(names[i], sizeof(names[i]), "%s3_Motor%02d", i % 2 ? "LINE" : "Line", (i * 17) % NMOTORS);
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_size=4&name=%s", names[i]);
+        motors[(i * 17) % NMOTORS] = plc_tag_create(attrs, 1000);
+    }
+    plc_tag_create("protocol=ab_eip&elem_size=4&name=Line3_Valve", 1000);
+    plc_tag_create("protocol=ab_eip&elem_size=4&name=Line4_Motor01", 1000);
+    plc_tag_create("protocol=ab_eip&elem_size=4&name=Line3", 1000);
+
+    /* Paging through a prefix gets every match once, in order of name. */
+    cursor[0] = '\0';
+    total = 0;
+    do {
+        n = plc_tag_find("line3_motor*", cursor, sizeof(cursor), ids, PAGE);
+        if (n < 0) {
+            errx(1, "plc_tag_find returned %s", plc_tag_decode_error(n));
+        }
+        for (i = 0; i < n; i++, total++) {
+            if (total >= NMOTORS || ids[i] != motors[total]) {
+                errx(1, "match %d: expected %d, got %d", total, motors[total], ids[i]);
+            }
+        }
+    } while (n == PAGE);
+    if (total != NMOTORS) {
+        errx(1, "expected %d matches, got %d", NMOTORS, total);
+    }
+    if (strcasecmp(cursor, "Line3_Motor49") != 0) {
+        errx(1, "expected the cursor to be left at Line3_Motor49, got %s", cursor);
+    }
+
+    /* Globs match anywhere, one character or many. */
+    cursor[0] = '\0';
+    if ((n = plc_tag_find("Line?_Motor01", cursor, sizeof(cursor), ids, NMOTORS)) != 2) {
+        errx(1, "expected 2 matches for Line?_Motor01, got %d", n);
+    }
+    cursor[0] = '\0';
+    if ((n = plc_tag_find("*3_*", cursor, sizeof(cursor), ids, NMOTORS + 10)) != NMOTORS + 1) {
+        errx(1, "expected %d matches for *3_*, got %d", NMOTORS + 1, n);
+    }
+    cursor[0] = '\0';
+    if ((n = plc_tag_find("Line3", cursor, sizeof(cursor), ids, NMOTORS)) != 1) {
+        errx(1, "expected an exact name to match once, got %d", n);
+    }
+    cursor[0] = '\0';
+    if ((n = plc_tag_find("Line3_Pump*", cursor, sizeof(cursor), ids, NMOTORS)) != 0) {
+        errx(1, "expected no pumps, got %d", n);
+    }
+
+    /* A page can carry on after its last tag is destroyed. */
+    cursor[0] = '\0';
+    plc_tag_find("Line3_Motor*", cursor, sizeof(cursor), ids, 10);
+    plc_tag_destroy(motors[9]);
+    if ((n = plc_tag_find("Line3_Motor*", cursor, sizeof(cursor), ids, 1)) != 1 || ids[0] != motors[10]) {
+        errx(1, "expected to carry on at %d, got %d", motors[10], n > 0 ? ids[0] : n);
+    }
+
+    /* Tags come and go from the index along with the catalog. */
+    id = plc_tag_create("protocol=ab_eip&elem_size=4&name=Line3_Motor09", 1000);
+    cursor[0] = '\0';
+    if (plc_tag_find("Line3_Motor09", cursor, sizeof(cursor), ids, 1) != 1 || ids[0] != id) {
+        errx(1, "expected to find the new Line3_Motor09");
+    }
+    plc_tag_destroy(id);
+    cursor[0] = '\0';
+    if ((n = plc_tag_find("Line3_Motor09", cursor, sizeof(cursor), ids, 1)) != 0) {
+        errx(1, "expected Line3_Motor09 to be gone, got %d", n);
+    }
+
+    /* Plenty of churn leaves the index whole. */
+    for (i = 0; i < 500; i++) {
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_size=4&name=Churn%d", (i * 7919) % 500);
+        ids[i % 2] = plc_tag_create(attrs, 1000);
+        if (i % 2) {
+            plc_tag_destroy(ids[0]);
+        }
+    }
+    cursor[0] = '\0';
+    for (total = 0; (n = plc_tag_find("churn*", cursor, sizeof(cursor), ids, PAGE)) > 0; total += n)
+        ;
+    if (total != 250) {
+        errx(1, "expected 250 tags left after churning, got %d", total);
+    }
+
+    /* The cursor must hold every name found, and is left alone otherwise. */
+    strcpy(cursor, "Line3_Motor4");
+    if ((ret = plc_tag_find("Line3_*", cursor, 13, ids, NMOTORS)) != PLCTAG_ERR_TOO_SMALL) {
+        errx(1, "expected a 13-byte cursor to be too small, got %d", ret);
+    }
+    if (strcmp(cursor, "Line3_Motor4") != 0) {
+        errx(1, "expected the cursor to be left alone, got %s", cursor);
+    }
+    if ((ret = plc_tag_find("*", cursor, sizeof(cursor), NULL, 1)) != PLCTAG_ERR_NULL_PTR) {
+        errx(1, "expected PLCTAG_ERR_NULL_PTR, got %d", ret);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "libplctag.h"
+
+#define NSETS 20000
+
+static int32_t tag;
+static int calls[3];
+static int order[8], norder;
+static int plain_calls;
+static int once_calls;
+static volatile int done;
+
+static void
+counting(int32_t tag_id, int event, int status, void* userdata)
+{
+    int* n = userdata;
+
+    (void)(status);
+    if (tag_id == tag && event == PLCTAG_EVENT_WRITE_COMPLETED) {
+        __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+        if (norder < 8) {
+            order[norder++] = n - calls;
+        }
+    }
+}
+
+static void
+plain(int32_t tag_id, int event, int status)
+{
+    (void)(tag_id);
+    (void)(status);
+    if (event == PLCTAG_EVENT_WRITE_COMPLETED) {
+        plain_calls++;
+    }
+}
+
+/* Unregisters itself the first time it is called, from inside emission. */
+static void
+once(int32_t tag_id, int event, int status, void* userdata)
+{
+    (void)(event);
+    (void)(status);
+    once_calls++;
+    plc_tag_unregister_callback_ex(tag_id, once, userdata);
+}
+
+static void
+noop(int32_t tag_id, int event, int status, void* userdata)
+{
+    (void)(tag_id);
+    (void)(event);
+    (void)(status);
+    (void)(userdata);
+}
+
+static void*
+churn(void* arg)
+{
+    (void)(arg);
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        plc_tag_register_callback_ex(tag, noop, NULL);
+        plc_tag_unregister_callback_ex(tag, noop, NULL);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t thr;
+    int i, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=4&name=Subscribed", 1000);
+
+    /* Every callback is called, in the order they were registered. */
+    plc_tag_register_callback_ex(tag, counting, &calls[2]);
+    plc_tag_register_callback_ex(tag, counting, &calls[0]);
+    plc_tag_register_callback(tag, plain);
+    plc_tag_set_int32(tag, 0, 1);
+    if (calls[0] != 1 || calls[2] != 1 || plain_calls != 1) {
+        errx(1, "expected each callback to be called once, got %d, %d and %d", calls[0], calls[2], plain_calls);
+    }
+    if (norder != 2 || order[0] != 2 || order[1] != 0) {
+        errx(1, "expected the callbacks in the order they were registered");
+    }
+
+    if ((ret = plc_tag_register_callback_ex(tag, counting, &calls[0])) != PLCTAG_ERR_DUPLICATE) {
+        errx(1, "expected a duplicate to be refused, got %d", ret);
+    }
+
+    /* Unregistering one leaves the rest be. */
+    if ((ret = plc_tag_unregister_callback_ex(tag, counting, &calls[2])) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_unregister_callback_ex returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_unregister_callback_ex(tag, counting, &calls[1])) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected an unknown callback not to be found, got %d", ret);
+    }
+    plc_tag_set_int32(tag, 0, 2);
+    if (calls[0] != 2 || calls[2] != 1 || plain_calls != 2) {
+        errx(1, "expected 2, 1 and 2 calls, got %d, %d and %d", calls[0], calls[2], plain_calls);
+    }
+
+    /* A callback can unregister itself, without deadlocking on the tag. */
+    plc_tag_register_callback_ex(tag, once, NULL);
+    plc_tag_set_int32(tag, 0, 3);
+    plc_tag_set_int32(tag, 0, 4);
+    if (once_calls != 1) {
+        errx(1, "expected the one-shot callback to be called once, got %d", once_calls);
+    }
+
+    /* Registering never holds up accessors, nor they it. */
+    pthread_create(&thr, NULL, churn, NULL);
+    for (i = 0; i < NSETS; i++) {
+        plc_tag_set_int32(tag, 0, i);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    pthread_join(thr, NULL);
+    if (calls[0] != 4 + NSETS) {
+        errx(1, "expected %d calls, got %d", 4 + NSETS, calls[0]);
+    }
+
+    /* plc_tag_unregister_callback() removes them all. */
+    if ((ret = plc_tag_unregister_callback(tag)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_unregister_callback returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_unregister_callback(tag)) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected no callbacks left, got %d", ret);
+    }
+    plc_tag_set_int32(tag, 0, 5);
+    if (calls[0] != 4 + NSETS) {
+        errx(1, "expected no more calls");
+    }
+
+    plc_tag_destroy(tag);
+
+    printf("Test passed!\n");
+    return 0;
+}
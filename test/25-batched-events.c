@@ -0,0 +1,160 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "libplctag.h"
+
+#define NTHREADS 4
+#define NSETS 20000
+#define BATCH 64
+
+static int32_t tags[NTHREADS];
+static int events_seen, batches_seen, biggest;
+static int flush_ret;
+
+/* The next event expected from each tag, and when it last had one. */
+static int next_event[NTHREADS];
+static int64_t last_ts[NTHREADS];
+
+static void
+checking(const struct plc_tag_event* ev, int n, void* userdata)
+{
+    int i, j;
+
+    (void)(userdata);
+    batches_seen++;
+    if (n > biggest) {
+        biggest = n;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < NTHREADS && tags[j] != ev[i].tag_id; j++) {
+        }
+        if (j == NTHREADS) {
+            continue;
+        }
+        if (ev[i].event != next_event[j] || ev[i].status != PLCTAG_STATUS_OK) {
+            errx(1, "tag %d: expected event %d, got %d (%d)", j, next_event[j], ev[i].event, ev[i].status);
+        }
+        if (ev[i].timestamp_ns < last_ts[j]) {
+            errx(1, "tag %d: events out of order", j);
+        }
+        next_event[j] = next_event[j] == PLCTAG_EVENT_WRITE_STARTED ? PLCTAG_EVENT_WRITE_COMPLETED
+                                                                    : PLCTAG_EVENT_WRITE_STARTED;
+        last_ts[j] = ev[i].timestamp_ns;
+        events_seen++;
+    }
+    flush_ret = plc_tag_flush_events();
+}
+
+static void*
+writer(void* arg)
+{
+    int32_t tag = tags[(intptr_t)arg];
+    int i;
+
+    for (i = 0; i < NSETS; i++) {
+        plc_tag_set_int32(tag, 0, i);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t thr[NTHREADS];
+    char name[64];
+    int i, ret, expected, batches, dropped;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    for (i = 0; i < NTHREADS; i++) {
+        snprintf(name, sizeof(name), "protocol=ab_eip&elem_size=4&name=Batched%d", i);
+        tags[i] = plc_tag_create(name, 1000);
+        next_event[i] = PLCTAG_EVENT_WRITE_STARTED;
+    }
+
+    if ((ret = plc_tag_register_batch_callback(NULL, NULL, BATCH, 10)) != PLCTAG_ERR_NULL_PTR) {
+        errx(1, "expected a NULL callback to be refused, got %d", ret);
+    }
+    if ((ret = plc_tag_register_batch_callback(checking, NULL, 0, 10)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected an empty batch to be refused, got %d", ret);
+    }
+    if ((ret = plc_tag_unregister_batch_callback()) != PLCTAG_ERR_NOT_FOUND) {
+        errx(1, "expected no batch callback to unregister, got %d", ret);
+    }
+
+    /* Full batches go as soon as they fill, in each thread's order, and the
+     * events left over when a thread exits aren't lost. */
+    if ((ret = plc_tag_register_batch_callback(checking, NULL, BATCH, 60000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_register_batch_callback returned %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_register_batch_callback(checking, NULL, BATCH, 60000)) != PLCTAG_ERR_DUPLICATE) {
+        errx(1, "expected a second batch callback to be refused, got %d", ret);
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_create(&thr[i], NULL, writer, (void*)(intptr_t)i);
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_join(thr[i], NULL);
+    }
+    if ((ret = plc_tag_flush_events()) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_flush_events returned %s", plc_tag_decode_error(ret));
+    }
+    expected = 2 * NTHREADS * NSETS;
+    if (events_seen != expected) {
+        errx(1, "expected %d events, got %d", expected, events_seen);
+    }
+    if (biggest > BATCH || batches_seen > expected / BATCH + NTHREADS) {
+        errx(1, "expected batches of up to %d events, got %d batches of up to %d", BATCH, batches_seen, biggest);
+    }
+    if ((batches = plc_tag_get_int_attribute(0, "event_batches", -1)) != batches_seen) {
+        errx(1, "expected the event_batches attribute to be %d, got %d", batches_seen, batches);
+    }
+    if (flush_ret != PLCTAG_ERR_NOT_ALLOWED) {
+        errx(1, "expected a flush from the callback to be refused, got %d", flush_ret);
+    }
+    if ((ret = plc_tag_unregister_batch_callback()) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_unregister_batch_callback returned %s", plc_tag_decode_error(ret));
+    }
+
+    /* A partly filled batch goes within max_delay_ms, unprompted. */
+    events_seen = 0;
+    plc_tag_register_batch_callback(checking, NULL, 1000, 10);
+    plc_tag_set_int32(tags[0], 0, 2);
+    for (i = 0; i < 500 && __atomic_load_n(&events_seen, __ATOMIC_RELAXED) < 2; i++) {
+        usleep(10000);
+    }
+    if (__atomic_load_n(&events_seen, __ATOMIC_RELAXED) != 2) {
+        errx(1, "expected the events to be delivered without a flush");
+    }
+
+    /* Unregistering delivers what is left. */
+    plc_tag_set_int32(tags[1], 0, 3);
+    plc_tag_unregister_batch_callback();
+    if (events_seen != 4) {
+        errx(1, "expected 4 events by unregistering, got %d", events_seen);
+    }
+
+    /* Events there's no memory for are dropped, and counted, but the
+     * accesses they report on go ahead. */
+    events_seen = 0;
+    dropped = plc_tag_get_int_attribute(0, "events_dropped", -1);
+    plc_tag_register_batch_callback(checking, NULL, 1000, 10);
+    plc_tag_set_int_attribute(0, "mem_budget", 1);
+    if ((ret = plc_tag_set_int32(tags[2], 0, 4)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_set_int32 over budget returned %s", plc_tag_decode_error(ret));
+    }
+    plc_tag_set_int_attribute(0, "mem_budget", 0);
+    plc_tag_unregister_batch_callback();
+    if (events_seen != 0 || (ret = plc_tag_get_int_attribute(0, "events_dropped", -1)) != dropped + 2) {
+        errx(1, "expected 2 events dropped, got %d, and %d delivered", ret - dropped, events_seen);
+    }
+
+    for (i = 0; i < NTHREADS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+
+    printf("Test passed!\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <err.h>
+#include <stdio.h>
+
+#include "libplctag.h"
+
+static int reads;
+
+static void
+counting(int32_t tag_id, int event, int status, void* userdata)
+{
+    (void)(tag_id);
+    (void)(status);
+    (void)(userdata);
+    if (event == PLCTAG_EVENT_READ_STARTED) {
+        reads++;
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    int32_t a, b;
+    int32_t dints[4];
+    int64_t lint;
+    uint16_t low;
+    int bit, i, ret;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    a = plc_tag_create("protocol=ab_eip&elem_size=4&elem_count=4&name=Items", 1000);
+    b = plc_tag_create("protocol=ab_eip&elem_size=8&name=Total", 1000);
+    if (a < 0 || b < 0) {
+        errx(1, "plc_tag_create returned %d and %d", a, b);
+    }
+    for (i = 0; i < 4; i++) {
+        plc_tag_set_int32(a, i, 1000 * (i + 1));
+    }
+    plc_tag_set_int32(a, 1, 2);
+    plc_tag_set_int64(b, 0, -5000000000LL);
+    plc_tag_register_callback_ex(a, counting, NULL);
+
+    struct plc_tag_item items[] = {
+        { a, 0, PLCTAG_ITEM_INT32, -1, &dints[0] },
+        { a, 1, PLCTAG_ITEM_INT32, -1, &dints[1] },
+        { a, 2, PLCTAG_ITEM_INT32, -1, &dints[2] },
+        { a, 3, PLCTAG_ITEM_INT32, -1, &dints[3] },
+        { a, 33, PLCTAG_ITEM_BIT, -1, &bit },
+        { a, 3, PLCTAG_ITEM_UINT16, -1, &low },
+        { b, 0, PLCTAG_ITEM_INT64, -1, &lint },
+    };
+
+    /* Every item is decoded, and each run of a tag's items is one read. */
+    if ((ret = plc_tag_read_items(items, 7, 1000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_read_items returned %s", plc_tag_decode_error(ret));
+    }
+    for (i = 0; i < 7; i++) {
+        if (items[i].status != PLCTAG_STATUS_OK) {
+            errx(1, "item %d: status %s", i, plc_tag_decode_error(items[i].status));
+        }
+    }
+    if (dints[0] != 1000 || dints[1] != 2 || dints[2] != 3000 || dints[3] != 4000) {
+        errx(1, "expected 1000, 2, 3000 and 4000, got %d, %d, %d and %d", dints[0], dints[1], dints[2], dints[3]);
+    }
+    if (bit != 1 || low != 4000 || lint != -5000000000LL) {
+        errx(1, "expected 1, 4000 and -5000000000, got %d, %u and %lld", bit, low, (long long)lint);
+    }
+    if (reads != 1) {
+        errx(1, "expected one read of the array, got %d", reads);
+    }
+
+    /* Bad items fail alone. */
+    struct plc_tag_item bad[] = {
+        { a, 4, PLCTAG_ITEM_INT32, -1, &dints[0] },
+        { a, 0, 99, -1, &dints[0] },
+        { a, 0, PLCTAG_ITEM_INT32, -1, NULL },
+        { a, 128, PLCTAG_ITEM_BIT, -1, &bit },
+        { b, 1, PLCTAG_ITEM_INT64, -1, &lint },
+        { -1, 0, PLCTAG_ITEM_INT32, -1, &dints[0] },
+        { b, 0, PLCTAG_ITEM_UINT32, -1, &dints[1] },
+    };
+    int expected[] = {
+        PLCTAG_ERR_BAD_PARAM,
+        PLCTAG_ERR_BAD_PARAM,
+        PLCTAG_ERR_NULL_PTR,
+        PLCTAG_ERR_OUT_OF_BOUNDS,
+        PLCTAG_ERR_BAD_PARAM,
+        PLCTAG_ERR_NOT_FOUND,
+        PLCTAG_STATUS_OK,
+    };
+    if ((ret = plc_tag_read_items(bad, 7, 1000)) != PLCTAG_ERR_PARTIAL) {
+        errx(1, "expected PLCTAG_ERR_PARTIAL, got %s", plc_tag_decode_error(ret));
+    }
+    for (i = 0; i < 7; i++) {
+        if (bad[i].status != expected[i]) {
+            errx(1, "item %d: expected %s, got %s", i, plc_tag_decode_error(expected[i]),
+                plc_tag_decode_error(bad[i].status));
+        }
+    }
+
+    if ((ret = plc_tag_read_items(NULL, 1, 1000)) != PLCTAG_ERR_NULL_PTR) {
+        errx(1, "expected NULL items to be refused, got %d", ret);
+    }
+    if ((ret = plc_tag_read_items(items, 1, -1)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected a negative timeout to be refused, got %d", ret);
+    }
+
+    plc_tag_destroy(a);
+    plc_tag_destroy(b);
+
+    printf("Test passed!\n");
+    return 0;
+}
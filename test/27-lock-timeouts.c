@@ -0,0 +1,162 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "libplctag.h"
+
+#define HELD 100
+
+static int32_t tag, others[HELD];
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int held, release;
+
+/* Holds the tags until told to let go. */
+static void*
+holder(void* arg)
+{
+    int i;
+
+    (void)(arg);
+    plc_tag_lock(tag);
+    for (i = 0; i < HELD; i++) {
+        plc_tag_lock(others[i]);
+    }
+    pthread_mutex_lock(&mtx);
+    held = 1;
+    pthread_cond_broadcast(&cond);
+    while (!release) {
+        pthread_cond_wait(&cond, &mtx);
+    }
+    pthread_mutex_unlock(&mtx);
+    for (i = 0; i < HELD; i++) {
+        plc_tag_unlock(others[i]);
+    }
+    plc_tag_unlock(tag);
+    return NULL;
+}
+
+static long
+elapsed_ms(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t thr;
+    struct timespec start;
+    struct plc_tag_item many[HELD + 1];
+    int32_t val, vals[HELD + 1], free_tag;
+    char attrs[64];
+    long ms;
+    int i, ret, timeouts;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=4&name=Stuck", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(tag));
+    }
+    if ((ret = plc_tag_lock_timeout(tag, -1)) != PLCTAG_ERR_BAD_PARAM) {
+        errx(1, "expected a negative timeout to be refused, got %d", ret);
+    }
+    for (i = 0; i < HELD; i++) {
+        snprintf(attrs, sizeof(attrs), "protocol=ab_eip&elem_size=4&name=Stuck%d", i);
+        others[i] = plc_tag_create(attrs, 1000);
+    }
+    free_tag = plc_tag_create("protocol=ab_eip&elem_size=4&name=Free", 1000);
+    plc_tag_set_int32(free_tag, 0, 77);
+    timeouts = plc_tag_get_int_attribute(0, "lock_timeouts", -1);
+
+    pthread_create(&thr, NULL, holder, NULL);
+    pthread_mutex_lock(&mtx);
+    while (!held) {
+        pthread_cond_wait(&cond, &mtx);
+    }
+    pthread_mutex_unlock(&mtx);
+
+    /* Operations on the held tag give up on time. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((ret = plc_tag_read(tag, 50)) != PLCTAG_ERR_TIMEOUT) {
+        errx(1, "expected the read to time out, got %s", plc_tag_decode_error(ret));
+    }
+    if ((ms = elapsed_ms(&start)) < 45 || ms > 2000) {
+        errx(1, "expected the read to wait about 50 ms, took %ld", ms);
+    }
+    if ((ret = plc_tag_status(tag)) != PLCTAG_ERR_TIMEOUT) {
+        errx(1, "expected the tag's status to be PLCTAG_ERR_TIMEOUT, got %d", ret);
+    }
+    if ((ret = plc_tag_write(tag, 0)) != PLCTAG_ERR_BUSY) {
+        errx(1, "expected the write to find the tag busy, got %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_lock_timeout(tag, 0)) != PLCTAG_ERR_BUSY) {
+        errx(1, "expected the lock to find the tag busy, got %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_lock_timeout(tag, 20)) != PLCTAG_ERR_TIMEOUT) {
+        errx(1, "expected the lock to time out, got %s", plc_tag_decode_error(ret));
+    }
+
+    struct plc_tag_item items[] = { { tag, 0, PLCTAG_ITEM_INT32, -1, &val } };
+    if ((ret = plc_tag_read_items(items, 1, 20)) != PLCTAG_ERR_PARTIAL || items[0].status != PLCTAG_ERR_TIMEOUT) {
+        errx(1, "expected the item to time out, got %s", plc_tag_decode_error(items[0].status));
+    }
+    if ((ret = plc_tag_get_int_attribute(0, "lock_timeouts", -1)) != timeouts + 5) {
+        errx(1, "expected %d lock timeouts, got %d", timeouts + 5, ret);
+    }
+
+    /* A batch waits out its timeout once, not once per busy tag, and still
+     * reads the free ones after it. */
+    for (i = 0; i < HELD + 1; i++) {
+        many[i] = (struct plc_tag_item) { i < HELD ? others[i] : free_tag, 0, PLCTAG_ITEM_INT32, -1, &vals[i] };
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((ret = plc_tag_read_items(many, HELD + 1, 20)) != PLCTAG_ERR_PARTIAL) {
+        errx(1, "expected a partial read, got %s", plc_tag_decode_error(ret));
+    }
+    if ((ms = elapsed_ms(&start)) > 20 + HELD / 2) {
+        errx(1, "expected %d busy tags to take about 20 ms, took %ld", HELD, ms);
+    }
+    for (i = 0; i < HELD; i++) {
+        if (many[i].status != PLCTAG_ERR_TIMEOUT) {
+            errx(1, "item %d: expected PLCTAG_ERR_TIMEOUT, got %s", i, plc_tag_decode_error(many[i].status));
+        }
+    }
+    if (many[HELD].status != PLCTAG_STATUS_OK || vals[HELD] != 77) {
+        errx(1, "expected the free tag to be read, got %s", plc_tag_decode_error(many[HELD].status));
+    }
+
+    /* Once it is let go, they go ahead, waiting for it if need be. */
+    pthread_mutex_lock(&mtx);
+    release = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mtx);
+    if ((ret = plc_tag_lock_timeout(tag, 5000)) != PLCTAG_STATUS_OK) {
+        errx(1, "plc_tag_lock_timeout returned %s", plc_tag_decode_error(ret));
+    }
+    pthread_join(thr, NULL);
+
+    /* The holder can nest locks, and use the tag, without waiting. */
+    if ((ret = plc_tag_lock_timeout(tag, 0)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected a nested lock, got %s", plc_tag_decode_error(ret));
+    }
+    if ((ret = plc_tag_read(tag, 0)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected the holder's read to go ahead, got %s", plc_tag_decode_error(ret));
+    }
+    plc_tag_unlock(tag);
+    plc_tag_unlock(tag);
+
+    if ((ret = plc_tag_write(tag, 100)) != PLCTAG_STATUS_OK || (ret = plc_tag_status(tag)) != PLCTAG_STATUS_OK) {
+        errx(1, "expected the write to succeed, got %s", plc_tag_decode_error(ret));
+    }
+
+    plc_tag_destroy(tag);
+
+    printf("Test passed!\n");
+    return 0;
+}
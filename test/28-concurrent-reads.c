@@ -0,0 +1,131 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "libplctag.h"
+
+#define NREADERS 4
+#define NWRITES 20000
+
+static int32_t tag;
+static volatile int done;
+static volatile int got;
+
+/* Writes each value a half at a time through the data pointer, holding the
+ * tag, so that a reader that didn't wait for it would see a torn value. */
+static void*
+writer(void* arg)
+{
+    uint32_t* p;
+    int i, len;
+
+    (void)(arg);
+    for (i = 1; i <= NWRITES; i++) {
+        plc_tag_lock(tag);
+        plc_tag_get_data_ptr(tag, (void**)&p, &len);
+        p[0] = i;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        p[1] = i;
+        plc_tag_unlock(tag);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void*
+reader(void* arg)
+{
+    uint64_t v;
+    uint32_t last = 0;
+
+    (void)(arg);
+    while (!__atomic_load_n(&done, __ATOMIC_RELAXED)) {
+        v = plc_tag_get_uint64(tag, 0);
+        if ((uint32_t)v != (uint32_t)(v >> 32)) {
+            errx(1, "read a torn value, %08x:%08x", (uint32_t)(v >> 32), (uint32_t)v);
+        }
+        if ((uint32_t)v < last) {
+            errx(1, "read %u after %u", (uint32_t)v, last);
+        }
+        last = (uint32_t)v;
+    }
+    return NULL;
+}
+
+static void*
+blocked_reader(void* arg)
+{
+    (void)(arg);
+    plc_tag_get_uint64(tag, 0);
+    __atomic_store_n(&got, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void
+noop(int32_t tag_id, int event, int status, void* userdata)
+{
+    (void)(tag_id);
+    (void)(event);
+    (void)(status);
+    __atomic_add_fetch((int*)userdata, 1, __ATOMIC_RELAXED);
+}
+
+int
+main(int argc, char** argv)
+{
+    pthread_t thr[NREADERS + 1];
+    int i, gets, calls = 0;
+
+    plc_tag_set_debug_level(PLCTAG_DEBUG_WARN);
+
+    tag = plc_tag_create("protocol=ab_eip&elem_size=8&name=Concurrent", 1000);
+    if (tag < 0) {
+        errx(1, "plc_tag_create returned %s", plc_tag_decode_error(tag));
+    }
+    plc_tag_set_uint64(tag, 0, 0);
+    gets = plc_tag_get_int_attribute(tag, "gets", -1);
+
+    /* Readers don't take the tag's lock, but never see a write half done. */
+    for (i = 0; i < NREADERS; i++) {
+        pthread_create(&thr[i], NULL, reader, NULL);
+    }
+    pthread_create(&thr[NREADERS], NULL, writer, NULL);
+    for (i = 0; i <= NREADERS; i++) {
+        pthread_join(thr[i], NULL);
+    }
+    if (plc_tag_get_uint64(tag, 0) != ((uint64_t)NWRITES << 32 | NWRITES)) {
+        errx(1, "expected the last write to stick");
+    }
+    if (plc_tag_get_int_attribute(tag, "gets", -1) <= gets) {
+        errx(1, "expected the reads to be counted");
+    }
+    if (plc_tag_status(tag) != PLCTAG_STATUS_OK) {
+        errx(1, "expected the tag's status to be OK");
+    }
+
+    /* A holder of plc_tag_lock() still keeps readers out. */
+    plc_tag_lock(tag);
+    pthread_create(&thr[0], NULL, blocked_reader, NULL);
+    usleep(50000);
+    if (__atomic_load_n(&got, __ATOMIC_RELAXED)) {
+        errx(1, "expected the reader to wait for the tag");
+    }
+    plc_tag_unlock(tag);
+    pthread_join(thr[0], NULL);
+    if (!got) {
+        errx(1, "expected the reader to go ahead once the tag was let go");
+    }
+
+    /* Reads are still seen by callbacks. */
+    plc_tag_register_callback_ex(tag, noop, &calls);
+    plc_tag_get_uint64(tag, 0);
+    if (calls != 2) {
+        errx(1, "expected a read's two events, got %d", calls);
+    }
+
+    plc_tag_destroy(tag);
+
+    printf("Test passed!\n");
+    return 0;
+}